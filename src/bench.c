@@ -0,0 +1,440 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * bench.c
+ * Contains the benchmark runner, a standalone program that runs canned
+ * bullet hell workloads for a fixed number of ticks and writes how long
+ * each stage took, one line of JSON per workload.
+ * Usage: bullet-rain-bench [results.json [ticks [workload]]]
+ *
+ * Results go to stdout if the file is "-" or missing. Every workload runs
+ * from the same random seed, with the engine reset in between, so the
+ * same build always does exactly the same work; only the times change.
+ * Keep the results from each build and compare them to spot regressions.
+ *
+ * It runs under SDL's dummy video driver, so it doesn't need a display,
+ * and everything's drawn into a 640x480 32 bit software surface. The
+ * scripted workload needs res/brcore.tgz, so run it from the top directory.
+ */
+
+#include "compile.h"
+#include "bullet.h"
+#include "debug.h"
+#include "geometry.h"
+#include "init.h"
+#include "metrics.h"
+#include "player.h"
+#include "profile.h"
+#include "render.h"
+#include "resource.h"
+#include "scripts.h"
+#include "timer.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/* A minute at 60hz */
+#define BENCH_TICKS   3600
+#define BENCH_SEED    12345
+/* Enemies kept on screen in the pbullet workload */
+#define BENCH_ENEMIES 48
+
+typedef struct workload_ workload;
+struct workload_ {
+    const char *name;
+    /* Make this tick's new bullets */
+    void (*spawn)(int tick);
+    /* Collision checks, NULL for none */
+    void (*collide)(void);
+    /* Needs the test scripts loaded */
+    int scripted;
+};
+
+SDL_Surface *screen;
+
+bullet_type  sm_type, lg_type, enemy_type;
+pbullet_type shot_type;
+
+/* Where the aimed streams aim */
+const float target_x = 0.0F;
+const float target_y = 160.0F;
+
+/* Make a bullet image: a colour keyed w*h box with a solid middle */
+SDL_Surface *_make_image(int w, int h, Uint8 r, Uint8 g, Uint8 b)
+{
+    SDL_Surface *img;
+    SDL_Rect rect;
+    Uint32 key;
+
+    img = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 32, 0x00FF0000,
+                               0x0000FF00, 0x000000FF, 0);
+    panic(img != NULL, "Couldn't make a bullet image");
+
+    key = SDL_MapRGB(img->format, 255, 0, 255);
+    SDL_FillRect(img, NULL, key);
+    rect.x = w / 4;
+    rect.y = h / 4;
+    rect.w = w / 2;
+    rect.h = h / 2;
+    SDL_FillRect(img, &rect, SDL_MapRGB(img->format, r, g, b));
+    SDL_SetColorKey(img, SDL_SRCCOLORKEY, key);
+
+    return img;
+}
+
+/* Fill out a round bullet type of the given size */
+void _make_type(bullet_type *type, int size, Uint32 flags, SDL_Surface *img)
+{
+    memset(type, 0, sizeof(bullet_type));
+    type->img      = img;
+    type->drawlocx = -size / 2.0F;
+    type->drawlocy = -size / 2.0F;
+    type->rad      = size * 3 / 8.0F;
+    type->tlx      = -type->rad;
+    type->tly      = -type->rad;
+    type->lrx      = type->rad;
+    type->lry      = type->rad;
+    type->flags    = flags;
+}
+
+void _make_types(void)
+{
+    _make_type(&sm_type, 8,  0, _make_image(8, 8, 255, 255, 255));
+    _make_type(&lg_type, 32, 0, _make_image(32, 32, 255, 64, 64));
+    _make_type(&enemy_type, 32, ENEMY, _make_image(32, 32, 64, 255, 64));
+
+    memset(&shot_type, 0, sizeof(pbullet_type));
+    shot_type.img          = _make_image(4, 12, 64, 64, 255);
+    shot_type.tlx          = -2.0F;
+    shot_type.tly          = -6.0F;
+    shot_type.lrx          = 2.0F;
+    shot_type.lry          = 6.0F;
+    shot_type.drawlocx     = 0.0F;
+    shot_type.drawlocy     = 0.0F;
+    shot_type.enemy_damage = 1;
+    shot_type.boss_damage  = 1;
+}
+
+/* A random float from lo to hi */
+float _rand_range(float lo, float hi)
+{
+    return lo + (hi - lo) * (rand() % 4096) / 4096.0F;
+}
+
+/* Random spray, like the bullet test */
+void _spray_spawn(int tick)
+{
+    int i;
+
+    for (i = 0; i < 12; ++i) {
+        make_bullet(_rand_range(-320.0F, 320.0F),
+                    _rand_range(-240.0F, 240.0F),
+                    _rand_range(-2.0F, 2.0F), _rand_range(-2.0F, 2.0F),
+                    rand() % 2 ? &sm_type : &lg_type);
+    }
+}
+
+/* A ring of 64 from the middle every 4 ticks, turning as it goes */
+void _rings_spawn(int tick)
+{
+    float x, y, turn;
+    int i;
+
+    if (tick % 4 != 0) return;
+
+    turn = (tick * 7) % 360;
+    for (i = 0; i < 64; ++i) {
+        polar_to_rect(2.5F, turn + i * 360.0F / 64, &x, &y);
+        make_bullet(0.0F, -60.0F, x, y, &sm_type);
+    }
+}
+
+/* Eight emitters across the top, each streaming at the target */
+void _aimed_spawn(int tick)
+{
+    float x, y, dx, dy, len;
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+        x  = -280.0F + i * 80.0F;
+        y  = -200.0F + (i % 2) * 20.0F;
+        dx = target_x - x + _rand_range(-16.0F, 16.0F);
+        dy = target_y - y;
+        len = (float) sqrt(dx*dx + dy*dy);
+        make_bullet(x, y, dx / len * 4.0F, dy / len * 4.0F,
+                    tick % 8 == 0 ? &lg_type : &sm_type);
+    }
+}
+
+/* 32 reversing bullets from test.lua every 5 ticks */
+void _scripted_spawn(int tick)
+{
+    float x, y;
+    int i, id;
+
+    if (tick % 5 != 0) return;
+
+    for (i = 0; i < 32; ++i) {
+        polar_to_rect(4.0F, (tick * 3) % 360 + i * 360.0F / 32, &x, &y);
+        id = make_bullet(0.0F, 0.0F, x, y, &sm_type);
+        if (id != -1) add_bullet(id, "reversing_bullet");
+    }
+}
+
+/*
+ * Keep the screen topped up with enemies that shoot rings, and a turret
+ * at the bottom firing five streams of pbullets at them
+ */
+void _pbullet_spawn(int tick)
+{
+    bullet *bul;
+    int i, enemies = 0;
+
+    for (i = 0; i < 8192; ++i) {
+        bul = &bullet_mem[i];
+        if (!is_alive(bul) || !is_enemy(bul)) continue;
+
+        ++enemies;
+        if (tick % 60 == i % 60) {
+            make_bullet(bul->centerx, bul->centery,  1.5F,  0.0F, &sm_type);
+            make_bullet(bul->centerx, bul->centery, -1.5F,  0.0F, &sm_type);
+            make_bullet(bul->centerx, bul->centery,  0.0F,  1.5F, &sm_type);
+            make_bullet(bul->centerx, bul->centery,  0.0F, -1.5F, &sm_type);
+        }
+    }
+    for (; enemies < BENCH_ENEMIES; ++enemies) {
+        make_bullet(_rand_range(-300.0F, 300.0F),
+                    _rand_range(-220.0F, -20.0F),
+                    _rand_range(-0.5F, 0.5F), 0.1F, &enemy_type);
+    }
+
+    for (i = -2; i <= 2; ++i) {
+        make_pbullet(&shot_type, i * 12.0F, 200.0F, i * 0.5F, -8.0F, FALSE);
+    }
+}
+
+/* Every enemy against every pbullet, like the player test */
+void _pbullet_collide(void)
+{
+    bullet *bul;
+    pbullet *pbul;
+    int i, j;
+
+    for (i = 0; i < 1024; ++i) {
+        pbul = &pbullet_mem[i];
+        if (pis_alive(pbul)) update_pbullet(pbul);
+    }
+
+    for (i = 0; i < 8192; ++i) {
+        bul = &bullet_mem[i];
+        if (!is_alive(bul) || !is_enemy(bul)) continue;
+
+        for (j = 0; j < 1024; ++j) {
+            pbul = &pbullet_mem[j];
+            if (pis_alive(pbul) && collide_pbullet(pbul, bul)) {
+                destroy_pbullet(pbul);
+                destroy_bullet(bul);
+                break;
+            }
+        }
+    }
+}
+
+const workload workloads[] = {
+    {"spray",    _spray_spawn,    NULL,             FALSE},
+    {"rings",    _rings_spawn,    NULL,             FALSE},
+    {"aimed",    _aimed_spawn,    NULL,             FALSE},
+    {"scripted", _scripted_spawn, NULL,             TRUE },
+    {"pbullets", _pbullet_spawn,  _pbullet_collide, FALSE}
+};
+
+#define NUM_WORKLOADS ((int)(sizeof(workloads) / sizeof(workload)))
+
+/* Load the test scripts into a fresh Lua state. FALSE if they're not there */
+int _load_test_scripts(void)
+{
+    resource *runner_lua, *test_lua;
+
+    runner_lua = GET_RES("res/brcore.tgz", "runner.lua");
+    test_lua   = GET_RES("res/brcore.tgz", "test.lua");
+    if (runner_lua == NULL || test_lua == NULL) return FALSE;
+
+    set_runner(runner_lua);
+    set_header(NULL);
+    set_main(test_lua);
+    reset_scripts();
+
+    return TRUE;
+}
+
+int _by_ns(const void *a, const void *b)
+{
+    Uint64 na = *(const Uint64*) a, nb = *(const Uint64*) b;
+
+    return na < nb ? -1 : (na > nb ? 1 : 0);
+}
+
+/* Run one workload and write its line */
+void _run(const workload *w, int ticks, Uint64 *tick_ns, FILE *out)
+{
+    Uint64 stage_ns[PROF_NUM_STAGES];
+    Uint64 start, tick_start, elapsed, updates = 0;
+    Sint64 live, peak = 0;
+    bullet *bul;
+    pbullet *pbul;
+    int t, i;
+
+    if (w->scripted && !_load_test_scripts()) {
+        fprintf(stderr, "bullet-rain-bench: no test scripts, skipping %s\n",
+                w->name);
+        return;
+    }
+
+    srand(BENCH_SEED);
+    reset_bullets();
+    reset_pbullets();
+    metrics_reset();
+    prof_reset();
+    memset(stage_ns, 0, sizeof(stage_ns));
+
+    start = clock_ns();
+    for (t = 0; t < ticks; ++t) {
+        tick_start = clock_ns();
+
+        w->spawn(t);
+
+        prof_start(PROF_INTEGRATE);
+        snapshot_bullets();
+        for (i = 0; i < 8192; ++i) {
+            bul = &bullet_mem[i];
+            if (is_alive(bul)) {
+                process_bullet(bul);
+                ++updates;
+            }
+        }
+        prof_stop(PROF_INTEGRATE);
+
+        if (w->collide != NULL) {
+            prof_start(PROF_COLLIDE);
+            w->collide();
+            prof_stop(PROF_COLLIDE);
+        }
+
+        if (w->scripted) {
+            exec_bullet_scripts();
+        }
+
+        SDL_FillRect(screen, NULL, 0);
+        render_bullets(screen, 320, 240);
+        prof_start(PROF_DRAW);
+        for (i = 0; i < 1024; ++i) {
+            pbul = &pbullet_mem[i];
+            if (pis_alive(pbul)) draw_pbullet(pbul, screen, 320, 240);
+        }
+        prof_stop(PROF_DRAW);
+
+        prof_start(PROF_FLIP);
+        SDL_Flip(screen);
+        prof_stop(PROF_FLIP);
+        prof_end_frame();
+
+        for (i = 0; i < PROF_NUM_STAGES; ++i) {
+            if (i != PROF_FRAME) stage_ns[i] += prof_last(i);
+        }
+        live = metric_get(MET_BULLETS_LIVE);
+        if (live > peak) peak = live;
+
+        tick_ns[t] = clock_ns() - tick_start;
+    }
+    elapsed = clock_ns() - start;
+
+    qsort(tick_ns, ticks, sizeof(Uint64), _by_ns);
+
+    /* Numbers go through double, like the metrics export */
+    fprintf(out, "{\"workload\":\"%s\",\"engine\":\"%s\",\"ticks\":%d,"
+            "\"seed\":%d,\"render_threads\":%d", w->name, ENGINE_VERSION,
+            ticks, BENCH_SEED, render_get_threads());
+    fprintf(out, ",\"ns_per_tick\":{");
+    for (i = 0; i < PROF_NUM_STAGES; ++i) {
+        if (i == PROF_FRAME) continue;
+        fprintf(out, "%s\"%s\":%.0f", i ? "," : "", prof_stage_name(i),
+                (double) stage_ns[i] / ticks);
+    }
+    fprintf(out, ",\"tick\":%.0f}", (double) elapsed / ticks);
+    fprintf(out, ",\"tick_p50_ns\":%.0f,\"tick_p99_ns\":%.0f,"
+            "\"tick_max_ns\":%.0f", (double) tick_ns[ticks / 2],
+            (double) tick_ns[(ticks - 1) * 99 / 100],
+            (double) tick_ns[ticks - 1]);
+    fprintf(out, ",\"bullet_updates\":%.0f,\"bullets_per_sec\":%.0f",
+            (double) updates, updates / (elapsed / 1000000000.0));
+    fprintf(out, ",\"peak_bullets\":%.0f", (double) peak);
+    for (i = 0; i < MET_NUM_METRICS; ++i) {
+        if (metric_kind(i) != MET_COUNTER) continue;
+        fprintf(out, ",\"%s\":%.0f", metric_name(i), (double) metric_get(i));
+    }
+    fprintf(out, "}\n");
+    fflush(out);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *out = stdout;
+    Uint64 *tick_ns;
+    int ticks = BENCH_TICKS, ran = 0, i;
+
+    if (argc > 4) {
+        fprintf(stderr, "usage: bullet-rain-bench "
+                "[results.json [ticks [workload]]]\n");
+        return 1;
+    }
+    if (argc >= 3) ticks = atoi(argv[2]);
+    if (ticks < 1) ticks = 1;
+
+    /* No display needed */
+    SDL_putenv("SDL_VIDEODRIVER=dummy");
+    panic(!init_all(), "Error initializing engine subsystems");
+
+    screen = SDL_SetVideoMode(640, 480, 32, SDL_SWSURFACE);
+    panic(screen != NULL, "Error setting up video mode");
+
+    if (argc >= 2 && strcmp(argv[1], "-") != 0) {
+        out = fopen(argv[1], "w");
+        if (out == NULL) {
+            fprintf(stderr, "bullet-rain-bench: couldn't open %s\n", argv[1]);
+            stop_all();
+            return 1;
+        }
+    }
+
+    tick_ns = (Uint64*) malloc(ticks * sizeof(Uint64));
+    panic(tick_ns != NULL, "Out of memory for tick times");
+
+    _make_types();
+    for (i = 0; i < NUM_WORKLOADS; ++i) {
+        if (argc == 4 && strcmp(argv[3], workloads[i].name) != 0) continue;
+        _run(&workloads[i], ticks, tick_ns, out);
+        ++ran;
+    }
+    if (ran == 0) {
+        fprintf(stderr, "bullet-rain-bench: no workload called %s\n",
+                argv[3]);
+    }
+
+    free(tick_ns);
+    if (out != stdout) fclose(out);
+    stop_all();
+    return ran == 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * brdump.c
+ * Contains the dump loader, a standalone program that loads a crash dump
+ * (see dump.h) back into the engine, says what was in it, and draws the
+ * frame it crashed on to a bitmap.
+ * Usage: brdump <dump> [frame.bmp [ticks]]
+ *
+ * It runs under SDL's dummy video driver, so it doesn't need a display.
+ * With ticks, the bullets are moved on that many ticks before drawing, to
+ * see where things were headed.
+ */
+
+#include "compile.h"
+#include "bullet.h"
+#include "debug.h"
+#include "dump.h"
+#include "init.h"
+#include "player.h"
+#include "profile.h"
+#include "render.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/* The dump is loaded into this, it's too big for the stack */
+dump_info info;
+
+/* Print the min, average and max time of each stage over the dump */
+void _print_frames(void)
+{
+    Uint64 min, max, total;
+    int stage, i;
+
+    printf("brdump: last %d frames, min/avg/max ms:\n", info.frames);
+    if (info.frames == 0) return;
+
+    for (stage = 0; stage < PROF_NUM_STAGES; ++stage) {
+        min = max = total = info.frame[0].ns[stage];
+        for (i = 1; i < info.frames; ++i) {
+            if (info.frame[i].ns[stage] < min) min = info.frame[i].ns[stage];
+            if (info.frame[i].ns[stage] > max) max = info.frame[i].ns[stage];
+            total += info.frame[i].ns[stage];
+        }
+        printf("  %-9s %6.2f %6.2f %6.2f\n", prof_stage_name(stage),
+               min / 1000000.0F, total / info.frames / 1000000.0F,
+               max / 1000000.0F);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    SDL_Surface *screen;
+    pbullet *pbul;
+    int ticks = 0, i;
+
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: brdump <dump> [frame.bmp [ticks]]\n");
+        return 1;
+    }
+    if (argc == 4) ticks = atoi(argv[3]);
+
+    /* No display needed */
+    SDL_putenv("SDL_VIDEODRIVER=dummy");
+    panic(!init_all(), "Error initializing engine subsystems");
+
+    /*
+     * A panic while restoring mustn't write a crash dump, it'd go right
+     * over the top of the one we're looking at
+     */
+    set_dump_hook(NULL);
+
+    screen = SDL_SetVideoMode(640, 480, 32, SDL_SWSURFACE);
+    panic(screen != NULL, "Error setting up video mode");
+
+    if (!load_dump(argv[1], &info)) {
+        fprintf(stderr, "brdump: couldn't load %s\n", argv[1]);
+        stop_all();
+        return 1;
+    }
+
+    printf("brdump: %s, written %u ms in\n", argv[1], (unsigned) info.ticks);
+    printf("brdump: %s\n", info.reason);
+    printf("brdump: %d archives, %d images (%d cut again, %d stand-ins)\n",
+           info.arcs, info.images, info.cut, info.missing);
+    printf("brdump: %d bullets, %d pbullets\n", info.bullets, info.pbullets);
+    _print_frames();
+    if (info.traceback[0] != '\0') {
+        printf("brdump: %s\n", info.traceback);
+    }
+
+    if (argc >= 3) {
+        for (; ticks > 0; --ticks) {
+            snapshot_bullets();
+            for (i = 0; i < 8192; ++i) {
+                if (is_alive(&bullet_mem[i])) process_bullet(&bullet_mem[i]);
+            }
+        }
+
+        SDL_FillRect(screen, NULL, 0);
+        render_bullets(screen, 320, 240);
+        for (i = 0; i < 1024; ++i) {
+            pbul = &pbullet_mem[i];
+            if (pis_alive(pbul)) draw_pbullet(pbul, screen, 320, 240);
+        }
+        for (i = 0; i < 4; ++i) {
+            if (players[i].img != NULL) {
+                draw_player(&players[i], screen, 320, 240);
+            }
+        }
+
+        if (SDL_SaveBMP(screen, argv[2]) != 0) {
+            fprintf(stderr, "brdump: couldn't write %s\n", argv[2]);
+        }
+        else {
+            printf("brdump: drew the frame to %s\n", argv[2]);
+        }
+    }
+
+    stop_all();
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * brpack.c
+ * Contains the pack builder, a standalone program that turns one of our
+ * gzipped tarballs into a .brp pack. See resource.h for the format.
+ * Usage: brpack <archive.tgz> <pack.brp>
+ *
+ * The pack is written under another name and then renamed, since a game
+ * with hot reloading on could have the old one mapped in.
+ */
+
+#include "compile.h"
+#include "resource.h"
+#include <archive.h>
+#include <archive_entry.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct pack_item pack_item;
+struct pack_item {
+    pack_entry entry;
+    char      *name;
+    void      *data;
+};
+
+/* Write zeroes until the file is at the given offset */
+void _pad_to(FILE *out, Uint32 offset)
+{
+    while ((Uint32)ftell(out) < offset) {
+        fputc(0, out);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct archive *arc;
+    struct archive_entry *ae;
+    pack_item *items = NULL;
+    pack_header header;
+    Uint32 count = 0, capacity = 0, offset, i;
+    FILE *out;
+    char *tmpname;
+    int r;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: brpack <archive.tgz> <pack.brp>\n");
+        return 1;
+    }
+
+    /* Read everything in */
+    arc = archive_read_new();
+#if ARCHIVE_VERSION_NUMBER < 3000000
+    archive_read_support_compression_gzip(arc);
+#else
+    archive_read_support_filter_gzip(arc);
+#endif
+    archive_read_support_format_tar(arc);
+
+    r = archive_read_open_filename(arc, argv[1], 10240);
+    if (r != ARCHIVE_OK) {
+        fprintf(stderr, "brpack: couldn't open %s\n", argv[1]);
+        return 1;
+    }
+
+    while (archive_read_next_header(arc, &ae) == ARCHIVE_OK) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            items = realloc(items, capacity * sizeof(pack_item));
+            if (items == NULL) {
+                fprintf(stderr, "brpack: out of memory\n");
+                return 1;
+            }
+        }
+
+        memset(&items[count].entry, 0, sizeof(pack_entry));
+        items[count].name = malloc(strlen(archive_entry_pathname(ae)) + 1);
+        if (items[count].name == NULL) {
+            fprintf(stderr, "brpack: out of memory\n");
+            return 1;
+        }
+        strcpy(items[count].name, archive_entry_pathname(ae));
+        items[count].entry.id   = calculate_sid(items[count].name);
+        items[count].entry.type = (Uint32) get_restype(items[count].name);
+        items[count].entry.size = (Uint32) archive_entry_size(ae);
+
+        items[count].data = malloc(items[count].entry.size + 1);
+        if (items[count].data == NULL) {
+            fprintf(stderr, "brpack: out of memory\n");
+            return 1;
+        }
+        archive_read_data(arc, items[count].data, items[count].entry.size);
+        items[count].entry.hash = calculate_hash(items[count].data,
+                                                 items[count].entry.size);
+        ++count;
+    }
+
+#if ARCHIVE_VERSION_NUMBER < 3000000
+    archive_read_finish(arc);
+#else
+    archive_read_free(arc);
+#endif
+
+    tmpname = malloc(strlen(argv[2]) + 5);
+    if (tmpname == NULL) {
+        fprintf(stderr, "brpack: out of memory\n");
+        return 1;
+    }
+    sprintf(tmpname, "%s.tmp", argv[2]);
+
+    out = fopen(tmpname, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "brpack: couldn't open %s for writing\n", tmpname);
+        return 1;
+    }
+
+    /* The names go straight after the index */
+    offset = sizeof(pack_header) + count * sizeof(pack_entry);
+    for (i = 0; i < count; ++i) {
+        _pad_to(out, offset);
+        items[i].entry.name = offset;
+        fwrite(items[i].name, 1, strlen(items[i].name) + 1, out);
+        offset += strlen(items[i].name) + 1;
+    }
+
+    /*
+     * The data goes in archive order, which is roughly the order things get
+     * used in, starting on a fresh page
+     */
+    offset = (offset + PACK_PAGE - 1) / PACK_PAGE * PACK_PAGE;
+    header.data = offset;
+    for (i = 0; i < count; ++i) {
+        _pad_to(out, offset);
+        items[i].entry.offset = offset;
+        fwrite(items[i].data, 1, items[i].entry.size, out);
+        offset += items[i].entry.size;
+        offset  = (offset + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+    }
+
+    /* Then go back and write the header and index */
+    memcpy(header.magic, PACK_MAGIC, 4);
+    header.version = PACK_VERSION;
+    header.count   = count;
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(pack_header), 1, out);
+    for (i = 0; i < count; ++i) {
+        fwrite(&items[i].entry, sizeof(pack_entry), 1, out);
+    }
+
+    fclose(out);
+
+#ifdef _WIN32
+    /* Windows won't rename over a file that's there already */
+    remove(argv[2]);
+#endif
+    if (rename(tmpname, argv[2]) != 0) {
+        fprintf(stderr, "brpack: couldn't rename %s to %s\n",
+                tmpname, argv[2]);
+        return 1;
+    }
+    free(tmpname);
+
+    printf("brpack: packed %u resources from %s into %s\n",
+           (unsigned) count, argv[1], argv[2]);
+
+    for (i = 0; i < count; ++i) {
+        free(items[i].name);
+        free(items[i].data);
+    }
+    free(items);
+
+    return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * budget.c
+ * Contains code for the frame budget controller
+ */
+
+#include "compile.h"
+#include "budget.h"
+#include "debug.h"
+#include "profile.h"
+#include "render.h"
+#include "text.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+const char policy_names[BUDGET_NUM_POLICIES][12] = {
+    "none",
+    "slowdown",
+    "shed",
+    "halve"
+};
+
+int    budget_policy = BUDGET_NONE;
+Uint64 budget_ns     = BUDGET_DEFAULT_NS;
+
+/* Smoothed costs of the simulation and of drawing */
+Uint64 budget_sim;
+Uint64 budget_draw;
+
+/* Whether the policy is on, and whether the last frame was drawn */
+int budget_on    = FALSE;
+int budget_drawn = TRUE;
+
+/* How fast the game should run */
+float budget_rate = 1.0F;
+
+/* Weight of the newest frame in the smoothed costs is 1/BUDGET_SMOOTH */
+#define BUDGET_SMOOTH 8
+
+/* Move a smoothed cost towards a new sample */
+Uint64 _smooth(Uint64 old, Uint64 sample)
+{
+    if (sample > old) return old + (sample - old) / BUDGET_SMOOTH;
+    return old - (old - sample) / BUDGET_SMOOTH;
+}
+
+/* Set/get the policy */
+void budget_set_policy(int policy)
+{
+    warn(policy >= 0 && policy < BUDGET_NUM_POLICIES, "Bad budget policy");
+    if (policy < 0 || policy >= BUDGET_NUM_POLICIES) return;
+
+    budget_policy = policy;
+    budget_on     = FALSE;
+    budget_rate   = 1.0F;
+    render_set_shed(FALSE);
+}
+
+int budget_get_policy(void)
+{
+    return budget_policy;
+}
+
+/* Get a policy's name, or find a policy by name */
+const char *budget_policy_name(int policy)
+{
+    return policy_names[policy];
+}
+
+int budget_find_policy(const char *name)
+{
+    int i;
+
+    for (i = 0; i < BUDGET_NUM_POLICIES; ++i) {
+        if (strcmp(policy_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+/* Set/get the frame budget */
+void budget_set_ns(Uint64 ns)
+{
+    budget_ns = ns;
+}
+
+Uint64 budget_get_ns(void)
+{
+    return budget_ns;
+}
+
+/* Take the last frame's costs into account */
+void budget_end_frame(void)
+{
+    Uint64 sim, cost;
+
+    sim = prof_last(PROF_INTEGRATE) + prof_last(PROF_COLLIDE) +
+          prof_last(PROF_SCRIPTS);
+    budget_sim = _smooth(budget_sim, sim);
+
+    /* A skipped frame costs nothing to draw, but that doesn't count */
+    if (budget_drawn) {
+        budget_draw = _smooth(budget_draw, prof_last(PROF_DRAW));
+    }
+
+    cost = budget_sim + budget_draw;
+
+    switch (budget_policy) {
+        case BUDGET_SLOWDOWN:
+            /*
+             * The cost was measured at the current rate, and slowing down
+             * means fewer ticks a frame, so scale the rate by how far over
+             * (or under) that was. That stops changing once the work fits
+             * the budget
+             */
+            if (cost > 0) budget_rate *= (float) budget_ns / cost;
+            if (budget_rate < BUDGET_MIN_SPEED) budget_rate = BUDGET_MIN_SPEED;
+            if (budget_rate > 1.0F) budget_rate = 1.0F;
+            budget_on = (budget_rate < 1.0F);
+            break;
+
+        case BUDGET_SHED:
+        case BUDGET_HALVE:
+            if (!budget_on && cost > budget_ns) {
+                budget_on = TRUE;
+            }
+            else if (budget_on && cost * 100 < budget_ns * BUDGET_RELEASE) {
+                budget_on = FALSE;
+            }
+            render_set_shed(budget_on && budget_policy == BUDGET_SHED);
+            break;
+
+        default:
+            budget_on = FALSE;
+            break;
+    }
+}
+
+/* Is the policy doing anything right now? */
+int budget_active(void)
+{
+    return budget_on;
+}
+
+/* How far under budget the frames are */
+Sint64 budget_headroom(void)
+{
+    return (Sint64) budget_ns - (Sint64)(budget_sim + budget_draw);
+}
+
+/* How fast the game should run */
+float budget_speed(void)
+{
+    return budget_rate;
+}
+
+/* Should this frame be drawn? */
+int budget_draw_frame(void)
+{
+    if (budget_on && budget_policy == BUDGET_HALVE) {
+        budget_drawn = !budget_drawn;
+    }
+    else {
+        budget_drawn = TRUE;
+    }
+    return budget_drawn;
+}
+
+/* Draw the policy, headroom and speed on one line */
+int budget_draw_overlay(SDL_Surface *dst, text_cache *tc, int x, int y)
+{
+    char line[64];
+
+    sprintf(line, "budget %-8s %+6.2f ms x%.2f%s",
+            policy_names[budget_policy], budget_headroom() / 1000000.0F,
+            budget_rate, budget_on ? " ON" : "");
+    draw_text(tc, dst, x, y, line);
+
+    return tc->height;
+}
+
+/* Start/stop functions */
+int init_budget(void)
+{
+    budget_ns   = BUDGET_DEFAULT_NS;
+    budget_sim  = 0;
+    budget_draw = 0;
+    budget_set_policy(BUDGET_NONE);
+
+    return 0;
+}
+
+void stop_budget(void)
+{
+    render_set_shed(FALSE);
+}
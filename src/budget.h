@@ -0,0 +1,96 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * budget.h
+ * Contains definitions and prototypes for the frame budget controller
+ */
+
+#ifndef BUDGET_H
+
+#define BUDGET_H
+
+#include "compile.h"
+#include "text.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/*
+ * After every frame, budget_end_frame looks at what the profiler measured
+ * for it: everything but the flip, which is mostly waiting on the display.
+ * When that goes over the frame budget, the policy says what to do:
+ *
+ *   BUDGET_NONE      nothing, frames just take longer
+ *   BUDGET_SLOWDOWN  the game runs slower, by as much as it's over, down to
+ *                    BUDGET_MIN_SPEED. Classic shmup slowdown. Feed
+ *                    budget_speed into the frame loop's speed to do it.
+ *   BUDGET_SHED      bullets marked NO_COLLIDE can't hit anything, so they
+ *                    aren't drawn
+ *   BUDGET_HALVE     only every other frame is drawn, see budget_draw_frame
+ *
+ * The cost is smoothed over a few frames. Shedding and halving start when
+ * it goes over budget and stop once it's back under BUDGET_RELEASE percent
+ * of it, so they don't flicker on and off right at the edge. Draw costs
+ * are only taken from frames that got drawn.
+ *
+ * Everything here should be called from the thread running the frame loop.
+ */
+
+#define BUDGET_NONE     0
+#define BUDGET_SLOWDOWN 1
+#define BUDGET_SHED     2
+#define BUDGET_HALVE    3
+
+#define BUDGET_NUM_POLICIES 4
+
+/* One frame at 60hz */
+#define BUDGET_DEFAULT_NS 16666666
+/* Slowest the game gets with BUDGET_SLOWDOWN */
+#define BUDGET_MIN_SPEED  0.5F
+/* Percentage of the budget to get back under before letting go */
+#define BUDGET_RELEASE    85
+
+/* Set/get the policy */
+extern void budget_set_policy(int policy);
+extern int  budget_get_policy(void);
+
+/* Get a policy's name, or find a policy by name (-1 if there isn't one) */
+extern const char *budget_policy_name(int policy);
+extern int         budget_find_policy(const char *name);
+
+/* Set/get the frame budget in nanoseconds */
+extern void   budget_set_ns(Uint64 ns);
+extern Uint64 budget_get_ns(void);
+
+/* Take the last frame's costs into account, call after prof_end_frame */
+extern void budget_end_frame(void);
+
+/* Is the policy doing anything right now? */
+extern int budget_active(void);
+
+/* How far under budget the frames are, in nanoseconds. Negative if over */
+extern Sint64 budget_headroom(void);
+
+/* How fast the game should run, 1.0 unless it's slowing down */
+extern float budget_speed(void);
+
+/* Should this frame be drawn? Call once per frame */
+extern int budget_draw_frame(void);
+
+/* Draw the policy, headroom and speed on one line. Returns the height */
+extern int budget_draw_overlay(SDL_Surface *dst, text_cache *tc, int x, int y);
+
+/* Start/stop functions */
+extern int  init_budget(void);
+extern void stop_budget(void);
+
+#endif /* !def BUDGET_H */
@@ -15,10 +15,14 @@
 #include "bullet.h"
 #include "collmath.h"
 #include "debug.h"
+#include "metrics.h"
 
 /* Memory to use for bullets */
 bullet bullet_mem[8192];
 
+/* Where they were at the last snapshot */
+bullet_pos bullet_prev[8192];
+
 bullet    *free_bullets_head;
 bullet    *free_bullets_tail;
 SDL_mutex *free_bullets_lock;
@@ -38,6 +42,7 @@ int make_bullet(float locx, float locy, float velx, float vely,
     check_mutex(r);
     
     if (free_bullets_head == NULL) {
+        metric_add(MET_BULLETS_FAILED, 1);
         warn(FALSE, "Out of bullet memory!");
         r = SDL_mutexV(free_bullets_lock);
         check_mutex(r);
@@ -66,9 +71,26 @@ int make_bullet(float locx, float locy, float velx, float vely,
     newbullet->lrx += locx;
     newbullet->lry += locy;
     
+    bullet_prev[newbullet - bullet_mem].x = locx;
+    bullet_prev[newbullet - bullet_mem].y = locy;
+    
+    metric_add(MET_BULLETS_MADE, 1);
+    metric_add(MET_BULLETS_LIVE, 1);
     return newbullet - bullet_mem;
 }
 
+/* Take a snapshot of where every bullet is */
+void snapshot_bullets(void)
+{
+    int i;
+    
+    /* Dead ones too, it's quicker than checking */
+    for (i = 0; i < 8192; ++i) {
+        bullet_prev[i].x = bullet_mem[i].centerx;
+        bullet_prev[i].y = bullet_mem[i].centery;
+    }
+}
+
 /* 
  * Process a single bullet to completion
  * TODO: This does not do anything with the extended block!
@@ -98,7 +120,10 @@ inline int process_bullet(bullet *bul)
 inline int collide_bullet(bullet *bul, float px, float py, float rad)
 {
     float sors = (rad+bul->rad)*(rad+bul->rad); /* sum of radii squared */
-    return circle_collide(bul->centerx, bul->centery, px, py, sors);
+    int hit = circle_collide(bul->centerx, bul->centery, px, py, sors);
+    
+    if (hit) metric_add(MET_BULLET_HITS, 1);
+    return hit;
 }
 
 /* Destroy a bullet */
@@ -123,6 +148,9 @@ void destroy_bullet(bullet *bul)
     
     r = SDL_mutexV(free_bullets_lock);
     check_mutex(r);
+    
+    metric_add(MET_BULLETS_DESTROYED, 1);
+    metric_add(MET_BULLETS_LIVE, -1);
 }
 
 /* Sets up the linked lists */
@@ -159,6 +187,8 @@ void reset_bullets(void)
     
     r = SDL_mutexV(free_bullets_lock);
     check_mutex(r);
+    
+    metric_set(MET_BULLETS_LIVE, 0);
 }
 
 /* Destroys all bullets and the linked lists */
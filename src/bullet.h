@@ -206,6 +206,22 @@ struct bullet_type_ {
 /* Memory to use for bullets */
 extern bullet bullet_mem[8192];
 
+/*
+ * Where each bullet was at the last snapshot_bullets, so drawing can be
+ * interpolated between ticks (see loop.h). New bullets start out with
+ * their snapshot where they are, so they don't fly in from somewhere.
+ */
+typedef struct bullet_pos_ bullet_pos;
+struct bullet_pos_ {
+    float x;
+    float y;
+};
+
+extern bullet_pos bullet_prev[8192];
+
+/* Take a snapshot of where every bullet is, before running a tick */
+extern void snapshot_bullets(void);
+
 /* Linked list of free bullet / extended block space */
 extern bullet    *free_bullets_head;
 extern bullet    *free_bullets_tail;
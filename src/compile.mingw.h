@@ -31,8 +31,52 @@
 /* Verbose output */
 /* #define VERBOSE_DEBUG */
 
-/* Size of hash map used to store resources */
-#define ARCLIST_HASH_SIZE 1024
+/*
+ * Lowest level of log message to compile in, see debug.h. Defaults to
+ * LOG_VERBOSE, LOG_DEBUG or LOG_PANIC going by DEBUG and VERBOSE_DEBUG
+ */
+/* #define LOG_LEVEL LOG_WARN */
+
+/*
+ * File a panic writes a crash dump to, see dump.h. Comment it out for no
+ * dump
+ */
+#define DUMP_FILE "brcrash.dmp"
+
+/* Compile out trace_begin/trace_end entirely, see trace.h */
+/* #define NO_TRACE */
+
+/*
+ * Starting number of buckets in each archive's resource table, a power
+ * of 2. Tables grow as needed, this just saves rehashing the big ones.
+ */
+#define ARCLIST_HASH_SIZE 64
+
+/* Size of a cache line in bytes */
+#define CACHE_LINE 64
+
+/* Number of threads used to decode images while loading archives */
+#define DECODE_THREADS 4
+
+/* Memory budget for decoded images in bytes, 0 for no limit */
+#define RES_BUDGET 0
+
+/*
+ * Bytes libarchive reads from a tarball at a time, or 0 to map the whole
+ * file in and let it read straight from memory
+ */
+#define TGZ_READ_BLOCK 0
+
+/* Size of the blocks archives are loaded into, and how many to keep spare */
+#define LOAD_ARENA_BLOCK 262144
+#define LOAD_ARENA_SPARE 16
+
+/*
+ * Have SDL fetch events from the OS on a thread of its own, so the event
+ * pump doesn't have to wait for the main thread to do it. X11 can do this,
+ * Windows can't.
+ */
+/* #define SDL_EVENT_THREAD */
 
 /* Include "SDL/SDL_***.h" instead of "SDL_***.h", needed on e.g. Ubuntu */
 /* #define INCLUDE_SDL_PREFIX */
@@ -19,6 +19,7 @@
 #include "geometry.h"
 #include "input.h"
 #include "player.h"
+#include "render.h"
 #include "resource.h"
 
 #ifdef INCLUDE_SDL_PREFIX
@@ -35,9 +36,6 @@ pbullet_type main_shot;
 pbullet_type left_shot;
 pbullet_type right_shot;
 
-/* The ship sprite sheet */
-SDL_Surface *ship_sprites;
-
 /* Actual sprites */
 SDL_Surface *ship_main_sprite;
 SDL_Surface *ship_destroy_anim[6];
@@ -71,56 +69,32 @@ SDL_Rect ship_destroy_anim_rect[6] = {
  */
 int init_coreship (void)
 {
-    SDL_PixelFormat fmt;
-    SDL_Surface *tmp;
+    resource *ship_sheet;
+    SDL_Surface *ship_sprites;
     int i;
-    
-    Uint32 colorkey;
  
     /* Abort if we've done this before */
     if (initialized) return 0;
     
     /* Load the sprites */
-    ship_sprites=(SDL_Surface*)(get_res("res/brcore.tgz", "coreship.png")->data);
-    
-    /* Get pixel format */
-    fmt = *(ship_sprites->format);
-    
-    /* Get color key */
-    colorkey = SDL_MapRGBA(&fmt, 255, 0, 255, SDL_ALPHA_OPAQUE);
+    ship_sheet = ACQUIRE_RES("res/brcore.tgz", "coreship.png");
+    ship_sprites = (SDL_Surface*) ship_sheet->data;
     
     /* Copy over all of the individual sprites */
-    tmp = SDL_CreateRGBSurface(SDL_HWSURFACE, 16, 16, 
-        fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
-    SDL_BlitSurface(ship_sprites, &ship_rect, tmp, NULL);
-    SDL_SetColorKey(tmp, SDL_SRCCOLORKEY, colorkey);
-    ship_main_sprite = tmp;
+    ship_main_sprite = cut_sprite(ship_sprites, &ship_rect);
     
     for (i = 0; i < 6; ++i) {
-        tmp = SDL_CreateRGBSurface(SDL_HWSURFACE, 16, 16, 
-            fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
-        SDL_BlitSurface(ship_sprites, &ship_destroy_anim_rect[i], tmp, NULL);
-        SDL_SetColorKey(tmp, SDL_SRCCOLORKEY, colorkey);
-        ship_destroy_anim[i] = tmp;
+        ship_destroy_anim[i] = cut_sprite(ship_sprites, &ship_destroy_anim_rect[i]);
     }
     
-    tmp = SDL_CreateRGBSurface(SDL_HWSURFACE, 8, 8,
-        fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
-    SDL_BlitSurface(ship_sprites, &main_shot_rect, tmp, NULL);
-    SDL_SetColorKey(tmp, SDL_SRCCOLORKEY, colorkey);
-    main_shot_sprite = tmp;
+    main_shot_sprite = cut_sprite(ship_sprites, &main_shot_rect);
+    
+    left_shot_sprite = cut_sprite(ship_sprites, &left_shot_rect);
     
-    tmp = SDL_CreateRGBSurface(SDL_HWSURFACE, 8, 8,
-        fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
-    SDL_BlitSurface(ship_sprites, &left_shot_rect, tmp, NULL);
-    SDL_SetColorKey(tmp, SDL_SRCCOLORKEY, colorkey);
-    left_shot_sprite = tmp;
+    right_shot_sprite = cut_sprite(ship_sprites, &right_shot_rect);
     
-    tmp = SDL_CreateRGBSurface(SDL_HWSURFACE, 8, 8,
-        fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
-    SDL_BlitSurface(ship_sprites, &right_shot_rect, tmp, NULL);
-    SDL_SetColorKey(tmp, SDL_SRCCOLORKEY, colorkey);
-    right_shot_sprite = tmp;
+    /* The sprites are copies, so the sheet can go back into the cache */
+    release_res(ship_sheet);
     
     /* Create the pbullet_types */
     main_shot.tlx          = -4.0F;
@@ -216,6 +190,9 @@ void setup_coreship (int id)
 /* Updates the coreship */
 void update_coreship (int id, player *ship)
 {
+    /* Everything goes off the snapshot for this tick */
+    const input_snapshot *in = input_last();
+    
     /* Update timers */
     if (ship->gamedata[TIME_TO_MAIN_SHOT] > 0) {
         --(ship->gamedata[TIME_TO_MAIN_SHOT]);
@@ -230,32 +207,35 @@ void update_coreship (int id, player *ship)
         --(ship->gamedata[DEATH_TIMER]);
     }
     
-    /* Check inputs and move ship/shoot accordingly */
-    if (input_value(CORESHIP_INPUT_UP + id*5)) {
+    /*
+     * Check inputs and move ship/shoot accordingly. A tap that started and
+     * ended inside the tick still counts for one tick's worth
+     */
+    if (snap_down(in, CORESHIP_INPUT_UP + id*5)) {
         ship->centery -= 3.333F;
         if (ship->centery < -240.0F) {
             ship->centery = -240.0F;
         }
     }
-    if (input_value(CORESHIP_INPUT_DOWN + id*5)) {
+    if (snap_down(in, CORESHIP_INPUT_DOWN + id*5)) {
         ship->centery += 3.333F;
         if (ship->centery > 240.0F) {
             ship->centery = 240.0F;
         }
     }
-    if (input_value(CORESHIP_INPUT_LEFT + id*5)) {
+    if (snap_down(in, CORESHIP_INPUT_LEFT + id*5)) {
         ship->centerx -= 3.333F;
         if (ship->centerx < -320.0F) {
             ship->centerx = -320.0F;
         }
     }
-    if (input_value(CORESHIP_INPUT_RIGHT + id*5)) {
+    if (snap_down(in, CORESHIP_INPUT_RIGHT + id*5)) {
         ship->centerx += 3.333F;
         if (ship->centerx > 320.0F) {
             ship->centerx = 320.0F;
         }
     }
-    if (input_value(CORESHIP_INPUT_SHOOT + id*5)) {
+    if (snap_down(in, CORESHIP_INPUT_SHOOT + id*5)) {
         if (ship->gamedata[TIME_TO_MAIN_SHOT] <= 0) {
             ship->gamedata[TIME_TO_MAIN_SHOT] = 5;
             make_pbullet(&main_shot, ship->centerx, ship->centery-8.0F,
@@ -25,80 +25,467 @@
 #include "SDL_thread.h"
 #endif
 
-SDL_mutex *debug_output_lock;
+typedef struct log_entry_ log_entry;
+struct log_entry_ {
+    int   level;
+    char *file;
+    int   line;
+    /* msg1 and msg2 with a space between, or just msg1 if there's a num */
+    char  text[LOG_TEXT];
+    int   hasnum;
+    int   num;
+};
 
-#ifdef DEBUG
+/*
+ * One thread's ring. head is only written by the thread that owns it, and
+ * tail only by whoever holds log_write_lock. Both just count up, and get
+ * masked to index the ring.
+ */
+typedef struct log_ring_ log_ring;
+struct log_ring_ {
+    volatile Uint32 head;
+    volatile Uint32 tail;
+    log_entry       entries[LOG_RING];
+};
+
+/* A call site being rate limited, claimed by setting state to 1 then 2 */
+typedef struct log_site_ log_site;
+struct log_site_ {
+    volatile int    state;
+    char           *file;
+    int             line;
+    volatile Uint32 second;
+    volatile Uint32 count;
+    volatile Uint32 limited;
+};
+
+/* Sites past this many slots from where they hash to aren't limited */
+#define LOG_PROBES 8
+
+log_ring    log_rings[LOG_THREADS];
+thread_slot log_slots[LOG_THREADS];
+log_site    log_sites[LOG_SITES];
+
+/* Tables thread_done releases slots in */
+thread_slot *slot_tables[THREAD_SLOT_TABLES];
+int          slot_table_sizes[THREAD_SLOT_TABLES];
+int          num_slot_tables = 0;
+
+/* Stats */
+Uint32 log_written = 0;
+Uint32 log_limited = 0;
+Uint32 log_dropped = 0;
 
-void _debug (char *msg1, char *msg2)
+/* Held by whoever is emptying the rings, the writer or a panic */
+SDL_mutex  *log_write_lock = NULL;
+SDL_Thread *log_thread = NULL;
+int         log_kill = FALSE;
+
+void _log_drain(void);
+
+void thread_slots_register(thread_slot *slots, int n)
 {
-    SDL_mutexP(debug_output_lock);
-    printf("  --> DEBUG: %s %s\n", msg1, msg2);
-    SDL_mutexV(debug_output_lock);
-    fflush(stdout);
+    int i;
+
+    for (i = 0; i < num_slot_tables; ++i) {
+        if (slot_tables[i] == slots) return;
+    }
+
+    warn(num_slot_tables < THREAD_SLOT_TABLES,
+         "Too many thread slot tables, raise THREAD_SLOT_TABLES");
+    if (num_slot_tables == THREAD_SLOT_TABLES) return;
+
+    slot_tables[num_slot_tables]      = slots;
+    slot_table_sizes[num_slot_tables] = n;
+    ++num_slot_tables;
 }
-void _debugn (char *msg1, int num)
-{    
-    SDL_mutexP(debug_output_lock);
-    printf("  --> DEBUG: %s %d\n", msg1, num);
-    SDL_mutexV(debug_output_lock);
-    fflush(stdout);
+
+int thread_slot_get(thread_slot *slots, int n)
+{
+    Uint32 id = SDL_ThreadID();
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (slots[i].state == THREAD_SLOT_OWNED && slots[i].owner == id) {
+            return i;
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (__sync_bool_compare_and_swap(&slots[i].state, THREAD_SLOT_FREE,
+                                         THREAD_SLOT_CLAIMING)) {
+            slots[i].owner = id;
+            __sync_synchronize();
+            slots[i].state = THREAD_SLOT_OWNED;
+            return i;
+        }
+    }
+
+    return -1;
 }
 
-#endif /* def DEBUG */
+int thread_slot_free(thread_slot *slot)
+{
+    return __sync_bool_compare_and_swap(&slot->state, THREAD_SLOT_RELEASED,
+                                        THREAD_SLOT_FREE);
+}
+
+void thread_done(void)
+{
+    Uint32 id = SDL_ThreadID();
+    thread_slot *slots;
+    int i, j;
 
-/* These we want in non-debug builds */
+    for (i = 0; i < num_slot_tables; ++i) {
+        slots = slot_tables[i];
+        for (j = 0; j < slot_table_sizes[i]; ++j) {
+            if (slots[j].state == THREAD_SLOT_OWNED &&
+                slots[j].owner == id) {
+                /* Everything it wrote has to be seen before this is */
+                __sync_synchronize();
+                slots[j].state = THREAD_SLOT_RELEASED;
+            }
+        }
+    }
+}
 
-void _warn (char *msg1, char *msg2, char *file, int line)
+/* Find the calling thread's ring, or give it one */
+log_ring *_log_ring(void)
 {
-    SDL_mutexP(debug_output_lock);
-    printf("  --> WARNING at %s line %d: %s %s\n", file, line, msg1, msg2);
-    SDL_mutexV(debug_output_lock);
-    fflush(stdout);
+    int i = thread_slot_get(log_slots, LOG_THREADS);
+
+    return (i < 0) ? NULL : &log_rings[i];
 }
-void _warnn (char *msg1, int num, char *file, int line)
+
+/* Count a message against its call site. FALSE if it's over the limit */
+int _log_allowed(char *file, int line)
+{
+    log_site *site;
+    Uint32 h, now;
+    int i;
+
+    h = (Uint32)(((unsigned long) file >> 3) ^ (line * 2654435761U));
+    for (i = 0; i < LOG_PROBES; ++i) {
+        site = &log_sites[(h + i) & (LOG_SITES-1)];
+        if (site->state == 0 &&
+            __sync_bool_compare_and_swap(&site->state, 0, 1)) {
+            site->file = file;
+            site->line = line;
+            __sync_synchronize();
+            site->state = 2;
+            break;
+        }
+        if (site->state == 2 && site->file == file && site->line == line) {
+            break;
+        }
+    }
+    /* Nowhere to keep count, let it through */
+    if (i == LOG_PROBES) return TRUE;
+
+    /* Two threads can both reset the count here, which doesn't matter */
+    now = SDL_GetTicks() / 1000;
+    if (site->second != now) {
+        site->second = now;
+        site->count  = 0;
+    }
+
+    if (__sync_fetch_and_add(&site->count, 1) < LOG_BURST) return TRUE;
+
+    __sync_fetch_and_add(&site->limited, 1);
+    __sync_fetch_and_add(&log_limited, 1);
+    return FALSE;
+}
+
+/* Copy s into dst, stopping at end. Returns where it stopped */
+char *_log_copy(char *dst, char *end, const char *s)
+{
+    while (*s != '\0' && dst < end) {
+        *dst++ = *s++;
+    }
+    return dst;
+}
+
+/* Get a free entry in this thread's ring, NULL if there isn't one */
+log_entry *_log_start(log_ring **ringp, int level, char *file, int line)
+{
+    log_ring  *ring;
+    log_entry *entry;
+
+    if (!_log_allowed(file, line)) return NULL;
+
+    ring = *ringp = _log_ring();
+    if (ring == NULL || ring->head - ring->tail >= LOG_RING) {
+        __sync_fetch_and_add(&log_dropped, 1);
+        return NULL;
+    }
+
+    entry = &ring->entries[ring->head & (LOG_RING-1)];
+    entry->level = level;
+    entry->file  = file;
+    entry->line  = line;
+    return entry;
+}
+
+/* Hand the entry to the writer */
+void _log_finish(log_ring *ring)
 {
-    SDL_mutexP(debug_output_lock);
-    printf("  --> WARNING at %s line %d: %s %d\n", file, line, msg1, num);
-    SDL_mutexV(debug_output_lock);
+    /* Make sure the entry is written before the writer can see it */
+    __sync_synchronize();
+    ++ring->head;
+
+    /* No writer, before init_debug or if it couldn't start, so write it now */
+    if (log_thread == NULL) {
+        if (log_write_lock != NULL) {
+            log_flush();
+        }
+        else {
+            _log_drain();
+        }
+    }
+}
+
+void _log (int level, char *msg1, char *msg2, char *file, int line)
+{
+    log_ring  *ring;
+    log_entry *entry;
+    char *end;
+
+    entry = _log_start(&ring, level, file, line);
+    if (entry == NULL) return;
+
+    end = _log_copy(entry->text, entry->text + LOG_TEXT - 2, msg1);
+    *end++ = ' ';
+    end = _log_copy(end, entry->text + LOG_TEXT - 1, msg2);
+    *end = '\0';
+    entry->hasnum = FALSE;
+
+    _log_finish(ring);
+}
+
+void _logn (int level, char *msg1, int num, char *file, int line)
+{
+    log_ring  *ring;
+    log_entry *entry;
+    char *end;
+
+    entry = _log_start(&ring, level, file, line);
+    if (entry == NULL) return;
+
+    end = _log_copy(entry->text, entry->text + LOG_TEXT - 1, msg1);
+    *end = '\0';
+    entry->hasnum = TRUE;
+    entry->num    = num;
+
+    _log_finish(ring);
+}
+
+/* Write one entry out, the same way messages always have been */
+void _log_write(log_entry *entry)
+{
+    if (entry->level == LOG_WARN) {
+        printf("  --> WARNING at %s line %d: ", entry->file, entry->line);
+    }
+    else {
+        printf("  --> DEBUG: ");
+    }
+
+    if (entry->hasnum) {
+        printf("%s %d\n", entry->text, entry->num);
+    }
+    else {
+        printf("%s\n", entry->text);
+    }
+}
+
+/*
+ * Empty every ring, and free the ones whose threads are gone once
+ * they're empty. Caller holds log_write_lock
+ */
+void _log_drain(void)
+{
+    log_ring *ring;
+    int i, state, wrote = FALSE;
+
+    for (i = 0; i < LOG_THREADS; ++i) {
+        ring  = &log_rings[i];
+        state = log_slots[i].state;
+        if (state != THREAD_SLOT_OWNED && state != THREAD_SLOT_RELEASED) {
+            continue;
+        }
+
+        /* A released ring's last entries are seen after it was released */
+        __sync_synchronize();
+
+        while (ring->tail != ring->head) {
+            /* Make sure we don't read the entry before it's done */
+            __sync_synchronize();
+            _log_write(&ring->entries[ring->tail & (LOG_RING-1)]);
+            ++log_written;
+            wrote = TRUE;
+
+            __sync_synchronize();
+            ++ring->tail;
+        }
+
+        if (state == THREAD_SLOT_RELEASED) {
+            thread_slot_free(&log_slots[i]);
+        }
+    }
+
+    if (wrote) fflush(stdout);
+}
+
+/* Say how many messages each site had left out since last time */
+void _log_report_limited(void)
+{
+    Uint32 n;
+    int i;
+
+    for (i = 0; i < LOG_SITES; ++i) {
+        if (log_sites[i].state != 2 || log_sites[i].limited == 0) continue;
+
+        n = __sync_fetch_and_and(&log_sites[i].limited, 0);
+        printf("  --> (left out %u more from %s line %d)\n",
+               (unsigned) n, log_sites[i].file, log_sites[i].line);
+    }
     fflush(stdout);
 }
 
-void _memdump(void)
+/* Write out everything logged so far */
+void log_flush(void)
 {
-    /* TODO: Not much I can do at this point, there's nothing to dump! */
+    int r;
+
+    r = SDL_mutexP(log_write_lock);
+    check_mutex(r);
+    _log_drain();
+    r = SDL_mutexV(log_write_lock);
+    check_mutex(r);
 }
 
+void log_stats(Uint32 *written, Uint32 *limited, Uint32 *dropped)
+{
+    *written = log_written;
+    *limited = log_limited;
+    *dropped = log_dropped;
+}
+
+/* The writer thread function */
+int _log_thread(void *data)
+{
+    Uint32 reported;
+    int r;
+
+    reported = SDL_GetTicks();
+    while (!log_kill) {
+        SDL_Delay(LOG_INTERVAL);
+
+        r = SDL_mutexP(log_write_lock);
+        check_mutex(r);
+        _log_drain();
+        if (SDL_GetTicks() - reported >= 1000) {
+            _log_report_limited();
+            reported = SDL_GetTicks();
+        }
+        r = SDL_mutexV(log_write_lock);
+        check_mutex(r);
+    }
+
+    return 0;
+}
+
+/* Whatever writes the crash dump, see dump.h */
+void (*dump_hook)(char *reason) = NULL;
+int  dumping = FALSE;
+
+void set_dump_hook(void (*hook)(char *reason))
+{
+    dump_hook = hook;
+}
+
+/* Write the crash dump, if anybody's set up to */
+void _memdump(char *msg1, char *msg2, char *file, int line)
+{
+    char reason[256], linebuf[16], *end, *max;
+
+    /* A panic while dumping shouldn't start another dump */
+    if (dump_hook == NULL || dumping) return;
+    dumping = TRUE;
+
+    sprintf(linebuf, " line %d: ", line);
+    max = reason + sizeof(reason) - 1;
+    end = _log_copy(reason, max, file);
+    end = _log_copy(end, max, linebuf);
+    end = _log_copy(end, max, msg1);
+    end = _log_copy(end, max, " ");
+    end = _log_copy(end, max, msg2);
+    *end = '\0';
+
+    dump_hook(reason);
+    dumping = FALSE;
+}
+
+/*
+ * Panics don't go through the rings, they're written straight away once
+ * everything logged before them is out. No check_mutex here, since it
+ * would just panic again.
+ */
 void _panic (char *msg1, char *msg2, char *file, int line)
 {
-    SDL_mutexP(debug_output_lock);
+    SDL_mutexP(log_write_lock);
+    _log_drain();
     printf("  --> PANIC at %s line %d: %s %s\n  Shutting down!\n",
                           file,  line,msg1,msg2);
-    SDL_mutexV(debug_output_lock);
     fflush(stdout);
+    SDL_mutexV(log_write_lock);
 
-    _memdump();
+    _memdump(msg1, msg2, file, line);
     abort();
 }
 
 void _panicn (char *msg1, int num, char *file, int line)
 {
-    SDL_mutexP(debug_output_lock);
+    char numbuf[16];
+
+    SDL_mutexP(log_write_lock);
+    _log_drain();
     printf("  --> PANIC at %s line %d: %s %d\n  Shutting down!\n",
                           file,  line,msg1,num);
     fflush(stdout);
-    SDL_mutexV(debug_output_lock);
+    SDL_mutexV(log_write_lock);
 
-    _memdump();
+    sprintf(numbuf, "%d", num);
+    _memdump(msg1, numbuf, file, line);
     abort();
 }
 
 int init_debug()
 {
-    debug_output_lock = SDL_CreateMutex();
+    thread_slots_register(log_slots, LOG_THREADS);
+    log_write_lock = SDL_CreateMutex();
+    log_kill = FALSE;
+    log_thread = SDL_CreateThread(_log_thread, NULL);
+
+    /* Not worth a panic, _log_finish will just write things straight out */
+    if (log_thread == NULL) {
+        printf("  --> WARNING: Couldn't start the log writer\n");
+        fflush(stdout);
+    }
     
     return 0;
 }
 void stop_debug()
 {
-    SDL_DestroyMutex(debug_output_lock);
+    log_kill = TRUE;
+    if (log_thread != NULL) {
+        SDL_WaitThread(log_thread, NULL);
+        log_thread = NULL;
+    }
+
+    /* Whatever came in after the writer's last go */
+    _log_drain();
+    _log_report_limited();
+
+    SDL_DestroyMutex(log_write_lock);
+    log_write_lock = NULL;
 }
@@ -18,7 +18,59 @@
 
 #define DEBUG_H
 
-#ifdef DEBUG
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/*
+ * Log levels. Messages below LOG_LEVEL are compiled out entirely, so they
+ * cost nothing at all. LOG_LEVEL can be set in compile.h or by the
+ * makefile; otherwise it goes by DEBUG and VERBOSE_DEBUG like it always
+ * has. Panics can't be turned off.
+ */
+#define LOG_VERBOSE 0
+#define LOG_DEBUG   1
+#define LOG_WARN    2
+#define LOG_PANIC   3
+
+#ifndef LOG_LEVEL
+#if defined(DEBUG) && defined(VERBOSE_DEBUG)
+#define LOG_LEVEL LOG_VERBOSE
+#elif defined(DEBUG)
+#define LOG_LEVEL LOG_DEBUG
+#else
+#define LOG_LEVEL LOG_PANIC
+#endif
+#endif
+
+/*
+ * Logging never waits on anything. Each thread that logs gets a ring of
+ * its own the first time it does (see thread slots below for how it's
+ * given back), and a writer thread empties the rings to stdout every
+ * LOG_INTERVAL ms. If a ring is full the message is dropped and counted,
+ * rather than holding up the thread that sent it.
+ *
+ * Each call site (file and line) gets LOG_BURST messages a second; any
+ * more than that are counted instead, and the writer says how many were
+ * left out. So a warn that fires every frame costs an atomic add, not a
+ * printf and a flush.
+ *
+ * Panics are still written straight away, after emptying the rings so
+ * nothing logged before them gets lost.
+ */
+
+/* Rings for this many threads, then messages from any more are dropped */
+#define LOG_THREADS  16
+/* Messages per thread, must be a power of 2 */
+#define LOG_RING     256
+/* Room for both message strings together */
+#define LOG_TEXT     120
+/* Call sites tracked for rate limiting, must be a power of 2 */
+#define LOG_SITES    512
+#define LOG_BURST    8
+#define LOG_INTERVAL 20
 
 /*
  * For each of these, the suffix means the following
@@ -32,20 +84,26 @@
 
 /*
  * debug
- * Produce output to stdout only if DEBUG is defined
+ * Produce output to stdout only if LOG_LEVEL is LOG_DEBUG or below
  */
-#define debug(msg1) _debug(msg1, "")
-#define debug2(msg1,msg2) _debug(msg1, msg2)
-#define debugn(msg1,num) _debugn(msg1, num)
+#if LOG_LEVEL <= LOG_DEBUG
+#define debug(msg1) _log(LOG_DEBUG, msg1, "", __FILE__, __LINE__)
+#define debug2(msg1,msg2) _log(LOG_DEBUG, msg1, msg2, __FILE__, __LINE__)
+#define debugn(msg1,num) _logn(LOG_DEBUG, msg1, num, __FILE__, __LINE__)
+#else
+#define debug(msg1)
+#define debug2(msg1,msg2)
+#define debugn(msg1,num)
+#endif
 
 /*
  * verbose
- * Produce output to stdout only if DEBUG and VERBOSE_DEBUG are both defined
+ * Produce output to stdout only if LOG_LEVEL is LOG_VERBOSE
  */
-#ifdef VERBOSE_DEBUG
-#define verbose(msg1) _debug(msg1, "")
-#define verbose2(msg1,msg2) _debug(msg1, msg2)
-#define verbosen(msg1,num) _debugn(msg1, num)
+#if LOG_LEVEL <= LOG_VERBOSE
+#define verbose(msg1) _log(LOG_VERBOSE, msg1, "", __FILE__, __LINE__)
+#define verbose2(msg1,msg2) _log(LOG_VERBOSE, msg1, msg2, __FILE__, __LINE__)
+#define verbosen(msg1,num) _logn(LOG_VERBOSE, msg1, num, __FILE__, __LINE__)
 #else
 #define verbose(msg1)
 #define verbose2(msg1,msg2)
@@ -54,44 +112,80 @@
 
 /*
  * warn
- * If cond is false, output a message to stderr, but resume.
+ * If cond is false, output a message, but resume.
+ * Only if LOG_LEVEL is LOG_WARN or below
  */
+#if LOG_LEVEL <= LOG_WARN
 #define warn(cond,msg1) \
                         if(cond) {} \
                         else { \
-                          _warn(msg1, "", __FILE__, __LINE__); \
+                          _log(LOG_WARN, msg1, "", __FILE__, __LINE__); \
                         }
 #define warn2(cond,msg1,msg2) \
                         if(cond) {} \
                         else { \
-                          _warn(msg1, msg2, __FILE__, __LINE__); \
+                          _log(LOG_WARN, msg1, msg2, __FILE__, __LINE__); \
                         }
 #define warnn(cond,msg1,num) \
                         if(cond) {} \
                         else { \
-                          _warnn(msg1, num, __FILE__, __LINE__); \
+                          _logn(LOG_WARN, msg1, num, __FILE__, __LINE__); \
                         }
+#else
+#define warn(cond,msg1)
+#define warn2(cond,msg1,msg2)
+#define warnn(cond,msg1,num)
+#endif
 
 /* Declarations of all those functions used earlier */
-extern void _debug (char *msg1, char *msg2);
-extern void _debugn (char *msg1, int num);
-extern void _warn (char *msg1, char *msg2, char *file, int line);
-extern void _warnn (char *msg1, int num, char *file, int line);
+extern void _log (int level, char *msg1, char *msg2, char *file, int line);
+extern void _logn (int level, char *msg1, int num, char *file, int line);
 
-#else   /* def DEBUG */
+/*
+ * Get the number of messages written, left out by the rate limit, and
+ * dropped because a ring was full or there were too many threads
+ */
+extern void log_stats(Uint32 *written, Uint32 *limited, Uint32 *dropped);
 
-/* No DEBUG, so evaluate these to nothing */
-#define debug(msg1)
-#define debug2(msg1,msg2)
-#define debugn(msg1,num)
-#define warn(cond,msg1)
-#define warn2(cond,msg1,msg2)
-#define warnn(cond,msg1,num)
-#define verbose(msg1)
-#define verbose2(msg1,msg2)
-#define verbosen(msg1,num)
+/* Write out everything logged so far, from whatever thread */
+extern void log_flush(void);
 
-#endif /* def DEBUG */
+/*
+ * Thread slots
+ * The log keeps a ring per thread (and so does the tracer), handed out
+ * from a table of slots by SDL_ThreadID the first time a thread needs
+ * one. Threads come and go, render_set_threads and set_decode_threads
+ * start new ones, so every thread the engine starts calls thread_done
+ * just before it returns, which releases its slot in every table that's
+ * been registered. A released slot stays out of use until whoever keeps
+ * the table is finished with what's in it, and frees it with
+ * thread_slot_free; the log writer does that once it's emptied the ring.
+ */
+#define THREAD_SLOT_FREE     0
+#define THREAD_SLOT_CLAIMING 1
+#define THREAD_SLOT_OWNED    2
+#define THREAD_SLOT_RELEASED 3
+
+/* Tables thread_done looks through */
+#define THREAD_SLOT_TABLES 4
+
+typedef struct thread_slot thread_slot;
+struct thread_slot {
+    volatile int    state;
+    volatile Uint32 owner;
+};
+
+/* Have thread_done release slots in this table of n */
+extern void thread_slots_register(thread_slot *slots, int n);
+
+/* The calling thread's slot, or a new one. -1 if they're all taken */
+extern int  thread_slot_get(thread_slot *slots, int n);
+
+/* Let another thread have a released slot. FALSE if it wasn't released */
+extern int  thread_slot_free(thread_slot *slot);
+
+/* Release the calling thread's slots, last thing before it returns */
+extern void thread_done(void);
 
 /* This we want in non-debug builds */
 
@@ -121,10 +215,16 @@ extern void _warnn (char *msg1, int num, char *file, int line);
                         _panic("Mutex lock failure", "", __FILE__, __LINE__); \
                     }
                          
+/*
+ * Set the function that writes a crash dump when there's a panic, given
+ * where and why it happened. NULL for no dump, which is the default.
+ */
+extern void set_dump_hook(void (*hook)(char *reason));
+
 extern void _panic (char *msg1, char *msg2, char *file, int line);
 extern void _panicn (char *msg1, int num, char *file, int line);
 
-/* And for some reason stdout requires a lock, so we need these: */
+/* Start/stop functions, for the log writer */
 extern int init_debug();
 extern void stop_debug();
 
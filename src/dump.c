@@ -0,0 +1,554 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * dump.c
+ * Contains code for writing crash dumps and loading them back in
+ */
+
+#include "compile.h"
+#include "bullet.h"
+#include "debug.h"
+#include "dump.h"
+#include "input.h"
+#include "player.h"
+#include "profile.h"
+#include "render.h"
+#include "resource.h"
+#include "scrfuncs.h"
+#include "scripts.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/*
+ * Everything write_dump needs is kept here, so it doesn't have to allocate
+ * anything in the middle of a panic
+ */
+SDL_Surface   *dump_images[DUMP_MAX_IMAGES];
+resource      *dump_image_res[DUMP_MAX_IMAGES];
+/* Sprites cut from dump_image_res, and where from */
+int            dump_image_cut[DUMP_MAX_IMAGES];
+SDL_Rect       dump_image_rect[DUMP_MAX_IMAGES];
+int            dump_num_images;
+input          dump_inputs[64];
+input_snapshot dump_snap;
+prof_frame     dump_frames[PROF_FRAMES];
+char           dump_trace[DUMP_TRACEBACK];
+
+/* Start a section, returning where its data starts */
+long _begin_section(FILE *out, Uint32 tag)
+{
+    dump_section sec;
+
+    sec.tag  = tag;
+    sec.size = 0;
+    fwrite(&sec, sizeof(sec), 1, out);
+
+    return ftell(out);
+}
+
+/* Go back and fill in the size of a section */
+void _end_section(FILE *out, Uint32 tag, long start)
+{
+    dump_section sec;
+    long end;
+
+    end = ftell(out);
+    sec.tag  = tag;
+    sec.size = (Uint32)(end - start);
+
+    fseek(out, start - (long) sizeof(sec), SEEK_SET);
+    fwrite(&sec, sizeof(sec), 1, out);
+    fseek(out, end, SEEK_SET);
+}
+
+/* Add an image to the ones this dump refers to */
+void _dump_add_image(SDL_Surface *img)
+{
+    int i;
+
+    if (img == NULL) return;
+    for (i = 0; i < dump_num_images; ++i) {
+        if (dump_images[i] == img) return;
+    }
+    if (dump_num_images == DUMP_MAX_IMAGES) return;
+
+    dump_image_res[dump_num_images] = NULL;
+    dump_image_cut[dump_num_images] = FALSE;
+    dump_images[dump_num_images++]  = img;
+}
+
+/* Look through an archive for any of the dump's images */
+void _dump_find_images(arclist *arc, void *data)
+{
+    resource *res;
+    Uint32 pos = 0;
+    int i;
+
+    if (!arc->loaded) return;
+
+    while ((res = sid_table_next(&(arc->table), &pos)) != NULL) {
+        if (res->type != RES_IMAGE || res->data == NULL) continue;
+
+        for (i = 0; i < dump_num_images; ++i) {
+            if (dump_images[i] == res->data) {
+                dump_image_res[i] = res;
+                break;
+            }
+        }
+    }
+}
+
+/* Write the name of every loaded archive */
+void _dump_write_arc(arclist *arc, void *data)
+{
+    FILE *out = (FILE*) data;
+
+    if (!arc->loaded) return;
+    fwrite(arc->name, 1, strlen(arc->name) + 1, out);
+}
+
+/* Write a dump */
+int write_dump(const char *filename, char *reason)
+{
+    FILE *out;
+    dump_header header;
+    dump_image image;
+    dump_bullet db;
+    dump_pbullet dp;
+    char *arcname, *resname;
+    long start;
+    int i, j, n;
+
+    out = fopen(filename, "wb");
+    if (out == NULL) return FALSE;
+
+    memcpy(header.magic, DUMP_MAGIC, 4);
+    memcpy(header.engine, ENGINE_VERSION_16, 16);
+    header.version      = DUMP_VERSION;
+    header.ticks        = SDL_GetTicks();
+    header.bullet_size  = sizeof(bullet);
+    header.pbullet_size = sizeof(pbullet);
+    header.player_size  = sizeof(player);
+    header.input_size   = sizeof(input);
+    fwrite(&header, sizeof(header), 1, out);
+
+    start = _begin_section(out, DUMP_REASON);
+    fwrite(reason, 1, strlen(reason) + 1, out);
+    _end_section(out, DUMP_REASON, start);
+
+    start = _begin_section(out, DUMP_ARCS);
+    walk_arcs(_dump_write_arc, out);
+    _end_section(out, DUMP_ARCS, start);
+
+    /* Round up the images, and see where they came from */
+    dump_num_images = 0;
+    for (i = 0; i < 8192; ++i) {
+        if (is_alive(&bullet_mem[i])) _dump_add_image(bullet_mem[i].img);
+    }
+    for (i = 0; i < 1024; ++i) {
+        if (pis_alive(&pbullet_mem[i])) _dump_add_image(pbullet_mem[i].img);
+    }
+    for (i = 0; i < 4; ++i) {
+        _dump_add_image(players[i].img);
+        for (j = 0; j < 32; ++j) {
+            _dump_add_image(players[i].anim[j]);
+        }
+    }
+    walk_arcs(_dump_find_images, NULL);
+    
+    /* Bullet types' sprites can be cut from their sheets again */
+    for (i = 0; i < dump_num_images; ++i) {
+        if (dump_image_res[i] != NULL) continue;
+        dump_image_cut[i] = type_sprite_source(dump_images[i],
+                                               &dump_image_res[i],
+                                               &dump_image_rect[i]);
+    }
+
+    start = _begin_section(out, DUMP_IMAGES);
+    for (i = 0; i < dump_num_images; ++i) {
+        arcname = resname = "";
+        if (dump_image_res[i] != NULL) {
+            arcname = dump_image_res[i]->arc->name;
+            resname = dump_image_res[i]->name;
+        }
+
+        image.ptr    = (Uint64)(size_t) dump_images[i];
+        image.w      = (Uint16) dump_images[i]->w;
+        image.h      = (Uint16) dump_images[i]->h;
+        image.arclen = (Uint16) strlen(arcname);
+        image.reslen = (Uint16) strlen(resname);
+        image.cut    = (Uint16) dump_image_cut[i];
+        image.x      = dump_image_cut[i] ? dump_image_rect[i].x : 0;
+        image.y      = dump_image_cut[i] ? dump_image_rect[i].y : 0;
+        fwrite(&image, sizeof(image), 1, out);
+        fwrite(arcname, 1, image.arclen + 1, out);
+        fwrite(resname, 1, image.reslen + 1, out);
+    }
+    _end_section(out, DUMP_IMAGES, start);
+
+    /* Only the live ones */
+    start = _begin_section(out, DUMP_BULLETS);
+    for (i = 0; i < 8192; ++i) {
+        if (!is_alive(&bullet_mem[i])) continue;
+
+        db.index  = i;
+        db.parent = (bullet_mem[i].parent != NULL) ?
+                    (Sint32)(bullet_mem[i].parent - bullet_mem) : -1;
+        db.prev   = bullet_prev[i];
+        db.bul    = bullet_mem[i];
+        fwrite(&db, sizeof(db), 1, out);
+    }
+    _end_section(out, DUMP_BULLETS, start);
+
+    start = _begin_section(out, DUMP_PBULLETS);
+    for (i = 0; i < 1024; ++i) {
+        if (!pis_alive(&pbullet_mem[i])) continue;
+
+        dp.index = i;
+        dp.pbul  = pbullet_mem[i];
+        fwrite(&dp, sizeof(dp), 1, out);
+    }
+    _end_section(out, DUMP_PBULLETS, start);
+
+    start = _begin_section(out, DUMP_PLAYERS);
+    fwrite(players, sizeof(player), 4, out);
+    _end_section(out, DUMP_PLAYERS, start);
+
+    start = _begin_section(out, DUMP_INPUTS);
+    input_save(dump_inputs, &dump_snap);
+    fwrite(dump_inputs, sizeof(input), 64, out);
+    fwrite(&dump_snap, sizeof(dump_snap), 1, out);
+    _end_section(out, DUMP_INPUTS, start);
+
+    start = _begin_section(out, DUMP_FRAMES);
+    n = prof_history(dump_frames, PROF_FRAMES);
+    fwrite(dump_frames, sizeof(prof_frame), n, out);
+    _end_section(out, DUMP_FRAMES, start);
+
+    /* Last, since it's the likeliest to go wrong if things are bad enough */
+    start = _begin_section(out, DUMP_LUA);
+    n = script_traceback(dump_trace, DUMP_TRACEBACK);
+    fwrite(dump_trace, 1, n + 1, out);
+    _end_section(out, DUMP_LUA, start);
+
+    fclose(out);
+    return TRUE;
+}
+
+/*
+ * Loading
+ * Images in the dump, what they were and what they are now
+ */
+Uint64       *load_from = NULL;
+SDL_Surface **load_to   = NULL;
+/* Which of them are ours, to be freed */
+char         *load_made = NULL;
+int           load_num  = 0;
+
+/* What load_made can be */
+#define LOAD_FOUND 0 /* belongs to its archive */
+#define LOAD_BOX   1 /* a stand-in */
+#define LOAD_CUT   2 /* cut from its sheet, with cut_sprite */
+
+/* Find what an image from the dump is now, NULL if it's not there */
+SDL_Surface *_remap_image(void *ptr)
+{
+    int i;
+
+    /* Newest first, in case more than one dump has been loaded */
+    if (ptr == NULL) return NULL;
+    for (i = load_num - 1; i >= 0; --i) {
+        if (load_from[i] == (Uint64)(size_t) ptr) return load_to[i];
+    }
+    return NULL;
+}
+
+/* Find every image in the section, or make a box to stand in for it */
+void _load_images(char *data, Uint32 size, dump_info *info)
+{
+    dump_image image;
+    resource *res;
+    SDL_Rect rect;
+    char *arcname, *resname, *end = data + size;
+
+    while (data + sizeof(image) <= end) {
+        memcpy(&image, data, sizeof(image));
+        arcname = data + sizeof(image);
+        resname = arcname + image.arclen + 1;
+        data    = resname + image.reslen + 1;
+        if (data > end) break;
+
+        load_from = realloc(load_from, (load_num + 1) * sizeof(Uint64));
+        load_to   = realloc(load_to, (load_num + 1) * sizeof(SDL_Surface*));
+        load_made = realloc(load_made, load_num + 1);
+        panic(load_from != NULL && load_to != NULL && load_made != NULL,
+              "Couldn't allocate memory for dump images");
+
+        res = NULL;
+        if (image.arclen > 0) {
+            /* The loader keeps these, it'll be gone before it matters */
+            res = acquire_res(arcname, resname);
+            warn2(res != NULL, "Dumped image isn't there any more:", resname);
+        }
+
+        if (res != NULL && image.cut) {
+            rect.x = image.x;
+            rect.y = image.y;
+            rect.w = image.w;
+            rect.h = image.h;
+            load_to[load_num]   = cut_sprite((SDL_Surface*) res->data, &rect);
+            load_made[load_num] = LOAD_CUT;
+            release_res(res);
+            ++info->cut;
+        }
+        else if (res != NULL) {
+            load_to[load_num]   = (SDL_Surface*) res->data;
+            load_made[load_num] = LOAD_FOUND;
+        }
+        else {
+            load_to[load_num] = SDL_CreateRGBSurface(SDL_SWSURFACE,
+                                    image.w ? image.w : 1,
+                                    image.h ? image.h : 1, 32,
+                                    0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+            panic(load_to[load_num] != NULL, "Couldn't make a stand-in image");
+            SDL_FillRect(load_to[load_num], NULL, 0x00FF00FF);
+            load_made[load_num] = LOAD_BOX;
+            ++info->missing;
+        }
+        load_from[load_num++] = image.ptr;
+        ++info->images;
+    }
+}
+
+/* Put the free lists back together around the bullets that were loaded */
+void _relink_bullets(void)
+{
+    int i, r;
+
+    r = SDL_mutexP(free_bullets_lock);
+    check_mutex(r);
+    free_bullets_head = free_bullets_tail = NULL;
+    for (i = 0; i < 8192; ++i) {
+        if (is_alive(&bullet_mem[i])) continue;
+
+        bullet_mem[i].next = NULL;
+        if (free_bullets_head == NULL) free_bullets_head = &bullet_mem[i];
+        else free_bullets_tail->next = &bullet_mem[i];
+        free_bullets_tail = &bullet_mem[i];
+    }
+    r = SDL_mutexV(free_bullets_lock);
+    check_mutex(r);
+
+    r = SDL_mutexP(free_pbullets_lock);
+    check_mutex(r);
+    free_pbullets_head = free_pbullets_tail = NULL;
+    for (i = 0; i < 1024; ++i) {
+        if (pis_alive(&pbullet_mem[i])) continue;
+
+        pbullet_mem[i].next = NULL;
+        if (free_pbullets_head == NULL) free_pbullets_head = &pbullet_mem[i];
+        else free_pbullets_tail->next = &pbullet_mem[i];
+        free_pbullets_tail = &pbullet_mem[i];
+    }
+    r = SDL_mutexV(free_pbullets_lock);
+    check_mutex(r);
+}
+
+/* Put one section back */
+void _load_section(Uint32 tag, char *data, Uint32 size, dump_info *info)
+{
+    dump_bullet  db;
+    dump_pbullet dp;
+    player saved[4];
+    char *name;
+    Uint32 i;
+    int j;
+
+    switch (tag) {
+        case DUMP_REASON:
+            strncpy(info->reason, data, sizeof(info->reason) - 1);
+            break;
+
+        case DUMP_ARCS:
+            for (name = data; name < data + size; name += strlen(name) + 1) {
+                load_arc(name);
+                ++info->arcs;
+            }
+            break;
+
+        case DUMP_IMAGES:
+            _load_images(data, size, info);
+            break;
+
+        case DUMP_BULLETS:
+            for (i = 0; i + sizeof(db) <= size; i += sizeof(db)) {
+                memcpy(&db, data + i, sizeof(db));
+                if (db.index < 0 || db.index >= 8192) continue;
+
+                db.bul.next   = NULL;
+                db.bul.extend = NULL;
+                db.bul.img    = _remap_image(db.bul.img);
+                db.bul.parent = (db.parent >= 0 && db.parent < 8192) ?
+                                &bullet_mem[db.parent] : NULL;
+                bullet_mem[db.index]  = db.bul;
+                bullet_prev[db.index] = db.prev;
+                ++info->bullets;
+            }
+            break;
+
+        case DUMP_PBULLETS:
+            for (i = 0; i + sizeof(dp) <= size; i += sizeof(dp)) {
+                memcpy(&dp, data + i, sizeof(dp));
+                if (dp.index < 0 || dp.index >= 1024) continue;
+
+                dp.pbul.next = NULL;
+                dp.pbul.img  = _remap_image(dp.pbul.img);
+                pbullet_mem[dp.index] = dp.pbul;
+                ++info->pbullets;
+            }
+            break;
+
+        case DUMP_PLAYERS:
+            if (size < sizeof(saved)) break;
+            memcpy(saved, data, sizeof(saved));
+            for (i = 0; i < 4; ++i) {
+                saved[i].img = _remap_image(saved[i].img);
+                for (j = 0; j < 32; ++j) {
+                    saved[i].anim[j] = _remap_image(saved[i].anim[j]);
+                }
+                players[i] = saved[i];
+            }
+            break;
+
+        case DUMP_INPUTS:
+            if (size < sizeof(dump_inputs) + sizeof(dump_snap)) break;
+            memcpy(dump_inputs, data, sizeof(dump_inputs));
+            memcpy(&dump_snap, data + sizeof(dump_inputs), sizeof(dump_snap));
+            input_restore(dump_inputs, &dump_snap);
+            break;
+
+        case DUMP_FRAMES:
+            info->frames = size / sizeof(prof_frame);
+            if (info->frames > PROF_FRAMES) info->frames = PROF_FRAMES;
+            memcpy(info->frame, data, info->frames * sizeof(prof_frame));
+            break;
+
+        case DUMP_LUA:
+            strncpy(info->traceback, data, sizeof(info->traceback) - 1);
+            break;
+
+        default:
+            /* From a newer version, maybe */
+            break;
+    }
+}
+
+/* Load a dump back in */
+int load_dump(const char *filename, dump_info *info)
+{
+    FILE *in;
+    dump_header header;
+    dump_section sec;
+    char *data;
+
+    memset(info, 0, sizeof(dump_info));
+
+    in = fopen(filename, "rb");
+    warn2(in != NULL, "Couldn't open dump", (char*) filename);
+    if (in == NULL) return FALSE;
+
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, DUMP_MAGIC, 4) != 0 ||
+        header.version != DUMP_VERSION) {
+        warn2(FALSE, "Not a dump, or from another version:", (char*) filename);
+        fclose(in);
+        return FALSE;
+    }
+    if (header.bullet_size  != sizeof(bullet)  ||
+        header.pbullet_size != sizeof(pbullet) ||
+        header.player_size  != sizeof(player)  ||
+        header.input_size   != sizeof(input)) {
+        warn2(FALSE, "Dump was written by a different build:",
+              (char*) filename);
+        fclose(in);
+        return FALSE;
+    }
+    info->ticks = header.ticks;
+
+    /* Start from nothing, so only what's in the dump is there */
+    reset_bullets();
+    reset_pbullets();
+
+    while (fread(&sec, sizeof(sec), 1, in) == 1) {
+        data = malloc(sec.size + 1);
+        panic(data != NULL, "Couldn't allocate memory to load a dump");
+        if (fread(data, 1, sec.size, in) != sec.size) {
+            warn2(FALSE, "Dump is cut short:", (char*) filename);
+            free(data);
+            break;
+        }
+        /* So text sections are always terminated */
+        data[sec.size] = '\0';
+
+        _load_section(sec.tag, data, sec.size, info);
+        free(data);
+    }
+    fclose(in);
+
+    _relink_bullets();
+    return TRUE;
+}
+
+#ifdef DUMP_FILE
+/* What panics call, through set_dump_hook */
+void _dump_on_panic(char *reason)
+{
+    if (write_dump(DUMP_FILE, reason)) {
+        printf("  --> Wrote crash dump to %s\n", DUMP_FILE);
+        fflush(stdout);
+    }
+}
+#endif
+
+/* Start/stop functions */
+int init_dump(void)
+{
+#ifdef DUMP_FILE
+    set_dump_hook(_dump_on_panic);
+#endif
+
+    return 0;
+}
+
+void stop_dump(void)
+{
+    int i;
+
+    set_dump_hook(NULL);
+
+    /* Stand-ins and sprites are ours, anything else belongs to its archive */
+    for (i = 0; i < load_num; ++i) {
+        if (load_made[i] == LOAD_BOX) SDL_FreeSurface(load_to[i]);
+        if (load_made[i] == LOAD_CUT) free_sprite(load_to[i]);
+    }
+    free(load_from);
+    free(load_to);
+    free(load_made);
+    load_from = NULL;
+    load_to   = NULL;
+    load_made = NULL;
+    load_num  = 0;
+}
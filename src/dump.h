@@ -0,0 +1,159 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * dump.h
+ * Contains definitions and prototypes for crash dumps
+ */
+
+#ifndef DUMP_H
+
+#define DUMP_H
+
+#include "compile.h"
+#include "bullet.h"
+#include "player.h"
+#include "profile.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/*
+ * When the engine panics, it writes what state it was in to DUMP_FILE (set
+ * in compile.h) before it quits: every live bullet and pbullet, the
+ * players, the inputs and their last snapshot, which archives were loaded,
+ * the last PROF_FRAMES frame times and a Lua traceback. load_dump puts all
+ * that back into the engine, so brdump can draw the frame it crashed on.
+ *
+ * The file is a dump_header and then sections, each a dump_section
+ * followed by size bytes; anything with a tag the loader doesn't know is
+ * skipped. Bullets and such are written as they are in memory, so a dump
+ * can only be loaded by the same build that wrote it, and the header has
+ * the struct sizes to check that. Pointers are turned into indices (bullet
+ * parents) or looked up by name (images) on the way back in; extended
+ * blocks aren't kept.
+ *
+ * Bullet types' sprites are cut again from their sheets, going by the
+ * sheet and rect each type was registered with. Anything else that didn't
+ * come straight out of an archive, like the ship's sprites, can't be found
+ * again, so it comes back as a plain magenta box of the same size.
+ */
+
+#define DUMP_MAGIC   "BRDM"
+#define DUMP_VERSION 2
+
+/* Section tags */
+#define DUMP_REASON   1 /* where and why it panicked, as text */
+#define DUMP_ARCS     2 /* loaded archive names, each NUL terminated */
+#define DUMP_IMAGES   3 /* dump_images, each followed by its two names */
+#define DUMP_BULLETS  4 /* dump_bullets */
+#define DUMP_PBULLETS 5 /* dump_pbullets */
+#define DUMP_PLAYERS  6 /* players[4] */
+#define DUMP_INPUTS   7 /* inputs[64], then the last input_snapshot */
+#define DUMP_FRAMES   8 /* prof_frames, oldest first */
+#define DUMP_LUA      9 /* Lua traceback, as text */
+
+/* Different images one dump can keep track of */
+#define DUMP_MAX_IMAGES 1024
+/* Longest Lua traceback kept */
+#define DUMP_TRACEBACK  4096
+
+typedef struct dump_header_ dump_header;
+struct dump_header_ {
+    char   magic[4];
+    Uint32 version;
+    char   engine[16];
+    /* SDL_GetTicks when it was written */
+    Uint32 ticks;
+    /* Sizes of everything that's written as it is in memory */
+    Uint32 bullet_size;
+    Uint32 pbullet_size;
+    Uint32 player_size;
+    Uint32 input_size;
+};
+
+typedef struct dump_section_ dump_section;
+struct dump_section_ {
+    Uint32 tag;
+    Uint32 size;
+};
+
+/*
+ * ptr is what the image was in the engine that crashed. The archive name
+ * and resource name follow, arclen and reslen bytes each plus a NUL, both
+ * empty if it didn't come from an archive. If cut is set, the image is a
+ * w by h sprite cut from that resource at x, y.
+ */
+typedef struct dump_image_ dump_image;
+struct dump_image_ {
+    Uint64 ptr;
+    Uint16 w;
+    Uint16 h;
+    Uint16 arclen;
+    Uint16 reslen;
+    Uint16 cut;
+    Sint16 x;
+    Sint16 y;
+};
+
+typedef struct dump_bullet_ dump_bullet;
+struct dump_bullet_ {
+    Sint32     index;
+    /* Index of the parent, -1 for none */
+    Sint32     parent;
+    bullet_pos prev;
+    bullet     bul;
+};
+
+typedef struct dump_pbullet_ dump_pbullet;
+struct dump_pbullet_ {
+    Sint32  index;
+    pbullet pbul;
+};
+
+/* What load_dump found that doesn't go back into the engine */
+typedef struct dump_info_ dump_info;
+struct dump_info_ {
+    Uint32     ticks;
+    char       reason[256];
+    char       traceback[DUMP_TRACEBACK];
+    int        arcs;
+    int        images;
+    /* Images that were cut from their sheets again */
+    int        cut;
+    /* Images that came back as boxes */
+    int        missing;
+    int        bullets;
+    int        pbullets;
+    int        frames;
+    prof_frame frame[PROF_FRAMES];
+};
+
+/*
+ * Write a dump, with reason saying why. Returns FALSE if it couldn't.
+ * It's called from panics, so it takes none of the engine's locks, but it
+ * does fopen the file and the Lua traceback allocates, so a panic from
+ * inside malloc or with a broken Lua state may not get a whole dump.
+ */
+extern int write_dump(const char *filename, char *reason);
+
+/*
+ * Load a dump back into the engine, replacing every bullet, pbullet,
+ * player and input, and loading the archives it had. Returns FALSE if it
+ * couldn't, or if it was written by a different build.
+ */
+extern int load_dump(const char *filename, dump_info *info);
+
+/* Start/stop functions, for the panic hook */
+extern int  init_dump(void);
+extern void stop_dump(void);
+
+#endif /* !def DUMP_H */
@@ -11,14 +11,22 @@
  * Contains code for initializing and stopping all subsystems
  */
 
+#include "budget.h"
 #include "debug.h"
+#include "dump.h"
 #include "init.h"
 #include "input.h"
+#include "metrics.h"
 #include "player.h"
+#include "profile.h"
+#include "pump.h"
+#include "render.h"
 #include "resource.h"
 #include "timer.h"
+#include "trace.h"
 #include "bullet.h"
 #include "scripts.h"
+#include "text.h"
 
 #ifdef INCLUDE_SDL_PREFIX
 #include "SDL/SDL.h"
@@ -33,27 +41,47 @@
 int init_all(void)
 {
     init_debug();
+#ifdef SDL_EVENT_THREAD
+    SDL_Init(SDL_INIT_EVERYTHING | SDL_INIT_EVENTTHREAD);
+#else
     SDL_Init(SDL_INIT_EVERYTHING);
+#endif
     IMG_Init(IMG_INIT_PNG);
     TTF_Init();
+    init_text();
     init_timer();
+    init_profile();
+    init_metrics();
+    init_trace();
+    init_pump();
     init_resources();
     init_inputs();
     init_bullets();
     init_player();
+    init_render();
+    init_budget();
     init_scripts();
+    init_dump();
     
     return 0;
 }
 
 void stop_all(void)
 {
+    stop_dump();
     stop_scripts();
+    stop_budget();
+    stop_render();
     stop_player();
     stop_bullets();
     stop_inputs();
     stop_resources();
+    stop_pump();
+    stop_trace();
+    stop_metrics();
+    stop_profile();
     stop_timer();
+    stop_text();
     TTF_Quit();
     IMG_Quit();
     SDL_Quit();
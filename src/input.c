@@ -14,6 +14,9 @@
 #include "compile.h"
 #include "debug.h"
 #include "input.h"
+#include "pump.h"
+#include "timer.h"
+#include <string.h>
 
 #ifdef INCLUDE_SDL_PREFIX
 #include "SDL/SDL.h"
@@ -27,6 +30,102 @@
  */
 input inputs[64];
 
+/*
+ * Reverse lookup tables: for each key, mouse button and joystick axis, a
+ * mask of the inputs bound to it, bit n being input n. The config functions
+ * keep these up to date, so update_input can go straight to the inputs an
+ * event is for instead of checking all 64.
+ */
+Uint64 key_binds[SDLK_LAST];
+Uint64 motion_binds;
+Uint64 button_binds[256];
+Uint64 axis_binds[INPUT_MAX_JOYS][INPUT_MAX_AXES];
+
+/* Get the lookup table entry for an input's current binding, if any */
+Uint64 *_bind_slot(int id)
+{
+    input *in = &inputs[id];
+    
+    switch (in->config_type) {
+        case INPUT_KEY:
+            return (in->key < SDLK_LAST) ? &key_binds[in->key] : NULL;
+        case INPUT_MOUSE:
+            return &motion_binds;
+        case INPUT_MOUSE_BUTTON:
+            if (in->input_num < sizeof(button_binds) / sizeof(Uint64)) {
+                return &button_binds[in->input_num];
+            }
+            return NULL;
+        case INPUT_JOY_AXIS:
+        case INPUT_JOY_EXTREME:
+            if (in->joy_num < INPUT_MAX_JOYS && in->axis_num < INPUT_MAX_AXES) {
+                return &axis_binds[in->joy_num][in->axis_num];
+            }
+            return NULL;
+        default:
+            /* Nothing in update_input handles these yet */
+            return NULL;
+    }
+}
+
+/* Take an input out of the lookup tables, before its binding changes */
+void _unlink_input(int id)
+{
+    Uint64 *slot = _bind_slot(id);
+    
+    if (slot != NULL) *slot &= ~((Uint64)1 << id);
+}
+
+/* Put an input into the lookup tables, after its binding changes */
+void _link_input(int id)
+{
+    Uint64 *slot = _bind_slot(id);
+    
+    if (slot != NULL) *slot |= (Uint64)1 << id;
+}
+
+/* Presses and releases since the last snapshot, for the next one */
+Uint8  pending_presses[64];
+Uint8  pending_releases[64];
+Uint32 pending_press_at[64];
+
+/* The last snapshot, when it was taken, and how many there have been */
+input_snapshot last_snap;
+Uint64         last_snap_ns;
+Uint32         snap_count;
+
+/* When the event being handled came in, 0 if it's happening right now */
+Uint64 event_ns = 0;
+
+/* Count a boolean input going down or up towards the next snapshot */
+void _note_edge(int id, int down)
+{
+    Uint64 since;
+    
+    if (down) {
+        if (pending_presses[id] == 0) {
+            since = event_ns ? event_ns : clock_ns();
+            /* It might have come in before the last snapshot was taken */
+            since = (since > last_snap_ns) ? since - last_snap_ns : 0;
+            pending_press_at[id] = (since > 0xFFFFFFFF) ? 0xFFFFFFFF
+                                                        : (Uint32) since;
+        }
+        if (pending_presses[id] < 255) ++pending_presses[id];
+    }
+    else if (pending_releases[id] < 255) {
+        ++pending_releases[id];
+    }
+}
+
+/* Take the lowest input number out of a mask of them */
+int _next_bind(Uint64 *mask)
+{
+    int i = __builtin_ctzll(*mask);
+    
+    *mask &= *mask - 1;
+    return i;
+}
+
 /* 
  * This function checks if a config type is compatible with an input type
  * e.g. a button works for a boolean input, but not an analog or two-dimensional
@@ -59,78 +158,84 @@ int is_input_compatible(input_type type, input_config_type cfg)
  */
 int update_input(SDL_Event event)
 {
-    int i, found = FALSE;
+    int i, down;
+    Uint64 mask;
+    
     switch (event.type) {
         /* We use the state here, so we don't need to keep these separate */
         case SDL_KEYDOWN:
         case SDL_KEYUP:
-            for (i = 0; i < 64; ++i) {
-                if (inputs[i].config_type == INPUT_KEY &&
-                    inputs[i].key == event.key.keysym.sym) {
-                    if (event.key.state == SDL_PRESSED) {
-                        inputs[i].valueX = TRUE;
-                        inputs[i].valueY = TRUE;
-                    }
-                    else {
-                        inputs[i].valueX = FALSE;
-                    }
-                    found = TRUE;
+            if (event.key.keysym.sym >= SDLK_LAST) return FALSE;
+            mask = key_binds[event.key.keysym.sym];
+            if (mask == 0) return FALSE;
+            
+            while (mask) {
+                i = _next_bind(&mask);
+                if (event.key.state == SDL_PRESSED) {
+                    if (!inputs[i].valueX) _note_edge(i, TRUE);
+                    inputs[i].valueX = TRUE;
+                    inputs[i].valueY = TRUE;
+                }
+                else {
+                    if (inputs[i].valueX) _note_edge(i, FALSE);
+                    inputs[i].valueX = FALSE;
                 }
             }
-            if (found) return TRUE;
-            break;
+            return TRUE;
         case SDL_MOUSEMOTION:
-            for (i = 0; i < 64; ++i) {
-                if (inputs[i].config_type == INPUT_MOUSE) {
-                    inputs[i].valueX = event.motion.x;
-                    inputs[i].valueY = event.motion.y;
-                    found = TRUE;
-                }
+            mask = motion_binds;
+            if (mask == 0) return FALSE;
+            
+            while (mask) {
+                i = _next_bind(&mask);
+                inputs[i].valueX = event.motion.x;
+                inputs[i].valueY = event.motion.y;
             }
-            if (found) return TRUE;
-            break;
+            return TRUE;
         case SDL_MOUSEBUTTONDOWN:
         case SDL_MOUSEBUTTONUP:
-            for (i = 0; i < 64; ++i) {
-                if (inputs[i].config_type == INPUT_MOUSE_BUTTON &&
-                    inputs[i].input_num == event.button.button) {
-                    if (event.button.state == SDL_PRESSED) {
-                        inputs[i].valueX = TRUE;
-                        inputs[i].valueY = TRUE;
-                    }
-                    else {
-                        inputs[i].valueX = FALSE;
-                    }
-                    found = TRUE;
+            mask = button_binds[event.button.button];
+            if (mask == 0) return FALSE;
+            
+            while (mask) {
+                i = _next_bind(&mask);
+                if (event.button.state == SDL_PRESSED) {
+                    if (!inputs[i].valueX) _note_edge(i, TRUE);
+                    inputs[i].valueX = TRUE;
+                    inputs[i].valueY = TRUE;
+                }
+                else {
+                    if (inputs[i].valueX) _note_edge(i, FALSE);
+                    inputs[i].valueX = FALSE;
                 }
             }
-            if (found) return TRUE;
-            break;
+            return TRUE;
         case SDL_JOYAXISMOTION:
-            for (i = 0; i < 64; ++i) {
-                if (inputs[i].config_type == INPUT_JOY_AXIS &&
-                    inputs[i].joy_num == event.jaxis.which &&
-                    inputs[i].axis_num == event.jaxis.axis) {
+            if (event.jaxis.which >= INPUT_MAX_JOYS ||
+                event.jaxis.axis  >= INPUT_MAX_AXES) {
+                return FALSE;
+            }
+            mask = axis_binds[event.jaxis.which][event.jaxis.axis];
+            if (mask == 0) return FALSE;
+            
+            while (mask) {
+                i = _next_bind(&mask);
+                if (inputs[i].config_type == INPUT_JOY_AXIS) {
                     /* TODO: Implement deadzone stuff */
                     inputs[i].valueX = event.jaxis.value;
-                    found = TRUE;
+                    continue;
                 }
-                else if (inputs[i].config_type == INPUT_JOY_EXTREME &&
-                         inputs[i].joy_num == event.jaxis.which &&
-                         inputs[i].axis_num == event.jaxis.axis) {
-                    if (inputs[i].extreme_dir < 0) {
-                        inputs[i].valueX =
-                            (event.jaxis.value < inputs[i].extreme_threshold);
-                    }
-                    else {
-                        inputs[i].valueX =
-                            (event.jaxis.value > inputs[i].extreme_threshold);
-                    }
-                    found = TRUE;
+                
+                if (inputs[i].extreme_dir < 0) {
+                    down = (event.jaxis.value < inputs[i].extreme_threshold);
                 }
+                else {
+                    down = (event.jaxis.value > inputs[i].extreme_threshold);
+                }
+                if (down != inputs[i].valueX) _note_edge(i, down);
+                inputs[i].valueX = down;
             }
-            if (found) return TRUE;
-            break;
+            return TRUE;
         case SDL_JOYBALLMOTION:
             /* TODO: Finish this up, I'm getting bored */
         default:
@@ -163,11 +268,13 @@ void unregister_input (int id)
 void input_config_key         (int id, SDLKey key)
 {
     if (is_input_compatible(inputs[id].type, INPUT_KEY)) {
+        _unlink_input(id);
         inputs[id].config_type = INPUT_KEY;
         inputs[id].key  = key;
         /* Start off false */
         inputs[id].valueX = FALSE;
         inputs[id].valueY = FALSE;
+        _link_input(id);
     }
     else {
         warnn(FALSE, "Invalid bind on input number", id);
@@ -179,10 +286,12 @@ void input_config_key         (int id, SDLKey key)
 void input_config_mouse       (int id)
 {
     if (is_input_compatible(inputs[id].type, INPUT_MOUSE)) {
+        _unlink_input(id);
         inputs[id].config_type = INPUT_MOUSE;
         /* Initialize with the correct position right away */
         SDL_GetMouseState((int*)&(inputs[id].valueX),
                           (int*)&(inputs[id].valueY));
+        _link_input(id);
     }
     else {
         warnn(FALSE, "Invalid bind on input number", id);
@@ -194,11 +303,13 @@ void input_config_mouse       (int id)
 void input_config_mouse_button(int id, Uint32 button)
 {
     if (is_input_compatible(inputs[id].type, INPUT_MOUSE_BUTTON)) {
+        _unlink_input(id);
         inputs[id].config_type = INPUT_MOUSE_BUTTON;
         inputs[id].input_num = button;
         /* Start off false */
         inputs[id].valueX = FALSE;
         inputs[id].valueY = FALSE;
+        _link_input(id);
     }
     else {
         warnn(FALSE, "Invalid bind on input number", id);
@@ -211,6 +322,7 @@ void input_config_joy_axis    (int id, Uint32 joy, Uint32 axis,
                                Uint16 dz, Uint16 ndz)
 {
     if (is_input_compatible(inputs[id].type, INPUT_JOY_AXIS)) {
+        _unlink_input(id);
         inputs[id].config_type = INPUT_JOY_AXIS;
         inputs[id].joy_num = joy;
         inputs[id].axis_num = axis;
@@ -219,6 +331,7 @@ void input_config_joy_axis    (int id, Uint32 joy, Uint32 axis,
         inputs[id].noise_deadzone = ndz;
         /* Start off zeroed */
         inputs[id].valueX = 0;
+        _link_input(id);
     }
     else {
         warnn(FALSE, "Invalid bind on input number", id);
@@ -233,6 +346,7 @@ void input_config_joy_extreme (int id, Uint32 joy, Uint32 axis,
                                Uint16 threshold)
 {
     if (is_input_compatible(inputs[id].type, INPUT_JOY_AXIS)) {
+        _unlink_input(id);
         inputs[id].config_type = INPUT_JOY_AXIS;
         inputs[id].joy_num = joy;
         inputs[id].axis_num = axis;
@@ -245,6 +359,7 @@ void input_config_joy_extreme (int id, Uint32 joy, Uint32 axis,
         /* Start off false */
         inputs[id].valueX = FALSE;
         inputs[id].valueY = FALSE;
+        _link_input(id);
     }
     else {
         verbosen("Input is of type", inputs[id].type);
@@ -256,12 +371,14 @@ void input_config_joy_extreme (int id, Uint32 joy, Uint32 axis,
 void input_config_joy_button  (int id, Uint32 joy, Uint32 button)
 {
     if (is_input_compatible(inputs[id].type, INPUT_JOY_BUTTON)) {
+        _unlink_input(id);
         inputs[id].config_type = INPUT_JOY_BUTTON;
         inputs[id].joy_num = joy;
         inputs[id].input_num = button;
         /* Start off false */
         inputs[id].valueX = FALSE;
         inputs[id].valueY = FALSE;
+        _link_input(id);
     }
     else {
         verbosen("Input is of type", inputs[id].type);
@@ -272,12 +389,14 @@ void input_config_joy_button  (int id, Uint32 joy, Uint32 button)
 void input_config_joy_hat     (int id, Uint32 joy, Uint32 hat)
 {
     if (is_input_compatible(inputs[id].type, INPUT_JOY_HAT)) {
+        _unlink_input(id);
         inputs[id].config_type = INPUT_JOY_HAT;
         inputs[id].joy_num = joy;
         inputs[id].input_num = hat;
         /* Start off false */
         inputs[id].valueX = FALSE;
         inputs[id].valueY = FALSE;
+        _link_input(id);
     }
     else {
         verbosen("Input is of type", inputs[id].type);
@@ -288,12 +407,14 @@ void input_config_joy_hat     (int id, Uint32 joy, Uint32 hat)
 void input_config_joy_ball    (int id, Uint32 joy, Uint32 ball)
 {
     if (is_input_compatible(inputs[id].type, INPUT_JOY_TRACKBALL)) {
+        _unlink_input(id);
         inputs[id].config_type = INPUT_JOY_TRACKBALL;
         inputs[id].joy_num = joy;
         inputs[id].input_num = ball;
         /* Start off zeroed - this is important because trackballs are relative */
         inputs[id].valueX = 0;
         inputs[id].valueY = 0;
+        _link_input(id);
     }
     else {
         verbosen("Input is of type", inputs[id].type);
@@ -304,6 +425,7 @@ void input_config_joy_ball    (int id, Uint32 joy, Uint32 ball)
 
 void unbind_input (int id)
 {
+    _unlink_input(id);
     inputs[id].config_type = INPUT_NO_BIND;
 }
 
@@ -314,8 +436,10 @@ Sint16 input_value  (int id)
 }
 Sint16 input_pressed(int id)
 {
+    Sint16 pressed = inputs[id].valueY;
+    
     inputs[id].valueY = FALSE;
-    return inputs[id].valueY;
+    return pressed;
 }
 void input_twodim_position(int id, Sint16 *x, Sint16 *y)
 {
@@ -328,14 +452,103 @@ void input_ball_position (int id, Sint16 *x, Sint16 *y)
     *y = inputs[id].valueY;
 }
 
+/* Drain the event queue and take a snapshot */
+int input_tick(input_snapshot *snap, SDL_Event *leftover, int max)
+{
+    SDL_Event event;
+    int i, left = 0;
+    
+    /* Time presses by when the pump got them, not when we got round to it */
+    while (pump_poll(&event)) {
+        event_ns = pump_time();
+        if (!update_input(event) && left < max) {
+            leftover[left++] = event;
+        }
+    }
+    event_ns = 0;
+    
+    snap->tick    = snap_count++;
+    snap->taken   = clock_ns();
+    snap->held    = 0;
+    snap->pressed = 0;
+    
+    for (i = 0; i < 64; ++i) {
+        if (inputs[i].type == INPUT_TYPE_BOOLEAN) {
+            if (inputs[i].valueX)   snap->held    |= (Uint64)1 << i;
+            if (pending_presses[i]) snap->pressed |= (Uint64)1 << i;
+        }
+        snap->presses[i]  = pending_presses[i];
+        snap->releases[i] = pending_releases[i];
+        snap->press_at[i] = pending_presses[i] ? pending_press_at[i] : 0;
+        snap->x[i] = inputs[i].valueX;
+        snap->y[i] = inputs[i].valueY;
+    }
+    
+    /* Start counting again for the next one */
+    memset(pending_presses,  0, sizeof(pending_presses));
+    memset(pending_releases, 0, sizeof(pending_releases));
+    last_snap_ns = snap->taken;
+    last_snap    = *snap;
+    
+    return left;
+}
+
+/* Get the last snapshot input_tick took */
+const input_snapshot *input_last(void)
+{
+    return &last_snap;
+}
+
 /* Init/stop functions */
+/* Copy out every input and the last snapshot */
+void input_save(input *saved, input_snapshot *snap)
+{
+    memcpy(saved, inputs, sizeof(inputs));
+    *snap = last_snap;
+}
+
+/* Put back what input_save copied out, bindings and all */
+void input_restore(const input *saved, const input_snapshot *snap)
+{
+    int i;
+    
+    memcpy(inputs, saved, sizeof(inputs));
+    last_snap = *snap;
+    
+    memset(key_binds,    0, sizeof(key_binds));
+    memset(button_binds, 0, sizeof(button_binds));
+    memset(axis_binds,   0, sizeof(axis_binds));
+    motion_binds = 0;
+    for (i = 0; i < 64; ++i) {
+        _link_input(i);
+    }
+    
+    memset(pending_presses,  0, sizeof(pending_presses));
+    memset(pending_releases, 0, sizeof(pending_releases));
+    last_snap_ns = clock_ns();
+}
+
 int init_inputs(void)
 {
     int i;
     for (i = 0; i < 64; ++i) {
         inputs[i].type = INPUT_TYPE_NONE;
+        inputs[i].config_type = INPUT_NO_BIND;
     }
     
+    /* Nothing's bound to anything */
+    memset(key_binds,    0, sizeof(key_binds));
+    memset(button_binds, 0, sizeof(button_binds));
+    memset(axis_binds,   0, sizeof(axis_binds));
+    motion_binds = 0;
+    
+    /* No snapshots yet, and nothing to put in one */
+    memset(pending_presses,  0, sizeof(pending_presses));
+    memset(pending_releases, 0, sizeof(pending_releases));
+    memset(&last_snap, 0, sizeof(last_snap));
+    last_snap_ns = clock_ns();
+    snap_count   = 0;
+    
     return 0;
 }
 void stop_inputs(void) {
@@ -21,6 +21,13 @@
 #include "SDL.h"
 #endif
 
+/*
+ * Joysticks past INPUT_MAX_JOYS and axes past INPUT_MAX_AXES can't be bound,
+ * since every joystick axis gets a slot in the lookup tables
+ */
+#define INPUT_MAX_JOYS 8
+#define INPUT_MAX_AXES 16
+
 typedef enum {
     INPUT_TYPE_NONE,    /* There is no input at this index */
     INPUT_TYPE_BOOLEAN, /* An on/off switch, like a button */
@@ -99,6 +106,8 @@ extern int is_input_compatible(input_type type, input_config_type cfg);
 /* 
  * Update function - this checks an SDL_Event to see if the input system can
  * do anything with it. Returns true if it can and false if it can't.
+ * The config functions keep tables of which inputs are bound to each key,
+ * button and axis, so this only looks at the inputs the event is for.
  */
 extern int update_input(SDL_Event event);
 
@@ -129,6 +138,65 @@ extern Sint16 input_value  (int id);
 extern Sint16 input_pressed(int id);
 extern void input_twodim_position(int id, Sint16 *x, Sint16 *y);
 
+/*
+ * Input snapshots
+ * Reading the inputs directly while events are still coming in means two
+ * checks in the same tick can disagree, and a press and release that both
+ * land between ticks are never seen at all. Instead, once per tick,
+ * input_tick drains the event pump (see pump.h) and freezes the state of every
+ * input into a snapshot. Game code reads that, and only that, for the
+ * whole tick.
+ *
+ * As well as the state at the end of the tick, the snapshot counts every
+ * press and release that happened during it, and records when the first
+ * press of each input came in, so quick taps aren't lost and anything that
+ * cares can tell an early press from a late one. It's plain data with no
+ * pointers, so it can be copied or written straight out for replays.
+ */
+typedef struct input_snapshot_ input_snapshot;
+struct input_snapshot_ {
+    /* Which snapshot this is, and the clock_ns it was taken at */
+    Uint32 tick;
+    Uint64 taken;
+    
+    /* Bit n set means boolean input n is held, or was pressed this tick */
+    Uint64 held;
+    Uint64 pressed;
+    
+    /* Presses and releases of each input this tick, up to 255 */
+    Uint8 presses[64];
+    Uint8 releases[64];
+    
+    /* When each input was first pressed, in ns after the last snapshot */
+    Uint32 press_at[64];
+    
+    /* Axis values, or X and Y for two-dimensional inputs */
+    Sint16 x[64];
+    Sint16 y[64];
+};
+
+#define snap_held(snap,id)    (((snap)->held    >> (id)) & 1)
+#define snap_pressed(snap,id) (((snap)->pressed >> (id)) & 1)
+/* Held now, or tapped and let go again during the tick */
+#define snap_down(snap,id)    (snap_held(snap,id) || snap_pressed(snap,id))
+
+/*
+ * Drain the event pump through update_input and take a snapshot. Events
+ * the input system can't use are copied into leftover, up to max of them,
+ * and the number copied is returned. Any more than that are dropped.
+ */
+extern int input_tick(input_snapshot *snap, SDL_Event *leftover, int max);
+
+/* Get the last snapshot input_tick took */
+extern const input_snapshot *input_last(void);
+
+/*
+ * Copy out all 64 inputs and the last snapshot, and put them back again,
+ * bindings and all. For crash dumps, see dump.h
+ */
+extern void input_save   (input *saved, input_snapshot *snap);
+extern void input_restore(const input *saved, const input_snapshot *snap);
+
 /* Init/stop functions */
 extern int  init_inputs(void);
 extern void stop_inputs(void);
@@ -0,0 +1,72 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * loop.c
+ * Contains code for the fixed-timestep loop driver
+ */
+
+#include "compile.h"
+#include "debug.h"
+#include "loop.h"
+#include "timer.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/* Start a loop running at hz ticks per second */
+void loop_start(frame_loop *fl, int hz, int max_ticks)
+{
+    warn(hz > 0 && max_ticks > 0, "Bad frame loop rate");
+
+    fl->tick_ns   = 1000000000 / hz;
+    fl->max_ticks = max_ticks;
+    fl->last      = clock_ns();
+    fl->acc       = 0;
+    fl->alpha     = 1.0F;
+    fl->speed     = 1.0F;
+    fl->ticks     = 0;
+    fl->frames    = 0;
+    fl->dropped   = 0;
+}
+
+/* Start a frame, and get the number of ticks to run before drawing it */
+int loop_begin(frame_loop *fl)
+{
+    Uint64 now, behind;
+    int n;
+
+    now = clock_ns();
+    if (fl->speed >= 1.0F) {
+        fl->acc += now - fl->last;
+    }
+    else {
+        fl->acc += (Uint64)((double)(now - fl->last) * fl->speed);
+    }
+    fl->last = now;
+
+    /* Too far behind, slow down instead of catching it all up */
+    behind = fl->acc / fl->tick_ns;
+    if (behind > (Uint64) fl->max_ticks) {
+        fl->dropped += (Uint32)(behind - fl->max_ticks);
+        fl->acc = fl->acc % fl->tick_ns + fl->max_ticks * fl->tick_ns;
+        behind = fl->max_ticks;
+    }
+
+    n = (int) behind;
+    fl->acc  -= n * fl->tick_ns;
+    fl->alpha = (float) fl->acc / (float) fl->tick_ns;
+
+    fl->ticks += n;
+    ++fl->frames;
+
+    return n;
+}
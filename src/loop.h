@@ -0,0 +1,80 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * loop.h
+ * Contains definitions and prototypes for the fixed-timestep loop driver
+ */
+
+#ifndef LOOP_H
+
+#define LOOP_H
+
+#include "compile.h"
+#include "timer.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/*
+ * The game simulates at a fixed rate, but draws as often as the display
+ * lets it. Each time round the main loop, loop_begin works out how much
+ * time has gone by and says how many ticks to simulate to catch up:
+ *   n = loop_begin(&fl);
+ *   while (n-- > 0) {
+ *       snapshot_bullets();
+ *       ...one tick's worth of processing...
+ *   }
+ *   render_bullets_lerp(screen, 320, 240, fl.alpha);
+ *
+ * Whatever's left over that doesn't make a whole tick ends up in alpha,
+ * which is how far the frame is between the last two ticks, from 0 to 1.
+ * Drawing everything that far between where it was at the last snapshot
+ * and where it is now makes motion smooth at any refresh rate.
+ *
+ * If the simulation falls more than max_ticks behind, because of a hitch
+ * or because ticks are taking longer than a tick to run, the rest of the
+ * time is thrown away and the game slows down instead, like shmups always
+ * have. Trying to catch all of it up would only make the next frame later.
+ */
+
+typedef struct frame_loop_ frame_loop;
+struct frame_loop_ {
+    /* Length of a tick, and the most to run in one frame */
+    Uint64 tick_ns;
+    int    max_ticks;
+
+    /* clock_ns at the last loop_begin, and time not simulated yet */
+    Uint64 last;
+    Uint64 acc;
+
+    /* How far between the last two ticks this frame is */
+    float  alpha;
+
+    /*
+     * How fast the game runs, 1.0 is full speed. Less than that and time
+     * builds up slower, for slowdown (see budget.h)
+     */
+    float  speed;
+
+    /* Ticks run, frames drawn, and ticks thrown away so far */
+    Uint32 ticks;
+    Uint32 frames;
+    Uint32 dropped;
+};
+
+/* Start a loop running at hz ticks per second */
+extern void loop_start(frame_loop *fl, int hz, int max_ticks);
+
+/* Start a frame, and get the number of ticks to run before drawing it */
+extern int loop_begin(frame_loop *fl);
+
+#endif /* !def LOOP_H */
@@ -15,34 +15,33 @@
 #include "geometry.h"
 #include "resource.h"
 #include "menu.h"
+#include "pump.h"
+#include "trace.h"
+
+#include <stdlib.h>
 
 #ifdef INCLUDE_SDL_PREFIX
 #include "SDL/SDL.h"
-#include "SDL/SDL_thread.h"
 #else
 #include "SDL.h"
-#include "SDL_thread.h"
 #endif
 
-int _menu_runner(void *data);
+/* The menu on top of the stack, which is the one taking input */
+brmenu *menu_stack = NULL;
 
 brmenu *create_menu(SDL_Surface *surface, SDL_Surface *back,
                     SDL_Rect backsrc, SDL_Rect backdst,
                     resource *sm, resource *se)
 {
     brmenu *brm;
-    int r;
     
     brm = malloc(sizeof(brmenu));
     panic(brm != NULL, "Could not allocate memory for new menu");
     
-    brm->_lock = SDL_CreateMutex();
-    r = SDL_mutexP(brm->_lock);
-    check_mutex(r);
-    
     brm->surface     = surface;
     brm->running     = FALSE;
-    brm->thread      = NULL;
+    brm->dirty       = FALSE;
+    brm->below       = NULL;
     brm->end         = -1;
     brm->entries     = NULL;
     brm->selected    = NULL;
@@ -51,61 +50,71 @@ brmenu *create_menu(SDL_Surface *surface, SDL_Surface *back,
     brm->backdst     = backdst;
     brm->sound_move  = sm;
     brm->sound_enter = se;
-    
-    r = SDL_mutexV(brm->_lock);
-    check_mutex(r);
+    brm->action      = DO_NOTHING;
     
     return brm;
 }
 
+/* Put a menu on top of the stack, where it takes all the input */
 int start_menu(brmenu *brm)
 {
-    int r;
+    warn(brm->entries != NULL, "Tried to start an empty menu");
+    if (brm->entries == NULL || brm->running) {
+        return 1;
+    }
     
-    r = SDL_mutexP(brm->_lock);
-    check_mutex(r);
+    brm->selected = brm->entries; /* always start with first list entry */
+    brm->entries->selected = TRUE;
+    brm->end     = -1;
+    brm->running = TRUE;
+    brm->dirty   = TRUE;
     
-    /* Make the thread */
-    brm->thread = SDL_CreateThread(&_menu_runner, brm);
-   
+    brm->below = menu_stack;
+    menu_stack = brm;
     
-    /* Did it work? */
-    if (brm->thread != NULL) {
-        brm->running = TRUE;
-        r = SDL_mutexV(brm->_lock);
-        check_mutex(r);
-        return 0;
+    debug("Menu started");
+    return 0;
+}
+
+/* Take a menu off the stack, wherever it is in it */
+void _stop_menu(brmenu *brm)
+{
+    brmenu **link;
+    
+    for (link = &menu_stack; *link != NULL; link = &((*link)->below)) {
+        if (*link == brm) {
+            *link = brm->below;
+            break;
+        }
     }
-    else {
-        brm->running = FALSE;
-        r = SDL_mutexV(brm->_lock);
-        check_mutex(r);
-        return 1;
+    
+    brm->running = FALSE;
+    brm->below   = NULL;
+    
+    /* Whatever's underneath needs drawing again */
+    if (menu_stack != NULL) {
+        menu_stack->dirty = TRUE;
     }
 }
 
+/* Get the menu on top of the stack */
+brmenu *menu_top(void)
+{
+    return menu_stack;
+}
+
 brmenu_entry *menu_add_entry(brmenu *brm, Sint32 id, Sint32 idup,
                              Sint32 iddown, Sint32 idleft, Sint32 idright,
                              SDL_Surface *off, SDL_Rect offsrc,
                              SDL_Rect offdst, SDL_Surface *on,
                              SDL_Rect onsrc, SDL_Rect ondst)
 {
-    int r;
     brmenu_entry *newentry, *temp;
     
     /* Allocate memory */
     newentry = malloc(sizeof(brmenu_entry));
     panic(newentry != NULL, "Could not allocate memory for new menu entry");
     
-    /* Create the lock */
-    newentry->_lock = SDL_CreateMutex();
-    
-    /* We'll need these locked for the remainder of the function */
-    r = SDL_mutexP(newentry->_lock);
-    check_mutex(r);
-    r = SDL_mutexP(brm->_lock);
-    check_mutex(r);
-        
     /* Set up the stuff we know */
     newentry->id     = id;
     newentry->off    = off;
@@ -147,28 +156,18 @@ brmenu_entry *menu_add_entry(brmenu *brm, Sint32 id, Sint32 idup,
     }
     newentry->next = NULL;
     
-    /* Unlock stuff */
-    r = SDL_mutexV(brm->_lock);
-    check_mutex(r);
-    r = SDL_mutexV(newentry->_lock);
-    check_mutex(r);
+    /* Has to be drawn in if the menu's already up */
+    brm->dirty = TRUE;
     
     return newentry;
 }
 
 void menu_link_entries(brmenu *brm)
 {
-    int r;
     brmenu_entry *current, *temp;
     
-    /* Lock up the menu */
-    r = SDL_mutexP(brm->_lock);
-    check_mutex(r);
-
     /* Set up the up, left, down, right references for every entry */
     for (current = brm->entries; current != NULL; current = current->next) {
-        r = SDL_mutexP(current->_lock);
-        check_mutex(r);
         if (current->idup >= 0) {
             for (temp = brm->entries;
                  temp != NULL && temp->id != current->idup;
@@ -220,24 +219,14 @@ void menu_link_entries(brmenu *brm)
                 current->right = NULL;
             }
         }
-        
-        r = SDL_mutexV(current->_lock);
-        check_mutex(r);
     }
-    
-    /* Unlock the menu */
-    r = SDL_mutexV(brm->_lock);
-    check_mutex(r);
 }
 
 void draw_menu(brmenu *brm)
 {
-    int r;
     SDL_Surface *surface;
     brmenu_entry *temp;
     
-    /* We assume the calling function locked the menu for us */
-    
     surface = brm->surface;
     
     /* Draw background */
@@ -245,9 +234,6 @@ void draw_menu(brmenu *brm)
     
     /* Draw entries */
     for (temp = brm->entries; temp != NULL; temp = temp->next) {
-        r = SDL_mutexP(temp->_lock);
-        check_mutex(r);
-        
         if (temp->selected) {
             SDL_BlitSurface(temp->on, &(temp->offsrc),
                             surface, &(temp->offdst));
@@ -256,35 +242,52 @@ void draw_menu(brmenu *brm)
             SDL_BlitSurface(temp->off, &(temp->onsrc),
                             surface, &(temp->ondst));
         }
-        
-        r = SDL_mutexV(temp->_lock);
-        check_mutex(r);
     }
+    
+    brm->dirty = FALSE;
+}
+
+/* Redraw the menu on top of the stack, if anything's changed */
+int menu_update(void)
+{
+    if (menu_stack == NULL || !menu_stack->dirty) {
+        return FALSE;
+    }
+    
+    draw_menu(menu_stack);
+    trace_begin("flip");
+    SDL_Flip(menu_stack->surface);
+    trace_end("flip");
+    return TRUE;
 }
 
+/*
+ * Run the menu loop until this menu stops. It sleeps in pump_wait until
+ * there's an event, so a menu nobody's touching costs next to nothing.
+ */
 int wait_on_menu(brmenu *brm)
 {
-    if (brm->thread == NULL || !(brm->running)) {
+    SDL_Event event;
+    
+    if (!brm->running) {
         return 1;
     }
     
-    SDL_WaitThread(brm->thread, NULL);
+    menu_update();
+    while (brm->running) {
+        pump_wait(&event);
+        menu_handle_event(&event);
+        menu_update();
+    }
     return 0;
 }
 
 void destroy_menu(brmenu *brm)
 {
-    int r;
     brmenu_entry *temp, *next;
     
     if (brm->running) {
-        /* Politely tell the thread to stop */
-        r = SDL_mutexP(brm->_lock);
-        check_mutex(r);
-        brm->running = FALSE;
-        r = SDL_mutexV(brm->_lock);
-        check_mutex(r);
-        SDL_WaitThread(brm->thread, NULL);
+        _stop_menu(brm);
     }
     
     temp = brm->entries;
@@ -292,7 +295,6 @@ void destroy_menu(brmenu *brm)
         next = temp->next;
         SDL_FreeSurface(temp->off);
         SDL_FreeSurface(temp->on);
-        SDL_DestroyMutex(temp->_lock);
         free(temp);
         temp = next;
     }
@@ -303,11 +305,36 @@ void destroy_menu(brmenu *brm)
      * We can probably free the background though
      */
     SDL_FreeSurface(brm->back);
-    SDL_DestroyMutex(brm->_lock);
     free(brm);
 }
 
 
+/* Work out what menu action an event is, if any */
+brmenu_action _event_action(SDL_Event *event)
+{
+    /* We really only care about key events */
+    /* TODO: Tie this into the input system so it can be configured */
+    if (event->type != SDL_KEYDOWN) {
+        return DO_NOTHING;
+    }
+    
+    switch(event->key.keysym.sym) {
+        /* Check for up, down, left, right, enter */
+        case SDLK_UP:
+            return DO_UP;
+        case SDLK_DOWN:
+            return DO_DOWN;
+        case SDLK_LEFT:
+            return DO_LEFT;
+        case SDLK_RIGHT:
+            return DO_RIGHT;
+        case SDLK_RETURN:
+            return DO_CONFIRM;
+        default:
+            return DO_NOTHING;
+    }
+}
+
 /* 
  * Handle input and process it into a menu action 
  * This has to be run by the main thread that created the window
@@ -315,269 +342,117 @@ void destroy_menu(brmenu *brm)
  */
 brmenu_action get_action(void)
 {
-    int r;
-    brmenu_action todo;
     SDL_Event event;
     
-    r = SDL_PollEvent(&event);
-    if (r != 0) {
-        /* We really only care about key events */
-        /* TODO: Tie this into the input system so it can be configured */
-        switch(event.type) {
-            case SDL_KEYDOWN:
-                switch(event.key.keysym.sym) {
-                    /* Check for up, down, left, right, enter */
-                    case SDLK_UP:
-                        todo = DO_UP;
-                        break;
-                    case SDLK_DOWN:
-                        todo = DO_DOWN;
-                        break;
-                    case SDLK_LEFT:
-                        todo = DO_LEFT;
-                        break;
-                    case SDLK_RIGHT:
-                        todo = DO_RIGHT;
-                        break;
-                    case SDLK_RETURN:
-                        todo = DO_CONFIRM;
-                        break;
-                    /* Need to clear todo otherwise */
-                    default:
-                        todo = DO_NOTHING;
-                        break;
-                }
-                break;
-            default:
-                todo = DO_NOTHING;
-                break;
-        }
-    }
-    else {
-        todo = DO_NOTHING;
+    if (!pump_poll(&event)) {
+        return DO_NOTHING;
     }
-    
-    return todo;
+    return _event_action(&event);
 }
 
-
-/* Set the menu action in a menu */
-void menu_action(brmenu *brm, brmenu_action act)
+/* Pass an event to the menu on top of the stack */
+int menu_handle_event(SDL_Event *event)
 {
-    int r;
+    brmenu_action act;
     
-    r = SDL_mutexP(brm->_lock);
-    check_mutex(r);
+    if (menu_stack == NULL) {
+        return FALSE;
+    }
     
-    if (brm->action == DO_NOTHING) {
-        brm->action = act;
+    act = _event_action(event);
+    if (act == DO_NOTHING) {
+        return FALSE;
     }
     
-    r = SDL_mutexV(brm->_lock);
-    check_mutex(r);
+    menu_action(menu_stack, act);
+    return TRUE;
 }
 
 
-/* The beast, this is the actual menu thread function */
-int _menu_runner(void *data)
+/* Move the cursor from the selected entry to another one */
+void _menu_select(brmenu *brm, brmenu_entry *to)
 {
-    int r;
-    brmenu *me;
-    brmenu_entry *temp;
+    brmenu_entry *from = brm->selected;
     
-    me = (brmenu*) data;
+    if (to == NULL) return;
     
-    /* Lock ourselves for some setup */
-    r = SDL_mutexP(me->_lock);
-    check_mutex(r);
+    from->selected = FALSE;
+    to->selected = TRUE;
     
-    /* Finish some stuff */
-    warn(me->entries != NULL, "Tried to start an empty menu");
-    if (me->entries == NULL) {
-        me->running = FALSE;
-        return 0;
+    /* check callbacks */
+    if (from->on_deselected != NULL) {
+        (*(from->on_deselected))(brm, from);
+    }
+    if (to->on_selected != NULL) {
+        (*(to->on_selected))(brm, to);
     }
     
-    me->selected = me->entries; /* always start with first list entry */
-    me->entries->selected = TRUE;
-    
-    /* Alright, let's get started */
-    r = SDL_mutexV(me->_lock);
-    check_mutex(r);
+    brm->selected = to;
+    brm->dirty = TRUE;
+}
+
+/* Do a menu action, right away */
+void menu_action(brmenu *brm, brmenu_action act)
+{
+    int r;
+    brmenu_entry *sel;
     
-    debug("Menu started");
+    if (!brm->running) return;
+    sel = brm->selected;
     
-    while (me->running) {
-        /*
-         * We leave it to the external thread to redraw ourselves
-         * that way they can sync it to the main drawing cycle
-         * Furthermore, the main window thread has to handle input
-         * events on some systems, so we let an external thread handle
-         * that as well.
-         * So, let's just see if we have something to do and handle it.
-         */
-        r = SDL_mutexP(me->_lock);
-        check_mutex(r);
-            
-        switch (me->action) {
-            case DO_NOTHING:
-                /* we do nothing, obviously */
-                break;
-            
-            case DO_UP:
-                if (me->selected->up != NULL) {
-                    temp = me->selected->up;
-                    me->selected->selected = FALSE;
-                    temp->selected = TRUE;
-                    
-                    /* check callbacks */
-                    if (me->selected->on_deselected != NULL) {
-                        (*(me->selected->on_deselected))(me, me->selected);
-                    }
-                    if (temp->on_selected != NULL) {
-                        (*(temp->on_selected))(me, temp);
-                    }                        
-                    me->selected = temp;                    
-                }
-                else if (me->selected->on_up != NULL) {
-                    temp = (*(me->selected->on_up))(me, me->selected);
-                    me->selected->selected = FALSE;
-                    temp->selected = TRUE;
-                    
-                    /* check callbacks */
-                    if (me->selected->on_deselected != NULL) {
-                        (*(me->selected->on_deselected))(me, me->selected);
-                    }
-                    if (temp->on_selected != NULL) {
-                        (*(temp->on_selected))(me, temp);
-                    }                        
-                    me->selected = temp;
-                }
-                break;
-            
-            case DO_DOWN:
-                if (me->selected->down != NULL) {
-                    temp = me->selected->down;
-                    me->selected->selected = FALSE;
-                    temp->selected = TRUE;
-                    
-                    /* check callbacks */
-                    if (me->selected->on_deselected != NULL) {
-                        (*(me->selected->on_deselected))(me, me->selected);
-                    }
-                    if (temp->on_selected != NULL) {
-                        (*(temp->on_selected))(me, temp);
-                    }
-                        
-                    me->selected = temp;
-                }
-                else if (me->selected->on_down != NULL) {
-                    temp = (*(me->selected->on_down))(me, me->selected);
-                    me->selected->selected = FALSE;
-                    temp->selected = TRUE;
-                        
-                    /* check callbacks */
-                    if (me->selected->on_deselected != NULL) {
-                        (*(me->selected->on_deselected))(me, me->selected);
-                    }
-                    if (temp->on_selected != NULL) {
-                        (*(temp->on_selected))(me, temp);
-                    }
-                        
-                    me->selected = temp;
-                }
-                break;
-            
-            case DO_LEFT:
-                if (me->selected->left != NULL) {
-                    temp = me->selected->left;
-                    me->selected->selected = FALSE;
-                    temp->selected = TRUE;
-                    
-                    /* check callbacks */
-                    if (me->selected->on_deselected != NULL) {
-                        (*(me->selected->on_deselected))(me, me->selected);
-                    }
-                    if (temp->on_selected != NULL) {
-                        (*(temp->on_selected))(me, temp);
-                    }
-                    
-                    me->selected = temp;
-                }
-                else if (me->selected->on_left != NULL) {
-                    temp = (*(me->selected->on_left))(me, me->selected);
-                    me->selected->selected = FALSE;
-                    temp->selected = TRUE;
-                    
-                    /* check callbacks */
-                    if (me->selected->on_deselected != NULL) {
-                        (*(me->selected->on_deselected))(me, me->selected);
-                    }
-                    if (temp->on_selected != NULL) {
-                        (*(temp->on_selected))(me, temp);
-                    }
-                    
-                    me->selected = temp;
-                }
-                break;
-            
-            case DO_RIGHT:
-                if (me->selected->right != NULL) {
-                    temp = me->selected->right;
-                    me->selected->selected = FALSE;
-                    temp->selected = TRUE;
-                    
-                    /* check callbacks */
-                    if (me->selected->on_deselected != NULL) {
-                        (*(me->selected->on_deselected))(me, me->selected);
-                    }
-                    if (temp->on_selected != NULL) {
-                        (*(temp->on_selected))(me, temp);
-                    }
-                    
-                    me->selected = temp;
-                }
-                else if (me->selected->on_right != NULL) {
-                    temp = (*(me->selected->on_right))(me, me->selected);
-                    me->selected->selected = FALSE;
-                    temp->selected = TRUE;
-                    
-                    /* check callbacks */
-                    if (me->selected->on_deselected != NULL) {
-                        (*(me->selected->on_deselected))(me, me->selected);
-                    }
-                    if (temp->on_selected != NULL) {
-                        (*(temp->on_selected))(me, temp);
-                    }
-                    
-                    me->selected = temp;
-                }
-                break;
-            
-            case DO_CONFIRM:
-                if (me->selected->on_enter != NULL) {
-                    r = (*(me->selected->on_enter))(me, me->selected);
-                }
-                else r = TRUE;
-                
-                if (r) {
-                    me->end = me->selected->id;
-                    /* In case this brmenu is used again */
-                    me->selected->selected = FALSE;
-                    me->running = FALSE;
-                }
-                break;
-        }
+    switch (act) {
+        case DO_NOTHING:
+            /* we do nothing, obviously */
+            break;
+        
+        case DO_UP:
+            if (sel->up != NULL) {
+                _menu_select(brm, sel->up);
+            }
+            else if (sel->on_up != NULL) {
+                _menu_select(brm, (*(sel->on_up))(brm, sel));
+            }
+            break;
         
-        /* Reset */
-        me->action = DO_NOTHING;
+        case DO_DOWN:
+            if (sel->down != NULL) {
+                _menu_select(brm, sel->down);
+            }
+            else if (sel->on_down != NULL) {
+                _menu_select(brm, (*(sel->on_down))(brm, sel));
+            }
+            break;
         
-        /* Unlock */
-        r = SDL_mutexV(me->_lock);
-        check_mutex(r);
+        case DO_LEFT:
+            if (sel->left != NULL) {
+                _menu_select(brm, sel->left);
+            }
+            else if (sel->on_left != NULL) {
+                _menu_select(brm, (*(sel->on_left))(brm, sel));
+            }
+            break;
         
-        /* Delay a little while to avoid sucking up all the CPU cycles */
-        SDL_Delay(20);
+        case DO_RIGHT:
+            if (sel->right != NULL) {
+                _menu_select(brm, sel->right);
+            }
+            else if (sel->on_right != NULL) {
+                _menu_select(brm, (*(sel->on_right))(brm, sel));
+            }
+            break;
+        
+        case DO_CONFIRM:
+            if (sel->on_enter != NULL) {
+                r = (*(sel->on_enter))(brm, sel);
+            }
+            else r = TRUE;
+            
+            if (r) {
+                brm->end = sel->id;
+                /* In case this brmenu is used again */
+                sel->selected = FALSE;
+                _stop_menu(brm);
+            }
+            break;
     }
-    return 1;
 }
@@ -19,12 +19,23 @@
 
 #ifdef INCLUDE_SDL_PREFIX
 #include "SDL/SDL.h"
-#include "SDL/SDL_thread.h"
 #else
 #include "SDL.h"
-#include "SDL_thread.h"
 #endif
 
+/*
+ * Menus are run off input events on the main thread. Starting a menu puts
+ * it on top of a stack, and only the menu on top takes input; when it's
+ * confirmed it comes off again and the one underneath is back on top.
+ * A menu only gets redrawn when something about it changes, and
+ * wait_on_menu sleeps until there's an event, so a menu sitting there
+ * with nobody touching it costs next to nothing (see pump.h for how
+ * often the pump still has to look).
+ *
+ * A game that has its own loop should pass events to menu_handle_event
+ * and call menu_update once a frame instead of using wait_on_menu.
+ */
+
 /*
  * Don't want to take chances that "menu" isn't already used
  * by some compilers
@@ -56,11 +67,15 @@ struct brmenu_ {
     /* Sound we should play when the user presses enter */
     resource *sound_enter;
     
-    /* Threading stuff */
-    SDL_Thread  *thread;
-    SDL_mutex   *_lock;
+    /* Is it on the menu stack? */
     Sint32      running;
     
+    /* The menu underneath this one on the stack */
+    brmenu      *below;
+    
+    /* Does it need drawing again? */
+    Sint32      dirty;
+    
     /* Where to draw it */
     SDL_Surface *surface;
     
@@ -143,9 +158,6 @@ struct brmenu_entry_ {
     brmenu_entry *(*on_down)  (brmenu*, brmenu_entry*);
     brmenu_entry *(*on_left)  (brmenu*, brmenu_entry*);
     brmenu_entry *(*on_right) (brmenu*, brmenu_entry*);
-    
-    /* Lock */
-    SDL_mutex *_lock;
 };
 
 extern brmenu *create_menu(SDL_Surface *surface, SDL_Surface *back,
@@ -161,10 +173,19 @@ extern brmenu_entry *menu_add_entry(brmenu *brm, Sint32 id, Sint32 idup,
                                     SDL_Rect onsrc, SDL_Rect ondst);
 extern void menu_link_entries(brmenu *brm);
 
+/* Get the menu on top of the stack, NULL if there aren't any running */
+extern brmenu *menu_top(void);
+
 extern void draw_menu   (brmenu *brm);
 extern int  wait_on_menu(brmenu *brm);
 extern void destroy_menu(brmenu *brm);
 
+/* Redraw the menu on top of the stack if it changed. TRUE if it was drawn */
+extern int  menu_update (void);
+
+/* Pass an event to the menu on top of the stack. TRUE if it used it */
+extern int  menu_handle_event(SDL_Event *event);
+
 extern brmenu_action get_action (void);
 extern void          menu_action(brmenu *brm, brmenu_action act);
 
@@ -0,0 +1,281 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * metrics.c
+ * Contains code for the engine metrics
+ */
+
+#include "compile.h"
+#include "debug.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+typedef struct metric_def_ metric_def;
+struct metric_def_ {
+    const char *name;
+    int         kind;
+};
+
+/* Names and kinds, in the order of the numbers in metrics.h */
+const metric_def metric_defs[MET_NUM_METRICS] = {
+    {"bullets_made",       MET_COUNTER},
+    {"bullets_failed",     MET_COUNTER},
+    {"bullets_destroyed",  MET_COUNTER},
+    {"bullet_hits",        MET_COUNTER},
+    {"pbullets_made",      MET_COUNTER},
+    {"pbullets_destroyed", MET_COUNTER},
+    {"pbullet_hits",       MET_COUNTER},
+    {"scripts_started",    MET_COUNTER},
+    {"scripts_resumed",    MET_COUNTER},
+    {"arcs_loaded",        MET_COUNTER},
+    {"images_decoded",     MET_COUNTER},
+    {"ticks_missed",       MET_COUNTER},
+    {"bullets_live",       MET_GAUGE},
+    {"pbullets_live",      MET_GAUGE},
+    {"script_ns",          MET_HISTOGRAM},
+    {"decode_ns",          MET_HISTOGRAM},
+    {"tick_late_ns",       MET_HISTOGRAM}
+};
+
+/* The bits that get counted into from everywhere, padded out to lines */
+#define MET_HOT_SIZE (2 * sizeof(Sint64) + MET_BUCKETS * sizeof(Uint32))
+
+typedef struct metric_ metric;
+struct metric_ {
+    /* A counter or gauge, or the number of times in a histogram */
+    volatile Sint64 value;
+    volatile Uint64 sum;
+    volatile Uint32 buckets[MET_BUCKETS];
+    char            pad[CACHE_LINE - MET_HOT_SIZE % CACHE_LINE];
+};
+
+metric metrics[MET_NUM_METRICS];
+
+/* Only touched by metrics_end_frame */
+Sint64 metric_last [MET_NUM_METRICS];
+Sint64 metric_delta[MET_NUM_METRICS];
+
+/* Exporting */
+FILE  *met_out = NULL;
+int    met_format;
+Uint32 met_interval;
+Uint32 met_exported;
+
+void metric_add(int id, Sint64 n)
+{
+    __sync_fetch_and_add(&metrics[id].value, n);
+}
+
+void metric_set(int id, Sint64 value)
+{
+    metrics[id].value = value;
+}
+
+void metric_observe(int id, Uint64 ns)
+{
+    Uint64 scaled = ns >> MET_FIRST_SHIFT;
+    int bucket;
+
+    /* Bucket b goes up to 1us << b */
+    bucket = scaled ? 64 - __builtin_clzll(scaled) : 0;
+    if (bucket >= MET_BUCKETS) bucket = MET_BUCKETS - 1;
+
+    __sync_fetch_and_add(&metrics[id].buckets[bucket], 1);
+    __sync_fetch_and_add(&metrics[id].sum, ns);
+    __sync_fetch_and_add(&metrics[id].value, 1);
+}
+
+Sint64 metric_get(int id)
+{
+    return metrics[id].value;
+}
+
+Sint64 metric_frame(int id)
+{
+    return metric_delta[id];
+}
+
+Uint64 metric_percentile(int id, int pct)
+{
+    Uint64 total = 0, want, seen = 0;
+    int i;
+
+    for (i = 0; i < MET_BUCKETS; ++i) {
+        total += metrics[id].buckets[i];
+    }
+    if (total == 0) return 0;
+
+    /* The pct'th one, counting from 1 */
+    want = (total * pct + 99) / 100;
+    if (want == 0) want = 1;
+
+    for (i = 0; i < MET_BUCKETS - 1; ++i) {
+        seen += metrics[id].buckets[i];
+        if (seen >= want) break;
+    }
+    return (Uint64)1 << (MET_FIRST_SHIFT + i);
+}
+
+Uint64 metric_sum(int id)
+{
+    return metrics[id].sum;
+}
+
+const char *metric_name(int id)
+{
+    return metric_defs[id].name;
+}
+
+int metric_kind(int id)
+{
+    return metric_defs[id].kind;
+}
+
+int metric_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < MET_NUM_METRICS; ++i) {
+        if (strcmp(metric_defs[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+void metrics_reset(void)
+{
+    memset(metrics, 0, sizeof(metrics));
+    memset(metric_last, 0, sizeof(metric_last));
+    memset(metric_delta, 0, sizeof(metric_delta));
+}
+
+/* Write the names, for the top of a CSV file */
+void _export_header(void)
+{
+    int i;
+
+    fprintf(met_out, "ms");
+    for (i = 0; i < MET_NUM_METRICS; ++i) {
+        if (metric_defs[i].kind == MET_HISTOGRAM) {
+            fprintf(met_out, ",%s_count,%s_p50,%s_p99", metric_defs[i].name,
+                    metric_defs[i].name, metric_defs[i].name);
+        }
+        else {
+            fprintf(met_out, ",%s", metric_defs[i].name);
+        }
+    }
+    fprintf(met_out, "\n");
+}
+
+/*
+ * Write a row of everything. Numbers go through double so they come out
+ * whole on every platform, 64 bit printf formats aren't
+ */
+void _export_row(Uint32 now)
+{
+    int i;
+
+    if (met_format == MET_CSV) {
+        fprintf(met_out, "%u", (unsigned) now);
+        for (i = 0; i < MET_NUM_METRICS; ++i) {
+            fprintf(met_out, ",%.0f", (double) metrics[i].value);
+            if (metric_defs[i].kind == MET_HISTOGRAM) {
+                fprintf(met_out, ",%.0f,%.0f",
+                        (double) metric_percentile(i, 50),
+                        (double) metric_percentile(i, 99));
+            }
+        }
+    }
+    else {
+        fprintf(met_out, "{\"ms\":%u", (unsigned) now);
+        for (i = 0; i < MET_NUM_METRICS; ++i) {
+            if (metric_defs[i].kind == MET_HISTOGRAM) {
+                fprintf(met_out, ",\"%s\":{\"count\":%.0f,\"sum\":%.0f,"
+                        "\"p50\":%.0f,\"p99\":%.0f}", metric_defs[i].name,
+                        (double) metrics[i].value, (double) metrics[i].sum,
+                        (double) metric_percentile(i, 50),
+                        (double) metric_percentile(i, 99));
+            }
+            else {
+                fprintf(met_out, ",\"%s\":%.0f", metric_defs[i].name,
+                        (double) metrics[i].value);
+            }
+        }
+        fprintf(met_out, "}");
+    }
+    fprintf(met_out, "\n");
+    fflush(met_out);
+}
+
+void metrics_end_frame(void)
+{
+    Sint64 value;
+    Uint32 now;
+    int i;
+
+    for (i = 0; i < MET_NUM_METRICS; ++i) {
+        value = metrics[i].value;
+        if (metric_defs[i].kind == MET_GAUGE) {
+            metric_delta[i] = value;
+        }
+        else {
+            metric_delta[i] = value - metric_last[i];
+        }
+        metric_last[i] = value;
+    }
+
+    if (met_out == NULL) return;
+    now = SDL_GetTicks();
+    if (now - met_exported >= met_interval) {
+        _export_row(now);
+        met_exported = now;
+    }
+}
+
+int metrics_export(const char *filename, int format, Uint32 interval_ms)
+{
+    if (met_out != NULL) {
+        fclose(met_out);
+        met_out = NULL;
+    }
+    if (filename == NULL) return TRUE;
+
+    met_out = fopen(filename, "w");
+    warn2(met_out != NULL, "Couldn't open metrics file", (char*) filename);
+    if (met_out == NULL) return FALSE;
+
+    met_format   = format;
+    met_interval = interval_ms;
+    met_exported = SDL_GetTicks();
+    if (format == MET_CSV) {
+        _export_header();
+    }
+
+    debug2("Exporting metrics to", (char*) filename);
+    return TRUE;
+}
+
+/* Start/stop functions */
+int init_metrics(void)
+{
+    metrics_reset();
+
+    return 0;
+}
+
+void stop_metrics(void)
+{
+    metrics_export(NULL, MET_CSV, 0);
+}
@@ -0,0 +1,126 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * metrics.h
+ * Contains definitions and prototypes for the engine metrics
+ */
+
+#ifndef METRICS_H
+
+#define METRICS_H
+
+#include "compile.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/*
+ * A fixed set of metrics, counted as things happen all over the engine:
+ *
+ *   counters    only go up, like bullets made
+ *   gauges      go up and down, like bullets alive right now
+ *   histograms  times in nanoseconds, counted into power of 2 buckets from
+ *               1us up, so percentiles are only good to within a factor
+ *               of 2, which is plenty for spotting a slow decode
+ *
+ * Everything is updated with atomic adds and each metric has its own cache
+ * line, so any thread can count things without locking. metrics_end_frame
+ * works out how much each counter went up by in the last frame, and writes
+ * a row to the export file every so often, if there is one.
+ *
+ * To add one, give it a number here and a name and kind in metrics.c.
+ */
+
+#define MET_COUNTER   0
+#define MET_GAUGE     1
+#define MET_HISTOGRAM 2
+
+/* Counters */
+#define MET_BULLETS_MADE       0
+#define MET_BULLETS_FAILED     1  /* out of bullet memory */
+#define MET_BULLETS_DESTROYED  2
+#define MET_BULLET_HITS        3  /* collide_bullet hits */
+#define MET_PBULLETS_MADE      4
+#define MET_PBULLETS_DESTROYED 5
+#define MET_PBULLET_HITS       6  /* collide_pbullet hits */
+#define MET_SCRIPTS_STARTED    7  /* add_bullet and set_stage */
+#define MET_SCRIPTS_RESUMED    8  /* bullet contexts set by the runner */
+#define MET_ARCS_LOADED        9
+#define MET_IMAGES_DECODED     10
+#define MET_TICKS_MISSED       11 /* wait_tick called after the deadline */
+/* Gauges */
+#define MET_BULLETS_LIVE       12
+#define MET_PBULLETS_LIVE      13
+/* Histograms */
+#define MET_SCRIPT_NS          14 /* exec_bullet_scripts */
+#define MET_DECODE_NS          15 /* decoding one image */
+#define MET_TICK_LATE_NS       16 /* how late wait_tick woke up */
+
+#define MET_NUM_METRICS        17
+
+/* 1us, 2us, 4us... and the last one takes everything over about 4s */
+#define MET_BUCKETS     24
+#define MET_FIRST_SHIFT 10
+
+/* Export formats */
+#define MET_CSV  0
+#define MET_JSON 1 /* one object per line */
+
+/* Count something */
+extern void metric_add(int id, Sint64 n);
+
+/* Set a gauge */
+extern void metric_set(int id, Sint64 value);
+
+/* Count a time into a histogram */
+extern void metric_observe(int id, Uint64 ns);
+
+/* Get a counter or gauge, or how many times went into a histogram */
+extern Sint64 metric_get(int id);
+
+/* Get how much a counter went up in the last frame, or a gauge at the end */
+extern Sint64 metric_frame(int id);
+
+/*
+ * Get a percentile of a histogram, which is the top of the bucket it falls
+ * in, in nanoseconds. 0 if nothing's been counted yet.
+ */
+extern Uint64 metric_percentile(int id, int pct);
+
+/* Get the total of every time counted into a histogram */
+extern Uint64 metric_sum(int id);
+
+extern const char *metric_name(int id);
+extern int         metric_kind(int id);
+
+/* Find a metric by name, -1 if there isn't one */
+extern int metric_find(const char *name);
+
+/* Zero everything */
+extern void metrics_reset(void);
+
+/* Finish a frame, and export a row if it's time */
+extern void metrics_end_frame(void);
+
+/*
+ * Write a row of every metric to filename every interval_ms, in the given
+ * format, until it's called again with NULL. The file is started over.
+ * Returns FALSE if it couldn't be opened.
+ */
+extern int metrics_export(const char *filename, int format,
+                          Uint32 interval_ms);
+
+/* Start/stop functions */
+extern int  init_metrics(void);
+extern void stop_metrics(void);
+
+#endif /* !def METRICS_H */
@@ -17,6 +17,7 @@
 #include "coreship.h"
 #include "debug.h"
 #include "geometry.h"
+#include "metrics.h"
 #include "player.h"
 
 #ifdef INCLUDE_SDL_PREFIX
@@ -104,13 +105,18 @@ pbullet *make_pbullet (pbullet_type *type, float x, float y,
     pbul->lry += y;
     pbul->next = NULL;
     
+    metric_add(MET_PBULLETS_MADE, 1);
+    metric_add(MET_PBULLETS_LIVE, 1);
     return pbul;
 }
 
 inline int collide_pbullet (pbullet *pbul, bullet *bul)
 {
-    return aabb_collide(pbul->tlx, pbul->tly, pbul->lrx, pbul->lry,
-                         bul->tlx,  bul->tly,  bul->lrx,  bul->lry);
+    int hit = aabb_collide(pbul->tlx, pbul->tly, pbul->lrx, pbul->lry,
+                            bul->tlx,  bul->tly,  bul->lrx,  bul->lry);
+    
+    if (hit) metric_add(MET_PBULLET_HITS, 1);
+    return hit;
 }
 
 void destroy_pbullet (pbullet *pbul)
@@ -133,6 +139,9 @@ void destroy_pbullet (pbullet *pbul)
     
     r = SDL_mutexV(free_pbullets_lock);
     check_mutex(r);
+    
+    metric_add(MET_PBULLETS_DESTROYED, 1);
+    metric_add(MET_PBULLETS_LIVE, -1);
 }
 
 inline void draw_player (player *plr, SDL_Surface *surface,
@@ -184,6 +193,8 @@ void reset_pbullets(void)
     
     r = SDL_mutexV(free_pbullets_lock);
     check_mutex(r);
+    
+    metric_set(MET_PBULLETS_LIVE, 0);
 }
 
 int init_player(void)
@@ -0,0 +1,221 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * profile.c
+ * Contains code for the frame-time profiler
+ */
+
+#include "compile.h"
+#include "debug.h"
+#include "profile.h"
+#include "text.h"
+#include "timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+const char stage_names[PROF_NUM_STAGES][12] = {
+    "integrate",
+    "collide",
+    "scripts",
+    "draw",
+    "flip",
+    "frame"
+};
+
+/* The frame being timed right now */
+prof_frame prof_current;
+Uint64     prof_frame_start;
+
+/* Finished frames, prof_head is the number filed away so far */
+prof_frame   prof_ring[PROF_FRAMES];
+volatile int prof_head = 0;
+
+/* Add some time to a stage of the current frame */
+void prof_add(int stage, Uint64 ns)
+{
+    __sync_fetch_and_add(&prof_current.ns[stage], ns);
+}
+
+/* Finish the current frame and start the next one */
+void prof_end_frame(void)
+{
+    prof_frame *slot;
+    Uint64 now;
+    int i;
+
+    now  = clock_ns();
+    slot = &prof_ring[prof_head & (PROF_FRAMES-1)];
+
+    for (i = 0; i < PROF_FRAME; ++i) {
+        slot->ns[i] = __sync_fetch_and_and(&prof_current.ns[i], 0);
+    }
+    slot->ns[PROF_FRAME] = now - prof_frame_start;
+    prof_frame_start = now;
+
+    /* Make sure the slot is written before anybody can see it */
+    __sync_synchronize();
+    ++prof_head;
+}
+
+/* Forget all the frames so far */
+void prof_reset(void)
+{
+    int i;
+
+    for (i = 0; i < PROF_NUM_STAGES; ++i) {
+        __sync_fetch_and_and(&prof_current.ns[i], 0);
+    }
+    prof_frame_start = clock_ns();
+    prof_head = 0;
+}
+
+/* Get the time of a stage in the last finished frame */
+Uint64 prof_last(int stage)
+{
+    int head;
+
+    head = prof_head;
+    __sync_synchronize();
+
+    if (head == 0) return 0;
+    return prof_ring[(head - 1) & (PROF_FRAMES-1)].ns[stage];
+}
+
+/* Copy out the finished frames still in the ring, oldest first */
+int prof_history(prof_frame *dst, int max)
+{
+    int head, n, i;
+
+    head = prof_head;
+    __sync_synchronize();
+
+    n = (head < PROF_FRAMES) ? head : PROF_FRAMES;
+    if (n > max) n = max;
+
+    for (i = 0; i < n; ++i) {
+        dst[i] = prof_ring[(head - n + i) & (PROF_FRAMES-1)];
+    }
+
+    return n;
+}
+
+int _compare_ns(const void *a, const void *b)
+{
+    Uint64 x = *(const Uint64*)a;
+    Uint64 y = *(const Uint64*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Get the min, average and 99th percentile time of a stage */
+int prof_stats(int stage, Uint64 *min, Uint64 *avg, Uint64 *p99)
+{
+    Uint64 samples[PROF_WINDOW];
+    Uint64 total = 0;
+    int head, n, i;
+
+    head = prof_head;
+    __sync_synchronize();
+
+    n = (head < PROF_WINDOW) ? head : PROF_WINDOW;
+    if (n == 0) {
+        *min = *avg = *p99 = 0;
+        return 0;
+    }
+
+    for (i = 0; i < n; ++i) {
+        samples[i] = prof_ring[(head - 1 - i) & (PROF_FRAMES-1)].ns[stage];
+        total += samples[i];
+    }
+    qsort(samples, n, sizeof(Uint64), _compare_ns);
+
+    *min = samples[0];
+    *avg = total / n;
+    *p99 = samples[(n * 99) / 100];
+
+    return n;
+}
+
+const char *prof_stage_name(int stage)
+{
+    return stage_names[stage];
+}
+
+/* Draw the stats for every stage, one line each */
+int prof_draw_overlay(SDL_Surface *dst, text_cache *tc, int x, int y)
+{
+    Uint64 min, avg, p99;
+    char line[64];
+    int i;
+
+    for (i = 0; i < PROF_NUM_STAGES; ++i) {
+        prof_stats(i, &min, &avg, &p99);
+        sprintf(line, "%-9s %6.2f %6.2f %6.2f ms", stage_names[i],
+                min / 1000000.0F, avg / 1000000.0F, p99 / 1000000.0F);
+        draw_text(tc, dst, x, y + i * tc->height, line);
+    }
+
+    return PROF_NUM_STAGES * tc->height;
+}
+
+/* Write every frame in the ring to a CSV file */
+int prof_dump_csv(const char *filename)
+{
+    FILE *out;
+    int head, first, f, i;
+
+    out = fopen(filename, "w");
+    warn(out != NULL, "Couldn't open profile dump file");
+    if (out == NULL) return FALSE;
+
+    fprintf(out, "frame");
+    for (i = 0; i < PROF_NUM_STAGES; ++i) {
+        fprintf(out, ",%s", stage_names[i]);
+    }
+    fprintf(out, "\n");
+
+    head = prof_head;
+    __sync_synchronize();
+    first = (head < PROF_FRAMES) ? 0 : head - PROF_FRAMES;
+
+    for (f = first; f < head; ++f) {
+        fprintf(out, "%d", f);
+        for (i = 0; i < PROF_NUM_STAGES; ++i) {
+            fprintf(out, ",%.0f",
+                    (double) prof_ring[f & (PROF_FRAMES-1)].ns[i]);
+        }
+        fprintf(out, "\n");
+    }
+
+    fclose(out);
+    debug2("Wrote profile to", (char*) filename);
+
+    return TRUE;
+}
+
+/* Start/stop functions */
+int init_profile(void)
+{
+    memset(&prof_current, 0, sizeof(prof_current));
+    prof_reset();
+
+    return 0;
+}
+
+void stop_profile(void)
+{
+    /* Nothing to clean up */
+}
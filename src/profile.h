@@ -0,0 +1,115 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * profile.h
+ * Contains definitions and prototypes for the frame-time profiler
+ */
+
+#ifndef PROFILE_H
+
+#define PROFILE_H
+
+#include "compile.h"
+#include "text.h"
+#include "timer.h"
+#include "trace.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/*
+ * Each frame is split up into stages, and the time spent in each stage is
+ * added up with prof_start/prof_stop. A stage can be timed more than once
+ * per frame, the times just add up. When the frame is done, prof_end_frame
+ * files the totals away in a ring buffer of the last PROF_FRAMES frames.
+ *
+ * Only one thread should call prof_end_frame, but stages can be timed from
+ * any thread, and the stats can be read from any thread without locking.
+ * The stats only look at the last PROF_WINDOW frames, so a reader would
+ * have to be a good few frames behind to see one being overwritten.
+ */
+
+#define PROF_INTEGRATE  0
+#define PROF_COLLIDE    1
+#define PROF_SCRIPTS    2
+#define PROF_DRAW       3
+#define PROF_FLIP       4
+/* The whole frame, from one prof_end_frame to the next */
+#define PROF_FRAME      5
+
+#define PROF_NUM_STAGES 6
+
+/* Must be a power of 2 */
+#define PROF_FRAMES     256
+/* Number of frames the stats are taken over, two seconds at 60hz */
+#define PROF_WINDOW     120
+
+typedef struct prof_frame_ prof_frame;
+struct prof_frame_ {
+    Uint64 ns[PROF_NUM_STAGES];
+};
+
+/*
+ * Time a stage. These open and close a block, so they have to be used in
+ * pairs within the same block, like so:
+ *   prof_start(PROF_DRAW);
+ *   render_bullets(screen, 320, 240);
+ *   prof_stop(PROF_DRAW);
+ * Each one also shows up in the trace as a slice named after the stage.
+ */
+#define prof_start(stage) { Uint64 _prof_start = clock_ns(); \
+                            trace_begin(prof_stage_name(stage))
+#define prof_stop(stage)  prof_add((stage), clock_ns() - _prof_start); \
+                          trace_end(prof_stage_name(stage)) }
+
+/* Add some time to a stage of the current frame */
+extern void prof_add(int stage, Uint64 ns);
+
+/* Finish the current frame and start the next one */
+extern void prof_end_frame(void);
+
+/* Forget all the frames so far */
+extern void prof_reset(void);
+
+/* Get the time of a stage in the last finished frame, 0 if there isn't one */
+extern Uint64 prof_last(int stage);
+
+/*
+ * Copy out up to max of the most recent finished frames, oldest first.
+ * Returns how many there were.
+ */
+extern int prof_history(prof_frame *dst, int max);
+
+/*
+ * Get the min, average and 99th percentile time of a stage over the last
+ * PROF_WINDOW frames, in nanoseconds. Returns the number of frames the
+ * stats were taken over, which is 0 if there aren't any yet.
+ */
+extern int prof_stats(int stage, Uint64 *min, Uint64 *avg, Uint64 *p99);
+
+/* Get the name of a stage */
+extern const char *prof_stage_name(int stage);
+
+/* Draw the stats for every stage, one line each. Returns the height */
+extern int prof_draw_overlay(SDL_Surface *dst, text_cache *tc, int x, int y);
+
+/*
+ * Write every frame in the ring to a CSV file, one row per frame with the
+ * time of each stage in nanoseconds. Returns FALSE if it couldn't.
+ */
+extern int prof_dump_csv(const char *filename);
+
+/* Start/stop functions */
+extern int  init_profile(void);
+extern void stop_profile(void);
+
+#endif /* !def PROFILE_H */
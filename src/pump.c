@@ -0,0 +1,244 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * pump.c
+ * Contains code for the event pump
+ */
+
+#include "compile.h"
+#include "debug.h"
+#include "pump.h"
+#include "timer.h"
+#include "trace.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#include "SDL/SDL_thread.h"
+#else
+#include "SDL.h"
+#include "SDL_thread.h"
+#endif
+
+typedef struct pumped_event_ pumped_event;
+struct pumped_event_ {
+    SDL_Event event;
+    Uint64    when;
+};
+
+/*
+ * The ring. pump_head is only written by the pump and pump_tail only by
+ * the consumer; both just count up, and get masked to index the ring.
+ */
+pumped_event    pump_ring[PUMP_RING];
+volatile Uint32 pump_head = 0;
+volatile Uint32 pump_tail = 0;
+
+/* When the last event handed out was gathered */
+Uint64 pump_last;
+
+/* Stats, only written by the pump */
+Uint32 pump_events  = 0;
+Uint32 pump_deepest = 0;
+Uint32 pump_stalls  = 0;
+
+int pump_kill = FALSE;
+
+#ifdef SDL_EVENT_THREAD
+SDL_Thread *pump_thread = NULL;
+
+/* Posted when the pump puts something in an empty ring, for pump_wait */
+SDL_sem    *pump_ready = NULL;
+/* Posted by pump_poll when the ring's empty, to get the pump looking */
+SDL_sem    *pump_wake = NULL;
+#endif
+
+/* Events to take off SDL's queue at a time */
+#define PUMP_BATCH 32
+
+/* Put an event in the ring, waiting for room if need be */
+void _pump_push(SDL_Event *event, Uint64 when)
+{
+    pumped_event *slot;
+    Uint32 depth;
+
+    while (pump_head - pump_tail >= PUMP_RING) {
+        ++pump_stalls;
+        SDL_Delay(PUMP_INTERVAL);
+        if (pump_kill) return;
+    }
+
+    slot = &pump_ring[pump_head & (PUMP_RING-1)];
+    slot->event = *event;
+    slot->when  = when;
+
+    /* Make sure the slot is written before the consumer can see it */
+    __sync_synchronize();
+    ++pump_head;
+
+    ++pump_events;
+    depth = pump_head - pump_tail;
+    if (depth > pump_deepest) pump_deepest = depth;
+}
+
+/* Move a batch of events off SDL's queue into the ring, returns how many */
+int _pump_gather(void)
+{
+    SDL_Event batch[PUMP_BATCH];
+    Uint64 now;
+    int i, n;
+
+    n = SDL_PeepEvents(batch, PUMP_BATCH, SDL_GETEVENT, SDL_ALLEVENTS);
+    if (n <= 0) return 0;
+
+    trace_begin("pump");
+    now = clock_ns();
+    for (i = 0; i < n; ++i) {
+        _pump_push(&batch[i], now);
+    }
+    trace_end("pump");
+
+    return n;
+}
+
+#ifdef SDL_EVENT_THREAD
+/* The pump thread function */
+int _pump_thread(void *data)
+{
+    Uint64 last;
+    Uint32 sleep = PUMP_INTERVAL;
+
+    trace_name_thread("pump");
+    last = clock_ns();
+
+    while (!pump_kill) {
+        if (_pump_gather() == 0) {
+            /* Events can turn up any time, but after a while, less often */
+            if (sleep < PUMP_IDLE &&
+                clock_ns() - last > (Uint64) PUMP_IDLE_AFTER * 1000000) {
+                sleep *= 2;
+            }
+            SDL_SemWaitTimeout(pump_wake, sleep);
+            continue;
+        }
+
+        last  = clock_ns();
+        sleep = PUMP_INTERVAL;
+
+        /* One post is enough to wake pump_wait, however many came in */
+        if (SDL_SemValue(pump_ready) == 0) {
+            SDL_SemPost(pump_ready);
+        }
+    }
+
+    thread_done();
+    return 0;
+}
+#endif
+
+/* Get the next event */
+int pump_poll(SDL_Event *event)
+{
+    pumped_event *slot;
+
+    if (pump_tail == pump_head) {
+#ifdef SDL_EVENT_THREAD
+        if (SDL_SemValue(pump_wake) == 0) {
+            SDL_SemPost(pump_wake);
+        }
+        return FALSE;
+#else
+        /*
+         * Nobody else is allowed to pump, so there's no pump thread; fetch
+         * them from the OS and gather them right here, as they arrive.
+         * The ring's empty, so there's always room for the first batch.
+         */
+        SDL_PumpEvents();
+        while (_pump_gather() == PUMP_BATCH &&
+               pump_head - pump_tail <= PUMP_RING - PUMP_BATCH) {}
+        if (pump_tail == pump_head) return FALSE;
+#endif
+    }
+
+    /* Make sure we don't read the slot before the pump's done with it */
+    __sync_synchronize();
+    slot = &pump_ring[pump_tail & (PUMP_RING-1)];
+    *event    = slot->event;
+    pump_last = slot->when;
+
+    __sync_synchronize();
+    ++pump_tail;
+
+    return TRUE;
+}
+
+/* Wait for the next event */
+int pump_wait(SDL_Event *event)
+{
+    while (!pump_poll(event)) {
+#ifdef SDL_EVENT_THREAD
+        SDL_SemWait(pump_ready);
+#else
+        /* Nothing's going to pump while we sleep, so like SDL_WaitEvent */
+        SDL_Delay(PUMP_WAIT);
+#endif
+    }
+
+    return TRUE;
+}
+
+/* Get the clock_ns the last event was gathered at */
+Uint64 pump_time(void)
+{
+    return pump_last;
+}
+
+/* Get the pump stats */
+void pump_stats(Uint32 *events, Uint32 *deepest, Uint32 *stalls)
+{
+    *events  = pump_events;
+    *deepest = pump_deepest;
+    *stalls  = pump_stalls;
+}
+
+/* Start/stop functions */
+int init_pump(void)
+{
+    pump_head = pump_tail = 0;
+    pump_events = pump_deepest = pump_stalls = 0;
+    pump_last = clock_ns();
+    pump_kill = FALSE;
+
+#ifdef SDL_EVENT_THREAD
+    pump_ready = SDL_CreateSemaphore(0);
+    pump_wake  = SDL_CreateSemaphore(0);
+    panic(pump_ready != NULL && pump_wake != NULL,
+          "Couldn't make the event pump semaphores");
+
+    pump_thread = SDL_CreateThread(_pump_thread, NULL);
+    panic(pump_thread != NULL, "Couldn't start the event pump");
+#endif
+
+    return 0;
+}
+
+void stop_pump(void)
+{
+    pump_kill = TRUE;
+
+#ifdef SDL_EVENT_THREAD
+    SDL_SemPost(pump_wake);
+    SDL_WaitThread(pump_thread, NULL);
+    pump_thread = NULL;
+
+    SDL_DestroySemaphore(pump_ready);
+    SDL_DestroySemaphore(pump_wake);
+    pump_ready = NULL;
+    pump_wake  = NULL;
+#endif
+}
@@ -0,0 +1,88 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * pump.h
+ * Contains definitions and prototypes for the event pump
+ */
+
+#ifndef PUMP_H
+
+#define PUMP_H
+
+#include "compile.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/*
+ * Events are taken off SDL's queue, stamped with clock_ns, and put in a
+ * ring for the main thread. If the ring fills up, the pump waits for room
+ * rather than dropping anything.
+ *
+ * Only the thread that set the video mode may call SDL_PumpEvents, which
+ * is what actually fetches events from the OS. With SDL_EVENT_THREAD set
+ * in compile.h, SDL does that on a thread of its own, and a pump thread
+ * of ours gathers them as they turn up. So they're timed as they come
+ * in, however long a frame takes, and SDL's own queue (only 128 events in
+ * 1.2) never fills up and starts dropping them. There's exactly one
+ * producer (the pump) and one consumer (whatever calls pump_poll, which
+ * must be the main thread), so the ring doesn't need any locks.
+ *
+ * SDL 1.2 has no way to wait for events off the video thread (SDL_WaitEvent
+ * pumps, and polls itself), so the pump looks every PUMP_INTERVAL ms
+ * while events are coming in, and backs off to every PUMP_IDLE ms once
+ * none have for PUMP_IDLE_AFTER ms. pump_poll finding the ring empty
+ * still wakes it straight away. SDL's own thread polls every few ms
+ * regardless, so that mode never gets all the way to nothing.
+ *
+ * Without SDL_EVENT_THREAD nothing can turn up until the main thread
+ * pumps, so a pump thread would only add a frame of lag. There isn't one:
+ * pump_poll pumps and gathers into the ring itself whenever it runs dry,
+ * so events are handed out in the same call, as SDL_PollEvent would.
+ *
+ * Once init_pump has been called, everything should get its events from
+ * pump_poll/pump_wait, never SDL_PollEvent, or the two will fight.
+ */
+
+/* Must be a power of 2 */
+#define PUMP_RING     1024
+#define PUMP_INTERVAL 1
+/* See above, both in ms */
+#define PUMP_IDLE     32
+#define PUMP_IDLE_AFTER 250
+/*
+ * How long pump_wait sleeps between SDL_PumpEvents calls without
+ * SDL_EVENT_THREAD, in ms, like SDL_WaitEvent. With it, pump_wait just sleeps until the pump
+ * has something.
+ */
+#define PUMP_WAIT     10
+
+/* Get the next event, like SDL_PollEvent. Returns FALSE if there isn't one */
+extern int pump_poll(SDL_Event *event);
+
+/* Wait for the next event, like SDL_WaitEvent */
+extern int pump_wait(SDL_Event *event);
+
+/* Get the clock_ns the last event from pump_poll was gathered at */
+extern Uint64 pump_time(void);
+
+/*
+ * Get the number of events pumped so far, the most ever waiting in the
+ * ring at once, and the number of times the pump had to wait for room
+ */
+extern void pump_stats(Uint32 *events, Uint32 *deepest, Uint32 *stalls);
+
+/* Start/stop functions */
+extern int  init_pump(void);
+extern void stop_pump(void);
+
+#endif /* !def PUMP_H */
@@ -0,0 +1,653 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * render.c
+ * Contains code for the threaded bullet renderer
+ */
+
+#include "compile.h"
+#include "bullet.h"
+#include "debug.h"
+#include "profile.h"
+#include "render.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#include "SDL/SDL_thread.h"
+#else
+#include "SDL.h"
+#include "SDL_thread.h"
+#endif
+
+typedef struct render_strip_ render_strip;
+struct render_strip_ {
+    /* Rows [top, bottom) of the screen belong to this strip */
+    int top;
+    int bottom;
+
+    /* Bullets to draw, by index into bullet_mem */
+    int    count;
+    Uint16 bins[8192];
+
+    /* Worker thread and its wakeup call (unused for strip 0) */
+    SDL_Thread *thread;
+    SDL_sem    *go;
+};
+
+render_strip strips[RENDER_MAX_THREADS];
+int num_strips = 1;
+
+/* Posted once by each worker when its strip is finished */
+SDL_sem *strips_done;
+
+/* Set when the workers should exit */
+int render_kill = FALSE;
+
+/* Current frame information, only written while the workers are idle */
+SDL_Surface *frame_screen;
+int frame_center_x;
+int frame_center_y;
+float frame_alpha;
+
+/*
+ * Sprite spans
+ * Bullet sprites are mostly colour key, so for every sprite made with
+ * cut_sprite we remember where the opaque runs are in each row. Blitting
+ * with these only ever reads the pixels that actually get drawn, instead
+ * of reading every pixel and comparing it against the key.
+ */
+typedef struct sprite_span_ sprite_span;
+struct sprite_span_ {
+    Uint16 x;
+    Uint16 len;
+};
+
+typedef struct sprite_spans_ sprite_spans;
+struct sprite_spans_ {
+    sprite_spans *next;
+    SDL_Surface  *img;
+
+    /* Spans of row j are spans[rows[j]] up to spans[rows[j+1]] */
+    int          *rows;
+    sprite_span  *spans;
+    int           count;
+    int           opaque;
+};
+
+#define SPAN_HASH_SIZE 256
+#define span_hash_of(img) ((((size_t)(img)) >> 4) & (SPAN_HASH_SIZE-1))
+
+sprite_spans *span_hash[SPAN_HASH_SIZE];
+SDL_mutex    *span_lock;
+int           use_spans = TRUE;
+
+/* Skip drawing NO_COLLIDE bullets */
+int shed_decor = FALSE;
+
+/* Spans for each bullet this frame, looked up while binning */
+sprite_spans *frame_spans[8192];
+
+/*
+ * Draw a colour-keyed sprite onto a 32-bit surface, clipped to the rows
+ * [top, bottom). Both surfaces must have the same pixel format, which is
+ * always true for sprites made from SDL_DisplayFormat'd sheets. The sprite
+ * also has to be a software surface, since we read its pixels directly.
+ */
+void _blit_clipped(SDL_Surface *src, SDL_Surface *dst, int x, int y,
+                   int top, int bottom)
+{
+    int sx, sy, w, h, i, j;
+    Uint32 key;
+    Uint32 *srow, *drow;
+    int keyed;
+
+    sx = 0;
+    sy = 0;
+    w  = src->w;
+    h  = src->h;
+
+    /* Clip against the left and right edges of the screen */
+    if (x < 0) {
+        sx = -x;
+        w += x;
+        x  = 0;
+    }
+    if (x + w > dst->w) {
+        w = dst->w - x;
+    }
+
+    /* Clip against the strip */
+    if (y < top) {
+        sy = top - y;
+        h -= sy;
+        y  = top;
+    }
+    if (y + h > bottom) {
+        h = bottom - y;
+    }
+
+    if (w <= 0 || h <= 0) return;
+
+    keyed = src->flags & SDL_SRCCOLORKEY;
+    key   = src->format->colorkey;
+
+    for (j = 0; j < h; ++j) {
+        srow = (Uint32*)((Uint8*)src->pixels + (sy+j)*src->pitch) + sx;
+        drow = (Uint32*)((Uint8*)dst->pixels + (y+j)*dst->pitch) + x;
+        if (keyed) {
+            for (i = 0; i < w; ++i) {
+                if (srow[i] != key) {
+                    drow[i] = srow[i];
+                }
+            }
+        }
+        else {
+            memcpy(drow, srow, w*sizeof(Uint32));
+        }
+    }
+}
+
+/*
+ * Same as _blit_clipped, but only touches the opaque runs of the sprite.
+ */
+void _blit_spans(sprite_spans *sp, SDL_Surface *dst, int x, int y,
+                 int top, int bottom)
+{
+    SDL_Surface *src = sp->img;
+    int sx, sy, w, h, j, k, a, b;
+    Uint32 *srow, *drow;
+    sprite_span *span;
+
+    sx = 0;
+    sy = 0;
+    w  = src->w;
+    h  = src->h;
+
+    if (x < 0) {
+        sx = -x;
+        w += x;
+        x  = 0;
+    }
+    if (x + w > dst->w) {
+        w = dst->w - x;
+    }
+    if (y < top) {
+        sy = top - y;
+        h -= sy;
+        y  = top;
+    }
+    if (y + h > bottom) {
+        h = bottom - y;
+    }
+
+    if (w <= 0 || h <= 0) return;
+
+    for (j = 0; j < h; ++j) {
+        srow = (Uint32*)((Uint8*)src->pixels + (sy+j)*src->pitch);
+        drow = (Uint32*)((Uint8*)dst->pixels + (y+j)*dst->pitch) + x;
+        for (k = sp->rows[sy+j]; k < sp->rows[sy+j+1]; ++k) {
+            span = &sp->spans[k];
+
+            /* Clip the run to the visible columns [sx, sx+w) */
+            a = span->x;
+            b = span->x + span->len;
+            if (a < sx) a = sx;
+            if (b > sx + w) b = sx + w;
+            if (a >= b) continue;
+
+            memcpy(drow + (a-sx), srow + a, (b-a)*sizeof(Uint32));
+        }
+    }
+}
+
+/* Where to draw a bullet, frame_alpha of the way from its snapshot */
+void _frame_pos(int i, float *x, float *y)
+{
+    bullet *bul = &bullet_mem[i];
+
+    if (frame_alpha >= 1.0F) {
+        *x = bul->centerx;
+        *y = bul->centery;
+    }
+    else {
+        *x = bullet_prev[i].x + (bul->centerx - bullet_prev[i].x) * frame_alpha;
+        *y = bullet_prev[i].y + (bul->centery - bullet_prev[i].y) * frame_alpha;
+    }
+}
+
+/* Draw everything binned into a strip */
+void _draw_strip(render_strip *strip)
+{
+    int i, x, y;
+    float fx, fy;
+    bullet *bul;
+
+    for (i = 0; i < strip->count; ++i) {
+        bul = &bullet_mem[strip->bins[i]];
+        _frame_pos(strip->bins[i], &fx, &fy);
+        x = (int)(fx + bul->drawlocx + frame_center_x);
+        y = (int)(fy + bul->drawlocy + frame_center_y);
+        if (frame_spans[strip->bins[i]] != NULL) {
+            _blit_spans(frame_spans[strip->bins[i]], frame_screen, x, y,
+                        strip->top, strip->bottom);
+        }
+        else {
+            _blit_clipped(bul->img, frame_screen, x, y,
+                          strip->top, strip->bottom);
+        }
+    }
+}
+
+/* The worker thread function, one per strip other than the first */
+int _render_worker(void *data)
+{
+    render_strip *me = (render_strip*) data;
+
+    trace_name_thread("render");
+
+    while (TRUE) {
+        SDL_SemWait(me->go);
+        if (render_kill) break;
+        trace_begin("strip");
+        _draw_strip(me);
+        trace_end("strip");
+        SDL_SemPost(strips_done);
+    }
+
+    thread_done();
+    return 0;
+}
+
+/* Stop all the worker threads */
+void _stop_workers(void)
+{
+    int i;
+
+    render_kill = TRUE;
+    for (i = 1; i < num_strips; ++i) {
+        SDL_SemPost(strips[i].go);
+    }
+    for (i = 1; i < num_strips; ++i) {
+        SDL_WaitThread(strips[i].thread, NULL);
+        SDL_DestroySemaphore(strips[i].go);
+        strips[i].thread = NULL;
+    }
+    render_kill = FALSE;
+}
+
+/* Set the number of strips (and thus threads) to draw with */
+void render_set_threads(int n)
+{
+    int i;
+
+    if (n < 1) n = 1;
+    if (n > RENDER_MAX_THREADS) n = RENDER_MAX_THREADS;
+    if (n == num_strips) return;
+
+    _stop_workers();
+
+    num_strips = n;
+    for (i = 1; i < num_strips; ++i) {
+        strips[i].go = SDL_CreateSemaphore(0);
+        strips[i].thread = SDL_CreateThread(_render_worker, &strips[i]);
+        panicn(strips[i].thread != NULL, "Couldn't start render thread", i);
+    }
+
+    debugn("Rendering with threads:", num_strips);
+}
+
+int render_get_threads(void)
+{
+    return num_strips;
+}
+
+/* Find the spans for a sprite, NULL if it has none. Call with span_lock */
+sprite_spans *_find_spans(SDL_Surface *img)
+{
+    sprite_spans *sp;
+
+    for (sp = span_hash[span_hash_of(img)]; sp != NULL; sp = sp->next) {
+        if (sp->img == img) return sp;
+    }
+
+    return NULL;
+}
+
+/* Work out the opaque runs of a 32-bit colour-keyed sprite */
+sprite_spans *_make_spans(SDL_Surface *img)
+{
+    sprite_spans *sp;
+    Uint32 *row;
+    Uint32 key;
+    int i, j, start, max;
+
+    sp = (sprite_spans*) malloc(sizeof(sprite_spans));
+    panic(sp != NULL, "Couldn't allocate sprite spans");
+
+    /* A row can't have more runs than half its width, rounded up */
+    max = img->h * ((img->w + 1) / 2);
+    sp->img    = img;
+    sp->rows   = (int*) malloc((img->h + 1) * sizeof(int));
+    sp->spans  = (sprite_span*) malloc((max > 0 ? max : 1) * sizeof(sprite_span));
+    sp->count  = 0;
+    sp->opaque = 0;
+    panic(sp->rows != NULL && sp->spans != NULL,
+          "Couldn't allocate sprite spans");
+
+    key = img->format->colorkey;
+
+    for (j = 0; j < img->h; ++j) {
+        row = (Uint32*)((Uint8*)img->pixels + j*img->pitch);
+        sp->rows[j] = sp->count;
+        i = 0;
+        while (i < img->w) {
+            /* Skip over the transparent run */
+            while (i < img->w && row[i] == key) ++i;
+            if (i >= img->w) break;
+
+            /* And record the opaque one */
+            start = i;
+            while (i < img->w && row[i] != key) ++i;
+            sp->spans[sp->count].x   = (Uint16) start;
+            sp->spans[sp->count].len = (Uint16) (i - start);
+            ++sp->count;
+            sp->opaque += i - start;
+        }
+    }
+    sp->rows[img->h] = sp->count;
+
+    return sp;
+}
+
+/*
+ * Cut a sprite out of a sheet, with (255,0,255) as the colour key. If it's
+ * 32-bit we keep its spans for the threaded renderer; anything else gets
+ * SDL's own RLE acceleration, since it will be drawn with SDL_BlitSurface.
+ */
+SDL_Surface *cut_sprite(SDL_Surface *sheet, SDL_Rect *rect)
+{
+    SDL_Surface *img;
+    SDL_PixelFormat *fmt = sheet->format;
+    SDL_Rect src = *rect;
+    sprite_spans *sp;
+    Uint32 colorkey;
+    int r;
+
+    img = SDL_CreateRGBSurface(SDL_SWSURFACE, rect->w, rect->h,
+            fmt->BitsPerPixel, fmt->Rmask, fmt->Gmask, fmt->Bmask, fmt->Amask);
+    panic(img != NULL, "Couldn't create sprite surface");
+    SDL_BlitSurface(sheet, &src, img, NULL);
+
+    colorkey = SDL_MapRGBA(img->format, 255, 0, 255, SDL_ALPHA_OPAQUE);
+
+    if (img->format->BytesPerPixel != 4) {
+        SDL_SetColorKey(img, SDL_SRCCOLORKEY | SDL_RLEACCEL, colorkey);
+        return img;
+    }
+
+    SDL_SetColorKey(img, SDL_SRCCOLORKEY, colorkey);
+    sp = _make_spans(img);
+
+    r = SDL_mutexP(span_lock);
+    check_mutex(r);
+    sp->next = span_hash[span_hash_of(img)];
+    span_hash[span_hash_of(img)] = sp;
+    r = SDL_mutexV(span_lock);
+    check_mutex(r);
+
+    return img;
+}
+
+/*
+ * Cut a sprite out of a sheet again, over the top of one made with
+ * cut_sprite from the same rect, so anything pointing at it gets the new
+ * one. Used when the sheet's been reloaded. Don't call it while drawing.
+ */
+void recut_sprite(SDL_Surface *img, SDL_Surface *sheet, SDL_Rect *rect)
+{
+    sprite_spans **link, *sp, *old = NULL;
+    SDL_Rect src = *rect;
+    Uint32 colorkey;
+    int r;
+
+    /* Take the key (and any RLE) off while it's drawn over */
+    colorkey = img->format->colorkey;
+    SDL_SetColorKey(img, 0, 0);
+    SDL_FillRect(img, NULL, colorkey);
+    SDL_BlitSurface(sheet, &src, img, NULL);
+
+    if (img->format->BytesPerPixel != 4) {
+        SDL_SetColorKey(img, SDL_SRCCOLORKEY | SDL_RLEACCEL, colorkey);
+        return;
+    }
+
+    SDL_SetColorKey(img, SDL_SRCCOLORKEY, colorkey);
+    sp = _make_spans(img);
+
+    r = SDL_mutexP(span_lock);
+    check_mutex(r);
+    for (link = &span_hash[span_hash_of(img)]; *link != NULL;
+         link = &(*link)->next) {
+        if ((*link)->img == img) {
+            old = *link;
+            *link = old->next;
+            break;
+        }
+    }
+    sp->next = span_hash[span_hash_of(img)];
+    span_hash[span_hash_of(img)] = sp;
+    r = SDL_mutexV(span_lock);
+    check_mutex(r);
+
+    if (old != NULL) {
+        free(old->rows);
+        free(old->spans);
+        free(old);
+    }
+}
+
+/* Free a sprite made with cut_sprite, along with its spans */
+void free_sprite(SDL_Surface *img)
+{
+    sprite_spans **link, *sp;
+    int r;
+
+    if (img == NULL) return;
+
+    r = SDL_mutexP(span_lock);
+    check_mutex(r);
+    for (link = &span_hash[span_hash_of(img)]; *link != NULL;
+         link = &(*link)->next) {
+        if ((*link)->img == img) {
+            sp = *link;
+            *link = sp->next;
+            free(sp->rows);
+            free(sp->spans);
+            free(sp);
+            break;
+        }
+    }
+    r = SDL_mutexV(span_lock);
+    check_mutex(r);
+
+    SDL_FreeSurface(img);
+}
+
+/* Get the opaque pixel and span counts of a sprite */
+int sprite_stats(SDL_Surface *img, int *opaque, int *spans)
+{
+    sprite_spans *sp;
+    int r, found;
+
+    r = SDL_mutexP(span_lock);
+    check_mutex(r);
+    sp = _find_spans(img);
+    found = (sp != NULL);
+    if (found) {
+        *opaque = sp->opaque;
+        *spans  = sp->count;
+    }
+    r = SDL_mutexV(span_lock);
+    check_mutex(r);
+
+    return found;
+}
+
+/* Turn span blitting on or off, for comparison */
+void render_set_spans(int on)
+{
+    use_spans = on;
+}
+
+int render_get_spans(void)
+{
+    return use_spans;
+}
+
+/* Turn shedding on or off */
+void render_set_shed(int on)
+{
+    shed_decor = on;
+}
+
+int render_get_shed(void)
+{
+    return shed_decor;
+}
+
+/* Does the actual work of render_bullets */
+void _render_bullets(SDL_Surface *screen, int center_x, int center_y,
+                     float alpha)
+{
+    int i, s, r, top, last, strip_h;
+    float fx, fy;
+    bullet *bul;
+    SDL_Surface  *lastimg = NULL;
+    sprite_spans *lastspans = NULL;
+    SDL_Rect drawdst;
+
+    frame_alpha = alpha;
+
+    /* Can't split it up, draw it the old-fashioned way */
+    if (screen->format->BytesPerPixel != 4 || (screen->flags & SDL_HWSURFACE)) {
+        for (i = 0; i < 8192; ++i) {
+            bul = &bullet_mem[i];
+            if (!is_alive(bul)) continue;
+            if (shed_decor && is_nocoll(bul)) continue;
+
+            _frame_pos(i, &fx, &fy);
+            drawdst.x = (int)(fx + bul->drawlocx + center_x);
+            drawdst.y = (int)(fy + bul->drawlocy + center_y);
+            SDL_BlitSurface(bul->img, NULL, screen, &drawdst);
+        }
+        return;
+    }
+
+    /* Set up the strips */
+    strip_h = (screen->h + num_strips - 1) / num_strips;
+    for (s = 0; s < num_strips; ++s) {
+        strips[s].top    = s * strip_h;
+        strips[s].bottom = (s+1) * strip_h;
+        if (strips[s].bottom > screen->h) {
+            strips[s].bottom = screen->h;
+        }
+        strips[s].count = 0;
+    }
+
+    /* Bin all the bullets */
+    r = SDL_mutexP(span_lock);
+    check_mutex(r);
+    for (i = 0; i < 8192; ++i) {
+        bul = &bullet_mem[i];
+        if (!is_alive(bul)) continue;
+        if (shed_decor && is_nocoll(bul)) continue;
+
+        /* Bullets of the same type tend to be next to each other */
+        if (bul->img != lastimg) {
+            lastimg   = bul->img;
+            lastspans = use_spans ? _find_spans(lastimg) : NULL;
+        }
+        frame_spans[i] = lastspans;
+
+        _frame_pos(i, &fx, &fy);
+        top  = (int)(fy + bul->drawlocy + center_y);
+        last = top + bul->img->h - 1;
+        if (last < 0 || top >= screen->h) continue;
+        if (top < 0) top = 0;
+        if (last >= screen->h) last = screen->h - 1;
+
+        for (s = top / strip_h; s <= last / strip_h; ++s) {
+            strips[s].bins[strips[s].count++] = (Uint16) i;
+        }
+    }
+    r = SDL_mutexV(span_lock);
+    check_mutex(r);
+
+    if (SDL_MUSTLOCK(screen)) {
+        SDL_LockSurface(screen);
+    }
+
+    frame_screen   = screen;
+    frame_center_x = center_x;
+    frame_center_y = center_y;
+
+    /* Wake everybody up, then do our own share */
+    for (s = 1; s < num_strips; ++s) {
+        SDL_SemPost(strips[s].go);
+    }
+    trace_begin("strip");
+    _draw_strip(&strips[0]);
+    trace_end("strip");
+    for (s = 1; s < num_strips; ++s) {
+        SDL_SemWait(strips_done);
+    }
+
+    if (SDL_MUSTLOCK(screen)) {
+        SDL_UnlockSurface(screen);
+    }
+}
+
+/* Draw every live bullet onto the screen */
+void render_bullets(SDL_Surface *screen, int center_x, int center_y)
+{
+    prof_start(PROF_DRAW);
+    _render_bullets(screen, center_x, center_y, 1.0F);
+    prof_stop(PROF_DRAW);
+}
+
+/* Draw every live bullet alpha of the way from its snapshot */
+void render_bullets_lerp(SDL_Surface *screen, int center_x, int center_y,
+                         float alpha)
+{
+    prof_start(PROF_DRAW);
+    _render_bullets(screen, center_x, center_y, alpha);
+    prof_stop(PROF_DRAW);
+}
+
+/* Start/stop functions */
+int init_render(void)
+{
+    strips_done = SDL_CreateSemaphore(0);
+    span_lock = SDL_CreateMutex();
+    num_strips = 1;
+    render_kill = FALSE;
+
+    return 0;
+}
+
+void stop_render(void)
+{
+    _stop_workers();
+    num_strips = 1;
+    SDL_DestroySemaphore(strips_done);
+    SDL_DestroyMutex(span_lock);
+}
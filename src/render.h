@@ -0,0 +1,96 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * render.h
+ * Contains function prototypes for the threaded bullet renderer
+ */
+
+#ifndef RENDER_H
+
+#define RENDER_H
+
+#include "compile.h"
+#include "bullet.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/*
+ * The screen is cut up into horizontal strips, one per thread. After the
+ * bullets have been processed, render_bullets bins every live bullet into
+ * the strip(s) it touches, and each strip is drawn by its own thread. The
+ * calling thread always draws the first strip itself, so with one thread
+ * nothing is spawned at all.
+ *
+ * Sprites that straddle a strip edge are put in both bins and clipped to
+ * each strip, so no two threads ever write the same row. Within a strip,
+ * bullets are drawn in bullet_mem order, same as the serial draw loop, so
+ * overlapping bullets come out the same either way.
+ *
+ * Only 32-bit software screens can be split up; anything else falls back
+ * to plain draw_bullet calls on the calling thread.
+ *
+ * Sprites should be made with cut_sprite, which records the opaque runs in
+ * each row so that blits skip over the transparent parts entirely. Other
+ * surfaces still work, they just get compared against the colour key one
+ * pixel at a time.
+ */
+
+#define RENDER_MAX_THREADS 8
+
+/* Set/get the number of strips (and thus threads) to draw with */
+extern void render_set_threads(int n);
+extern int  render_get_threads(void);
+
+/* Turn span blitting on or off, for comparison */
+extern void render_set_spans(int on);
+extern int  render_get_spans(void);
+
+/*
+ * Turn shedding on or off. While it's on, bullets marked NO_COLLIDE aren't
+ * drawn at all; the budget controller does this when frames run long.
+ */
+extern void render_set_shed(int on);
+extern int  render_get_shed(void);
+
+/* Cut a (255,0,255) colour-keyed sprite out of a sheet */
+extern SDL_Surface *cut_sprite(SDL_Surface *sheet, SDL_Rect *rect);
+
+/* Cut a sprite again over the top of one made with cut_sprite */
+extern void recut_sprite(SDL_Surface *img, SDL_Surface *sheet,
+                         SDL_Rect *rect);
+
+/* Free a sprite made with cut_sprite */
+extern void free_sprite(SDL_Surface *img);
+
+/*
+ * Get the number of opaque pixels and runs in a sprite made with
+ * cut_sprite. Returns FALSE if the sprite has no spans.
+ */
+extern int sprite_stats(SDL_Surface *img, int *opaque, int *spans);
+
+/* Draw every live bullet onto the screen */
+extern void render_bullets(SDL_Surface *screen, int center_x, int center_y);
+
+/*
+ * Draw every live bullet alpha of the way from where it was at the last
+ * snapshot_bullets to where it is now. An alpha of 1 is the same as
+ * render_bullets.
+ */
+extern void render_bullets_lerp(SDL_Surface *screen, int center_x,
+                                int center_y, float alpha);
+
+/* Start/stop functions */
+extern int  init_render(void);
+extern void stop_render(void);
+
+#endif /* !def RENDER_H */
@@ -15,7 +15,10 @@
 
 #include "compile.h"
 #include "debug.h"
+#include "metrics.h"
 #include "resource.h"
+#include "timer.h"
+#include "trace.h"
 #include <archive.h>
 #include <archive_entry.h>
 #include <ctype.h>
@@ -23,6 +26,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #ifdef INCLUDE_SDL_PREFIX
 #include "SDL/SDL.h"
 #include "SDL/SDL_thread.h"
@@ -69,9 +83,9 @@ char *get_ext(char *a)
 }
 
 /* 
- * Jenkins one-at-a-time hash 
+ * FNV-1a hash
  * NOTE TO SELF: If I ever change this algorithm, be sure
- * to change the precalculated hashes in resource.h!
+ * to change the precalculated hashes and SID in resource.h!
  */
 sid_t calculate_sid(char *string)
 {
@@ -83,22 +97,449 @@ sid_t calculate_sid(char *string)
      */
 
     /* Not much to say here. This is the algorithm. */
-    for (hash = i = 0; string[i] != '\0'; ++i) {
-        hash += string[i];
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
+    for (hash = SID_BASIS, i = 0; string[i] != '\0'; ++i) {
+        hash ^= (Uint8)string[i];
+        hash *= SID_PRIME;
     }
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
 
     return (sid_t)hash;
 }
 
-/* arclist chain */
-arclist *arc_head = NULL;
+/* The same thing for data that isn't a string */
+Uint32 calculate_hash(const void *data, size_t size)
+{
+    const Uint8 *bytes = (const Uint8*) data;
+    Uint32 hash;
+    size_t i;
+    
+    for (hash = SID_BASIS, i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= SID_PRIME;
+    }
+    
+    return hash;
+}
+
+/* Work out what type of resource a file is from its extension */
+restype get_restype(char *name)
+{
+    switch (calculate_sid(get_ext(name))) {
+        case PNG_HASH:
+            debug("Filetype is PNG");
+            return RES_IMAGE;
+        case BIN_HASH:
+            debug("Filetype is BIN");
+            return RES_BINARY;
+        case MID_HASH:
+            debug("Filetype is MID");
+            return RES_MIDI;
+        case OGG_HASH:
+            debug("Filetype is OGG");
+            return RES_SOUND;
+        case LUA_HASH:
+            debug("Filetype is LUA");
+            return RES_SCRIPT;
+        case TXT_HASH:
+            debug("Filetype is TXT");
+            return RES_STRING;
+        case MAP_HASH:
+            debug("Filetype is MAP");
+            return RES_MAP;
+        default:
+            debug("Filetype is unrecognized (this is not an error)");
+            return RES_OTHER;
+    }
+}
+
+/*
+ * sid_table
+ * See resource.h. Tables are never more than 3/4 full, so there's
+ * always an empty slot to end a search.
+ *
+ * This leans on loads of a pointer being ordered after the load of the
+ * pointer they came from, which every CPU we'll ever run on does. The
+ * other way around, stores get an explicit barrier.
+ */
+#define _read_once(x) (*(volatile __typeof__(x) *)&(x))
+
+sid_array *_sid_array_new(Uint32 buckets)
+{
+    sid_array *array;
+    
+    /* The buckets go after the header, lined up with the cache lines */
+    array = malloc(sizeof(sid_array) + CACHE_LINE +
+                   buckets * sizeof(sid_bucket));
+    panic(array, "Couldn't allocate memory for sid_table");
+    
+    array->buckets = (sid_bucket*)(((size_t)(array + 1) + CACHE_LINE - 1) &
+                                   ~(size_t)(CACHE_LINE - 1));
+    memset(array->buckets, 0, buckets * sizeof(sid_bucket));
+    array->mask    = buckets - 1;
+    array->retired = NULL;
+    
+    return array;
+}
+
+/* Free the arrays a table has grown out of */
+void _sid_array_free_retired(sid_array *array)
+{
+    sid_array *old;
+    
+    while (array->retired) {
+        old = array->retired;
+        array->retired = old->retired;
+        free(old);
+    }
+}
+
+void sid_table_init(sid_table *t, Uint32 size, char *(*name_of)(void *item))
+{
+    Uint32 buckets;
+    
+    /* Round up to a power of 2 */
+    for (buckets = 1; buckets < size; buckets <<= 1);
+    
+    t->name_of = name_of;
+    t->count   = 0;
+    t->array   = _sid_array_new(buckets);
+}
+
+void sid_array_free(sid_array *array)
+{
+    if (array == NULL) {
+        return;
+    }
+    _sid_array_free_retired(array);
+    free(array);
+}
+
+void sid_table_free(sid_table *t)
+{
+    sid_array_free(t->array);
+    t->array = NULL;
+    t->count = 0;
+}
+
+sid_array *sid_table_detach(sid_table *t)
+{
+    sid_array *old, *array;
+    
+    old   = t->array;
+    array = _sid_array_new(old->mask + 1);
+    
+    /* Readers can't see the new array before it's empty */
+    __sync_synchronize();
+    t->array = array;
+    t->count = 0;
+    
+    return old;
+}
+
+void *sid_table_find(sid_table *t, sid_t id, char *name)
+{
+    sid_array *array;
+    sid_bucket *bucket;
+    char *itemname;
+    void *item;
+    Uint32 i, j;
+    
+    array = _read_once(t->array);
+    for (i = id & array->mask; ; i = (i + 1) & array->mask) {
+        bucket = &(array->buckets[i]);
+        for (j = 0; j < SID_BUCKET_SLOTS; ++j) {
+            item = _read_once(bucket->item[j]);
+            if (item == NULL) {
+                return NULL;
+            }
+            
+            /*
+             * If the item's only just gone in, the id might not look like
+             * it has yet, which just makes this a miss
+             * Interned names usually save us the strcmp
+             */
+            if (_read_once(bucket->id[j]) == id) {
+                itemname = t->name_of(item);
+                if (itemname == name || strcmp(itemname, name) == 0) {
+                    return item;
+                }
+            }
+        }
+    }
+}
+
+/* Put an item in the first empty slot, there has to be one */
+void _sid_array_place(sid_array *array, sid_t id, void *item)
+{
+    sid_bucket *bucket;
+    Uint32 i, j;
+    
+    for (i = id & array->mask; ; i = (i + 1) & array->mask) {
+        bucket = &(array->buckets[i]);
+        for (j = 0; j < SID_BUCKET_SLOTS; ++j) {
+            if (bucket->item[j] == NULL) {
+                /* Readers can't see the item before its id */
+                bucket->id[j] = id;
+                __sync_synchronize();
+                bucket->item[j] = item;
+                return;
+            }
+        }
+    }
+}
+
+void sid_table_insert(sid_table *t, sid_t id, void *item)
+{
+    sid_array *old, *array;
+    sid_bucket *bucket;
+    Uint32 i, j;
+    
+    old = t->array;
+    
+    /* Double it if it'd be more than 3/4 full */
+    if ((t->count + 1) * 4 > (old->mask + 1) * SID_BUCKET_SLOTS * 3) {
+        array = _sid_array_new((old->mask + 1) * 2);
+        for (i = 0; i <= old->mask; ++i) {
+            bucket = &(old->buckets[i]);
+            for (j = 0; j < SID_BUCKET_SLOTS; ++j) {
+                if (bucket->item[j] != NULL) {
+                    _sid_array_place(array, bucket->id[j], bucket->item[j]);
+                }
+            }
+        }
+        
+        /* Swap it in, readers might still be in the old one */
+        array->retired = old;
+        __sync_synchronize();
+        t->array = array;
+    }
+    
+    _sid_array_place(t->array, id, item);
+    ++(t->count);
+}
+
+void *sid_table_next(sid_table *t, Uint32 *pos)
+{
+    sid_array *array;
+    void *item;
+    
+    array = t->array;
+    while (*pos < (array->mask + 1) * SID_BUCKET_SLOTS) {
+        item = array->buckets[*pos / SID_BUCKET_SLOTS].
+                   item[*pos % SID_BUCKET_SLOTS];
+        ++(*pos);
+        if (item != NULL) {
+            return item;
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * Interned names
+ * Copied into big blocks that stay around until stop_resources, names
+ * are never needed back and there won't be all that many of them.
+ */
+#define INTERN_BLOCK 4096
+
+typedef struct intern_block_ intern_block;
+struct intern_block_ {
+    intern_block *next;
+    size_t        used;
+    size_t        size;
+};
+
+intern_block *intern_head = NULL;
+sid_table     intern_table;
+SDL_mutex    *intern_lock;
+
+char *_name_of_string(void *item)
+{
+    return (char*)item;
+}
+
+char *intern_name(char *name, sid_t id)
+{
+    intern_block *block;
+    char *interned;
+    size_t len;
+    int r;
+    
+    r = SDL_mutexP(intern_lock);
+    check_mutex(r);
+    
+    interned = sid_table_find(&intern_table, id, name);
+    if (interned == NULL) {
+        len = strlen(name) + 1;
+        
+        /* Start a new block if it won't fit, long names get their own */
+        if (intern_head == NULL ||
+            intern_head->used + len > intern_head->size) {
+            block = malloc(sizeof(intern_block) +
+                           (len > INTERN_BLOCK ? len : INTERN_BLOCK));
+            panic2(block, "Couldn't allocate memory to intern name", name);
+            block->next = intern_head;
+            block->used = 0;
+            block->size = len > INTERN_BLOCK ? len : INTERN_BLOCK;
+            intern_head = block;
+        }
+        
+        /* The names go right after the block header */
+        interned = (char*)(intern_head + 1) + intern_head->used;
+        intern_head->used += len;
+        memcpy(interned, name, len);
+        
+        sid_table_insert(&intern_table, id, interned);
+    }
+    
+    r = SDL_mutexV(intern_lock);
+    check_mutex(r);
+    
+    return interned;
+}
+
+/*
+ * Load arenas
+ * A tarball's resources and their data are carved out of big blocks that
+ * belong to its arclist, instead of getting a malloc each. They all go
+ * at once anyway, when the archive's freed (and no lookup can still be in
+ * them, see Retiring below), and then the blocks are kept spare for the
+ * next archive, so loading one that's about the same size as the last
+ * doesn't touch the heap at all. Only one thread allocates from an arena
+ * at once: the loader thread while the archive's being read in, and
+ * reload_arc after that.
+ */
+struct arena_block_ {
+    arena_block *next;
+    size_t       used;
+    size_t       size;
+};
+
+/* Everything handed out is aligned to this, and so is the block header */
+#define ARENA_ALIGN  16
+#define ARENA_HEADER ((sizeof(arena_block) + ARENA_ALIGN - 1) & \
+                      ~(size_t)(ARENA_ALIGN - 1))
+
+arena_block *arena_spare = NULL;
+int          arena_spares = 0;
+SDL_mutex   *arena_lock;
+
+/* Heap allocations made while loading, and bytes held by arenas */
+volatile Uint32 res_allocs = 0;
+volatile size_t res_arena  = 0;
+
+void *_arena_alloc(arclist *arc, size_t n)
+{
+    arena_block *block, **prev;
+    size_t size;
+    void *ptr;
+    int r;
+    
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    
+    block = arc->arena;
+    if (block == NULL || block->used + n > block->size) {
+        /* Use a spare block if there's one big enough */
+        r = SDL_mutexP(arena_lock);
+        check_mutex(r);
+        for (prev = &arena_spare; *prev != NULL; prev = &((*prev)->next)) {
+            if ((*prev)->size >= n) break;
+        }
+        block = *prev;
+        if (block != NULL) {
+            *prev = block->next;
+            --arena_spares;
+        }
+        r = SDL_mutexV(arena_lock);
+        check_mutex(r);
+        
+        /* If not, make one, big entries get one of their own */
+        if (block == NULL) {
+            size  = n > LOAD_ARENA_BLOCK ? n : LOAD_ARENA_BLOCK;
+            block = malloc(ARENA_HEADER + size);
+            panic2(block, "Couldn't allocate memory to load archive",
+                   arc->name);
+            block->size = size;
+            __sync_fetch_and_add(&res_allocs, 1);
+            __sync_fetch_and_add(&res_arena, ARENA_HEADER + size);
+        }
+        
+        block->used = 0;
+        block->next = arc->arena;
+        arc->arena  = block;
+    }
+    
+    ptr = (Uint8*)block + ARENA_HEADER + block->used;
+    block->used += n;
+    
+    return ptr;
+}
+
+/* Give a list of blocks back, keeping some spare */
+void _arena_release(arena_block *arena)
+{
+    arena_block *block;
+    int r;
+    
+    r = SDL_mutexP(arena_lock);
+    check_mutex(r);
+    while (arena != NULL) {
+        block = arena;
+        arena = block->next;
+        if (arena_spares < LOAD_ARENA_SPARE) {
+            block->next = arena_spare;
+            arena_spare = block;
+            ++arena_spares;
+        }
+        else {
+            __sync_fetch_and_sub(&res_arena, ARENA_HEADER + block->size);
+            free(block);
+        }
+    }
+    r = SDL_mutexV(arena_lock);
+    check_mutex(r);
+}
+
+char *_name_of_res(void *item)
+{
+    return ((resource*)item)->name;
+}
+
+char *_name_of_arc(void *item)
+{
+    return ((arclist*)item)->name;
+}
+
+/* Every arclist there is, by name */
+sid_table arc_table;
 SDL_mutex *arc_lock;
 
+/* Whether lookups skip the locks when they can */
+int res_lockfree = TRUE;
+
+/* How tarballs are read, 0 for mapping them */
+size_t tgz_read_block = TGZ_READ_BLOCK;
+
+void set_tgz_read_block(size_t bytes)
+{
+    tgz_read_block = bytes;
+}
+
+size_t get_tgz_read_block(void)
+{
+    return tgz_read_block;
+}
+
+void set_res_lockfree(int on)
+{
+    res_lockfree = on;
+}
+
+int get_res_lockfree(void)
+{
+    return res_lockfree;
+}
+
 /* For creating human-readable description of what I'm doing */
 SDL_mutex *load_lock;
 int progress;
@@ -112,9 +553,11 @@ int get_progress(char *buf, size_t n)
     r = SDL_mutexP(load_lock);
     check_mutex(r);
     strncpy(buf, doing, n);
-    return progress;
+    n = progress;
     r = SDL_mutexV(load_lock);
     check_mutex(r);
+    
+    return n;
 }
 
 /* Reset the progress spinner */
@@ -129,6 +572,170 @@ void reset_progress(void)
     check_mutex(r);
 }
 
+/* Memory budget for decoded images, see resource.h */
+size_t          res_budget   = RES_BUDGET;
+volatile size_t res_resident = 0;
+volatile Uint32 res_epoch    = 0;
+
+/*
+ * Hits are counted on every lookup, so they're spread over a few counters
+ * on cache lines of their own, one per thread (more or less), rather than
+ * having every thread fight over the same one
+ */
+#define HIT_STRIPES 8
+
+typedef struct hit_stripe_ hit_stripe;
+struct hit_stripe_ {
+    volatile Uint32 hits;
+    char            pad[CACHE_LINE - sizeof(Uint32)];
+};
+
+hit_stripe      res_hits[HIT_STRIPES];
+volatile Uint32 res_misses    = 0;
+volatile Uint32 res_evictions = 0;
+volatile Uint32 res_redecodes = 0;
+
+/* Which stripe the calling thread uses */
+int _res_stripe(void)
+{
+    /* Thread ids tend to be aligned, so mix them up a bit first */
+    return ((SDL_ThreadID() * 2654435761U) >> 24) % HIT_STRIPES;
+}
+
+/* Count a lookup that found its data ready, and mark it used */
+void _res_hit(resource *res)
+{
+    __sync_fetch_and_add(&(res_hits[_res_stripe()].hits), 1);
+    
+    /* Don't write to it unless we have to, lots of threads read it */
+    if (res->last_used != res_epoch) {
+        res->last_used = res_epoch;
+    }
+}
+
+/*
+ * Retiring
+ * get_res looks resources up without a lock, so free_arc can't free an
+ * archive's table, or the arena blocks and pack resources its resources
+ * live in, while a lookup might still be in them. They're retired
+ * instead, and freed a couple of reclaims later, once every lookup that
+ * could have seen them has finished.
+ *
+ * Lookups count themselves in and out on one of two sets of counters,
+ * whichever res_phase says when they start (striped like the hits, so
+ * they don't fight over one line). Each _reclaim_retired that finds the
+ * other set empty frees what was retired before the last one, holds on
+ * to what's been retired since, and flips res_phase. So anything freed
+ * has seen both sets empty since it was retired, and every lookup that
+ * was going when it was has finished; any that started after couldn't
+ * find it. A reclaim never waits on a lookup, if one's still going it
+ * just leaves everything for the next.
+ */
+typedef struct retired_ retired;
+struct retired_ {
+    retired     *next;
+    sid_array   *array;
+    arena_block *arena;
+    resource    *packres;
+};
+
+typedef struct read_stripe_ read_stripe;
+struct read_stripe_ {
+    volatile Uint32 readers[2];
+    char            pad[CACHE_LINE - 2 * sizeof(Uint32)];
+};
+
+read_stripe  res_readers[HIT_STRIPES];
+volatile int res_phase = 0;
+
+/* Retired since the last reclaim, and before it */
+retired   *retire_new = NULL;
+retired   *retire_old = NULL;
+SDL_mutex *retire_lock;
+
+/* Count a lookup in, returns what to count it out with */
+int _read_begin(void)
+{
+    int stripe, phase;
+    
+    /* The add's a full barrier, so the lookup can't start before it */
+    stripe = _res_stripe();
+    phase  = res_phase;
+    __sync_fetch_and_add(&(res_readers[stripe].readers[phase]), 1);
+    
+    return stripe * 2 + phase;
+}
+
+void _read_end(int slot)
+{
+    __sync_fetch_and_sub(&(res_readers[slot / 2].readers[slot % 2]), 1);
+}
+
+/* Hand an archive's table and memory over to be freed later */
+void _retire(sid_array *array, arena_block *arena, resource *packres)
+{
+    retired *old;
+    int r;
+    
+    old = malloc(sizeof(retired));
+    panic(old, "Couldn't allocate memory to retire an archive");
+    old->array   = array;
+    old->arena   = arena;
+    old->packres = packres;
+    
+    r = SDL_mutexP(retire_lock);
+    check_mutex(r);
+    old->next  = retire_new;
+    retire_new = old;
+    r = SDL_mutexV(retire_lock);
+    check_mutex(r);
+}
+
+void _free_retired(retired *old)
+{
+    retired *next;
+    
+    while (old != NULL) {
+        next = old->next;
+        sid_array_free(old->array);
+        _arena_release(old->arena);
+        free(old->packres);
+        free(old);
+        old = next;
+    }
+}
+
+/* Free whatever no lookup can be using any more */
+void _reclaim_retired(void)
+{
+    retired *done = NULL;
+    Uint32 readers = 0;
+    int other, i, r;
+    
+    /* Nearly always the case */
+    if (retire_new == NULL && retire_old == NULL) {
+        return;
+    }
+    
+    r = SDL_mutexP(retire_lock);
+    check_mutex(r);
+    other = !res_phase;
+    for (i = 0; i < HIT_STRIPES; ++i) {
+        readers += res_readers[i].readers[other];
+    }
+    if (readers == 0) {
+        done       = retire_old;
+        retire_old = retire_new;
+        retire_new = NULL;
+        __sync_synchronize();
+        res_phase  = other;
+    }
+    r = SDL_mutexV(retire_lock);
+    check_mutex(r);
+    
+    _free_retired(done);
+}
+
 /* 
  * "Doctor" a resource to its finished format
  * Mainly, this converts PNGs to SDL_Surfaces
@@ -137,147 +744,453 @@ void _doctor_resource(resource *res)
 {
     SDL_Surface *img, *opt;
     SDL_RWops   *rwop;
+    Uint64       start;
     
     /* We assume the calling function has already locked the resource */
     switch (res->type) {
         case RES_IMAGE:
+            start = clock_ns();
             /*  Need to go through SDL_RWops to load an image from memory */
             debug2("Doctoring image:", res->name);
             verbose("Creating SDL_RWops");
-            rwop = SDL_RWFromMem(res->data, res->size);
+            rwop = SDL_RWFromMem(res->source, res->size);
             panic(rwop != NULL, "Failed to set up SDL_RWops");
             verbose("Loading PNG from SDL_RWops");
             img  = IMG_LoadPNG_RW(rwop);
             verbose("Cleaning up");
             SDL_FreeRW(rwop);
+            warn2(img != NULL, "Couldn't decode image", res->name);
             /* Now we need to optimize the surface */
-            opt = SDL_DisplayFormat(img);
-            SDL_FreeSurface(img);
-            free(res->data);
-            res->data = (void*)opt;
+            opt = NULL;
+            if (img != NULL) {
+                opt = SDL_DisplayFormat(img);
+                SDL_FreeSurface(img);
+            }
+            /* The source stays, in case it's evicted */
+            res->data  = (void*)opt;
+            res->bytes = opt ? (size_t)opt->pitch * opt->h : 0;
+            __sync_fetch_and_add(&res_resident, res->bytes);
+            metric_add(MET_IMAGES_DECODED, 1);
+            metric_observe(MET_DECODE_NS, clock_ns() - start);
             break;
         default:
+            res->data = res->source;
             break;
     }
 }
 
-/* Get an archive from the arclist chain */
-inline arclist *_get_arc_from_chain(sid_t id, char *arcname)
+/*
+ * Decode thread pool
+ * load_arc has to read the archive in order, since it's one compressed
+ * stream, but once an image entry has been read into memory, decoding it
+ * doesn't depend on anything else. So image entries are handed off to a
+ * pool of decode threads, and load_arc moves straight on to the next entry.
+ * Each resource is marked ready as soon as its own decode is done.
+ */
+typedef struct decode_job_ decode_job;
+struct decode_job_ {
+    decode_job *next;
+    arclist    *arc;
+    resource   *res;
+};
+
+decode_job *decode_head = NULL;
+decode_job *decode_tail = NULL;
+/* Finished jobs, kept around to be used again */
+decode_job *decode_spare = NULL;
+
+SDL_Thread *decode_threads[MAX_DECODE_THREADS];
+int num_decode_threads = 0;
+int decode_kill = FALSE;
+
+/* Protects the job queue and every arclist's pending count */
+SDL_mutex *decode_lock;
+/* Signalled when a job is queued */
+SDL_cond  *decode_queued;
+/* Signalled when a job is finished */
+SDL_cond  *decode_finished;
+
+/* Mark a resource as ready and wake anybody waiting on it */
+void _resource_ready(resource *res)
 {
-    arclist *temparc;
     int r;
     
-    r = SDL_mutexP(arc_lock);
+    r = SDL_mutexP(res->_lock);
     check_mutex(r);
-    for(temparc = arc_head; temparc != NULL && temparc->id != id;
-        temparc = temparc->next);
-    /* Check the strings too, because I'm paranoid */
-    /* for(; temparc != NULL && (r = strcmp(temparc->name, arcname)) < 0;
-        temparc = temparc->next); */
-    /* Did we miss it? */
-    if (r > 0) temparc = NULL;
-    r = SDL_mutexV(arc_lock);
+    res->ready = TRUE;
+    SDL_CondBroadcast(res->_ready);
+    r = SDL_mutexV(res->_lock);
     check_mutex(r);
-    return temparc;
 }
 
-/* Load an archive */
-arclist *load_arc(char *arcname)
+/* The decode thread function */
+int _decode_worker(void *unused)
 {
-    int i, r;
-    arclist *newarclist, *curr, *prev;
-    resource *newresource, *tempres, *prevres = NULL;
-    sid_t reshash, temphash;
-    void *tempdat;
-    char *tempname;
+    decode_job *job;
+    int r;
     
-    struct archive *newarc;
-    struct archive_entry *entry;
+    trace_name_thread("decode");
     
-    debug2("Starting to load archive", arcname);
+    r = SDL_mutexP(decode_lock);
+    check_mutex(r);
     
-    temphash = calculate_sid(arcname);
-    /* Do we already have this arclist in memory? */
-    if ((newarclist = _get_arc_from_chain(temphash, arcname))) {
-        debug("Archive found in arc chain");
-        /* And is it loaded? */
-        r = SDL_mutexP(newarclist->_lock);
-        check_mutex(r);
-        if(newarclist->loaded) {
-            /* Then we're golden */
-            debug("Archive is loaded, we're done.");
-            r = SDL_mutexV(newarclist->_lock);
-            check_mutex(r);
-            return newarclist;
+    while (!decode_kill) {
+        if (decode_head == NULL) {
+            SDL_CondWait(decode_queued, decode_lock);
+            continue;
         }
-        /* if not, we sill don't need to make a new one at least */
-    }
-    else {
-        /* Make an arclist */
-        r = SDL_mutexP(load_lock);
-        check_mutex(r);
-        sprintf(doing, "Initializing archive %s", arcname);
-        ++progress;
-        debug(doing);
-        r = SDL_mutexV(load_lock);
-        check_mutex(r);
         
-        newarclist = malloc(sizeof(arclist));
-        panic2(newarclist, "Could not allocate memory for new arclist:", arcname);
+        /* Take a job off the queue */
+        job = decode_head;
+        decode_head = job->next;
+        if (decode_head == NULL) {
+            decode_tail = NULL;
+        }
         
-        /* Prepare the lock */
-        newarclist->_lock = SDL_CreateMutex();
-                                        
-        /* Lock it */
-        r = SDL_mutexP(newarclist->_lock);
+        r = SDL_mutexV(decode_lock);
         check_mutex(r);
         
-        /* Prepare other stuff */
-        strcpy(newarclist->name, arcname);
-        newarclist->id = temphash;
-        for (i = 0; i < ARCLIST_HASH_SIZE; ++i) {
-            newarclist->map[i] = NULL;
-        }
+        /* Nobody else touches the resource until it's marked ready */
+        trace_begin("decode");
+        _doctor_resource(job->res);
+        _resource_ready(job->res);
+        trace_end("decode");
         
-        /* Add it to the arclist chain */
-        r = SDL_mutexP(arc_lock);
-        check_mutex(r);
-        if (arc_head) {
-            /* 
-             * List is not currently empty - add it
-             * We need it sorted to make the string checks more efficient
-             */
-            curr = arc_head;
-            prev = curr;
-            for (; curr != NULL && curr->id < temphash;
-                prev = curr, curr = curr->next);
-            if (curr != NULL && curr->id == temphash) {
-                /* Settle hash ties via strcmp */
-                for (; curr != NULL && strcmp(curr->name, arcname) < 0;
-                    prev = curr, curr = curr->next);
-            }
-            /* Now we should be at the right place */
-            prev->next = newarclist;
-            newarclist->next = curr;
-        }
-        else {
-            /* List is empty - make it */
-            arc_head = newarclist;
-            newarclist->next = NULL;
-        }
-        r = SDL_mutexV(arc_lock);
+        r = SDL_mutexP(decode_lock);
         check_mutex(r);
+        --(job->arc->pending);
+        SDL_CondBroadcast(decode_finished);
+        job->next = decode_spare;
+        decode_spare = job;
     }
     
-    /* Start loading the archive */
-    r = SDL_mutexP(load_lock);
+    r = SDL_mutexV(decode_lock);
     check_mutex(r);
-    sprintf(doing, "Opening up archive %s", arcname);
-    ++progress;
+    
+    thread_done();
+    return 0;
+}
+
+/* Hand a resource off to the decode threads */
+void _queue_decode(arclist *arc, resource *res)
+{
+    decode_job *job;
+    int r;
+    
+    r = SDL_mutexP(decode_lock);
+    check_mutex(r);
+    
+    if (decode_spare) {
+        job = decode_spare;
+        decode_spare = job->next;
+    }
+    else {
+        job = malloc(sizeof(decode_job));
+        panic2(job, "Couldn't allocate memory for decode job", res->name);
+        __sync_fetch_and_add(&res_allocs, 1);
+    }
+    job->next = NULL;
+    job->arc  = arc;
+    job->res  = res;
+    
+    if (decode_tail) {
+        decode_tail->next = job;
+    }
+    else {
+        decode_head = job;
+    }
+    decode_tail = job;
+    ++(arc->pending);
+    SDL_CondSignal(decode_queued);
+    
+    r = SDL_mutexV(decode_lock);
+    check_mutex(r);
+}
+
+/* Wait until all of an archive's images have been decoded */
+void _wait_decodes(arclist *arc)
+{
+    int r;
+    
+    r = SDL_mutexP(decode_lock);
+    check_mutex(r);
+    while (arc->pending > 0) {
+        SDL_CondWait(decode_finished, decode_lock);
+    }
+    r = SDL_mutexV(decode_lock);
+    check_mutex(r);
+}
+
+/* Stop all the decode threads, the queue should be empty by now */
+void _stop_decode_threads(void)
+{
+    int i, r;
+    
+    r = SDL_mutexP(decode_lock);
+    check_mutex(r);
+    decode_kill = TRUE;
+    SDL_CondBroadcast(decode_queued);
+    r = SDL_mutexV(decode_lock);
+    check_mutex(r);
+    
+    for (i = 0; i < num_decode_threads; ++i) {
+        SDL_WaitThread(decode_threads[i], NULL);
+    }
+    num_decode_threads = 0;
+    decode_kill = FALSE;
+}
+
+/* Set the number of threads used to decode images */
+void set_decode_threads(int n)
+{
+    if (n < 0) n = 0;
+    if (n > MAX_DECODE_THREADS) n = MAX_DECODE_THREADS;
+    
+    _stop_decode_threads();
+    
+    for (num_decode_threads = 0; num_decode_threads < n;
+         ++num_decode_threads) {
+        decode_threads[num_decode_threads] =
+            SDL_CreateThread(_decode_worker, NULL);
+        panicn(decode_threads[num_decode_threads] != NULL,
+               "Couldn't start decode thread", num_decode_threads);
+    }
+    
+    debugn("Decoding images with threads:", num_decode_threads);
+}
+
+int get_decode_threads(void)
+{
+    return num_decode_threads;
+}
+
+/*
+ * Get an archive from the arclist table
+ * Archives never leave the table, so if it's there it's there for good,
+ * but if it looks like it isn't, it might only just be going in
+ */
+arclist *_get_arc_from_chain(sid_t id, char *arcname)
+{
+    arclist *temparc;
+    int r;
+    
+    if (res_lockfree) {
+        temparc = sid_table_find(&arc_table, id, arcname);
+        if (temparc != NULL) {
+            return temparc;
+        }
+    }
+    
+    r = SDL_mutexP(arc_lock);
+    check_mutex(r);
+    temparc = sid_table_find(&arc_table, id, arcname);
+    r = SDL_mutexV(arc_lock);
+    check_mutex(r);
+    return temparc;
+}
+
+/* Map a whole file into memory, read-only. Returns NULL if we can't */
+void *_map_file(char *filename, size_t *size)
+{
+    void *base;
+#ifdef _WIN32
+    HANDLE file, mapping;
+    
+    file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                      OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    
+    *size = (size_t) GetFileSize(file, NULL);
+    mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) return NULL;
+    
+    /* The view keeps the mapping alive on its own */
+    base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    
+    return base;
+#else
+    struct stat st;
+    int fd;
+    
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t) st.st_size;
+    
+    base = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    
+    return (base == MAP_FAILED) ? NULL : base;
+#endif
+}
+
+void _unmap_file(void *base, size_t size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+#else
+    munmap(base, size);
+#endif
+}
+
+/* Check a pack's header and that its index is all there */
+int _pack_ok(void *pack, size_t pack_size)
+{
+    pack_header *header = (pack_header*) pack;
+    
+    /* Divided rather than multiplied, so a huge count can't wrap */
+    return pack_size >= sizeof(pack_header) &&
+           memcmp(header->magic, PACK_MAGIC, 4) == 0 &&
+           header->version == PACK_VERSION &&
+           header->data <= pack_size &&
+           header->data >= sizeof(pack_header) &&
+           header->count <= (header->data - sizeof(pack_header)) /
+                            sizeof(pack_entry);
+}
+
+/* Get the name of a pack entry, or NULL if the entry runs off the end */
+char *_pack_entry_name(void *pack, size_t pack_size, pack_entry *entry)
+{
+    pack_header *header = (pack_header*) pack;
+    
+    /* offset + size could wrap, so it's checked a piece at a time */
+    if (entry->name >= header->data ||
+        memchr((char*)pack + entry->name, '\0',
+               header->data - entry->name) == NULL ||
+        entry->offset > pack_size ||
+        entry->size > pack_size - entry->offset) {
+        return NULL;
+    }
+    
+    return (char*)pack + entry->name;
+}
+
+/*
+ * Load a pack into an arclist, on the loader thread. Everything is set up
+ * first and then put in the arclist's table in one go, so anybody looking
+ * for a resource sees either the whole pack or none of it. See resource.h
+ * for the format.
+ */
+void _load_pack(arclist *arc, char *arcname)
+{
+    pack_header *header;
+    pack_entry *entry, *index;
+    resource *res, *packres;
+    void *pack;
+    char *name;
+    size_t pack_size;
+    Uint32 i, count;
+    int r;
+    
+    r = SDL_mutexP(load_lock);
+    check_mutex(r);
+    snprintf(doing, sizeof(doing), "Mapping pack %s", arcname);
+    ++progress;
     debug(doing);
     r = SDL_mutexV(load_lock);
     check_mutex(r);
     
+    pack = _map_file(arcname, &pack_size);
+    panic2(pack != NULL, "Couldn't map pack", arcname);
+    
+    header = (pack_header*) pack;
+    panic2(_pack_ok(pack, pack_size), "Not a valid pack", arcname);
+    
+    count = header->count;
+    index = (pack_entry*)((Uint8*)pack + sizeof(pack_header));
+    
+    /* One resource per index entry, in the same order */
+    packres = malloc(count * sizeof(resource) + 1);
+    panic2(packres, "Couldn't allocate memory for pack resources", arcname);
+    __sync_fetch_and_add(&res_allocs, 1);
+    
+    for (i = 0; i < count; ++i) {
+        entry = &(index[i]);
+        res   = &(packres[i]);
+        name  = _pack_entry_name(pack, pack_size, entry);
+        panic2(name, "Pack entry runs off the end of the pack", arcname);
+        
+        res->name   = intern_name(name, entry->id);
+        res->id     = entry->id;
+        res->type   = (restype) entry->type;
+        res->size   = entry->size;
+        res->arc    = arc;
+        res->source = (Uint8*)pack + entry->offset;
+        res->data   = NULL;
+        res->mapped = TRUE;
+        res->hash   = entry->hash;
+        res->bytes  = 0;
+        res->refs   = 0;
+        res->last_used = res_epoch;
+        res->evicted   = FALSE;
+        res->_lock  = SDL_CreateMutex();
+        res->_ready = SDL_CreateCond();
+        res->ready  = FALSE;
+    }
+    
+    /* Put it all in place */
+    r = SDL_mutexP(arc->_lock);
+    check_mutex(r);
+    arc->pack      = pack;
+    arc->pack_size = pack_size;
+    arc->index     = index;
+    arc->count     = count;
+    arc->packres   = packres;
+    for (i = 0; i < count; ++i) {
+        sid_table_insert(&(arc->table), packres[i].id, &(packres[i]));
+    }
+    SDL_CondBroadcast(arc->_changed);
+    r = SDL_mutexV(arc->_lock);
+    check_mutex(r);
+    
+    /* Only images need any work, everything else is used in place */
+    for (i = 0; i < count; ++i) {
+        res = &(packres[i]);
+        if (res->type == RES_IMAGE && num_decode_threads > 0) {
+            _queue_decode(arc, res);
+        }
+        else {
+            _doctor_resource(res);
+            _resource_ready(res);
+        }
+    }
+}
+
+/* Finish with a tarball opened by _open_tgz */
+void _close_tgz(struct archive *newarc, void *input, size_t input_size)
+{
+    /* 
+     * "libarchive version 3 is just around the corner! Honest!"
+     *  -- Libarchive developers, Mar 2010
+     */
+#if ARCHIVE_VERSION_NUMBER < 3000000
+    archive_read_finish(newarc);
+#else
+    archive_read_free(newarc);
+#endif
+    
+    /* Everything we need has been copied out of it */
+    if (input != NULL) {
+        _unmap_file(input, input_size);
+    }
+}
+
+/*
+ * Open a gzipped tarball for reading, or return NULL if we can't. If it
+ * gets mapped in, *input is set to the mapping, which has to stay until
+ * _close_tgz.
+ */
+struct archive *_open_tgz(char *arcname, void **input, size_t *input_size)
+{
+    struct archive *newarc;
+    int r;
+    
     newarc = archive_read_new();
     /* All archives are gzipped tarballs */
     
@@ -293,9 +1206,63 @@ arclist *load_arc(char *arcname)
 
     archive_read_support_format_tar(newarc);
     
-    /* Open it up */
-    r = archive_read_open_filename(newarc, arcname, 10240);
-    panic2(r==ARCHIVE_OK, "Couldn't open archive", arcname);
+    /*
+     * Open it up, straight from memory if we can map it, which saves
+     * libarchive copying every block it reads
+     */
+    *input = NULL;
+    if (tgz_read_block == 0) {
+        *input = _map_file(arcname, input_size);
+        warn2(*input != NULL, "Couldn't map archive, reading it instead",
+              arcname);
+    }
+    if (*input != NULL) {
+        r = archive_read_open_memory(newarc, *input, *input_size);
+    }
+    else {
+        r = archive_read_open_filename(newarc, arcname,
+                                       tgz_read_block ? tgz_read_block
+                                                      : 10240);
+    }
+    
+    if (r != ARCHIVE_OK) {
+        _close_tgz(newarc, *input, *input_size);
+        return NULL;
+    }
+    
+    return newarc;
+}
+
+/*
+ * Read a gzipped tarball into an arclist, on the loader thread. Each
+ * resource goes into the map as soon as its header has been read, and
+ * is marked ready once its data is in and doctored. The resources and
+ * their data all go in the arclist's arena.
+ */
+void _load_tgz(arclist *arc, char *arcname)
+{
+    int r;
+    resource *newresource;
+    sid_t reshash;
+    void *tempdat;
+    char *tempname;
+    void *input = NULL;
+    size_t input_size = 0;
+    
+    struct archive *newarc;
+    struct archive_entry *entry;
+    
+    /* Start loading the archive */
+    r = SDL_mutexP(load_lock);
+    check_mutex(r);
+    snprintf(doing, sizeof(doing), "Opening up archive %s", arcname);
+    ++progress;
+    debug(doing);
+    r = SDL_mutexV(load_lock);
+    check_mutex(r);
+    
+    newarc = _open_tgz(arcname, &input, &input_size);
+    panic2(newarc, "Couldn't open archive", arcname);
     
     /*
      * Start reading
@@ -307,22 +1274,19 @@ arclist *load_arc(char *arcname)
         
         r = SDL_mutexP(load_lock);
         check_mutex(r);
-        sprintf(doing, "Reading in archive entry %s", tempname);
+        snprintf(doing, sizeof(doing), "Reading in archive entry %s",
+                 tempname);
         ++progress;
         debug(doing);
         r = SDL_mutexV(load_lock);
         check_mutex(r);
         
         /* Set up new resource entry */
-        newresource = malloc(sizeof(resource));
-        panic2(newresource, "Couldn't allocate memory for new resource",
-                                                                    tempname);
-                                                                    
-        newresource->_lock = SDL_CreateMutex();
+        newresource = _arena_alloc(arc, sizeof(resource));
         
-        /* Lock it */
-        r = SDL_mutexP(newresource->_lock);
-        check_mutex(r);
+        newresource->_lock  = SDL_CreateMutex();
+        newresource->_ready = SDL_CreateCond();
+        newresource->ready  = FALSE;
         
         /* 
          * Copy over some stuff
@@ -332,225 +1296,565 @@ arclist *load_arc(char *arcname)
          * does have a size of zero. Although I'm not sure why
          * we would ever need that...
          */
-        strncpy(newresource->name, archive_entry_pathname(entry), 15);
-        (newresource->name)[15] = '\0';
-        reshash = calculate_sid(newresource->name);
+        reshash = calculate_sid(tempname);
+        newresource->name = intern_name(tempname, reshash);
         newresource->id = reshash;
         newresource->size = archive_entry_size(entry);
+        newresource->arc = arc;
+        newresource->source = NULL;
         newresource->data = NULL;
+        newresource->mapped = FALSE;
+        newresource->bytes = 0;
+        newresource->refs = 0;
+        newresource->last_used = res_epoch;
+        newresource->evicted = FALSE;
         
         /* Good to know! */
         debug2("Copied over filepath:", newresource->name);
         /* Less good to know */
         verbosen("File is size", newresource->size);
         verbosen("File has SID", (int)newresource->id);
-        verbosen("File will be stored in map slot", reshash%ARCLIST_HASH_SIZE);
         
         /* Try and determine filetype */
-        temphash = calculate_sid(get_ext(newresource->name));
-        switch (temphash) {
-            case PNG_HASH:
-                debug("Filetype is PNG");
-                newresource->type = RES_IMAGE;
-                break;
-            case BIN_HASH:
-                debug("Filetype is BIN");
-                newresource->type = RES_BINARY;
-                break;
-            case MID_HASH:
-                debug("Filetype is MID");
-                newresource->type = RES_MIDI;
-                break;
-            case OGG_HASH:
-                debug("Filetype is OGG");
-                newresource->type = RES_SOUND;
-                break;
-            case LUA_HASH:
-                debug("Filetype is LUA");
-                newresource->type = RES_SCRIPT;
-                break;
-            case TXT_HASH:
-                debug("Filetype is TXT");
-                newresource->type = RES_STRING;
-                break;
-            case MAP_HASH:
-                debug("Filetype is MAP");
-                newresource->type = RES_MAP;
-                break;
-            default:
-                debug("Filetype is unrecognized (this is not an error)");
-                newresource->type = RES_OTHER;
-        }
+        newresource->type = get_restype(newresource->name);
         
         r = SDL_mutexP(load_lock);
         check_mutex(r);
-        sprintf(doing, "Mapping resource %s", newresource->name);
+        snprintf(doing, sizeof(doing), "Mapping resource %s",
+                 newresource->name);
         ++progress;
         debug(doing);
         r = SDL_mutexV(load_lock);
         check_mutex(r);
         
-        /* Store it in arclist */
-        tempres = newarclist->map[reshash%ARCLIST_HASH_SIZE];
-        if (tempres) {
-            /* 
-             * List is not empty - add it 
-             * Again, need to sort it to make hash collisions less painful
-             * via string checks
-             *
-             * Thanks to the if, we know tempres != NULL on the first
-             * iteration, so we don't need to worry about intializing prevres
-             */
-            for (; tempres != NULL && tempres->id < reshash;
-                prevres = tempres, tempres = tempres->next);
-            if (tempres->id == reshash) {
-                /* String checks ahoy! */
-                for (; tempres != NULL &&
-                    strcmp(tempres->name, newresource->name) < 0;
-                    prevres = tempres, tempres = tempres->next);
-            }
-            /* And now we're in position */
-            prevres->next = newresource;
-            newresource->next = tempres;
-        }
-        else {
-            /* list is empty - make it */
-            newarclist->map[reshash%ARCLIST_HASH_SIZE] = newresource;
-            newresource->next = NULL;
-        }
+        /*
+         * Store it in arclist
+         * Anybody waiting on the arclist gets woken up to look for theirs
+         */
+        r = SDL_mutexP(arc->_lock);
+        check_mutex(r);
+        sid_table_insert(&(arc->table), reshash, newresource);
+        SDL_CondBroadcast(arc->_changed);
+        r = SDL_mutexV(arc->_lock);
+        check_mutex(r);
         
         /* Now we need to load this entry, pretty standard stuff */
         
         r = SDL_mutexP(load_lock);
         check_mutex(r);
-        sprintf(doing, "Loading resource %s into memory", newresource->name);
+        snprintf(doing, sizeof(doing), "Loading resource %s into memory",
+                 newresource->name);
         ++progress;
         debug(doing);
         r = SDL_mutexV(load_lock);
         check_mutex(r);
         
-        tempdat = malloc((size_t)newresource->size);
-        panic2(tempdat, "Couldn't allocate memory to load resource",
-                newresource->name);
+        tempdat = _arena_alloc(arc, (size_t)newresource->size);
         archive_read_data(newarc, tempdat, (size_t)newresource->size);
         
-        newresource->data = tempdat;
+        newresource->source = tempdat;
+        newresource->hash   = calculate_hash(tempdat,
+                                             (size_t)newresource->size);
         
-        /* Convert from file format to internal format, if needed */
-        _doctor_resource(newresource);
-        
-        /* Finally, unlock */
-        r = SDL_mutexV(newresource->_lock);
-        check_mutex(r);
+        /* 
+         * Convert from file format to internal format, if needed
+         * Images go to the decode threads if we have any, everything
+         * else is cheap enough to do right here
+         */
+        if (newresource->type == RES_IMAGE && num_decode_threads > 0) {
+            _queue_decode(arc, newresource);
+        }
+        else {
+            _doctor_resource(newresource);
+            _resource_ready(newresource);
+        }
     }
-    /* Everything's loaded, just need to clean some stuff */
+    /* Everything's read in, just need to clean some stuff */
     
     r = SDL_mutexP(load_lock);
     check_mutex(r);
-    sprintf(doing, "Cleaning up internal copy of %s", arcname);
+    snprintf(doing, sizeof(doing), "Cleaning up internal copy of %s",
+             arcname);
     ++progress;
     debug(doing);
     r = SDL_mutexV(load_lock);
     check_mutex(r);
     
-    /* 
-     * "libarchive version 3 is just around the corner! Honest!"
-     *  -- Libarchive developers, Mar 2010
-     */
-#if ARCHIVE_VERSION_NUMBER < 3000000
-    archive_read_finish(newarc);
-#else
-    archive_read_free(newarc);
-#endif
+    _close_tgz(newarc, input, input_size);
+}
 
-    newarclist->loaded = 1;
-    r = SDL_mutexV(newarclist->_lock);
+/* Read an archive in, on the loader thread */
+void _read_arc(arclist *arc, char *filename)
+{
+    int r;
+    
+    debug2("Starting to load archive", filename);
+    
+    if (calculate_sid(get_ext(filename)) == BRP_HASH) {
+        _load_pack(arc, filename);
+    }
+    else {
+        _load_tgz(arc, filename);
+    }
+    
+    /*
+     * Everything is in place now, so the arclist counts as loaded; get_res
+     * will wait on any particular image that's still being decoded
+     */
+    r = SDL_mutexP(arc->_lock);
+    check_mutex(r);
+    arc->loaded = 1;
+    arc->queued = FALSE;
+    SDL_CondBroadcast(arc->_changed);
+    r = SDL_mutexV(arc->_lock);
     check_mutex(r);
+    metric_add(MET_ARCS_LOADED, 1);
     
     /* clear this out */
     r = SDL_mutexP(load_lock);
     check_mutex(r);
     doing[0] = '\0';
-    debug2("Done loading archive", arcname);
+    debug2("Done loading archive", filename);
     r = SDL_mutexV(load_lock);
     check_mutex(r);
-    return newarclist;
 }
 
-/* Internal function to free an archive */
-void _free_arc(arclist *arc)
+/*
+ * Loader thread
+ * Archives are read in one at a time, in the order they were asked for,
+ * except that anything somebody is actually waiting on gets moved to the
+ * front of the queue.
+ */
+typedef struct load_request_ load_request;
+struct load_request_ {
+    load_request *next;
+    arclist      *arc;
+};
+
+load_request *request_head = NULL;
+load_request *request_tail = NULL;
+
+SDL_Thread *loader_thread;
+int loader_kill = FALSE;
+
+/* Protects the request queue */
+SDL_mutex *request_lock;
+/* Signalled when a request is queued */
+SDL_cond  *request_queued;
+
+/* The loader thread function */
+int _loader_worker(void *unused)
 {
-    resource *tempres, *nextres;
-    int i, r;
+    load_request *req;
+    int r;
     
-    /* Is it freed already? */
-    if (!(arc->loaded)) {
-    }
-    else {
-        /* Lock it */
-        r = SDL_mutexP(arc->_lock);
-        check_mutex(r);
+    trace_name_thread("loader");
+    
+    r = SDL_mutexP(request_lock);
+    check_mutex(r);
+    
+    while (!loader_kill) {
+        if (request_head == NULL) {
+            SDL_CondWait(request_queued, request_lock);
+            continue;
+        }
         
-        /* Free all resources */
-        debug2("Freeing resources in arclist", arc->name);
-        for (i = 0; i < ARCLIST_HASH_SIZE; ++i) {
-            tempres = arc->map[i];
-            while (tempres) {
-                /* Free everything */
-                debug2("Freeing resource", tempres->name);
-                /* Wait, how DO we free it? */
-                switch (tempres->type) {
-                    case RES_IMAGE:
-                        SDL_FreeSurface((SDL_Surface*)tempres->data);
-                        break;
-                    default:
-                        free(tempres->data);
-                        break;
-                }
-                SDL_DestroyMutex(tempres->_lock);
-                
-                /* Free the resource itself, need to shuffle around a bit */
-                nextres = tempres->next;
-                free(tempres);
-                tempres = nextres;
-            }
-            arc->map[i] = NULL;
+        req = request_head;
+        request_head = req->next;
+        if (request_head == NULL) {
+            request_tail = NULL;
         }
-    
-        /* Clean up */
-        arc->loaded = 0;
-        r = SDL_mutexV(arc->_lock);
+        
+        r = SDL_mutexV(request_lock);
         check_mutex(r);
         
-        debug2("Done freeing archive", arc->name);
+        trace_begin("read_arc");
+        _read_arc(req->arc, req->arc->name);
+        trace_end("read_arc");
+        free(req);
+        
+        r = SDL_mutexP(request_lock);
+        check_mutex(r);
     }
-} 
+    
+    r = SDL_mutexV(request_lock);
+    check_mutex(r);
+    
+    thread_done();
+    return 0;
+}
 
-/*
- * Free an archive
- * Note that the arclist struct STAYS IN MEMORY, but all the resources therein
- * are freed.
- */
-void free_arc(char *arcname)
+/* Move an archive's request to the front of the queue, if it's still in it */
+void _bump_request(arclist *arc)
 {
-    _free_arc(_get_arc_from_chain(calculate_sid(arcname), arcname));
+    load_request *req, *prev = NULL;
+    int r;
+    
+    r = SDL_mutexP(request_lock);
+    check_mutex(r);
+    
+    for (req = request_head; req != NULL && req->arc != arc;
+         prev = req, req = req->next);
+    
+    if (req != NULL && prev != NULL) {
+        prev->next = req->next;
+        if (request_tail == req) {
+            request_tail = prev;
+        }
+        req->next = request_head;
+        request_head = req;
+    }
+    
+    r = SDL_mutexV(request_lock);
+    check_mutex(r);
+}
+
+/* Same thing for an image waiting on the decode threads */
+void _bump_decode(resource *res)
+{
+    decode_job *job, *prev = NULL;
+    int r;
+    
+    r = SDL_mutexP(decode_lock);
+    check_mutex(r);
+    
+    for (job = decode_head; job != NULL && job->res != res;
+         prev = job, job = job->next);
+    
+    if (job != NULL && prev != NULL) {
+        prev->next = job->next;
+        if (decode_tail == job) {
+            decode_tail = prev;
+        }
+        job->next = decode_head;
+        decode_head = job;
+    }
+    
+    r = SDL_mutexV(decode_lock);
+    check_mutex(r);
+}
+
+/* Wait until an archive isn't waiting on the loader thread any more */
+void _wait_arc(arclist *arc)
+{
+    int r;
+    
+    /* Once it's done, queued is only set again by somebody reloading it */
+    if (res_lockfree && !(arc->queued)) {
+        __sync_synchronize();
+        return;
+    }
+    
+    r = SDL_mutexP(arc->_lock);
+    check_mutex(r);
+    while (arc->queued) {
+        SDL_CondWait(arc->_changed, arc->_lock);
+    }
+    r = SDL_mutexV(arc->_lock);
+    check_mutex(r);
+}
+
+/* Make a new, empty arclist and put it in the table. Call with arc_lock */
+arclist *_new_arc(char *arcname, sid_t hash)
+{
+    arclist *newarclist;
+    int r;
+    
+    r = SDL_mutexP(load_lock);
+    check_mutex(r);
+    snprintf(doing, sizeof(doing), "Initializing archive %s", arcname);
+    ++progress;
+    debug(doing);
+    r = SDL_mutexV(load_lock);
+    check_mutex(r);
+    
+    newarclist = malloc(sizeof(arclist));
+    panic2(newarclist, "Could not allocate memory for new arclist:", arcname);
+    
+    /* Prepare the lock */
+    newarclist->_lock    = SDL_CreateMutex();
+    newarclist->_changed = SDL_CreateCond();
+    
+    /* Prepare other stuff */
+    newarclist->name = intern_name(arcname, hash);
+    newarclist->id   = hash;
+    sid_table_init(&(newarclist->table), ARCLIST_HASH_SIZE, _name_of_res);
+    newarclist->loaded  = 0;
+    newarclist->queued  = FALSE;
+    newarclist->pending = 0;
+    newarclist->refs    = 0;
+    newarclist->doomed  = FALSE;
+    newarclist->pack    = NULL;
+    newarclist->index   = NULL;
+    newarclist->count   = 0;
+    newarclist->packres = NULL;
+    newarclist->arena   = NULL;
+    newarclist->mappings = NULL;
+    newarclist->watched = FALSE;
+    newarclist->stale   = FALSE;
+    newarclist->stamp   = 0;
+    
+    /* Add it to the arclist table */
+    sid_table_insert(&arc_table, hash, newarclist);
+    
+    return newarclist;
+}
+
+/* Ask the loader thread to load an archive, and return straight away */
+arclist *_load_arc_async(char *arcname, sid_t hash)
+{
+    arclist *arc;
+    load_request *req;
+    int r;
+    
+    /* Find it or make it, without anybody else sneaking in */
+    arc = _get_arc_from_chain(hash, arcname);
+    if (arc == NULL) {
+        r = SDL_mutexP(arc_lock);
+        check_mutex(r);
+        arc = sid_table_find(&arc_table, hash, arcname);
+        if (arc == NULL) {
+            arc = _new_arc(arcname, hash);
+        }
+        r = SDL_mutexV(arc_lock);
+        check_mutex(r);
+    }
+    
+    /* Is it loaded? Then there's nothing to lock for */
+    if (res_lockfree && arc->loaded && !(arc->queued)) {
+        return arc;
+    }
+    
+    /* Is it loaded, or on its way? */
+    r = SDL_mutexP(arc->_lock);
+    check_mutex(r);
+    if (arc->loaded || arc->queued) {
+        r = SDL_mutexV(arc->_lock);
+        check_mutex(r);
+        return arc;
+    }
+    arc->queued = TRUE;
+    r = SDL_mutexV(arc->_lock);
+    check_mutex(r);
+    
+    /* If not, put it on the queue */
+    req = malloc(sizeof(load_request));
+    panic2(req, "Couldn't allocate memory for load request", arcname);
+    req->next = NULL;
+    req->arc  = arc;
+    
+    r = SDL_mutexP(request_lock);
+    check_mutex(r);
+    if (request_tail) {
+        request_tail->next = req;
+    }
+    else {
+        request_head = req;
+    }
+    request_tail = req;
+    SDL_CondSignal(request_queued);
+    r = SDL_mutexV(request_lock);
+    check_mutex(r);
+    
+    debug2("Queued archive for loading", arcname);
+    
+    return arc;
+}
+
+arclist *load_arc_async(char *arcname)
+{
+    return _load_arc_async(arcname, calculate_sid(arcname));
+}
+
+/* Load an archive, and wait until it's completely done */
+arclist *load_arc(char *arcname)
+{
+    arclist *arc;
+    
+    trace_begin("load_arc");
+    arc = load_arc_async(arcname);
+    if (arc->queued) {
+        _bump_request(arc);
+    }
+    _wait_arc(arc);
+    _wait_decodes(arc);
+    
+    /* Load time is as good a time as any to get back under budget */
+    trim_resources();
+    trace_end("load_arc");
+    
+    return arc;
+}
+
+/*
+ * Evict a decoded image, if nobody's holding on to it
+ * Call with the arclist locked. Returns TRUE if it was evicted.
+ */
+int _evict(resource *res)
+{
+    int r;
+    
+    r = SDL_mutexP(res->_lock);
+    check_mutex(r);
+    
+    if (res->type != RES_IMAGE || !(res->ready) || res->data == NULL ||
+        res->refs > 0) {
+        r = SDL_mutexV(res->_lock);
+        check_mutex(r);
+        return FALSE;
+    }
+    
+    /*
+     * acquire_res adds its ref and then checks ready, so if we take ready
+     * away and then check refs, one of us is bound to see the other
+     */
+    res->ready = FALSE;
+    __sync_synchronize();
+    if (res->refs > 0) {
+        res->ready = TRUE;
+        r = SDL_mutexV(res->_lock);
+        check_mutex(r);
+        return FALSE;
+    }
+    
+    debug2("Evicting image", res->name);
+    SDL_FreeSurface((SDL_Surface*)res->data);
+    __sync_fetch_and_sub(&res_resident, res->bytes);
+    __sync_fetch_and_add(&res_evictions, 1);
+    res->data    = NULL;
+    res->bytes   = 0;
+    res->evicted = TRUE;
+    
+    r = SDL_mutexV(res->_lock);
+    check_mutex(r);
+    return TRUE;
+}
+
+/* Internal function to free an archive */
+void _free_arc(arclist *arc)
+{
+    resource *tempres;
+    Uint32 pos;
+    int r;
+    
+    /* Was it ever made? */
+    if (arc == NULL) {
+        return;
+    }
+    
+    /* Can't free it out from under the loader thread */
+    _wait_arc(arc);
+    
+    /* Keeps trim_resources out while we're at it */
+    r = SDL_mutexP(arc_lock);
+    check_mutex(r);
+    
+    /* Is it freed already? */
+    if (!(arc->loaded)) {
+    }
+    else {
+        /* Can't free images out from under the decode threads */
+        _wait_decodes(arc);
+        
+        /* Lock it */
+        r = SDL_mutexP(arc->_lock);
+        check_mutex(r);
+        
+        /*
+         * Is somebody still holding on to some of it? Then it has to wait
+         * until they let go, but everything else can go now
+         */
+        if (arc->refs > 0) {
+            debug2("Arclist is still held, freeing it later:", arc->name);
+            arc->doomed = TRUE;
+            pos = 0;
+            while ((tempres = sid_table_next(&(arc->table), &pos)) != NULL) {
+                _evict(tempres);
+            }
+            r = SDL_mutexV(arc->_lock);
+            check_mutex(r);
+            r = SDL_mutexV(arc_lock);
+            check_mutex(r);
+            return;
+        }
+        arc->doomed = FALSE;
+        
+        /* Free all resources */
+        debug2("Freeing resources in arclist", arc->name);
+        pos = 0;
+        while ((tempres = sid_table_next(&(arc->table), &pos)) != NULL) {
+            /* Free everything */
+            debug2("Freeing resource", tempres->name);
+            /* Wait, how DO we free it? */
+            if (tempres->type == RES_IMAGE && tempres->data != NULL) {
+                SDL_FreeSurface((SDL_Surface*)tempres->data);
+                __sync_fetch_and_sub(&res_resident, tempres->bytes);
+            }
+            /* The source goes with the mapping or the arena */
+            SDL_DestroyMutex(tempres->_lock);
+            SDL_DestroyCond(tempres->_ready);
+        }
+        
+        /*
+         * A lookup might still be in the table, or just about to look at
+         * a resource it found there, so the table and the memory the
+         * resources live in are retired rather than freed. Tarballs keep
+         * their resources in the arena, and so do reloads
+         */
+        _retire(sid_table_detach(&(arc->table)), arc->arena, arc->packres);
+        arc->arena   = NULL;
+        arc->packres = NULL;
+        
+        /* Reloads can leave newer pack mappings around */
+        while (arc->mappings) {
+            _unmap_file(arc->mappings->pack, arc->mappings->pack_size);
+            arc->mappings = arc->mappings->next;
+        }
+        
+        if (arc->pack) {
+            debug2("Unmapping pack", arc->name);
+            _unmap_file(arc->pack, arc->pack_size);
+            arc->pack    = NULL;
+            arc->index   = NULL;
+            arc->count   = 0;
+        }
+    
+        /* Clean up */
+        arc->loaded = 0;
+        r = SDL_mutexV(arc->_lock);
+        check_mutex(r);
+        
+        debug2("Done freeing archive", arc->name);
+    }
+    
+    r = SDL_mutexV(arc_lock);
+    check_mutex(r);
+    
+    _reclaim_retired();
+} 
+
+/*
+ * Free an archive
+ * Note that the arclist struct STAYS IN MEMORY, but all the resources therein
+ * are freed. If any of them are held, that waits for the last release_res.
+ */
+void free_arc(char *arcname)
+{
+    _free_arc(_get_arc_from_chain(calculate_sid(arcname), arcname));
 }
 
 /* Retrieve something that's been loaded */
 arclist *get_arc(char *arcname)
 {
     arclist *temp;
-    sid_t archash;
-    int r;
     
-    archash = calculate_sid(arcname);
-    temp = _get_arc_from_chain(archash, arcname);
+    temp = _get_arc_from_chain(calculate_sid(arcname), arcname);
     if (temp) {
-        /* If it's being worked on, wait */
-        r = SDL_mutexP(temp->_lock);
-        check_mutex(r);
-        r = SDL_mutexV(temp->_lock);
-        check_mutex(r);
+        /* If it's being worked on, hurry it up and wait */
+        if (temp->queued) {
+            _bump_request(temp);
+        }
+        _wait_arc(temp);
         return temp;
     }
     else {
@@ -560,66 +1864,805 @@ arclist *get_arc(char *arcname)
     }
 }
 
+/*
+ * Call fn for every archive. This doesn't lock anything, since it's for
+ * crash dumps, and whoever crashed might be holding the locks
+ */
+void walk_arcs(void (*fn)(arclist *arc, void *data), void *data)
+{
+    arclist *arc;
+    Uint32 pos = 0;
+    
+    while ((arc = sid_table_next(&arc_table, &pos)) != NULL) {
+        fn(arc, data);
+    }
+}
+
+/*
+ * Retrieve a resource. If its archive is still queued up or being read in,
+ * this only waits as long as it takes for that one resource to turn up.
+ */
 resource *get_res(char *arcname, char *resname)
+{
+    return get_res_sid(arcname, calculate_sid(arcname),
+                       resname, calculate_sid(resname));
+}
+
+resource *get_res_sid(char *arcname, sid_t arcid, char *resname, sid_t resid)
 {
     arclist *temparc;
     resource *tempres;
-    sid_t reshash;
-    int r;
+    int r, slot;
     
-    temparc = get_arc(arcname); 
-    /* Was the arclist freed? */
-    if (!(temparc->loaded)) {
+    temparc = _get_arc_from_chain(arcid, arcname);
+    
+    /*
+     * If it's already in and ready, that's all there is to it
+     * The barrier makes sure the resource's data is seen after ready is
+     */
+    if (res_lockfree && temparc != NULL) {
+        slot    = _read_begin();
+        tempres = sid_table_find(&(temparc->table), resid, resname);
+        if (tempres != NULL && tempres->ready) {
+            __sync_synchronize();
+            _res_hit(tempres);
+            _read_end(slot);
+            return tempres;
+        }
+        _read_end(slot);
+    }
+    
+    if (temparc == NULL) {
+        warn2(FALSE, "Requested arclist was not loaded, loading it now:",
+                arcname);
+        temparc = _load_arc_async(arcname, arcid);
+    }
+    else if (!(temparc->loaded) && !(temparc->queued)) {
         warn2(FALSE, "Arclist was loaded but has since been freed, reloading:",
                 arcname);
-        temparc = load_arc(arcname);
+        _load_arc_async(arcname, arcid);
+    }
+    
+    /* Somebody's waiting on it now, so it goes to the front of the queue */
+    if (!(temparc->loaded)) {
+        _bump_request(temparc);
     }
     
-    reshash = calculate_sid(resname);
-    /* Look for the resource we want */
+    /* Look for the resource we want, until it turns up or can't */
     r = SDL_mutexP(temparc->_lock);
     check_mutex(r);
-    for (tempres = temparc->map[reshash%ARCLIST_HASH_SIZE];
-         tempres != NULL && tempres->id < reshash; tempres = tempres->next);
+    for (;;) {
+        tempres = sid_table_find(&(temparc->table), resid, resname);
+        if (tempres != NULL || temparc->loaded) {
+            break;
+        }
+        SDL_CondWait(temparc->_changed, temparc->_lock);
+    }
+    r = SDL_mutexV(temparc->_lock);
+    check_mutex(r);
     
-    /* Did we reach the end of the list? */
     if (tempres == NULL) {
-        r = SDL_mutexV(temparc->_lock);
-        check_mutex(r);
         warn2(FALSE, "Arclist didn't have the requested resource:", resname);
         return NULL;
     }
     
-    /* If there's a hash tie, check for strings */
-    if (tempres->id == reshash) {
-        for(; tempres != NULL && strcmp(tempres->name, resname) < 0;
-            tempres = tempres->next);
-        /* Did we go too far? */
-        if (strcmp(tempres->name, resname) > 0) {
-            tempres = NULL;
+    /*
+     * If it's still being decoded, hurry it up and wait
+     * If it's been evicted, it needs decoding all over again
+     */
+    r = SDL_mutexP(tempres->_lock);
+    check_mutex(r);
+    if (tempres->ready) {
+        _res_hit(tempres);
+    }
+    else {
+        __sync_fetch_and_add(&res_misses, 1);
+        if (tempres->evicted) {
+            debug2("Decoding evicted image again:", tempres->name);
+            __sync_fetch_and_add(&res_redecodes, 1);
+            tempres->evicted   = FALSE;
+            tempres->last_used = res_epoch;
+            if (num_decode_threads > 0) {
+                _queue_decode(temparc, tempres);
+            }
+            else {
+                _doctor_resource(tempres);
+                _resource_ready(tempres);
+            }
         }
+        _bump_decode(tempres);
     }
-    /* Did we go too far? */
-    else if (tempres->id > reshash) {
-        tempres = NULL;
+    while (!(tempres->ready)) {
+        SDL_CondWait(tempres->_ready, tempres->_lock);
     }
-    
-    r = SDL_mutexV(temparc->_lock);
+    r = SDL_mutexV(tempres->_lock);
     check_mutex(r);
     
-    /* Check again for NULL, since we may have set NULL since then */
-    if (tempres == NULL) {
-        warn2(FALSE, "Arclist didn't have the requested resource:", resname);
+    return tempres;
+}
+
+/* Get a resource and hold on to it until release_res */
+resource *acquire_res(char *arcname, char *resname)
+{
+    return acquire_res_sid(arcname, calculate_sid(arcname),
+                           resname, calculate_sid(resname));
+}
+
+resource *acquire_res_sid(char *arcname, sid_t arcid,
+                          char *resname, sid_t resid)
+{
+    resource *res;
+    
+    res = get_res_sid(arcname, arcid, resname, resid);
+    if (res == NULL) {
         return NULL;
     }
     
-    /* If it's being worked on, wait */
-    r = SDL_mutexP(tempres->_lock);
+    __sync_fetch_and_add(&(res->arc->refs), 1);
+    __sync_fetch_and_add(&(res->refs), 1);
+    
+    /* Evicted before the ref went in? It can't be again now, so get it back */
+    if (!(res->ready)) {
+        get_res_sid(arcname, arcid, resname, resid);
+    }
+    
+    return res;
+}
+
+/* Let go of a resource from acquire_res */
+void release_res(resource *res)
+{
+    arclist *arc;
+    int r;
+    
+    arc = res->arc;
+    warn2(res->refs > 0, "Released a resource that wasn't held:", res->name);
+    __sync_fetch_and_sub(&(res->refs), 1);
+    
+    /* If it was the last thing holding up free_arc, finish it off */
+    if (__sync_sub_and_fetch(&(arc->refs), 1) == 0) {
+        r = SDL_mutexP(arc->_lock);
+        check_mutex(r);
+        if (arc->doomed && arc->refs == 0) {
+            arc->doomed = FALSE;
+            r = SDL_mutexV(arc->_lock);
+            check_mutex(r);
+            _free_arc(arc);
+            return;
+        }
+        r = SDL_mutexV(arc->_lock);
+        check_mutex(r);
+    }
+}
+
+void set_res_budget(size_t bytes)
+{
+    res_budget = bytes;
+    debugn("Decoded image budget set to KiB:", (int)(bytes / 1024));
+}
+
+size_t get_res_budget(void)
+{
+    return res_budget;
+}
+
+int _compare_last_used(const void *a, const void *b)
+{
+    Uint32 x = (*(resource* const*)a)->last_used;
+    Uint32 y = (*(resource* const*)b)->last_used;
+    
+    return (x > y) - (x < y);
+}
+
+/*
+ * Start a new epoch, free what free_arc retired if nobody can be looking
+ * at it any more, and if we're over budget, evict images that aren't
+ * held, least recently used first, until we aren't
+ */
+void trim_resources(void)
+{
+    arclist *arc;
+    resource *res, **lru = NULL;
+    Uint32 arcpos, pos, count = 0, size = 0, i;
+    int r;
+    
+    __sync_fetch_and_add(&res_epoch, 1);
+    _reclaim_retired();
+    if (res_budget == 0 || res_resident <= res_budget) {
+        return;
+    }
+    
+    r = SDL_mutexP(arc_lock);
     check_mutex(r);
-    r = SDL_mutexV(tempres->_lock);
+    
+    /* Round up everything that could go */
+    arcpos = 0;
+    while ((arc = sid_table_next(&arc_table, &arcpos)) != NULL) {
+        r = SDL_mutexP(arc->_lock);
+        check_mutex(r);
+        pos = 0;
+        while ((res = sid_table_next(&(arc->table), &pos)) != NULL) {
+            if (res->type != RES_IMAGE || !(res->ready) || res->refs > 0) {
+                continue;
+            }
+            if (count == size) {
+                size = size ? size * 2 : 64;
+                lru  = realloc(lru, size * sizeof(resource*));
+                panic(lru, "Couldn't allocate memory to trim resources");
+            }
+            lru[count++] = res;
+        }
+        r = SDL_mutexV(arc->_lock);
+        check_mutex(r);
+    }
+    
+    qsort(lru, count, sizeof(resource*), _compare_last_used);
+    for (i = 0; i < count && res_resident > res_budget; ++i) {
+        r = SDL_mutexP(lru[i]->arc->_lock);
+        check_mutex(r);
+        _evict(lru[i]);
+        r = SDL_mutexV(lru[i]->arc->_lock);
+        check_mutex(r);
+    }
+    free(lru);
+    
+    r = SDL_mutexV(arc_lock);
     check_mutex(r);
     
-    return tempres;
+    warn(res_resident <= res_budget,
+         "Over the image budget, but everything left is held");
+}
+
+void get_res_stats(res_stats *stats)
+{
+    int i;
+    
+    stats->hits = 0;
+    for (i = 0; i < HIT_STRIPES; ++i) {
+        stats->hits += res_hits[i].hits;
+    }
+    stats->misses    = res_misses;
+    stats->evictions = res_evictions;
+    stats->redecodes = res_redecodes;
+    stats->resident  = res_resident;
+    stats->budget    = res_budget;
+    stats->allocs    = res_allocs;
+    stats->arena     = res_arena;
+}
+
+void reset_res_stats(void)
+{
+    int i;
+    
+    for (i = 0; i < HIT_STRIPES; ++i) {
+        res_hits[i].hits = 0;
+    }
+    res_misses    = 0;
+    res_evictions = 0;
+    res_redecodes = 0;
+    res_allocs    = 0;
+}
+
+/*
+ * Hot reloading
+ * reload_arc runs on whichever thread calls it, with arc_lock held so
+ * trim_resources and free_arc keep out, and the loader and decode threads
+ * are left alone with every other archive.
+ */
+int hot_reload = FALSE;
+
+void (*reload_hooks[MAX_RELOAD_HOOKS])(resource *res);
+int num_reload_hooks = 0;
+
+/* Where tarball entries are read to be hashed, grown as needed */
+void     *reload_scratch      = NULL;
+size_t    reload_scratch_size = 0;
+
+/* The resources that changed in the last reload, for the hooks */
+resource **reload_changed     = NULL;
+int        num_reload_changed = 0;
+int        max_reload_changed = 0;
+
+#ifndef _WIN32
+/* Archives are watched by directory, so files written by renaming count */
+#define MAX_RELOAD_WATCHES 16
+#define RELOAD_PATH        256
+
+typedef struct reload_watch_ reload_watch;
+struct reload_watch_ {
+    int  wd;
+    char dir[RELOAD_PATH];
+};
+
+int          reload_fd = -1;
+reload_watch reload_watches[MAX_RELOAD_WATCHES];
+int          num_reload_watches = 0;
+#endif
+
+void add_reload_hook(void (*hook)(resource *res))
+{
+    int i;
+    
+    for (i = 0; i < num_reload_hooks; ++i) {
+        if (reload_hooks[i] == hook) return;
+    }
+    
+    panic(num_reload_hooks < MAX_RELOAD_HOOKS, "Too many reload hooks");
+    reload_hooks[num_reload_hooks++] = hook;
+}
+
+/* Remember that a resource changed, for the hooks */
+void _reload_changed(resource *res)
+{
+    if (num_reload_changed == max_reload_changed) {
+        max_reload_changed = max_reload_changed ? max_reload_changed * 2 : 64;
+        reload_changed = realloc(reload_changed,
+                                 max_reload_changed * sizeof(resource*));
+        panic(reload_changed, "Couldn't allocate memory for reload");
+    }
+    reload_changed[num_reload_changed++] = res;
+}
+
+/*
+ * Bring one entry of an archive being reloaded up to date, if its contents
+ * have changed. data is wherever the new contents are right now; unless
+ * that's a mapping that's staying, they're copied into the arena.
+ * Returns TRUE if it changed. Call with arc_lock.
+ */
+int _reload_entry(arclist *arc, char *name, void *data, size_t size,
+                  Uint32 hash, int mapped)
+{
+    resource *res;
+    SDL_Surface *old, *img;
+    size_t oldbytes;
+    void *copy;
+    sid_t id;
+    int r;
+    
+    id  = calculate_sid(name);
+    res = sid_table_find(&(arc->table), id, name);
+    if (res != NULL && res->hash == hash && res->size == (Sint64)size) {
+        return FALSE;
+    }
+    
+    if (!mapped) {
+        copy = _arena_alloc(arc, size);
+        memcpy(copy, data, size);
+        data = copy;
+    }
+    
+    /* Something new, so it goes in just like it would have when loading */
+    if (res == NULL) {
+        debug2("Reload found new resource", name);
+        res = _arena_alloc(arc, sizeof(resource));
+        res->name   = intern_name(name, id);
+        res->id     = id;
+        res->type   = get_restype(name);
+        res->size   = size;
+        res->arc    = arc;
+        res->source = data;
+        res->data   = NULL;
+        res->mapped = mapped;
+        res->hash   = hash;
+        res->bytes  = 0;
+        res->refs   = 0;
+        res->last_used = res_epoch;
+        res->evicted   = FALSE;
+        res->_lock  = SDL_CreateMutex();
+        res->_ready = SDL_CreateCond();
+        res->ready  = FALSE;
+        
+        _doctor_resource(res);
+        _resource_ready(res);
+        
+        r = SDL_mutexP(arc->_lock);
+        check_mutex(r);
+        sid_table_insert(&(arc->table), id, res);
+        SDL_CondBroadcast(arc->_changed);
+        r = SDL_mutexV(arc->_lock);
+        check_mutex(r);
+        
+        _reload_changed(res);
+        return TRUE;
+    }
+    
+    debug2("Reloading changed resource", name);
+    r = SDL_mutexP(res->_lock);
+    check_mutex(r);
+    
+    res->source = data;
+    res->size   = size;
+    res->mapped = mapped;
+    res->hash   = hash;
+    
+    if (res->type != RES_IMAGE) {
+        res->data = res->source;
+    }
+    /* Evicted images just get decoded from the new source next time */
+    else if (res->data != NULL) {
+        old      = (SDL_Surface*) res->data;
+        oldbytes = res->bytes;
+        _doctor_resource(res);
+        img = (SDL_Surface*) res->data;
+        
+        if (img == NULL) {
+            /* Probably caught it half-written, there'll be another go */
+            res->data  = old;
+            res->bytes = oldbytes;
+            __sync_fetch_and_add(&res_resident, oldbytes);
+        }
+        else if (img->w == old->w && img->h == old->h) {
+            /* Draw it over the old one, so every pointer to that's good */
+            SDL_BlitSurface(img, NULL, old, NULL);
+            SDL_FreeSurface(img);
+            res->data = old;
+        }
+        else if (res->refs > 0) {
+            /*
+             * Whoever's holding it might have its size worked into
+             * something, so it stays until it's let go and evicted, and
+             * then the new source gets decoded
+             */
+            warn2(FALSE, "Held image changed size, keeping the old one:",
+                  name);
+            __sync_fetch_and_sub(&res_resident, res->bytes);
+            __sync_fetch_and_add(&res_resident, oldbytes);
+            SDL_FreeSurface(img);
+            res->data  = old;
+            res->bytes = oldbytes;
+        }
+        else {
+            SDL_FreeSurface(old);
+        }
+        __sync_fetch_and_sub(&res_resident, oldbytes);
+    }
+    
+    r = SDL_mutexV(res->_lock);
+    check_mutex(r);
+    
+    _reload_changed(res);
+    return TRUE;
+}
+
+/* Read a tarball in again, returns the number of entries that changed */
+int _reload_tgz(arclist *arc)
+{
+    struct archive *newarc;
+    struct archive_entry *entry;
+    void *input;
+    size_t input_size, size;
+    int changed = 0;
+    
+    newarc = _open_tgz(arc->name, &input, &input_size);
+    if (newarc == NULL) {
+        warn2(FALSE, "Couldn't open archive to reload it", arc->name);
+        return 0;
+    }
+    
+    while (archive_read_next_header(newarc, &entry) == ARCHIVE_OK) {
+        size = (size_t) archive_entry_size(entry);
+        if (size > reload_scratch_size) {
+            reload_scratch = realloc(reload_scratch, size);
+            panic2(reload_scratch, "Couldn't allocate memory to reload",
+                   arc->name);
+            reload_scratch_size = size;
+        }
+        archive_read_data(newarc, reload_scratch, size);
+        
+        changed += _reload_entry(arc, (char*) archive_entry_pathname(entry),
+                                 reload_scratch, size,
+                                 calculate_hash(reload_scratch, size), FALSE);
+    }
+    
+    _close_tgz(newarc, input, input_size);
+    
+    return changed;
+}
+
+/*
+ * Map a pack in again, returns the number of entries that changed. The
+ * hashes are in the index, so unchanged entries' data is never touched.
+ */
+int _reload_pack(arclist *arc)
+{
+    pack_header *header;
+    pack_entry *index;
+    pack_mapping *mapping;
+    void *pack;
+    size_t pack_size;
+    char *name;
+    Uint32 i;
+    int changed = 0;
+    
+    pack = _map_file(arc->name, &pack_size);
+    if (pack == NULL || !_pack_ok(pack, pack_size)) {
+        warn2(FALSE, "Couldn't map pack to reload it", arc->name);
+        if (pack != NULL) {
+            _unmap_file(pack, pack_size);
+        }
+        return 0;
+    }
+    
+    header = (pack_header*) pack;
+    index  = (pack_entry*)((Uint8*)pack + sizeof(pack_header));
+    
+    for (i = 0; i < header->count; ++i) {
+        name = _pack_entry_name(pack, pack_size, &(index[i]));
+        if (name == NULL) {
+            warn2(FALSE, "Skipping a broken entry in", arc->name);
+            continue;
+        }
+        changed += _reload_entry(arc, name, (Uint8*)pack + index[i].offset,
+                                 index[i].size, index[i].hash, TRUE);
+    }
+    
+    /* Whatever changed points into the new mapping now, so it stays */
+    if (changed > 0) {
+        mapping = _arena_alloc(arc, sizeof(pack_mapping));
+        mapping->pack      = pack;
+        mapping->pack_size = pack_size;
+        mapping->next      = arc->mappings;
+        arc->mappings      = mapping;
+    }
+    else {
+        _unmap_file(pack, pack_size);
+    }
+    
+    return changed;
+}
+
+int reload_arc(char *arcname)
+{
+    arclist *arc;
+    Uint32 start;
+    char took[64];
+    int changed, i, j, r;
+    
+    arc = _get_arc_from_chain(calculate_sid(arcname), arcname);
+    if (arc == NULL) {
+        return 0;
+    }
+    
+    /* Let the loader thread finish with it first */
+    _wait_arc(arc);
+    
+    r = SDL_mutexP(arc_lock);
+    check_mutex(r);
+    
+    /* Not loaded, or being loaded again anyway? Nothing to do then */
+    if (!(arc->loaded) || arc->queued || arc->doomed) {
+        r = SDL_mutexV(arc_lock);
+        check_mutex(r);
+        return 0;
+    }
+    
+    /* The decode threads might still have some of its images */
+    _wait_decodes(arc);
+    
+    start = SDL_GetTicks();
+    num_reload_changed = 0;
+    if (arc->pack) {
+        changed = _reload_pack(arc);
+    }
+    else {
+        changed = _reload_tgz(arc);
+    }
+    
+    r = SDL_mutexV(arc_lock);
+    check_mutex(r);
+    
+    /* Let everybody who made something out of them know */
+    for (i = 0; i < num_reload_changed; ++i) {
+        for (j = 0; j < num_reload_hooks; ++j) {
+            reload_hooks[j](reload_changed[i]);
+        }
+    }
+    
+    sprintf(took, "%d changed, took %u ms:", changed,
+            (unsigned) (SDL_GetTicks() - start));
+    debug2(took, arc->name);
+    
+    return changed;
+}
+
+#ifdef _WIN32
+/* No inotify, so just look at the modification times */
+void _check_watches(void)
+{
+    arclist *arc;
+    struct stat st;
+    Uint32 pos;
+    int r;
+    
+    r = SDL_mutexP(arc_lock);
+    check_mutex(r);
+    pos = 0;
+    while ((arc = sid_table_next(&arc_table, &pos)) != NULL) {
+        if (!(arc->loaded) || stat(arc->name, &st) != 0) continue;
+        
+        if (arc->watched && arc->stamp != (long) st.st_mtime) {
+            arc->stale = TRUE;
+        }
+        arc->stamp   = (long) st.st_mtime;
+        arc->watched = TRUE;
+    }
+    r = SDL_mutexV(arc_lock);
+    check_mutex(r);
+}
+#else
+/* Watch the directory an archive is in, if it isn't already */
+void _watch_arc(arclist *arc)
+{
+    char dir[RELOAD_PATH];
+    char *slash;
+    int i;
+    
+    arc->watched = TRUE;
+    
+    strncpy(dir, arc->name, RELOAD_PATH - 1);
+    dir[RELOAD_PATH - 1] = '\0';
+    slash = strrchr(dir, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+    }
+    else {
+        strcpy(dir, ".");
+    }
+    
+    for (i = 0; i < num_reload_watches; ++i) {
+        if (strcmp(reload_watches[i].dir, dir) == 0) return;
+    }
+    
+    if (num_reload_watches == MAX_RELOAD_WATCHES) {
+        warn2(FALSE, "Too many directories to watch, not watching", dir);
+        return;
+    }
+    
+    reload_watches[num_reload_watches].wd =
+        inotify_add_watch(reload_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (reload_watches[num_reload_watches].wd < 0) {
+        warn2(FALSE, "Couldn't watch directory", dir);
+        return;
+    }
+    strcpy(reload_watches[num_reload_watches].dir, dir);
+    ++num_reload_watches;
+    debug2("Watching for reloads in", dir);
+}
+
+/* Mark every archive that's been written to since last time as stale */
+void _check_watches(void)
+{
+    union {
+        struct inotify_event ev;
+        char buf[4096];
+    } events;
+    struct inotify_event *ev;
+    char path[RELOAD_PATH * 2];
+    arclist *arc;
+    Uint32 pos;
+    ssize_t len, at;
+    int i, r;
+    
+    /* Pick up anything loaded since last time */
+    r = SDL_mutexP(arc_lock);
+    check_mutex(r);
+    pos = 0;
+    while ((arc = sid_table_next(&arc_table, &pos)) != NULL) {
+        if (arc->loaded && !(arc->watched)) {
+            _watch_arc(arc);
+        }
+    }
+    r = SDL_mutexV(arc_lock);
+    check_mutex(r);
+    
+    /* The descriptor doesn't block, so this stops when there's no more */
+    while ((len = read(reload_fd, events.buf, sizeof(events.buf))) > 0) {
+        for (at = 0; at < len; at += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event*)(events.buf + at);
+            if (ev->len == 0) continue;
+            
+            for (i = 0; i < num_reload_watches; ++i) {
+                if (reload_watches[i].wd != ev->wd) continue;
+                
+                if (strcmp(reload_watches[i].dir, ".") == 0) {
+                    strcpy(path, ev->name);
+                }
+                else {
+                    sprintf(path, "%s/%.*s", reload_watches[i].dir,
+                            RELOAD_PATH - 1, ev->name);
+                }
+                
+                arc = _get_arc_from_chain(calculate_sid(path), path);
+                if (arc != NULL) {
+                    arc->stale = TRUE;
+                }
+            }
+        }
+    }
+}
+#endif
+
+/* Take the stale flag off the next stale archive, NULL if there isn't one */
+arclist *_next_stale(void)
+{
+    arclist *arc;
+    Uint32 pos;
+    int r;
+    
+    r = SDL_mutexP(arc_lock);
+    check_mutex(r);
+    pos = 0;
+    while ((arc = sid_table_next(&arc_table, &pos)) != NULL) {
+        if (arc->stale) {
+            arc->stale = FALSE;
+            break;
+        }
+    }
+    r = SDL_mutexV(arc_lock);
+    check_mutex(r);
+    
+    return arc;
+}
+
+int poll_reloads(void)
+{
+    arclist *arc;
+    int changed = 0;
+    
+    if (!hot_reload) {
+        return 0;
+    }
+    
+    _check_watches();
+    
+    /* Archives are reloaded one at a time, in case a hook loads another */
+    while ((arc = _next_stale()) != NULL) {
+        changed += reload_arc(arc->name);
+    }
+    
+    return changed;
+}
+
+void set_hot_reload(int on)
+{
+    arclist *arc;
+    Uint32 pos;
+    int r;
+    
+    if (on == hot_reload) {
+        return;
+    }
+    
+#ifndef _WIN32
+    if (on) {
+        reload_fd = inotify_init1(IN_NONBLOCK);
+        warn(reload_fd >= 0, "Couldn't start watching files for reloads");
+        if (reload_fd < 0) return;
+    }
+    else {
+        close(reload_fd);
+        reload_fd = -1;
+        num_reload_watches = 0;
+    }
+#endif
+    
+    /* Everything gets watched again from scratch */
+    r = SDL_mutexP(arc_lock);
+    check_mutex(r);
+    pos = 0;
+    while ((arc = sid_table_next(&arc_table, &pos)) != NULL) {
+        arc->watched = FALSE;
+        arc->stale   = FALSE;
+    }
+    r = SDL_mutexV(arc_lock);
+    check_mutex(r);
+    
+    hot_reload = on;
+}
+
+int get_hot_reload(void)
+{
+    return hot_reload;
 }
 
 /* Initialize stuff needed by all resource functions */
@@ -627,29 +2670,75 @@ void init_resources(void)
 {
     arc_lock = SDL_CreateMutex();
     load_lock = SDL_CreateMutex();
+    
+    intern_lock = SDL_CreateMutex();
+    sid_table_init(&intern_table, 64, _name_of_string);
+    arena_lock  = SDL_CreateMutex();
+    retire_lock = SDL_CreateMutex();
+    sid_table_init(&arc_table, 4, _name_of_arc);
+    
+    decode_lock     = SDL_CreateMutex();
+    decode_queued   = SDL_CreateCond();
+    decode_finished = SDL_CreateCond();
+    set_decode_threads(DECODE_THREADS);
+    
+    request_lock   = SDL_CreateMutex();
+    request_queued = SDL_CreateCond();
+    loader_kill    = FALSE;
+    loader_thread  = SDL_CreateThread(_loader_worker, NULL);
+    panic(loader_thread, "Couldn't start loader thread");
+    
     debug("Resource loader initialized");
 }
 
 void stop_resources(void)
 {
-    arclist *temparc, *nextarc;
+    arclist *temparc;
+    load_request *req;
+    intern_block *block;
+    arena_block *spare;
+    decode_job *job;
+    Uint32 pos;
     int r;
     
+    /*
+     * Stop the loader thread first, once it's done with whatever it's
+     * reading in right now. Anything else still queued is just dropped.
+     */
+    debug("Stopping loader thread");
+    r = SDL_mutexP(request_lock);
+    check_mutex(r);
+    loader_kill = TRUE;
+    SDL_CondSignal(request_queued);
+    while (request_head) {
+        req = request_head;
+        request_head = req->next;
+        req->arc->queued = FALSE;
+        free(req);
+    }
+    request_tail = NULL;
+    r = SDL_mutexV(request_lock);
+    check_mutex(r);
+    SDL_WaitThread(loader_thread, NULL);
+    
+    set_hot_reload(FALSE);
+    
     /*
      * Clear EVERYTHING
      * We can safely assume that this will be called at a time when
      * nothing else needs anything we have loaded
      * Thus, we may hack away with impunity
-     * Just to be safe, though, we'll still lock/unlock the arclist chain
+     * Just to be safe, though, we'll still lock/unlock the arclist table
      */
     
     r = SDL_mutexP(arc_lock);
     check_mutex(r);
-    temparc = arc_head;
-    while (temparc) {
+    pos = 0;
+    while ((temparc = sid_table_next(&arc_table, &pos)) != NULL) {
         debug2("Clearing arclist", temparc->name);
         
-        /* Is it still loaded? If so, free it */
+        /* Is it still loaded? If so, free it, held or not */
+        temparc->refs = 0;
         if (temparc->loaded) {
             debug2("Arclist still loaded, freeing it:", temparc->name);
             _free_arc(temparc);
@@ -658,18 +2747,64 @@ void stop_resources(void)
         /* Now go to work on its guts */
         debug2("Freeing arclist memory:", temparc->name);
         SDL_DestroyMutex(temparc->_lock);
-        nextarc = temparc->next;
+        SDL_DestroyCond(temparc->_changed);
+        sid_table_free(&(temparc->table));
         free(temparc);
-        temparc = nextarc;
         
         debug("Arclist freed");
     }
+    sid_table_free(&arc_table);
     r = SDL_mutexV(arc_lock);
     check_mutex(r);
     
+    debug("Stopping decode threads");
+    _stop_decode_threads();
+    
     debug("Freeing miscellaneous memory");
     SDL_DestroyMutex(arc_lock);
     SDL_DestroyMutex(load_lock);
+    SDL_DestroyMutex(decode_lock);
+    SDL_DestroyCond(decode_queued);
+    SDL_DestroyCond(decode_finished);
+    SDL_DestroyMutex(request_lock);
+    SDL_DestroyCond(request_queued);
+    
+    while (intern_head) {
+        block = intern_head;
+        intern_head = block->next;
+        free(block);
+    }
+    sid_table_free(&intern_table);
+    SDL_DestroyMutex(intern_lock);
+    
+    /* Everything's stopped, so nobody can be looking at any of it */
+    _free_retired(retire_old);
+    _free_retired(retire_new);
+    retire_old = NULL;
+    retire_new = NULL;
+    SDL_DestroyMutex(retire_lock);
+    
+    while (arena_spare) {
+        spare = arena_spare;
+        arena_spare = spare->next;
+        __sync_fetch_and_sub(&res_arena, ARENA_HEADER + spare->size);
+        free(spare);
+    }
+    arena_spares = 0;
+    SDL_DestroyMutex(arena_lock);
+    
+    while (decode_spare) {
+        job = decode_spare;
+        decode_spare = job->next;
+        free(job);
+    }
+    
+    free(reload_scratch);
+    free(reload_changed);
+    reload_scratch      = NULL;
+    reload_scratch_size = 0;
+    reload_changed      = NULL;
+    max_reload_changed  = 0;
     
     debug("Resources stopped and ready for engine closure.");
 }
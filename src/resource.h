@@ -28,29 +28,112 @@
 #endif
 
 /*
- * Here, we're using a hash map to store the different resources
- * loaded from a single archive.
- * It's an open hash map, so it handles collisions gracefully.
- * Each entry in the map is essentially a pointer to a linked list.
- * We're not worried about dynamic allocation here, because resources
- * will only be loaded and unloaded during load times.
- *
- * The arclists themselves are stored in a linked list. This will
- * be searched linearly; there won't be enough archives loaded to
- * worry about this.
- *
- * Outside code will interface with this system using strings. Again,
- * no reason to worry about performance overhead. When a piece of
+ * Resources and archives are looked up by name through sid_tables, flat
+ * open-addressing hash tables (see below). There's one for the archives
+ * and one per archive for its resources.
+ *
+ * Outside code will interface with this system using strings, and can
+ * use GET_RES to have the hashing done at compile time. When a piece of
  * code needs to keep track of a resource for later retrieval, it will
  * store the pointer to the resource structure.
  *
+ * Names are interned, so they can be any length, and each name is only
+ * stored once no matter how many times its archive is loaded.
+ *
  * Unloading a resource will free the memory used for its data.
  * Unloading an archive will free the memory used for all of its loaded
- * resources, all of its resource entries, and its arclist structure.
+ * resources and all of its resource entries. Its arclist structure
+ * stays around in case it's loaded again.
  */
 
+/*
+ * String IDs are 32-bit FNV-1a hashes of the name
+ * NOTE TO SELF: If I ever change this algorithm, be sure to change the
+ * precalculated hashes below, SID, and PACK_VERSION!
+ */
 typedef Uint32 sid_t;
 
+#define SID_BASIS 2166136261U
+#define SID_PRIME 16777619U
+
+/*
+ * SID("name") works out calculate_sid("name") at compile time. It only
+ * works on string literals, of up to SID_MAX_LITERAL characters; longer
+ * ones won't compile. Every character position is unrolled, the ones past
+ * the end of the string just don't change the hash.
+ */
+#define SID_MAX_LITERAL 32
+
+#define _SID_IN(s, i)   ((i) < sizeof(s) - 1)
+#define _SID_C(s, i, h) \
+    (((h) ^ (_SID_IN(s, i) ? (Uint8)(s)[_SID_IN(s, i) ? (i) : 0] : 0U)) * \
+     (_SID_IN(s, i) ? SID_PRIME : 1U))
+#define _SID4(s, i, h) \
+    _SID_C(s, (i)+3, _SID_C(s, (i)+2, _SID_C(s, (i)+1, _SID_C(s, i, h))))
+#define _SID32(s) \
+    _SID4(s, 28, _SID4(s, 24, _SID4(s, 20, _SID4(s, 16, \
+    _SID4(s, 12, _SID4(s, 8, _SID4(s, 4, _SID4(s, 0, SID_BASIS))))))))
+
+#define SID(s) \
+    ((sid_t)(sizeof(char[sizeof(s) <= SID_MAX_LITERAL + 1 ? 1 : -1]) * 0 + \
+             _SID32(s)))
+
+/*
+ * sid_table
+ * Open addressing, probing a bucket at a time. Each bucket is one cache
+ * line, with the full hashes of its slots next to the items, so a lookup
+ * usually touches one line and only compares names on a full hash match.
+ * name_of gets an item's name for that. Items can't be removed one at a
+ * time, only all at once, so an empty slot ends a search.
+ *
+ * Inserts have to be locked against each other, but sid_table_find needs
+ * no lock at all. Slots are filled in id first, and only then the item,
+ * and a table that grows is built off to the side and swapped in with one
+ * pointer, so a reader racing an insert either finds an item or misses
+ * it, never anything half-made. The arrays a table has grown out of are
+ * kept until the table is freed, since a reader might still be in one.
+ * Emptying a table is the same: sid_table_detach swaps in a new array,
+ * and whoever called it frees the old one with sid_array_free once no
+ * reader can still be in it.
+ */
+#define SID_BUCKET_SLOTS (CACHE_LINE / (sizeof(sid_t) + sizeof(void*)))
+
+typedef struct sid_bucket sid_bucket;
+struct sid_bucket {
+    sid_t  id[SID_BUCKET_SLOTS];
+    void  *item[SID_BUCKET_SLOTS];
+};
+
+typedef struct sid_array sid_array;
+struct sid_array {
+    sid_bucket *buckets;
+    /* Number of buckets - 1, there's always a power of 2 */
+    Uint32      mask;
+    /* The smaller array this one replaced */
+    sid_array  *retired;
+};
+
+typedef struct sid_table sid_table;
+struct sid_table {
+    sid_array *array;
+    Uint32     count;
+    char    *(*name_of)(void *item);
+};
+
+extern void  sid_table_init(sid_table *t, Uint32 size,
+                            char *(*name_of)(void *item));
+extern void  sid_table_free(sid_table *t);
+extern sid_array *sid_table_detach(sid_table *t);
+/* Free an array, and the ones it grew out of */
+extern void  sid_array_free(sid_array *array);
+extern void *sid_table_find(sid_table *t, sid_t id, char *name);
+extern void  sid_table_insert(sid_table *t, sid_t id, void *item);
+/* Go through every item, start with *pos at 0. Returns NULL at the end */
+extern void *sid_table_next(sid_table *t, Uint32 *pos);
+
+/* Get the one copy of a name, making it if need be */
+extern char *intern_name(char *name, sid_t id);
+
 /*
  * Enum for telling us what resource type we're looking at
  * Some of these might be handled differently when being loaded, so this
@@ -69,15 +152,78 @@ typedef enum {
 
 /* 
  * Precalculated hashes, used to detect filetype from extension
- * e.g. PNG_HASH is the result of calculate_sid(".png")
+ * e.g. PNG_HASH is the result of calculate_sid(".png"). SID can't be used
+ * for these, they need to be constant enough for case labels.
  */
-#define PNG_HASH 0x5c4046f0
-#define BIN_HASH 0x090e5a36
-#define MID_HASH 0xefe92d02
-#define OGG_HASH 0x3cb30fc1
-#define LUA_HASH 0xf4af8b0f
-#define TXT_HASH 0x1c6ca03e
-#define MAP_HASH 0x0dc0b9a8
+#define PNG_HASH 0x433f52e0
+#define BIN_HASH 0xf06df42a
+#define MID_HASH 0xc291c619
+#define OGG_HASH 0x98b14a80
+#define LUA_HASH 0x51dfa555
+#define TXT_HASH 0x044862c3
+#define MAP_HASH 0xe67e770d
+#define BRP_HASH 0xf4b0e063
+
+/*
+ * Resource packs
+ * Besides gzipped tarballs, load_arc can load our own .brp packs, made from
+ * the tarballs by brpack ("make packs"). A pack is laid out like this:
+ *
+ *   pack_header
+ *   pack_entry[count]
+ *   the names, nul-terminated
+ *   padding up to the next PACK_PAGE boundary
+ *   the resources themselves, each starting on a PACK_ALIGN boundary
+ *
+ * Packs are loaded by mapping the whole file into memory, so resources
+ * other than images are never copied, their data points straight into the
+ * mapping. The index and names come first and on their own pages, so
+ * building the arclist's table only ever touches those.
+ *
+ * Each index entry has a hash of its resource's contents, so a reload can
+ * tell what's changed without reading any of the data.
+ *
+ * Everything is stored in native byte order, so packs aren't portable
+ * between machines with different endianness. Just rebuild them.
+ */
+#define PACK_MAGIC   "BRPK"
+#define PACK_VERSION 3
+#define PACK_PAGE    4096
+#define PACK_ALIGN   64
+
+typedef struct pack_header pack_header;
+struct pack_header {
+    char   magic[4];
+    Uint32 version;
+    Uint32 count;
+    /* Offset of the first resource from the start of the file */
+    Uint32 data;
+};
+
+typedef struct pack_entry pack_entry;
+struct pack_entry {
+    sid_t  id;
+    Uint32 type;
+    Uint32 offset;
+    Uint32 size;
+    /* Offset of the name from the start of the file */
+    Uint32 name;
+    /* calculate_hash of the contents */
+    Uint32 hash;
+};
+
+typedef struct arclist arclist;
+
+/* A block of memory a tarball is loaded into, see resource.c */
+typedef struct arena_block_ arena_block;
+
+/* A newer mapping of a pack, made by a reload, kept until free_arc */
+typedef struct pack_mapping pack_mapping;
+struct pack_mapping {
+    pack_mapping *next;
+    void         *pack;
+    size_t        pack_size;
+};
 
 typedef struct resource resource;
 struct resource {
@@ -87,31 +233,103 @@ struct resource {
      */
     Sint64    size;
     
-    resource *next;
-    char      name[16];
+    /* Interned */
+    char     *name;
     sid_t     id;
     restype   type;
+    arclist  *arc;
+    
+    /*
+     * source is the resource as it was in the archive, size bytes of it.
+     * data is what everybody else uses: the decoded SDL_Surface for images,
+     * and just source for everything else. Images keep their source around
+     * so they can be evicted and decoded again later.
+     */
+    void     *source;
     void     *data;
     
+    /* source points into a pack mapping, and mustn't be freed */
+    int       mapped;
+    /* calculate_hash of source, to tell if a reload changed it */
+    Uint32    hash;
+    
+    /* Size of the decoded data, only counted for images */
+    size_t    bytes;
+    
+    /* Number of acquire_res calls not yet released */
+    volatile int refs;
+    /* The trim_resources epoch this was last looked up in */
+    volatile Uint32 last_used;
+    /* Evicted, and not queued to be decoded again yet */
+    int       evicted;
+    
+    /* 
+     * Images are decoded on the decode threads, so a resource can be in
+     * the map before its data is ready. ready is set (and _ready signalled)
+     * once it is, both under _lock. get_res checks it without locking.
+     */
+    volatile int ready;
     SDL_mutex *_lock;
+    SDL_cond  *_ready;
 };
 
-typedef struct arclist arclist;
 struct arclist {
-    arclist  *next;
+    /* Interned, and the file it's loaded from */
+    char     *name;
     sid_t     id;
-    char      name[16];
-    int       loaded;
-    resource *map[ARCLIST_HASH_SIZE];
+    volatile int loaded;
+    /* Every resource, packed or not */
+    sid_table table;
+    
+    /* Number of images still waiting on the decode threads */
+    int       pending;
+    
+    /* Waiting on, or being read in by, the loader thread */
+    volatile int queued;
+    
+    /*
+     * Total refs of all its resources. free_arc can't free it while
+     * there are any, so it's doomed instead, and freed on the last release.
+     */
+    volatile int refs;
+    int       doomed;
+    
+    /*
+     * Only used for packs: the mapping, its index, and the resources
+     * (in index order, all in one block).
+     */
+    void       *pack;
+    size_t      pack_size;
+    pack_entry *index;
+    Uint32      count;
+    resource   *packres;
+    
+    /*
+     * The blocks a tarball's resources and data live in. Packs only use
+     * it for what's added by reloads, and they keep any newer mappings
+     * the reloads needed in mappings.
+     */
+    arena_block  *arena;
+    pack_mapping *mappings;
+    
+    /* Being watched for hot reloading, and written to since */
+    int       watched;
+    int       stale;
+    long      stamp;
     
     SDL_mutex *_lock;
+    /* Broadcast whenever resources turn up, and when loading finishes */
+    SDL_cond  *_changed;
 };
 
 extern void clip_string(char *a);
 extern char *get_ext(char *a);
 extern sid_t calculate_sid(char *string);
+/* The same hash, for any old data */
+extern Uint32 calculate_hash(const void *data, size_t size);
+extern restype get_restype(char *name);
 
-/* Start and stop resources thread */
+/* Start and stop the loader and decode threads */
 extern void init_resources(void);
 extern void stop_resources(void);
 
@@ -119,8 +337,30 @@ extern void stop_resources(void);
 extern int get_progress(char *buf, size_t n);
 
 /*
- * load_arc loads an archive,  The get_ functions block
- * until the arc or res is loaded if necessary.
+ * Set the number of threads used to decode images while loading archives
+ * Zero decodes everything on the loading thread, like it used to
+ * Don't call this while an archive is loading
+ */
+#define MAX_DECODE_THREADS 8
+extern void set_decode_threads(int n);
+extern int  get_decode_threads(void);
+
+/*
+ * Set how tarballs are read: that many bytes at a time, or 0 to map the
+ * whole file in. Defaults to TGZ_READ_BLOCK. Packs are always mapped.
+ */
+extern void   set_tgz_read_block(size_t bytes);
+extern size_t get_tgz_read_block(void);
+
+/*
+ * load_arc loads an archive, either a .tgz or a .brp pack, going by the
+ * extension, and waits until it's completely done. load_arc_async just
+ * queues it up for the loader thread and returns straight away, so the
+ * next stage can be streamed in while this one is playing; archives are
+ * read in the order they were queued. The get_ functions block until the
+ * arc or res is loaded if necessary, but get_res only waits for the one
+ * resource it wants, and moves its archive and image to the front of the
+ * queues while it does.
  *
  * OTHER SYSTEMS SHOULD NOT MODIFY ARCLISTS OR RESOURCES. ONLY
  * THE FUNCTIONS IN THIS FILE SHOULD MODIFY THEM, AND ONLY AFTER
@@ -132,9 +372,115 @@ extern int get_progress(char *buf, size_t n);
  */
 
 extern arclist *load_arc(char *arcname);
+extern arclist *load_arc_async(char *arcname);
 extern void free_arc(char *arcname);
 
 extern arclist *get_arc(char *arcname);
 extern resource *get_res(char *arcname, char *resname);
 
+/*
+ * Call fn for every archive, loaded or not. Nothing is locked, so this is
+ * only safe when nothing else is running, or when it doesn't matter, like
+ * writing a crash dump.
+ */
+extern void walk_arcs(void (*fn)(arclist *arc, void *data), void *data);
+
+/*
+ * Once an archive is loaded, get_res and get_arc don't lock anything, so
+ * any number of threads can look things up at once. This turns that off
+ * (everything goes through the locks, like it used to) for benchmarking.
+ */
+extern void set_res_lockfree(int on);
+extern int  get_res_lockfree(void);
+
+/* get_res with the hashes already worked out */
+extern resource *get_res_sid(char *arcname, sid_t arcid,
+                             char *resname, sid_t resid);
+/* get_res for string literals, hashed at compile time */
+#define GET_RES(arcname, resname) \
+    get_res_sid((arcname), SID(arcname), (resname), SID(resname))
+
+/*
+ * Resource handles and the memory budget
+ *
+ * Decoded images can take a lot of memory, so there's a budget for them.
+ * Whenever the budget is blown, trim_resources evicts the least recently
+ * used images until it isn't, and they're decoded again (from the tarball
+ * copy or the pack mapping) next time somebody asks for them. load_arc
+ * trims once it's done, other than that it's up to the game to call it
+ * somewhere safe, like between stages.
+ *
+ * So a pointer from get_res is only borrowed: it's good until the next
+ * trim_resources or load_arc. Anything kept for longer than that should
+ * come from acquire_res, which holds on to it (and makes free_arc hold on
+ * to its archive) until release_res. The budget is soft, it never evicts
+ * anything that's held.
+ *
+ * free_arc can't free an archive's table or resources straight away,
+ * since get_res might be looking at them without a lock, so it retires
+ * them, and trim_resources frees them once no lookup can be.
+ *
+ * A budget of 0 means no limit, which is what RES_BUDGET defaults to.
+ */
+extern resource *acquire_res(char *arcname, char *resname);
+extern resource *acquire_res_sid(char *arcname, sid_t arcid,
+                                 char *resname, sid_t resid);
+#define ACQUIRE_RES(arcname, resname) \
+    acquire_res_sid((arcname), SID(arcname), (resname), SID(resname))
+extern void release_res(resource *res);
+
+extern void   set_res_budget(size_t bytes);
+extern size_t get_res_budget(void);
+extern void   trim_resources(void);
+
+typedef struct res_stats res_stats;
+struct res_stats {
+    /* Lookups that found their data ready, and ones that had to wait */
+    Uint32 hits;
+    Uint32 misses;
+    Uint32 evictions;
+    /* Images decoded again after being evicted */
+    Uint32 redecodes;
+    /* Bytes of decoded images in memory */
+    size_t resident;
+    size_t budget;
+    /* Heap allocations made while loading archives, decoding aside */
+    Uint32 allocs;
+    /* Bytes of load arena, in use or spare */
+    size_t arena;
+};
+
+extern void get_res_stats(res_stats *stats);
+extern void reset_res_stats(void);
+
+/*
+ * Hot reloading
+ * With hot reloading on, poll_reloads watches the file each loaded archive
+ * came from (with inotify, or by checking the modification times on
+ * Windows), and reloads any that have been written since the last poll.
+ * It returns the number of resources that changed.
+ *
+ * reload_arc reads an archive in again and only touches the entries whose
+ * contents hash differently: they're updated in place, so every resource
+ * pointer (held or not) stays good. A changed image that's the same size
+ * is even drawn over the old surface, so pointers to that stay good too.
+ * New entries are added, and entries that have gone are left alone. Once
+ * the archive is done, each reload hook is called with every resource
+ * that changed, so things made from them can be made again.
+ *
+ * Like trim_resources, both of these should only be called somewhere safe:
+ * a changed image that isn't the same size gets a new surface, and the old
+ * one is freed unless it's held. They're meant for iterating on content,
+ * not for shipping, so the old data of anything else just stays in memory
+ * until free_arc.
+ */
+#define MAX_RELOAD_HOOKS 8
+
+extern void set_hot_reload(int on);
+extern int  get_hot_reload(void);
+extern int  poll_reloads(void);
+extern int  reload_arc(char *arcname);
+/* Adding the same hook twice does nothing */
+extern void add_reload_hook(void (*hook)(resource *res));
+
 #endif /* def RESOURCE_H */
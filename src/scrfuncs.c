@@ -11,14 +11,18 @@
  * Functions which will be provided to Lua to provide scripting functionality.
  */
 
+#include "budget.h"
 #include "bullet.h"
 #include "compile.h"
 #include "debug.h"
 #include "geometry.h"
+#include "metrics.h"
+#include "render.h"
 #include "scrfuncs.h"
 #include "scripts.h"
 #include "./lua/lua.h"
 #include "./lua/lauxlib.h"
+#include <string.h>
 
 #ifdef INCLUDE_SDL_PREFIX
 #include "SDL/SDL.h"
@@ -41,6 +45,10 @@ int first_load = TRUE;
 int valid_type[MAX_TYPES];
 bullet_type types[MAX_TYPES];
 
+/* Where each type's sprite came from, so it can be cut again on reload */
+resource *type_sheet[MAX_TYPES];
+SDL_Rect  type_rect [MAX_TYPES];
+
 /* The format used for bullet images */
 SDL_PixelFormat fmt;
 
@@ -59,6 +67,9 @@ static int set_bullet_context(lua_State *L)
         }
         
         context = &(bullet_mem[id]);
+        
+        /* The runner sets the context right before every resume */
+        metric_add(MET_SCRIPTS_RESUMED, 1);
     }
     return 0;
 }
@@ -99,8 +110,7 @@ static int register_type(lua_State *L)
     char *arcname;
     char *resname;
     
-    SDL_Surface *temp;
-    SDL_Surface *img;
+    resource *sheet;
     SDL_Rect rect;
     
     /* Bring them all in, one by one... */
@@ -137,20 +147,34 @@ static int register_type(lua_State *L)
     types[idx].drawlocx  = drawlocx;
     types[idx].drawlocy  = drawlocy;
     
-    /* Now we need to load the SDL_Surface */
-    load_arc(arcname);
-    temp = (get_res(arcname, resname))->data;
+    /*
+     * Now we need to load the SDL_Surface
+     * This only waits for the one sheet, not the whole archive
+     */
+    load_arc_async(arcname);
+    sheet = acquire_res(arcname, resname);
     
-    /* Create surface for img and blit it over */
-    img = SDL_CreateRGBSurface(SDL_HWSURFACE, gfxw, gfxh, fmt.BitsPerPixel,
-            fmt.Rmask, fmt.Gmask, fmt.Bmask, fmt.Amask);
+    /* Cut the sprite out of the sheet */
     rect.x = gfxx;
     rect.y = gfxy;
     rect.w = gfxw;
     rect.h = gfxh;
-    SDL_BlitSurface(temp, &rect, img, NULL);
     
-    types[idx].img = img;
+    /*
+     * Registering it again, like a reloaded script does? Bullets have a
+     * pointer to the old sprite, so if it's the same size it's cut again
+     * right over the top of itself
+     */
+    if (types[idx].img != NULL &&
+        types[idx].img->w == gfxw && types[idx].img->h == gfxh) {
+        recut_sprite(types[idx].img, (SDL_Surface*) sheet->data, &rect);
+    }
+    else {
+        types[idx].img = cut_sprite((SDL_Surface*) sheet->data, &rect);
+    }
+    type_sheet[idx] = sheet;
+    type_rect [idx] = rect;
+    release_res(sheet);
     
     return 0;
 }
@@ -166,13 +190,56 @@ static int unregister_type(lua_State *L)
     
     /* Free surface if necessary */
     if (types[idx].img != NULL) {
-        SDL_FreeSurface(types[idx].img);
+        free_sprite(types[idx].img);
         types[idx].img = NULL;
     }
     
     return 0;
 }
 
+/* Reload hook: cut the sprites from a reloaded sheet again */
+void reload_types(resource *res)
+{
+    resource *sheet = NULL;
+    int i;
+    
+    if (res->type != RES_IMAGE) return;
+    
+    for (i = 0; i < MAX_TYPES; ++i) {
+        /* Unregistered types have had their sprites freed */
+        if (type_sheet[i] != res || types[i].img == NULL) continue;
+        
+        /* It might have been evicted, this brings it back */
+        if (sheet == NULL) {
+            sheet = acquire_res_sid(res->arc->name, res->arc->id,
+                                    res->name, res->id);
+        }
+        recut_sprite(types[i].img, (SDL_Surface*) sheet->data,
+                     &type_rect[i]);
+    }
+    
+    if (sheet != NULL) {
+        debug2("Cut bullet types again from", res->name);
+        release_res(sheet);
+    }
+}
+
+/* Find where a bullet type's sprite was cut from */
+int type_sprite_source(SDL_Surface *img, resource **sheet, SDL_Rect *rect)
+{
+    int i;
+    
+    for (i = 0; i < MAX_TYPES; ++i) {
+        if (types[i].img == img && type_sheet[i] != NULL) {
+            *sheet = type_sheet[i];
+            *rect  = type_rect[i];
+            return TRUE;
+        }
+    }
+    
+    return FALSE;
+}
+
 static int clear_types(lua_State *L)
 {
     int i;
@@ -183,7 +250,7 @@ static int clear_types(lua_State *L)
         
         /* Free surface if necessary */
         if (types[i].img != NULL) {
-            SDL_FreeSurface(types[i].img);
+            free_sprite(types[i].img);
             types[i].img = NULL;
         }
     }
@@ -191,6 +258,31 @@ static int clear_types(lua_State *L)
     return 0;
 }
 
+static int preload_archive(lua_State *L)
+{
+    char *arcname;
+    
+    arcname = (char*) luaL_checkstring(L, 1);
+    
+    /* The loader thread reads it in while the stage keeps going */
+    load_arc_async(arcname);
+    
+    return 0;
+}
+
+static int archive_loaded(lua_State *L)
+{
+    arclist *arc;
+    char *arcname;
+    
+    arcname = (char*) luaL_checkstring(L, 1);
+    /* Asking about it is as good as preloading it */
+    arc = load_arc_async(arcname);
+    
+    lua_pushboolean(L, arc->loaded);
+    return 1;
+}
+
 static int fire_bullet(lua_State *L)
 {
     /* TODO: stub - testing for compilation */
@@ -396,6 +488,99 @@ static int kill_other(lua_State *L)
     return 0;
 }
 
+/*
+ * Get the frame budget state: the policy's name, the headroom in ms
+ * (negative when over budget), whether the policy is kicking in right now,
+ * and how fast the game is running
+ */
+static int get_budget(lua_State *L)
+{
+    lua_pushstring(L, budget_policy_name(budget_get_policy()));
+    lua_pushnumber(L, budget_headroom() / 1000000.0);
+    lua_pushboolean(L, budget_active());
+    lua_pushnumber(L, budget_speed());
+    
+    return 4;
+}
+
+static int set_budget_policy(lua_State *L)
+{
+    const char *name;
+    int policy;
+    
+    name   = luaL_checkstring(L, 1);
+    policy = budget_find_policy(name);
+    
+    if (policy < 0) {
+        luaL_error(L, "Unknown budget policy '%s'", name);
+    }
+    
+    budget_set_policy(policy);
+    return 0;
+}
+
+/*
+ * Metrics functions
+ * stats() gives a table of every metric by name: a number for counters and
+ * gauges, and {count, sum_ms, p50_ms, p99_ms} for histograms. stats(true)
+ * gives how much each counter went up in the last frame instead.
+ */
+static int get_stats(lua_State *L)
+{
+    int i, frame;
+    
+    frame = lua_toboolean(L, 1);
+    lua_createtable(L, 0, MET_NUM_METRICS);
+    
+    for (i = 0; i < MET_NUM_METRICS; ++i) {
+        if (metric_kind(i) == MET_HISTOGRAM && !frame) {
+            lua_createtable(L, 0, 4);
+            lua_pushnumber(L, (lua_Number) metric_get(i));
+            lua_setfield(L, -2, "count");
+            lua_pushnumber(L, metric_sum(i) / 1000000.0);
+            lua_setfield(L, -2, "sum_ms");
+            lua_pushnumber(L, metric_percentile(i, 50) / 1000000.0);
+            lua_setfield(L, -2, "p50_ms");
+            lua_pushnumber(L, metric_percentile(i, 99) / 1000000.0);
+            lua_setfield(L, -2, "p99_ms");
+        }
+        else if (frame) {
+            lua_pushnumber(L, (lua_Number) metric_frame(i));
+        }
+        else {
+            lua_pushnumber(L, (lua_Number) metric_get(i));
+        }
+        lua_setfield(L, -2, metric_name(i));
+    }
+    
+    return 1;
+}
+
+/* export_stats(filename, "csv" or "json", interval_ms), or () to stop */
+static int export_stats(lua_State *L)
+{
+    const char *filename, *format;
+    Uint32 interval;
+    
+    if (lua_isnoneornil(L, 1)) {
+        metrics_export(NULL, MET_CSV, 0);
+        return 0;
+    }
+    
+    filename = luaL_checkstring(L, 1);
+    format   = luaL_optstring(L, 2, "csv");
+    interval = (Uint32) luaL_optinteger(L, 3, 1000);
+    
+    if (strcmp(format, "csv") != 0 && strcmp(format, "json") != 0) {
+        luaL_error(L, "Unknown stats format '%s'", format);
+    }
+    
+    lua_pushboolean(L, metrics_export(filename,
+                         strcmp(format, "json") == 0 ? MET_JSON : MET_CSV,
+                         interval));
+    return 1;
+}
+
 /*
  * The translation table for Lua
  */
@@ -410,6 +595,10 @@ static const struct luaL_Reg bulletrain[] = {
     {"register_type",              register_type},
     {"unregister_type",            unregister_type},
     {"clear_types",                clear_types},
+    
+    /* Resource functions */
+    {"preload_archive",            preload_archive},
+    {"archive_loaded",             archive_loaded},
  
     /* Bullet creation functions */
     {"fire_bullet",                fire_bullet},
@@ -438,6 +627,14 @@ static const struct luaL_Reg bulletrain[] = {
     {"kill_me",                    kill_me},
     {"kill_other",                 kill_other},
     
+    /* Frame budget functions */
+    {"get_budget",                 get_budget},
+    {"set_budget_policy",          set_budget_policy},
+    
+    /* Metrics functions */
+    {"stats",                      get_stats},
+    {"export_stats",               export_stats},
+    
     /* sentinel */
     {NULL, NULL}
 };
@@ -461,8 +658,12 @@ int init_library(lua_State *L)
         /* Set all of the types to have null SDL_Surfaces to ensure safety */
         for (i = 0; i < MAX_TYPES; ++i) {
             types[i].img = NULL;
+            type_sheet[i] = NULL;
         }
         
+        /* Sheets can change under us with hot reloading */
+        add_reload_hook(reload_types);
+        
         first_load = FALSE;
     }
     
@@ -17,8 +17,22 @@
 
 #include "./lua/lua.h"
 #include "./lua/lauxlib.h"
+#include "resource.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
 
 extern int luaopen_bulletrain (lua_State *L);
 extern int init_library();
 
+/*
+ * If img is a bullet type's sprite, get the sheet and rect it was cut
+ * from and return TRUE. For crash dumps, so it doesn't lock anything.
+ */
+extern int type_sprite_source(SDL_Surface *img, resource **sheet,
+                              SDL_Rect *rect);
+
 #endif /* !def SCRFUNCS_H */
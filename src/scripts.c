@@ -12,14 +12,26 @@
  */
 
 #include "debug.h"
+#include "metrics.h"
+#include "profile.h"
 #include "scrfuncs.h"
+#include "scrprof.h"
 #include "scripts.h"
+#include "trace.h"
 #include "./lua/lua.h"
 #include "./lua/lauxlib.h"
 #include "./lua/lualib.h"
+#include <string.h>
 
 static lua_State *L_main;
 
+/*
+ * The coroutine being resumed right now, NULL if none. Bullet and stage
+ * scripts all run in coroutines, so if a script gets the engine to panic,
+ * this is where it was.
+ */
+static lua_State *L_running = NULL;
+
 resource *runner  = NULL;
 resource *header  = NULL;
 resource *runmain = NULL;
@@ -68,34 +80,65 @@ static const char *reader(lua_State *L, void *data, size_t *size)
     }
 }
 
-/* Loads the files into the Lua state */
-void load_scripts(void)
+/* Loads one file into the Lua state and runs it */
+void run_chunk(resource *res, const char *chunkname)
 {
     int r;
     
-    r = lua_load(L_main, reader, (void*)runner , "<<runner>>"  , "bt");
-    check_lua_error(r == LUA_OK, L_main);
-    
-    r = lua_pcall(L_main, 0, 0, 0);
+    r = lua_load(L_main, reader, (void*)res, chunkname, "bt");
     check_lua_error(r == LUA_OK, L_main);
     
-    r = lua_load(L_main, reader, (void*)header , "<<header>>"  , "bt");
-    check_lua_error(r == LUA_OK, L_main);
+    /* Don't run the error message */
+    if (r != LUA_OK) {
+        lua_pop(L_main, 1);
+        return;
+    }
     
     r = lua_pcall(L_main, 0, 0, 0);
     check_lua_error(r == LUA_OK, L_main);
+}
+
+/* Loads the files into the Lua state */
+void load_scripts(void)
+{
+    int r;
     
-    r = lua_load(L_main, reader, (void*)runmain, "<<runmain>>" , "bt");
-    check_lua_error(r == LUA_OK, L_main);
-    
-    r = lua_pcall(L_main, 0, 0, 0);
-    check_lua_error(r == LUA_OK, L_main);
+    run_chunk(runner , "<<runner>>" );
+    run_chunk(header , "<<header>>" );
+    run_chunk(runmain, "<<runmain>>");
     
     lua_getglobal(L_main, "init_table");
     r = lua_pcall(L_main, 0, 0, 0);
     check_lua_error(r == LUA_OK, L_main);
 }
 
+/*
+ * Reload hook
+ * A changed header or main script is just run again in the same state, so
+ * its functions get redefined while every bullet's coroutine keeps going
+ * (with the old function, until it finishes). The runner has the bullet
+ * table in it, so running that again would lose every coroutine; that
+ * needs a reset_scripts.
+ */
+void reload_script(resource *res)
+{
+    if (res == header) {
+        run_chunk(header, "<<header>>");
+    }
+    else if (res == runmain) {
+        run_chunk(runmain, "<<runmain>>");
+    }
+    else if (res == runner) {
+        warn(FALSE, "Runner script changed, it needs a reset_scripts");
+        return;
+    }
+    else {
+        return;
+    }
+    
+    debug2("Ran reloaded script again:", res->name);
+}
+
 /* Resets the script */
 void reset_scripts(void)
 {
@@ -110,11 +153,21 @@ void reset_scripts(void)
 /* A shortcut for running the exec_bullet_scripts function in Lua. */
 void exec_bullet_scripts(void)
 {
+    Uint64 start, ns;
     int r;
     
+    trace_begin("scripts");
+    start = clock_ns();
+    sprof_begin_frame();
     lua_getglobal(L_main, "exec_bullet_scripts");
     r = lua_pcall(L_main, 0, 0, 0);
     check_lua_error(r == LUA_OK, L_main);
+    sprof_end_frame();
+    
+    ns = clock_ns() - start;
+    trace_end("scripts");
+    prof_add(PROF_SCRIPTS, ns);
+    metric_observe(MET_SCRIPT_NS, ns);
 }
 
 /* A shortcut for calling the add_bullet function in Lua. */
@@ -127,6 +180,7 @@ void add_bullet(int bid, const char *func)
     lua_pushstring(L_main, func);
     r = lua_pcall(L_main, 2, 0, 0);
     check_lua_error(r == LUA_OK, L_main);
+    metric_add(MET_SCRIPTS_STARTED, 1);
 }
 
 /* A shortcut for calling the set_stage function in Lua. */
@@ -138,6 +192,65 @@ void set_stage(const char *func)
     lua_pushstring(L_main, func);
     r = lua_pcall(L_main, 1, 0, 0);
     check_lua_error(r == LUA_OK, L_main);
+    metric_add(MET_SCRIPTS_STARTED, 1);
+}
+
+/* Start the script profiler on the main state */
+void start_script_profile(void)
+{
+    sprof_start(L_main);
+}
+
+/* Stop the script profiler, and write what it found to filename */
+int stop_script_profile(const char *filename)
+{
+    sprof_stop(L_main);
+    return sprof_report(filename);
+}
+
+/*
+ * Write a traceback of the running coroutine (or the main state, outside
+ * of one) into buf, which is always NUL terminated. Returns the length,
+ * 0 if there's no state.
+ */
+int script_traceback(char *buf, int size)
+{
+    lua_State *L;
+    const char *trace;
+    size_t len;
+    
+    buf[0] = '\0';
+    if (L_main == NULL || size <= 0) return 0;
+    
+    L = (L_running != NULL ? L_running : L_main);
+    luaL_traceback(L, L, NULL, 0);
+    trace = lua_tolstring(L, -1, &len);
+    if (len >= (size_t) size) len = size - 1;
+    memcpy(buf, trace, len);
+    buf[len] = '\0';
+    lua_pop(L, 1);
+    
+    return (int) len;
+}
+
+/*
+ * coroutine.resume, with the real one as its upvalue, keeping L_running
+ * up to date. Errors in the coroutine come back from the real one as
+ * values; only bad arguments get here as errors, and are passed along.
+ */
+static int resume_tracked(lua_State *L)
+{
+    lua_State *prev = L_running;
+    int r, n = lua_gettop(L);
+    
+    L_running = lua_tothread(L, 1);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    r = lua_pcall(L, n, LUA_MULTRET, 0);
+    L_running = prev;
+    if (r != LUA_OK) return lua_error(L);
+    
+    return lua_gettop(L);
 }
 
 /* Initializes L_main */
@@ -146,12 +259,25 @@ void init_scripts()
     L_main = luaL_newstate();
     luaL_openlibs(L_main);
     
+    /* The runner resumes scripts from Lua, so that's where to catch it */
+    lua_getglobal(L_main, "coroutine");
+    lua_getfield(L_main, -1, "resume");
+    lua_pushcclosure(L_main, resume_tracked, 1);
+    lua_setfield(L_main, -2, "resume");
+    lua_pop(L_main, 1);
+    
     init_library();
     luaopen_bulletrain(L_main);
+    
+    add_reload_hook(reload_script);
 }
 
 /* Closes L_main */
 void stop_scripts()
 {
+    /* The profile would be full of functions that are about to be gone */
+    sprof_stop(L_main);
     lua_close(L_main);
+    L_main    = NULL;
+    L_running = NULL;
 }
@@ -31,6 +31,13 @@ extern void exec_bullet_scripts(void);
 extern void add_bullet(int bid, const char *func);
 extern void set_stage(const char *func);
 
+/* Profile exec_bullet_scripts, see scrprof.h */
+extern void start_script_profile(void);
+extern int  stop_script_profile(const char *filename);
+
+/* Traceback of the running script for crash dumps, see scripts.c */
+extern int script_traceback(char *buf, int size);
+
 extern void init_scripts(void);
 extern void stop_scripts(void);
 
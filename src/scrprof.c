@@ -0,0 +1,507 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * scrprof.c
+ * Contains code for the script profiler
+ */
+
+#include "compile.h"
+#include "debug.h"
+#include "scrprof.h"
+#include "timer.h"
+#include "./lua/lua.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+#define SPROF_MASK (LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT)
+
+typedef struct sprof_func_ sprof_func;
+struct sprof_func_ {
+    /* What lua_topointer says, NULL for an empty slot */
+    const void *ptr;
+    char        name[SPROF_NAME];
+};
+
+/*
+ * A place in the call tree. Node 0 is the root, which is its own parent.
+ * Children always come after their parents.
+ */
+typedef struct sprof_node_ sprof_node;
+struct sprof_node_ {
+    int    func;
+    int    parent;
+    int    child;
+    int    next;
+    Uint32 calls;
+    Uint64 self_ns;
+    Uint64 instrs;
+    /* Worked out by sprof_report */
+    Uint64 total_ns;
+    Uint64 total_instrs;
+};
+
+sprof_func sprof_funcs[SPROF_FUNCS];
+sprof_node sprof_nodes[SPROF_NODES];
+int        sprof_num_funcs;
+int        sprof_num_nodes;
+/* Functions or nodes that didn't fit */
+Uint32     sprof_lost;
+
+int        sprof_on = FALSE;
+int        sprof_in_frame = FALSE;
+/* The state whose stack sprof_cur is the top of */
+lua_State *sprof_state;
+int        sprof_cur;
+/* When the last hook finished */
+Uint64     sprof_last;
+/* coroutine.resume, to spot coroutines being resumed */
+const void *sprof_resume;
+
+Uint32     sprof_frames;
+Uint64     sprof_frame_start;
+Uint64     sprof_frame_ns;
+Uint64     sprof_worst_ns;
+
+void _sprof_hook(lua_State *L, lua_Debug *ar);
+
+/*
+ * Look for the function at fn in the table at t, and name it after the
+ * key it's under. TRUE if it was there.
+ */
+int _sprof_find(lua_State *L, int t, int fn, const char *prefix, char *buf)
+{
+    lua_pushnil(L);
+    while (lua_next(L, t)) {
+        if (lua_type(L, -2) == LUA_TSTRING && lua_rawequal(L, -1, fn)) {
+            sprintf(buf, "%.30s%s%.40s", prefix, *prefix ? "." : "",
+                    lua_tostring(L, -2));
+            lua_pop(L, 2);
+            return TRUE;
+        }
+        lua_pop(L, 1);
+    }
+    return FALSE;
+}
+
+/*
+ * Name the function on top of the stack after the global it's in, or the
+ * field of a global table, like bulletrain.get_velocity_self. Coroutine
+ * functions don't get a name from the call, so this is the only way to
+ * find out they're reversing_bullet. TRUE if it found one.
+ */
+int _sprof_global_name(lua_State *L, char *buf)
+{
+    int fn = lua_gettop(L), g = fn + 1;
+    int found = FALSE;
+
+    lua_pushglobaltable(L);
+    found = _sprof_find(L, g, fn, "", buf);
+
+    lua_pushnil(L);
+    while (!found && lua_next(L, g)) {
+        if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1) &&
+            !lua_rawequal(L, -1, g)) {
+            found = _sprof_find(L, lua_gettop(L), fn, lua_tostring(L, -2),
+                                buf);
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_settop(L, fn);
+    return found;
+}
+
+/*
+ * Find the function in ar, which has had "Snf" done on it, in the
+ * function table, or add it. -1 if it's full.
+ */
+int _sprof_func(lua_State *L, lua_Debug *ar)
+{
+    const void *ptr = lua_topointer(L, -1);
+    sprof_func *func;
+    char name[SPROF_NAME];
+    Uint32 h;
+    int i;
+
+    h = (Uint32)(((unsigned long) ptr >> 3) * 2654435761U);
+    for (i = 0; i < SPROF_FUNCS; ++i) {
+        func = &sprof_funcs[(h + i) & (SPROF_FUNCS-1)];
+        if (func->ptr == ptr) return (h + i) & (SPROF_FUNCS-1);
+        if (func->ptr == NULL) break;
+    }
+    /* Keep some room, probing a nearly full table takes forever */
+    if (i == SPROF_FUNCS || sprof_num_funcs >= SPROF_FUNCS * 3 / 4) {
+        ++sprof_lost;
+        return -1;
+    }
+
+    if (!_sprof_global_name(L, name)) {
+        if (ar->name != NULL) {
+            sprintf(name, "%.40s", ar->name);
+        }
+        else if (ar->what[0] == 'm') {
+            strcpy(name, "main chunk");
+        }
+        else {
+            strcpy(name, "?");
+        }
+    }
+
+    if (ar->what[0] == 'C') {
+        strcpy(func->name, name);
+    }
+    else {
+        sprintf(func->name, "%.40s (%.40s:%d)", name, ar->short_src,
+                ar->linedefined);
+    }
+    func->ptr = ptr;
+    ++sprof_num_funcs;
+
+    return (h + i) & (SPROF_FUNCS-1);
+}
+
+/* Find or add the child of parent for func. The parent if it's full */
+int _sprof_child(int parent, int func)
+{
+    sprof_node *node;
+    int i;
+
+    if (func < 0) return parent;
+
+    for (i = sprof_nodes[parent].child; i != 0; i = sprof_nodes[i].next) {
+        if (sprof_nodes[i].func == func) return i;
+    }
+
+    if (sprof_num_nodes == SPROF_NODES) {
+        ++sprof_lost;
+        return parent;
+    }
+
+    i = sprof_num_nodes++;
+    node = &sprof_nodes[i];
+    memset(node, 0, sizeof(sprof_node));
+    node->func   = func;
+    node->parent = parent;
+    node->next   = sprof_nodes[parent].child;
+    sprof_nodes[parent].child = i;
+
+    return i;
+}
+
+/* Find where in the tree L is, by looking at its whole stack */
+int _sprof_walk(lua_State *L)
+{
+    lua_Debug ar;
+    int funcs[SPROF_DEPTH];
+    int n = 0, node = 0;
+
+    while (n < SPROF_DEPTH && lua_getstack(L, n, &ar)) {
+        lua_getinfo(L, "Snf", &ar);
+        funcs[n++] = _sprof_func(L, &ar);
+        lua_pop(L, 1);
+    }
+    while (n > 0) {
+        node = _sprof_child(node, funcs[--n]);
+    }
+
+    return node;
+}
+
+/* Put the hook on a coroutine that's about to be resumed */
+void _sprof_hook_resumed(lua_State *L, lua_Debug *ar)
+{
+    lua_State *co;
+
+    if (lua_getlocal(L, ar, 1) == NULL) return;
+    co = lua_tothread(L, -1);
+    lua_pop(L, 1);
+
+    if (co != NULL && lua_gethook(co) != _sprof_hook) {
+        lua_sethook(co, _sprof_hook, SPROF_MASK, SPROF_COUNT);
+    }
+}
+
+void _sprof_hook(lua_State *L, lua_Debug *ar)
+{
+    int func = -1, parent;
+
+    /* Coroutines keep the hook after sprof_stop, until they next run */
+    if (!sprof_on) {
+        lua_sethook(L, NULL, 0, 0);
+        return;
+    }
+    if (!sprof_in_frame) return;
+
+    sprof_nodes[sprof_cur].self_ns += clock_ns() - sprof_last;
+
+    /*
+     * A different coroutine from last time. The call being hooked is
+     * already on its stack, so there's nothing else to do for a call.
+     */
+    if (L != sprof_state) {
+        sprof_state = L;
+        sprof_cur = _sprof_walk(L);
+        if (ar->event == LUA_HOOKCALL || ar->event == LUA_HOOKTAILCALL) {
+            ++(sprof_nodes[sprof_cur].calls);
+            func = sprof_nodes[sprof_cur].func;
+            if (func >= 0 && sprof_funcs[func].ptr == sprof_resume) {
+                _sprof_hook_resumed(L, ar);
+            }
+            sprof_last = clock_ns();
+            return;
+        }
+    }
+
+    switch (ar->event) {
+        case LUA_HOOKCALL:
+        case LUA_HOOKTAILCALL:
+            lua_getinfo(L, "Snf", ar);
+            func = _sprof_func(L, ar);
+            lua_pop(L, 1);
+
+            /* A tail call takes the place of the function that made it */
+            parent = sprof_cur;
+            if (ar->event == LUA_HOOKTAILCALL) {
+                parent = sprof_nodes[sprof_cur].parent;
+            }
+            sprof_cur = _sprof_child(parent, func);
+            ++(sprof_nodes[sprof_cur].calls);
+
+            if (func >= 0 && sprof_funcs[func].ptr == sprof_resume) {
+                _sprof_hook_resumed(L, ar);
+            }
+            break;
+        case LUA_HOOKRET:
+            sprof_cur = sprof_nodes[sprof_cur].parent;
+            break;
+        case LUA_HOOKCOUNT:
+            sprof_nodes[sprof_cur].instrs += SPROF_COUNT;
+            break;
+    }
+
+    sprof_last = clock_ns();
+}
+
+void sprof_start(lua_State *L)
+{
+    memset(sprof_funcs, 0, sizeof(sprof_funcs));
+    memset(sprof_nodes, 0, sizeof(sprof_node));
+    sprof_nodes[0].func = -1;
+    sprof_num_funcs = 0;
+    sprof_num_nodes = 1;
+    sprof_lost      = 0;
+    sprof_frames    = 0;
+    sprof_frame_ns  = 0;
+    sprof_worst_ns  = 0;
+
+    lua_getglobal(L, "coroutine");
+    lua_getfield(L, -1, "resume");
+    sprof_resume = lua_topointer(L, -1);
+    lua_pop(L, 2);
+
+    sprof_on = TRUE;
+    lua_sethook(L, _sprof_hook, SPROF_MASK, SPROF_COUNT);
+    debug("Script profiler started");
+}
+
+void sprof_stop(lua_State *L)
+{
+    if (!sprof_on) return;
+
+    sprof_on = FALSE;
+    sprof_in_frame = FALSE;
+    lua_sethook(L, NULL, 0, 0);
+}
+
+int sprof_running(void)
+{
+    return sprof_on;
+}
+
+void sprof_begin_frame(void)
+{
+    if (!sprof_on) return;
+
+    sprof_in_frame = TRUE;
+    /* Look at the whole stack at the first hook, in case of a Lua error */
+    sprof_state = NULL;
+    sprof_cur   = 0;
+    sprof_frame_start = sprof_last = clock_ns();
+}
+
+void sprof_end_frame(void)
+{
+    Uint64 now, ns;
+
+    if (!sprof_in_frame) return;
+    sprof_in_frame = FALSE;
+
+    now = clock_ns();
+    sprof_nodes[sprof_cur].self_ns += now - sprof_last;
+
+    ns = now - sprof_frame_start;
+    sprof_frame_ns += ns;
+    if (ns > sprof_worst_ns) sprof_worst_ns = ns;
+    ++sprof_frames;
+}
+
+/* Add up the totals, children first since they come after their parents */
+void _sprof_totals(void)
+{
+    sprof_node *node;
+    int i;
+
+    for (i = 0; i < sprof_num_nodes; ++i) {
+        sprof_nodes[i].total_ns     = sprof_nodes[i].self_ns;
+        sprof_nodes[i].total_instrs = sprof_nodes[i].instrs;
+    }
+    for (i = sprof_num_nodes - 1; i > 0; --i) {
+        node = &sprof_nodes[i];
+        sprof_nodes[node->parent].total_ns     += node->total_ns;
+        sprof_nodes[node->parent].total_instrs += node->total_instrs;
+    }
+}
+
+/* Put a node's children in order of total time, most first */
+void _sprof_sort_children(int parent)
+{
+    int sorted = 0, i, next, *p;
+
+    for (i = sprof_nodes[parent].child; i != 0; i = next) {
+        next = sprof_nodes[i].next;
+        p = &sorted;
+        while (*p != 0 &&
+               sprof_nodes[*p].total_ns >= sprof_nodes[i].total_ns) {
+            p = &sprof_nodes[*p].next;
+        }
+        sprof_nodes[i].next = *p;
+        *p = i;
+    }
+    sprof_nodes[parent].child = sorted;
+}
+
+/* Each function's share of the tree, for the flat list */
+Uint64 sprof_flat_self  [SPROF_FUNCS];
+Uint64 sprof_flat_total [SPROF_FUNCS];
+Uint64 sprof_flat_instrs[SPROF_FUNCS];
+Uint32 sprof_flat_calls [SPROF_FUNCS];
+int    sprof_flat_order [SPROF_FUNCS];
+
+int _sprof_by_self(const void *a, const void *b)
+{
+    Uint64 sa = sprof_flat_self[*(const int*) a];
+    Uint64 sb = sprof_flat_self[*(const int*) b];
+
+    return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+/* Is func somewhere above node? So recursion isn't counted twice */
+int _sprof_above(int node, int func)
+{
+    for (node = sprof_nodes[node].parent; node != 0;
+         node = sprof_nodes[node].parent) {
+        if (sprof_nodes[node].func == func) return TRUE;
+    }
+    return FALSE;
+}
+
+void _sprof_write_flat(FILE *out, double frames)
+{
+    sprof_node *node;
+    int i, n = 0, f;
+
+    memset(sprof_flat_self,   0, sizeof(sprof_flat_self));
+    memset(sprof_flat_total,  0, sizeof(sprof_flat_total));
+    memset(sprof_flat_instrs, 0, sizeof(sprof_flat_instrs));
+    memset(sprof_flat_calls,  0, sizeof(sprof_flat_calls));
+
+    for (i = 1; i < sprof_num_nodes; ++i) {
+        node = &sprof_nodes[i];
+        f = node->func;
+        sprof_flat_self[f]   += node->self_ns;
+        sprof_flat_instrs[f] += node->instrs;
+        sprof_flat_calls[f]  += node->calls;
+        if (!_sprof_above(i, f)) sprof_flat_total[f] += node->total_ns;
+    }
+
+    for (i = 0; i < SPROF_FUNCS; ++i) {
+        if (sprof_funcs[i].ptr != NULL) sprof_flat_order[n++] = i;
+    }
+    qsort(sprof_flat_order, n, sizeof(int), _sprof_by_self);
+
+    fprintf(out, "\nFlat, by own time\n");
+    fprintf(out, "%9s %10s %10s %10s  %s\n",
+            "calls", "self us", "total us", "instrs", "function");
+    for (i = 0; i < n; ++i) {
+        f = sprof_flat_order[i];
+        fprintf(out, "%9.1f %10.2f %10.2f %10.0f  %s\n",
+                sprof_flat_calls[f] / frames,
+                sprof_flat_self[f] / frames / 1000.0,
+                sprof_flat_total[f] / frames / 1000.0,
+                sprof_flat_instrs[f] / frames, sprof_funcs[f].name);
+    }
+}
+
+void _sprof_write_tree(FILE *out, int parent, int depth, double frames)
+{
+    sprof_node *node;
+    int i;
+
+    _sprof_sort_children(parent);
+    for (i = sprof_nodes[parent].child; i != 0; i = node->next) {
+        node = &sprof_nodes[i];
+        fprintf(out, "%9.1f %10.2f %10.2f %10.0f  %*s%s\n",
+                node->calls / frames, node->self_ns / frames / 1000.0,
+                node->total_ns / frames / 1000.0, node->total_instrs / frames,
+                depth * 2, "", sprof_funcs[node->func].name);
+        _sprof_write_tree(out, i, depth + 1, frames);
+    }
+}
+
+int sprof_report(const char *filename)
+{
+    FILE *out;
+    double frames;
+
+    out = fopen(filename, "w");
+    warn2(out != NULL, "Couldn't open script profile", (char*) filename);
+    if (out == NULL) return FALSE;
+
+    frames = sprof_frames ? (double) sprof_frames : 1.0;
+    _sprof_totals();
+
+    fprintf(out, "Script profile over %u frames, everything is per frame\n",
+            (unsigned) sprof_frames);
+    fprintf(out, "%.2f us in scripts, %.2f us worst, %.0f instructions\n",
+            sprof_frame_ns / frames / 1000.0, sprof_worst_ns / 1000.0,
+            sprof_nodes[0].total_instrs / frames);
+    fprintf(out, "Instructions are counted %d at a time\n", SPROF_COUNT);
+    if (sprof_lost > 0) {
+        fprintf(out, "%u functions or calls didn't fit, and went to their "
+                "caller\n", (unsigned) sprof_lost);
+    }
+
+    _sprof_write_flat(out, frames);
+
+    fprintf(out, "\nCall tree, by total time, instructions include callees\n");
+    fprintf(out, "%9s %10s %10s %10s  %s\n",
+            "calls", "self us", "total us", "instrs", "function");
+    _sprof_write_tree(out, 0, 0, frames);
+
+    fclose(out);
+    debug2("Wrote script profile to", (char*) filename);
+    return TRUE;
+}
@@ -0,0 +1,73 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * scrprof.h
+ * Contains definitions and prototypes for the script profiler
+ */
+
+#ifndef SCRPROF_H
+
+#define SCRPROF_H
+
+#include "compile.h"
+#include "./lua/lua.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/*
+ * The profiler times exec_bullet_scripts as a whole; this one looks inside
+ * it, to see which script functions and which bulletrain calls the time
+ * goes on.
+ *
+ * It works with a Lua hook on every call and return, and every SPROF_COUNT
+ * VM instructions. Each hook adds the time since the last one to whatever
+ * function was running, and the instructions to it on a count, so the
+ * hook's own time isn't counted. Functions are kept in a call tree, which
+ * gets a root for each coroutine's function (reversing_bullet and such)
+ * as well as for exec_bullet_scripts. Coroutines that were started before
+ * the profiler have the hook put on them when they're resumed.
+ *
+ * Only time inside exec_bullet_scripts is counted, and sprof_report gives
+ * everything per frame, averaged over the frames since sprof_start: a flat
+ * list of functions by their own time, then the call tree.
+ *
+ * When it's off there's no hook at all, so it costs nothing.
+ */
+
+/* Different places in the call tree, then they're lumped in with the caller */
+#define SPROF_NODES 4096
+/* Different functions, must be a power of 2 */
+#define SPROF_FUNCS 1024
+/* Stack levels looked at when switching coroutines */
+#define SPROF_DEPTH 64
+/* Instructions between count hooks */
+#define SPROF_COUNT 100
+/* Longest function name, with where it's from */
+#define SPROF_NAME  96
+
+/* Start profiling L, and any coroutine it runs. Forgets the last profile */
+extern void sprof_start(lua_State *L);
+
+/* Stop profiling. What was counted stays for sprof_report */
+extern void sprof_stop(lua_State *L);
+
+extern int sprof_running(void);
+
+/* Called around each exec_bullet_scripts */
+extern void sprof_begin_frame(void);
+extern void sprof_end_frame(void);
+
+/* Write the report to filename. Returns FALSE if it couldn't */
+extern int sprof_report(const char *filename);
+
+#endif /* !def SCRPROF_H */
@@ -17,17 +17,26 @@
 
 #ifdef SYSTEM_TEST
 
+#include "budget.h"
 #include "bullet.h"
 #include "coreship.h"
 #include "debug.h"
+#include "dump.h"
 #include "geometry.h"
 #include "init.h"
 #include "input.h"
+#include "loop.h"
 #include "menu.h"
+#include "metrics.h"
 #include "player.h"
+#include "profile.h"
+#include "pump.h"
+#include "render.h"
 #include "resource.h"
 #include "timer.h"
+#include "trace.h"
 #include "scripts.h"
+#include "text.h"
 #include <ctype.h>
 #include <math.h>
 #include <stdio.h>
@@ -56,8 +65,14 @@ void bull_test_fake_proc(SDL_Surface *surface, TTF_Font *font);
 void bull_test_collision(SDL_Surface *surface, TTF_Font *font);
 void player_test(SDL_Surface *surface, TTF_Font *font);
 void partial_scripts_test(SDL_Surface *surface, TTF_Font *font);
+void render_bench(SDL_Surface *surface, TTF_Font *font);
+void span_test(SDL_Surface *surface, TTF_Font *font);
+void lookup_test(SDL_Surface *surface, TTF_Font *font);
+void cache_test(SDL_Surface *surface, TTF_Font *font);
+void input_bench(SDL_Surface *surface, TTF_Font *font);
+void tap_test(SDL_Surface *surface, TTF_Font *font);
 
-#define TEST_MENU_SIZE 7
+#define TEST_MENU_SIZE 14
 
 #define TEST_TIMER     0
 #define TEST_INPUT     1
@@ -65,7 +80,14 @@ void partial_scripts_test(SDL_Surface *surface, TTF_Font *font);
 #define TEST_COLLISION 3
 #define TEST_PLAYER    4
 #define TEST_SCR_PART  5
-#define TEST_QUIT      6
+#define TEST_RENDER    6
+#define TEST_RESOURCE  7
+#define TEST_SPANS     8
+#define TEST_LOOKUP    9
+#define TEST_CACHE     10
+#define TEST_INPUTS    11
+#define TEST_TAPS      12
+#define TEST_QUIT      13
 
 const char menu[TEST_MENU_SIZE][32] = {
     "60 hz timer test",
@@ -74,6 +96,13 @@ const char menu[TEST_MENU_SIZE][32] = {
     "Collision test",
     "Player test",
     "Scripts test (partial)",
+    "Render thread benchmark",
+    "Archive load benchmark",
+    "Sprite span statistics",
+    "Resource lookup contention",
+    "Resource cache statistics",
+    "Input dispatch benchmark",
+    "Quick tap test",
     "Quit the system test"
 };
     
@@ -170,39 +199,12 @@ brmenu *construct_menu(SDL_Surface *surface, TTF_Font *font, resource *logo)
     /* Link all the entries together */
     menu_link_entries(brm);
     
-    /* Clear surfaces */
-    SDL_FreeSurface(logoimg);
+    /* Clear surfaces, the logo belongs to the resource cache */
     SDL_FreeSurface(version);
     
     return brm;
 }
 
-int draw_stop = FALSE;
-
-/* 
- * This redraws the menu approximately 60 times a second
- * It's VERY rough, and would obviously only be used for something
- * simple like this
- */
-int _drawthread(void *data)
-{
-    brmenu *brm = (brmenu*)data;
-    int r;
-    
-    draw_stop = FALSE;
-    while (!draw_stop) {
-        r = SDL_mutexP(brm->_lock);
-        check_mutex(r);
-        draw_menu(brm);
-        SDL_Flip(brm->surface);
-        r = SDL_mutexV(brm->_lock);
-        check_mutex(r);
-        SDL_Delay(16);
-    }
-    
-    return 1;
-}
-
 int main(int argc, char *argv[])
 {
     int finished = FALSE;
@@ -210,7 +212,6 @@ int main(int argc, char *argv[])
     arclist *core;
     resource *corner_logo;
     SDL_Surface *screen = NULL;
-    SDL_Thread  *drawthread = NULL;
     TTF_Font *font = NULL;
 
     srand((int) time(NULL));
@@ -225,19 +226,15 @@ int main(int argc, char *argv[])
     SDL_WM_SetCaption("BULLET RAIN ENGINE TEST", NULL);
     
     core = load_arc("res/brcore.tgz");
-    corner_logo = get_res("res/brcore.tgz", "logosmbk.png");
+    corner_logo = ACQUIRE_RES("res/brcore.tgz", "logosmbk.png");
     
     brm = construct_menu(screen, font, corner_logo);
+    release_res(corner_logo);
 
     while (!finished) {
+        /* The menu only gets drawn when the selection moves */
         start_menu(brm);
-        drawthread = SDL_CreateThread(&_drawthread, brm);
-        while (brm->running == TRUE) {
-            menu_action(brm, get_action());
-            SDL_Delay(10);
-        }
-        
-        draw_stop = TRUE;
+        wait_on_menu(brm);
         
         switch (brm->end) {
             case TEST_TIMER:
@@ -258,6 +255,27 @@ int main(int argc, char *argv[])
             case TEST_SCR_PART:
                 partial_scripts_test(screen, font);
                 break;
+            case TEST_RENDER:
+                render_bench(screen, font);
+                break;
+            case TEST_RESOURCE:
+                res_test(screen, font);
+                break;
+            case TEST_SPANS:
+                span_test(screen, font);
+                break;
+            case TEST_LOOKUP:
+                lookup_test(screen, font);
+                break;
+            case TEST_CACHE:
+                cache_test(screen, font);
+                break;
+            case TEST_INPUTS:
+                input_bench(screen, font);
+                break;
+            case TEST_TAPS:
+                tap_test(screen, font);
+                break;
             case TEST_QUIT:
                 finished = TRUE;
                 break;
@@ -357,7 +375,7 @@ void hash_test(SDL_Surface *surface, TTF_Font *font)
         SDL_Flip(surface);
         
         /* Check input */
-        SDL_WaitEvent(&event);
+        pump_wait(&event);
         if (event.type == SDL_KEYDOWN) {
             if (event.key.keysym.sym == SDLK_ESCAPE) {
                 break;
@@ -416,20 +434,163 @@ void hash_test(SDL_Surface *surface, TTF_Font *font)
     SDL_EnableUNICODE(0);
 }
 
+/*
+ * Times loading a big archive of sprites with 0, 1, 2, 4 and 8 decode
+ * threads (0 meaning everything is decoded on the loading thread), and
+ * the same thing as a pack if there is one. Neither is in svn, build them
+ * with "make benchres" and "make packs" first.
+ */
+#define RES_BENCH_ARC  "res/bench.tgz"
+#define RES_BENCH_PACK "res/bench.brp"
+#define RES_BENCH_RUNS 5
+
+/*
+ * Then with a few ways of reading the tarball in, counting how many times
+ * loading it goes to the heap (images' surfaces aside). After the first
+ * load the arena blocks get reused, so that should be close to none.
+ */
+#define RES_INPUT_RUNS 3
+
+/* Time a load_arc, then free it again */
+Uint32 time_load(char *arcname)
+{
+    Uint32 start, elapsed;
+    
+    start = SDL_GetTicks();
+    load_arc(arcname);
+    elapsed = SDL_GetTicks() - start;
+    free_arc(arcname);
+    
+    return elapsed;
+}
+
+void res_test(SDL_Surface *surface, TTF_Font *font)
+{
+    const int threads[RES_BENCH_RUNS] = {0, 1, 2, 4, 8};
+    const size_t blocks[RES_INPUT_RUNS] = {10240, 262144, 0};
+    char result[64];
+    int i, oldthreads, havepack;
+    size_t oldblock;
+    Uint32 arctime, packtime;
+    res_stats stats;
+    FILE *test;
+    text_cache *text;
+    SDL_Event event;
+    
+    const Uint32 bg = SDL_MapRGB(surface->format, 0, 0, 32); /* dk.blue */
+    
+    text = get_text_cache(font, off);
+    SDL_FillRect(surface, NULL, bg);
+    
+    test = fopen(RES_BENCH_ARC, "rb");
+    if (test == NULL) {
+        draw_text(text, surface, 0, 0, "Couldn't open " RES_BENCH_ARC);
+        draw_text(text, surface, 0, text->height,
+                  "Run \"make benchres\" to build it");
+    }
+    else {
+        fclose(test);
+        oldthreads = get_decode_threads();
+        
+        test = fopen(RES_BENCH_PACK, "rb");
+        havepack = (test != NULL);
+        if (havepack) {
+            fclose(test);
+        }
+        
+        /* Load them once first so every run sees a warm file cache */
+        time_load(RES_BENCH_ARC);
+        if (havepack) {
+            time_load(RES_BENCH_PACK);
+        }
+        
+        for (i = 0; i < RES_BENCH_RUNS; ++i) {
+            set_decode_threads(threads[i]);
+            
+            arctime = time_load(RES_BENCH_ARC);
+            if (havepack) {
+                packtime = time_load(RES_BENCH_PACK);
+                sprintf(result, "%d decode thread(s): %u ms, pack %u ms",
+                        threads[i], arctime, packtime);
+            }
+            else {
+                sprintf(result, "%d decode thread(s): %u ms",
+                        threads[i], arctime);
+            }
+            debug(result);
+            draw_text(text, surface, 0, i * text->height, result);
+            SDL_Flip(surface);
+        }
+        
+        set_decode_threads(oldthreads);
+        
+        oldblock = get_tgz_read_block();
+        for (i = 0; i < RES_INPUT_RUNS; ++i) {
+            set_tgz_read_block(blocks[i]);
+            
+            reset_res_stats();
+            arctime = time_load(RES_BENCH_ARC);
+            get_res_stats(&stats);
+            if (blocks[i]) {
+                sprintf(result, "%lu byte reads: %u ms, %u allocs",
+                        (unsigned long) blocks[i], arctime,
+                        (unsigned) stats.allocs);
+            }
+            else {
+                sprintf(result, "Mapped: %u ms, %u allocs",
+                        arctime, (unsigned) stats.allocs);
+            }
+            debug(result);
+            draw_text(text, surface, 0,
+                      (RES_BENCH_RUNS + 1 + i) * text->height, result);
+            SDL_Flip(surface);
+        }
+        set_tgz_read_block(oldblock);
+        
+        sprintf(result, "Arena: %lu KiB", (unsigned long) stats.arena / 1024);
+        draw_text(text, surface, 0,
+                  (RES_BENCH_RUNS + 1 + i) * text->height, result);
+        
+        if (!havepack) {
+            draw_text(text, surface, 0,
+                      (RES_BENCH_RUNS + RES_INPUT_RUNS + 3) * text->height,
+                      "Run \"make packs\" to compare against " RES_BENCH_PACK);
+        }
+    }
+    
+    draw_text(text, surface, 0, surface->h - text->height,
+              "Escape: Exit to menu");
+    SDL_Flip(surface);
+    
+    while (pump_wait(&event)) {
+        if (event.type == SDL_KEYDOWN &&
+            event.key.keysym.sym == SDLK_ESCAPE) {
+            break;
+        }
+    }
+}
+
 void timer_test(SDL_Surface *surface, TTF_Font *font)
 {
     Uint32 start_clock = clock_60hz();
     Uint32 start_ticks = SDL_GetTicks();
+    Uint32 last_clock_tick = start_clock;
     Sint32 clock, ticks;
+    Uint64 mean, p99, max;
+    int quit = FALSE;
     float realhz;
     char buffer[64];
     
-    SDL_Surface *tmp;
+    text_cache *offtext, *ontext;
     SDL_Event event;
-    SDL_Rect rect;
 
     const Uint32 bg = SDL_MapRGB(surface->format, 0, 0, 32); /* dk.blue */
     
+    offtext = get_text_cache(font, off);
+    ontext  = get_text_cache(font, on);
+    
+    timer_reset_jitter();
+    
     while (TRUE) {
         /* Update calculations */
         clock = clock_60hz()   - start_clock;
@@ -442,29 +603,36 @@ void timer_test(SDL_Surface *surface, TTF_Font *font)
         
         /* Draw in text */
         sprintf(buffer, "%u clock ticks in %u ms", clock, ticks);
-        tmp = TTF_RenderText_Solid(font, buffer, off);
-        rectset(rect, 0, 0, 0, 0);
-        SDL_BlitSurface(tmp, NULL, surface, &rect);
+        draw_text(offtext, surface, 0, 0, buffer);
         
         sprintf(buffer, "% g hz error", realhz - 60.0);
         if (fabs(realhz - 60.0) <= 0.2) {
-            tmp = TTF_RenderText_Solid(font, buffer, off);
+            draw_text(offtext, surface, 0, offtext->height, buffer);
         }
         else {
-            tmp = TTF_RenderText_Solid(font, buffer, on);
+            draw_text(ontext, surface, 0, ontext->height, buffer);
+        }
+        
+        /* Frame pacing, anything much over a millisecond is a bad sign */
+        if (timer_jitter(&mean, &p99, &max) > 0) {
+            sprintf(buffer, "jitter: mean %.3f p99 %.3f max %.3f ms",
+                    mean / 1000000.0F, p99 / 1000000.0F, max / 1000000.0F);
+            draw_text(p99 <= 1000000 ? offtext : ontext, surface,
+                      0, offtext->height * 3, buffer);
         }
-        rectset(rect, 0, tmp->h, 0, 0);
-        SDL_BlitSurface(tmp, NULL, surface, &rect);
 
         SDL_Flip(surface);
         
-        if (SDL_PollEvent(&event)) {
-            if (event.type == SDL_KEYDOWN) {
-                if (event.key.keysym.sym == SDLK_ESCAPE) {
-                    break;
-                }
+        /* Pace it like a real frame loop, or there's no jitter to see */
+        last_clock_tick = wait_tick(last_clock_tick);
+        
+        while (pump_poll(&event)) {
+            if (event.type == SDL_KEYDOWN &&
+                event.key.keysym.sym == SDLK_ESCAPE) {
+                quit = TRUE;
             }
         }
+        if (quit) break;
     }
 }
 
@@ -489,7 +657,7 @@ void input_test(SDL_Surface *surface, TTF_Font *font)
 #define INPUT_TEST_MOVESPEED 0.25F
     
     /* Get the sprite */
-    lgsprite = (SDL_Surface*)(get_res("res/brcore.tgz", "lgbullet.png")->data);
+    lgsprite = (SDL_Surface*)(GET_RES("res/brcore.tgz", "lgbullet.png")->data);
     fmt = lgsprite->format;
     /* copy over the one we actually want */
     rectset(rect, 32, 0, 32, 32);
@@ -509,7 +677,7 @@ void input_test(SDL_Surface *surface, TTF_Font *font)
     SDL_BlitSurface(text, NULL, surface, &rect);
     SDL_Flip(surface);
     while (TRUE) {
-        if (SDL_WaitEvent(&event) && event.type == SDL_KEYDOWN) {
+        if (pump_wait(&event) && event.type == SDL_KEYDOWN) {
             if (event.key.keysym.sym == SDLK_ESCAPE) {
                 /* Abandon thread! */
                 SDL_FreeSurface(text);
@@ -535,7 +703,7 @@ void input_test(SDL_Surface *surface, TTF_Font *font)
     SDL_BlitSurface(text, NULL, surface, &rect);
     SDL_Flip(surface);
     while (TRUE) {
-        if (SDL_WaitEvent(&event) && event.type == SDL_KEYDOWN) {
+        if (pump_wait(&event) && event.type == SDL_KEYDOWN) {
             if (event.key.keysym.sym == SDLK_ESCAPE) {
                 /* Abandon thread! */
                 SDL_FreeSurface(text);
@@ -561,7 +729,7 @@ void input_test(SDL_Surface *surface, TTF_Font *font)
     SDL_BlitSurface(text, NULL, surface, &rect);
     SDL_Flip(surface);
     while (TRUE) {
-        if (SDL_WaitEvent(&event) && event.type == SDL_KEYDOWN) {
+        if (pump_wait(&event) && event.type == SDL_KEYDOWN) {
             if (event.key.keysym.sym == SDLK_ESCAPE) {
                 /* Abandon thread! */
                 SDL_FreeSurface(text);
@@ -587,7 +755,7 @@ void input_test(SDL_Surface *surface, TTF_Font *font)
     SDL_BlitSurface(text, NULL, surface, &rect);
     SDL_Flip(surface);
     while (TRUE) {
-        if (SDL_WaitEvent(&event) && event.type == SDL_KEYDOWN) {
+        if (pump_wait(&event) && event.type == SDL_KEYDOWN) {
             if (event.key.keysym.sym == SDLK_ESCAPE) {
                 /* Abandon thread! */
                 SDL_FreeSurface(text);
@@ -607,7 +775,7 @@ void input_test(SDL_Surface *surface, TTF_Font *font)
     
     while (TRUE) {
         /* Do we have events? */
-        while (SDL_PollEvent(&event)) {
+        while (pump_poll(&event)) {
             /* Run through the input system */
             if (!update_input(event)) {
                 /* Check for escape */
@@ -655,37 +823,20 @@ void input_test(SDL_Surface *surface, TTF_Font *font)
     /* We never get out of here */
 }
 
-void bull_test_fake_proc(SDL_Surface *surface, TTF_Font *font)
+/*
+ * Makes the twelve small and twelve large bullet types used by the bullet
+ * test, cutting their images out of the core bullet sheets
+ */
+void make_fake_types(SDL_Surface *surface, bullet_type *sm, bullet_type *lg)
 {
-    bullet *tmp;
-    
-    bullet_type sm[12];
-    bullet_type lg[12];
-    
-    float velx, vely, px, py;
-    
-    int i, bullets_made = 0, numbullets = 0;
-    Uint32 lasttime = SDL_GetTicks(), newtime, frametotal = 0;
-    Uint32 frames[12] = {0,0,0,0,0,0,0,0,0,0,0,0};
-    float fps;
-    char fpsbuf[24];
+    int i;
     
     SDL_Rect rect;
-    SDL_Surface *smsprite, *lgsprite, *smtmp, *lgtmp, *fpstmp;
-    SDL_Event event;
-    
-    const SDL_PixelFormat fmt = *(surface->format);
-    const int center_x = 320;
-    const int center_y = 240;
-    const Uint32 bg = SDL_MapRGB(&fmt, 0, 0, 32); /* dk.blue */
-    const Uint32 colorkey = SDL_MapRGBA(surface->format, 255, 0, 255, SDL_ALPHA_OPAQUE);
-    
-    /* Clear all the bullets */
-    reset_bullets();
+    SDL_Surface *smsprite, *lgsprite;
     
     /* Get the resources we need */
-    smsprite = (SDL_Surface*)(get_res("res/brcore.tgz", "smbullet.png")->data);
-    lgsprite = (SDL_Surface*)(get_res("res/brcore.tgz", "lgbullet.png")->data);
+    smsprite = (SDL_Surface*)(GET_RES("res/brcore.tgz", "smbullet.png")->data);
+    lgsprite = (SDL_Surface*)(GET_RES("res/brcore.tgz", "lgbullet.png")->data);
     
     /* Make the bullet types */
     for (i = 0; i < 12; ++i) {
@@ -712,238 +863,198 @@ void bull_test_fake_proc(SDL_Surface *surface, TTF_Font *font)
         /* Now we need to get the images */
         switch (i) {
             case 0:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,8,0,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,32,0,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
             case 1:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,16,0,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,64,0,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
             case 2:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,24,0,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,96,0,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
             case 3:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,0,8,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,0,32,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
             case 4:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,8,8,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,32,32,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
             case 5:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,16,8,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,64,32,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
             case 6:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,8,16,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,32,64,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
             case 7:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,16,16,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,64,64,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
             case 8:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,24,16,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,96,64,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
             case 9:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,0,24,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,0,96,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
             case 10:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,8,24,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,32,96,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
             case 11:
-                smtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,8,8,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,16,24,8,8);
-                SDL_BlitSurface(smsprite,&rect, smtmp, NULL);
-                SDL_SetColorKey(smtmp, SDL_SRCCOLORKEY, colorkey);
-                sm[i].img = smtmp;
+                sm[i].img = cut_sprite(smsprite, &rect);
                 
-                lgtmp = SDL_CreateRGBSurface(SDL_HWSURFACE,32,32,
-                    fmt.BitsPerPixel,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
                 rectset(rect,64,96,32,32);
-                SDL_BlitSurface(lgsprite,&rect, lgtmp, NULL);
-                SDL_SetColorKey(lgtmp, SDL_SRCCOLORKEY, colorkey);
-                lg[i].img = lgtmp;
+                lg[i].img = cut_sprite(lgsprite, &rect);
                 
                 break;
         }
     }
+}
+
+void bull_test_fake_proc(SDL_Surface *surface, TTF_Font *font)
+{
+    bullet *tmp;
+    
+    bullet_type sm[12];
+    bullet_type lg[12];
+    
+    float velx, vely, px, py;
+    
+    int i, ticks, bullets_made = 0, numbullets = 0, quit = FALSE;
+    int exporting = FALSE, tracing = FALSE;
+    Uint32 lasttime = SDL_GetTicks(), newtime, frametotal = 0;
+    Uint32 frames[12] = {0,0,0,0,0,0,0,0,0,0,0,0};
+    float fps;
+    char fpsbuf[64];
+    
+    frame_loop fl;
+    text_cache *hud;
+    SDL_Event event;
+    
+/* Ticks to catch up in one frame before slowing down */
+#define BULL_TEST_CATCHUP 4
+    
+    const int center_x = 320;
+    const int center_y = 240;
+    const Uint32 bg = SDL_MapRGB(surface->format, 0, 0, 32); /* dk.blue */
+    
+    /* Clear all the bullets */
+    reset_bullets();
+    
+    /* Get the bullet types */
+    make_fake_types(surface, sm, lg);
+    
+    /* Get the text cache for the FPS counter */
+    hud = get_text_cache(font, off);
+    
+    prof_reset();
+    
+    /*
+     * The bullets move at 60hz however fast we draw them, and get drawn
+     * in between ticks when we draw faster than that
+     */
+    loop_start(&fl, 60, BULL_TEST_CATCHUP);
     
     while (TRUE) {
         /* Blank the screen */
         SDL_FillRect(surface, NULL, bg);
         
-        /* Process ALL the bullets! */
-        for (i = 0; i < 8192; ++i) {
-            tmp = &bullet_mem[i];
-            if (is_alive(tmp)) {
-                if (process_bullet(tmp)) {
-                    --numbullets;
-                }
-            }
-            /* flooding screen with bullets is bad, hence the limit */
-            else if (bullets_made < 12) {
-                px   = (rand()%40960-20480) / 64.0F;
-                py   = (rand()%30720-15360) / 64.0F;
-                velx = (rand()%256-128) / 64.0F;
-                vely = (rand()%256-128) / 64.0F;
-                if (rand()%2) {
-                    if (make_bullet(px, py, velx, vely, &sm[rand()%12]) != -1) {
-                        ++numbullets;
-                        ++bullets_made;
+        /* Process ALL the bullets, once for every tick that's gone by */
+        ticks = loop_begin(&fl);
+        prof_start(PROF_INTEGRATE);
+        while (ticks-- > 0) {
+            snapshot_bullets();
+            bullets_made = 0;
+            
+            for (i = 0; i < 8192; ++i) {
+                tmp = &bullet_mem[i];
+                if (is_alive(tmp)) {
+                    if (process_bullet(tmp)) {
+                        --numbullets;
                     }
                 }
-                else {
-                    if (make_bullet(px, py, velx, vely, &lg[rand()%12]) != -1) {
-                        ++numbullets;
-                        ++bullets_made;
+                /* flooding screen with bullets is bad, hence the limit */
+                else if (bullets_made < 12) {
+                    px   = (rand()%40960-20480) / 64.0F;
+                    py   = (rand()%30720-15360) / 64.0F;
+                    velx = (rand()%256-128) / 64.0F;
+                    vely = (rand()%256-128) / 64.0F;
+                    if (rand()%2) {
+                        if (make_bullet(px, py, velx, vely,
+                                        &sm[rand()%12]) != -1) {
+                            ++numbullets;
+                            ++bullets_made;
+                        }
+                    }
+                    else {
+                        if (make_bullet(px, py, velx, vely,
+                                        &lg[rand()%12]) != -1) {
+                            ++numbullets;
+                            ++bullets_made;
+                        }
                     }
                 }
             }
-            
-            draw_bullet(tmp, surface, center_x, center_y);
         }
+        prof_stop(PROF_INTEGRATE);
         
-        /* Update time information */
-        bullets_made = 0;
+        /* Draw them all at once, split up across the render threads */
+        if (budget_draw_frame()) {
+            render_bullets_lerp(surface, center_x, center_y, fl.alpha);
+        }
         
+        /* Update time information */
         newtime = SDL_GetTicks();
         
         frametotal += newtime - lasttime;
@@ -964,25 +1075,563 @@ void bull_test_fake_proc(SDL_Surface *surface, TTF_Font *font)
             fps = 12.0F / (frametotal/1000.0F); /* time is in milliseconds */
         }
         sprintf(fpsbuf, "%d @ %.2f fps", numbullets, fps);
-        fpstmp = TTF_RenderText_Solid(font, fpsbuf, off);
-        SDL_BlitSurface(fpstmp, NULL, surface, NULL);
+        draw_text(hud, surface, 0, 0, fpsbuf);
+        sprintf(fpsbuf, "%u ticks, %u frames, %u dropped",
+                fl.ticks, fl.frames, fl.dropped);
+        draw_text(hud, surface, 0, hud->height, fpsbuf);
+        budget_draw_overlay(surface, hud, 0, hud->height * 2);
+        i = prof_draw_overlay(surface, hud, 0, hud->height * 3);
+        sprintf(fpsbuf, "%ld made, %ld gone, %ld failed%s%s",
+                (long) metric_frame(MET_BULLETS_MADE),
+                (long) metric_frame(MET_BULLETS_DESTROYED),
+                (long) metric_frame(MET_BULLETS_FAILED),
+                exporting ? ", exporting" : "",
+                tracing ? ", tracing" : "");
+        draw_text(hud, surface, 0, hud->height * 3 + i, fpsbuf);
         
+        prof_start(PROF_FLIP);
         SDL_Flip(surface);
+        prof_stop(PROF_FLIP);
+        prof_end_frame();
+        metrics_end_frame();
+        
+        /* See if we're over budget, and slow down if that's the policy */
+        budget_end_frame();
+        fl.speed = budget_speed();
         
         SDL_Delay(1);
         
-        /* Should we quit? */
-        if (SDL_PollEvent(&event)) {
+        /* Should we quit? Or dump the profile? Or fake a hitch? */
+        /* M writes a crash dump without the crash, for brdump */
+        while (pump_poll(&event)) {
             if (event.type == SDL_KEYDOWN) {
                 if (event.key.keysym.sym == SDLK_ESCAPE) {
-                    break;
+                    quit = TRUE;
+                }
+                else if (event.key.keysym.sym == SDLK_d) {
+                    prof_dump_csv("profile.csv");
+                }
+                else if (event.key.keysym.sym == SDLK_h) {
+                    SDL_Delay(250);
+                }
+                else if (event.key.keysym.sym == SDLK_m) {
+                    write_dump("systest.dmp", "Dumped from the bullet test");
+                }
+                /* E starts or stops exporting the metrics */
+                else if (event.key.keysym.sym == SDLK_e) {
+                    exporting = !exporting &&
+                                metrics_export("metrics.csv", MET_CSV, 1000);
+                    if (!exporting) metrics_export(NULL, MET_CSV, 0);
+                }
+                /* T starts a trace, then writes it out the next time */
+                else if (event.key.keysym.sym == SDLK_t) {
+                    if (tracing) {
+                        trace_dump("trace.json");
+                    }
+                    else {
+                        trace_start();
+                    }
+                    tracing = !tracing;
+                }
+                /* B tries the next budget policy */
+                else if (event.key.keysym.sym == SDLK_b) {
+                    budget_set_policy((budget_get_policy() + 1) %
+                                      BUDGET_NUM_POLICIES);
                 }
             }
         }
+        if (quit) break;
     }
+    budget_set_policy(BUDGET_NONE);
+    metrics_export(NULL, MET_CSV, 0);
+    trace_stop();
     reset_bullets();
 }
 
+/*
+ * Times render_bullets on the bullet test workload, using 1, 2, 4 and 8
+ * render threads in turn. Every run uses the same random seed, so they all
+ * draw exactly the same frames.
+ */
+#define RENDER_BENCH_FRAMES  240
+#define RENDER_BENCH_BULLETS 8000
+
+/* Run the workload once, returning the total ns spent drawing */
+Uint64 time_render(SDL_Surface *surface, bullet_type *sm, bullet_type *lg)
+{
+    bullet *tmp;
+    
+    float velx, vely, px, py;
+    
+    int i, j, numbullets = 0;
+    Uint64 start, drawtime = 0;
+    
+    const int center_x = 320;
+    const int center_y = 240;
+    const Uint32 bg = SDL_MapRGB(surface->format, 0, 0, 32); /* dk.blue */
+    
+    reset_bullets();
+    srand(12345);
+    
+    for (j = 0; j < RENDER_BENCH_FRAMES; ++j) {
+        /* Move everything along */
+        for (i = 0; i < 8192; ++i) {
+            tmp = &bullet_mem[i];
+            if (is_alive(tmp) && process_bullet(tmp)) {
+                --numbullets;
+            }
+        }
+        
+        /* Keep the screen flooded */
+        while (numbullets < RENDER_BENCH_BULLETS) {
+            px   = (rand()%40960-20480) / 64.0F;
+            py   = (rand()%30720-15360) / 64.0F;
+            velx = (rand()%256-128) / 64.0F;
+            vely = (rand()%256-128) / 64.0F;
+            if (rand()%2) {
+                make_bullet(px, py, velx, vely, &sm[rand()%12]);
+            }
+            else {
+                make_bullet(px, py, velx, vely, &lg[rand()%12]);
+            }
+            ++numbullets;
+        }
+        
+        /* Only the drawing is timed, and it's often well under a ms */
+        SDL_FillRect(surface, NULL, bg);
+        start = clock_ns();
+        render_bullets(surface, center_x, center_y);
+        drawtime += clock_ns() - start;
+        
+        SDL_Flip(surface);
+    }
+    
+    reset_bullets();
+    srand((int) time(NULL));
+    
+    return drawtime;
+}
+
+/* Show some result lines and wait for Escape */
+void show_results(SDL_Surface *surface, TTF_Font *font,
+                  char results[][64], int count)
+{
+    int i;
+    text_cache *text;
+    SDL_Event event;
+    
+    const Uint32 bg = SDL_MapRGB(surface->format, 0, 0, 32); /* dk.blue */
+    
+    text = get_text_cache(font, off);
+    SDL_FillRect(surface, NULL, bg);
+    for (i = 0; i < count; ++i) {
+        draw_text(text, surface, 0, i * text->height, results[i]);
+    }
+    draw_text(text, surface, 0, surface->h - text->height,
+              "Escape: Exit to menu");
+    SDL_Flip(surface);
+    
+    while (pump_wait(&event)) {
+        if (event.type == SDL_KEYDOWN &&
+            event.key.keysym.sym == SDLK_ESCAPE) {
+            break;
+        }
+    }
+}
+
+void render_bench(SDL_Surface *surface, TTF_Font *font)
+{
+    bullet_type sm[12];
+    bullet_type lg[12];
+    
+    int i, run, numthreads, oldthreads;
+    Uint64 drawtime;
+    char results[4][64];
+    
+    make_fake_types(surface, sm, lg);
+    oldthreads = render_get_threads();
+    
+    for (run = 0, numthreads = 1; run < 4; ++run, numthreads *= 2) {
+        render_set_threads(numthreads);
+        drawtime = time_render(surface, sm, lg);
+        sprintf(results[run], "%d thread(s): %.1f us/frame", numthreads,
+                drawtime / 1000.0 / RENDER_BENCH_FRAMES);
+        debug(results[run]);
+    }
+    
+    /* Put everything back how we found it */
+    render_set_threads(oldthreads);
+    for (i = 0; i < 12; ++i) {
+        free_sprite(sm[i].img);
+        free_sprite(lg[i].img);
+    }
+    
+    show_results(surface, font, results, 4);
+}
+
+/*
+ * Works out how many bytes a blit of each bullet sprite touches, with and
+ * without spans, then times the render benchmark both ways on one thread.
+ *
+ * Without spans, every pixel of the sprite is read and compared against
+ * the colour key, and the opaque ones are written. With spans, only the
+ * opaque pixels are read, plus the span table itself.
+ */
+void span_test(SDL_Surface *surface, TTF_Font *font)
+{
+    bullet_type sm[12];
+    bullet_type lg[12];
+    
+    bullet_type *sheet;
+    SDL_Surface *img;
+    int i, s, opaque, spans, oldthreads, oldspans;
+    long keyed, spanned;
+    Uint64 keytime, spantime;
+    char results[4][64];
+    
+    make_fake_types(surface, sm, lg);
+    
+    for (s = 0; s < 2; ++s) {
+        sheet   = (s == 0) ? sm : lg;
+        keyed   = 0;
+        spanned = 0;
+        for (i = 0; i < 12; ++i) {
+            img = sheet[i].img;
+            if (!sprite_stats(img, &opaque, &spans)) {
+                /* No spans, so the keyed path is all we've got */
+                opaque = img->w * img->h;
+                spans  = 0;
+            }
+            keyed   += img->w * img->h * 4 + opaque * 4;
+            spanned += opaque * 8 + spans * 4 + (img->h + 1) * sizeof(int);
+        }
+        sprintf(results[s], "%s sheet: %ld B/blit keyed, %ld B/blit spans",
+                (s == 0) ? "Small" : "Large", keyed / 12, spanned / 12);
+        debug(results[s]);
+    }
+    
+    oldthreads = render_get_threads();
+    oldspans   = render_get_spans();
+    render_set_threads(1);
+    
+    render_set_spans(FALSE);
+    keytime = time_render(surface, sm, lg);
+    render_set_spans(TRUE);
+    spantime = time_render(surface, sm, lg);
+    
+    sprintf(results[2], "Keyed: %.1f us/frame",
+            keytime / 1000.0 / RENDER_BENCH_FRAMES);
+    sprintf(results[3], "Spans: %.1f us/frame",
+            spantime / 1000.0 / RENDER_BENCH_FRAMES);
+    debug(results[2]);
+    debug(results[3]);
+    
+    render_set_threads(oldthreads);
+    render_set_spans(oldspans);
+    for (i = 0; i < 12; ++i) {
+        free_sprite(sm[i].img);
+        free_sprite(lg[i].img);
+    }
+    
+    show_results(surface, font, results, 4);
+}
+
+/*
+ * Has 1, 2, 4 and 8 threads all calling get_res on the core archive at
+ * once, going through the locks and then without them
+ */
+#define LOOKUP_BENCH_CALLS 200000
+#define LOOKUP_BENCH_NAMES 8
+
+const char lookup_names[LOOKUP_BENCH_NAMES][16] = {
+    "coreship.png",
+    "enemy.png",
+    "lgbullet.png",
+    "smbullet.png",
+    "logosmbk.png",
+    "logolg.png",
+    "runner.lua",
+    "test.lua"
+};
+
+int lookup_worker(void *unused)
+{
+    int i;
+    
+    for (i = 0; i < LOOKUP_BENCH_CALLS; ++i) {
+        get_res("res/brcore.tgz",
+                (char*)lookup_names[i % LOOKUP_BENCH_NAMES]);
+    }
+    
+    thread_done();
+    return 0;
+}
+
+/* Returns millions of lookups per second over every thread */
+float time_lookups(int numthreads)
+{
+    SDL_Thread *threads[8];
+    Uint64 start, elapsed;
+    int i;
+    
+    start = clock_ns();
+    for (i = 0; i < numthreads; ++i) {
+        threads[i] = SDL_CreateThread(lookup_worker, NULL);
+    }
+    for (i = 0; i < numthreads; ++i) {
+        SDL_WaitThread(threads[i], NULL);
+    }
+    elapsed = clock_ns() - start;
+    
+    return (numthreads * (float)LOOKUP_BENCH_CALLS * 1000.0F) / elapsed;
+}
+
+void lookup_test(SDL_Surface *surface, TTF_Font *font)
+{
+    int run, numthreads, oldlockfree;
+    float locked, lockfree;
+    char results[4][64];
+    
+    /* Make sure everything's in before timing anything */
+    load_arc("res/brcore.tgz");
+    oldlockfree = get_res_lockfree();
+    
+    for (run = 0, numthreads = 1; run < 4; ++run, numthreads *= 2) {
+        set_res_lockfree(FALSE);
+        locked   = time_lookups(numthreads);
+        set_res_lockfree(TRUE);
+        lockfree = time_lookups(numthreads);
+        sprintf(results[run], "%d thread(s): %.2f M/s locked, %.2f lock-free",
+                numthreads, locked, lockfree);
+        debug(results[run]);
+    }
+    
+    set_res_lockfree(oldlockfree);
+    
+    show_results(surface, font, results, 4);
+}
+
+/*
+ * Squeezes the core archive's images into half the memory they need and
+ * cycles through them, trimming after every round like a game would
+ * between stages, to see how the cache copes
+ */
+#define CACHE_TEST_ROUNDS 16
+#define CACHE_TEST_IMAGES 6
+
+void cache_test(SDL_Surface *surface, TTF_Font *font)
+{
+    res_stats stats;
+    size_t oldbudget;
+    int round, i;
+    char results[5][64];
+    
+    load_arc("res/brcore.tgz");
+    oldbudget = get_res_budget();
+    get_res_stats(&stats);
+    set_res_budget(stats.resident / 2);
+    reset_res_stats();
+    
+    for (round = 0; round < CACHE_TEST_ROUNDS; ++round) {
+        /* Look at a different part of the list each round */
+        for (i = 0; i <= round % CACHE_TEST_IMAGES; ++i) {
+            get_res("res/brcore.tgz", (char*)lookup_names[i]);
+        }
+        trim_resources();
+    }
+    
+    get_res_stats(&stats);
+    set_res_budget(oldbudget);
+    
+    sprintf(results[0], "Hits: %u, misses: %u (%.1f%% hit rate)",
+            (unsigned) stats.hits, (unsigned) stats.misses,
+            100.0F * stats.hits / (stats.hits + stats.misses + 1));
+    sprintf(results[1], "Evictions: %u", (unsigned) stats.evictions);
+    sprintf(results[2], "Re-decodes: %u", (unsigned) stats.redecodes);
+    sprintf(results[3], "Resident: %lu KiB",
+            (unsigned long) stats.resident / 1024);
+    sprintf(results[4], "Budget: %lu KiB",
+            (unsigned long) stats.budget / 1024);
+    for (i = 0; i < 5; ++i) {
+        debug(results[i]);
+    }
+    
+    show_results(surface, font, results, 5);
+}
+
+/*
+ * Binds all 64 inputs, then floods update_input with key, mouse motion and
+ * mouse button events. Each flood is timed going straight to update_input,
+ * and again going through the SDL event queue first, the way events get to
+ * it for real.
+ */
+#define INPUT_BENCH_EVENTS 200000
+/* SDL 1.2's queue only holds 128 events, so we push them in batches */
+#define INPUT_BENCH_BATCH  64
+
+const char input_bench_kinds[3][8] = {"key", "motion", "button"};
+
+/* Make the nth event of a flood */
+void _input_bench_event(int kind, int n, SDL_Event *event)
+{
+    memset(event, 0, sizeof(SDL_Event));
+    switch (kind) {
+        case 0:
+            /* Some of these keys aren't bound, like real typing */
+            event->type = (n & 1) ? SDL_KEYUP : SDL_KEYDOWN;
+            event->key.state = (n & 1) ? SDL_RELEASED : SDL_PRESSED;
+            event->key.keysym.sym = (SDLKey)('a' + (n/2) % 32);
+            break;
+        case 1:
+            event->type = SDL_MOUSEMOTION;
+            event->motion.x = n % 640;
+            event->motion.y = n % 480;
+            break;
+        default:
+            event->type = (n & 1) ? SDL_MOUSEBUTTONUP : SDL_MOUSEBUTTONDOWN;
+            event->button.state = (n & 1) ? SDL_RELEASED : SDL_PRESSED;
+            event->button.button = 1 + (n/2) % 5;
+            break;
+    }
+}
+
+void input_bench(SDL_Surface *surface, TTF_Font *font)
+{
+    SDL_Event event;
+    Uint64 start, direct, queued;
+    int i, kind, n, b;
+    char results[3][64];
+    
+    /* Keys for most of them, two to a key, then buttons and the mouse */
+    for (i = 0; i < 64; ++i) {
+        unbind_input(i);
+        if (i < 52) {
+            input_register_boolean(i);
+            input_config_key(i, (SDLKey)('a' + i % 26));
+        }
+        else if (i < 60) {
+            input_register_boolean(i);
+            input_config_mouse_button(i, 1 + i % 3);
+        }
+        else {
+            input_register_twodim(i);
+            input_config_mouse(i);
+        }
+    }
+    
+    /* Get rid of anything real that's waiting */
+    while (pump_poll(&event)) {}
+    
+    for (kind = 0; kind < 3; ++kind) {
+        start = clock_ns();
+        for (n = 0; n < INPUT_BENCH_EVENTS; ++n) {
+            _input_bench_event(kind, n, &event);
+            update_input(event);
+        }
+        direct = clock_ns() - start;
+        
+        start = clock_ns();
+        for (n = 0; n < INPUT_BENCH_EVENTS; n += INPUT_BENCH_BATCH) {
+            for (b = 0; b < INPUT_BENCH_BATCH; ++b) {
+                _input_bench_event(kind, n + b, &event);
+                SDL_PushEvent(&event);
+            }
+            /* Wait for the pump to hand every one of them over */
+            for (b = 0; b < INPUT_BENCH_BATCH; ) {
+                if (pump_poll(&event)) {
+                    update_input(event);
+                    ++b;
+                }
+            }
+        }
+        queued = clock_ns() - start;
+        
+        sprintf(results[kind], "%-6s %6.1f ns/event direct, %6.1f pumped",
+                input_bench_kinds[kind],
+                direct / (float) INPUT_BENCH_EVENTS,
+                queued / (float) INPUT_BENCH_EVENTS);
+        debug(results[kind]);
+    }
+    
+    /* Leave everything unbound for the other tests */
+    for (i = 0; i < 64; ++i) {
+        unbind_input(i);
+        unregister_input(i);
+    }
+    
+    show_results(surface, font, results, 3);
+}
+
+/*
+ * Press and let go of each of the ship's keys between two ticks, and
+ * check the ship still moves or shoots for it
+ */
+#define TAP_SETTLE (PUMP_IDLE * 2)
+
+const SDLKey tap_keys[5]     = {SDLK_UP, SDLK_DOWN, SDLK_LEFT, SDLK_RIGHT,
+                                SDLK_z};
+const char   tap_names[5][8] = {"up", "down", "left", "right", "shoot"};
+
+void tap_test(SDL_Surface *surface, TTF_Font *font)
+{
+    player ship;
+    input_snapshot in;
+    SDL_Event event, leftover[16];
+    char results[5][64];
+    int i, j, shots, ok;
+    
+    reset_pbullets();
+    ship = make_coreship();
+    setup_coreship(0);
+    
+    /* Get rid of anything real that's waiting */
+    SDL_Delay(TAP_SETTLE);
+    input_tick(&in, leftover, 16);
+    
+    for (i = 0; i < 5; ++i) {
+        ship.centerx = 0.0F;
+        ship.centery = 0.0F;
+        ship.gamedata[TIME_TO_MAIN_SHOT] = 0;
+        ship.gamedata[TIME_TO_SIDE_SHOT] = 0;
+        
+        memset(&event, 0, sizeof(SDL_Event));
+        event.type = SDL_KEYDOWN;
+        event.key.state = SDL_PRESSED;
+        event.key.keysym.sym = tap_keys[i];
+        SDL_PushEvent(&event);
+        event.type = SDL_KEYUP;
+        event.key.state = SDL_RELEASED;
+        SDL_PushEvent(&event);
+        
+        /* Long enough for the pump to have both, even backed off */
+        SDL_Delay(TAP_SETTLE);
+        input_tick(&in, leftover, 16);
+        update_coreship(0, &ship);
+        
+        shots = 0;
+        for (j = 0; j < 1024; ++j) {
+            if (pis_alive(&pbullet_mem[j])) ++shots;
+        }
+        
+        switch (CORESHIP_INPUT_UP + i) {
+            case CORESHIP_INPUT_UP:    ok = ship.centery < 0.0F; break;
+            case CORESHIP_INPUT_DOWN:  ok = ship.centery > 0.0F; break;
+            case CORESHIP_INPUT_LEFT:  ok = ship.centerx < 0.0F; break;
+            case CORESHIP_INPUT_RIGHT: ok = ship.centerx > 0.0F; break;
+            default:                   ok = shots > 0;
+        }
+        
+        sprintf(results[i], "%-5s tap: %s (held %d, pressed %d, %d shots)",
+                tap_names[i], ok ? "ok" : "MISSED",
+                (int) snap_held(&in, CORESHIP_INPUT_UP + i),
+                (int) snap_pressed(&in, CORESHIP_INPUT_UP + i), shots);
+        debug(results[i]);
+        reset_pbullets();
+    }
+    
+    show_results(surface, font, results, 5);
+}
+
 void bull_test_collision(SDL_Surface *surface, TTF_Font *font)
 {
     bullet *tmp;
@@ -992,24 +1641,23 @@ void bull_test_collision(SDL_Surface *surface, TTF_Font *font)
     
     float px, py;
     
-    int i, j, mouse_x, mouse_y;
+    int i, j, mouse_x, mouse_y, quit = FALSE;
     
     SDL_Rect rect;
-    SDL_Surface *smsprite, *lgsprite, *stmp;
+    SDL_Surface *smsprite, *lgsprite;
     SDL_Event event;
     
     const SDL_PixelFormat fmt = *(surface->format);
     const int center_x = 320;
     const int center_y = 240;
     const Uint32 bg = SDL_MapRGB(&fmt, 0, 0, 32); /* dk.blue */
-    const Uint32 colorkey = SDL_MapRGBA(surface->format, 255, 0, 255, SDL_ALPHA_OPAQUE);
     
     /* Clear all the bullets */
     reset_bullets();
     
     /* Get the resources we need */
-    smsprite = (SDL_Surface*)(get_res("res/brcore.tgz", "smbullet.png")->data);
-    lgsprite = (SDL_Surface*)(get_res("res/brcore.tgz", "lgbullet.png")->data);
+    smsprite = (SDL_Surface*)(GET_RES("res/brcore.tgz", "smbullet.png")->data);
+    lgsprite = (SDL_Surface*)(GET_RES("res/brcore.tgz", "lgbullet.png")->data);
     
     /* Make the bullet types */
     
@@ -1055,33 +1703,17 @@ void bull_test_collision(SDL_Surface *surface, TTF_Font *font)
         
     /* Now we need to get the images */
     
-    stmp = SDL_CreateRGBSurface(SDL_HWSURFACE, 8, 8, fmt.BitsPerPixel,
-                        fmt.Rmask, fmt.Gmask, fmt.Bmask, fmt.Amask);
     rectset(rect,24,24,8,8);
-    SDL_BlitSurface(smsprite,&rect, stmp, NULL);
-    SDL_SetColorKey(stmp, SDL_SRCCOLORKEY, colorkey);
-    miss[0].img = stmp;
+    miss[0].img = cut_sprite(smsprite, &rect);
     
-    stmp = SDL_CreateRGBSurface(SDL_HWSURFACE, 32, 32, fmt.BitsPerPixel,
-                        fmt.Rmask, fmt.Gmask, fmt.Bmask, fmt.Amask);
     rectset(rect,0,0,32,32);
-    SDL_BlitSurface(lgsprite,&rect, stmp, NULL);
-    SDL_SetColorKey(stmp, SDL_SRCCOLORKEY, colorkey);
-    miss[1].img = stmp;
+    miss[1].img = cut_sprite(lgsprite, &rect);
     
-    stmp = SDL_CreateRGBSurface(SDL_HWSURFACE, 8, 8, fmt.BitsPerPixel,
-                        fmt.Rmask, fmt.Gmask, fmt.Bmask, fmt.Amask);
     rectset(rect,16,0,8,8);
-    SDL_BlitSurface(smsprite,&rect, stmp, NULL);
-    SDL_SetColorKey(stmp, SDL_SRCCOLORKEY, colorkey);
-    hit[0].img = stmp;
+    hit[0].img = cut_sprite(smsprite, &rect);
     
-    stmp = SDL_CreateRGBSurface(SDL_HWSURFACE, 32, 32, fmt.BitsPerPixel,
-                        fmt.Rmask, fmt.Gmask, fmt.Bmask, fmt.Amask);
     rectset(rect,64,64,32,32);
-    SDL_BlitSurface(lgsprite,&rect, stmp, NULL);
-    SDL_SetColorKey(stmp, SDL_SRCCOLORKEY, colorkey);
-    hit[1].img = stmp;
+    hit[1].img = cut_sprite(lgsprite, &rect);
     
     /* 
      * For this test, we're going to create a matrix of stationary bullets
@@ -1142,13 +1774,13 @@ void bull_test_collision(SDL_Surface *surface, TTF_Font *font)
         SDL_Flip(surface);
         
         /* Should we quit? */
-        if (SDL_PollEvent(&event)) {
-            if (event.type == SDL_KEYDOWN) {
-                if (event.key.keysym.sym == SDLK_ESCAPE) {
-                    break;
-                }
+        while (pump_poll(&event)) {
+            if (event.type == SDL_KEYDOWN &&
+                event.key.keysym.sym == SDLK_ESCAPE) {
+                quit = TRUE;
             }
         }
+        if (quit) break;
     }
     reset_bullets();
 }
@@ -1156,7 +1788,9 @@ void bull_test_collision(SDL_Surface *surface, TTF_Font *font)
 void player_test(SDL_Surface *surface, TTF_Font *font)
 {
     player ship;
-    SDL_Event event;
+    input_snapshot in;
+    SDL_Event leftover[16];
+    int left, quit = FALSE;
     Uint32 last_clock_tick;
     SDL_Surface *temp, *tempsrc;
     SDL_PixelFormat *fmt;
@@ -1172,6 +1806,7 @@ void player_test(SDL_Surface *surface, TTF_Font *font)
     float xvel, yvel;
     float dir;
     char deathstring[20];
+    text_cache *hud;
     
 #define ENEMY_TIMER  120
 #define SHOT_A_TIMER 120
@@ -1192,7 +1827,7 @@ void player_test(SDL_Surface *surface, TTF_Font *font)
     ship.centerx = 0.0F;
     ship.centery = 0.0F;
     
-    tempsrc = (SDL_Surface*)(get_res("res/brcore.tgz", "enemy.png")->data);
+    tempsrc = (SDL_Surface*)(GET_RES("res/brcore.tgz", "enemy.png")->data);
     SDL_SetColorKey(tempsrc, SDL_SRCCOLORKEY, colorkey);
     enemy.img = tempsrc;
     enemy.drawlocx  = -16.0F;
@@ -1205,7 +1840,7 @@ void player_test(SDL_Surface *surface, TTF_Font *font)
     enemy.flags     = ENEMY;
     enemy.gameflags = 0;
     
-    tempsrc = (SDL_Surface*)(get_res("res/brcore.tgz", "lgbullet.png")->data);
+    tempsrc = (SDL_Surface*)(GET_RES("res/brcore.tgz", "lgbullet.png")->data);
     fmt = tempsrc->format;
     temp = SDL_CreateRGBSurface(SDL_SWSURFACE,32,32,fmt->BitsPerPixel,
                                 fmt->Rmask,fmt->Gmask,fmt->Bmask,fmt->Amask);
@@ -1223,7 +1858,7 @@ void player_test(SDL_Surface *surface, TTF_Font *font)
     shot_a.flags     = 0;
     shot_a.gameflags = 0;
     
-    tempsrc = (SDL_Surface*)(get_res("res/brcore.tgz", "smbullet.png")->data);
+    tempsrc = (SDL_Surface*)(GET_RES("res/brcore.tgz", "smbullet.png")->data);
     fmt = tempsrc->format;
     temp = SDL_CreateRGBSurface(SDL_SWSURFACE,8,8,fmt->BitsPerPixel,
                                 fmt->Rmask,fmt->Gmask,fmt->Bmask,fmt->Amask);
@@ -1241,26 +1876,30 @@ void player_test(SDL_Surface *surface, TTF_Font *font)
     shot_b.flags     = 0;
     shot_b.gameflags = 0;
     
+    hud = get_text_cache(font, off);
+    
+    prof_reset();
     last_clock_tick = clock_60hz();
     
     while (TRUE) {
-        /* Check for events */
-        if (SDL_PollEvent(&event)) {
-            /* Give escape priority */
-            if (event.type == SDL_KEYDOWN &&
-                event.key.keysym.sym == SDLK_ESCAPE) {
-                break;
-            }
-            else {
-                /* Run through input system */
-                update_input(event);
+        /*
+         * Take this tick's input, everything the ship does this tick goes
+         * off this snapshot. Escape isn't bound, so it'll be left over.
+         */
+        left = input_tick(&in, leftover, 16);
+        for (i = 0; i < left; ++i) {
+            if (leftover[i].type == SDL_KEYDOWN &&
+                leftover[i].key.keysym.sym == SDLK_ESCAPE) {
+                quit = TRUE;
             }
         }
+        if (quit) break;
         
         /* Blank out the screen */
         SDL_FillRect(surface, NULL, bg);
         
         /* Update all the pbullets */
+        prof_start(PROF_INTEGRATE);
         for (i = 0; i < 1024; ++i) {
             tmp = &pbullet_mem[i];
             if (pis_alive(tmp)) {
@@ -1270,6 +1909,7 @@ void player_test(SDL_Surface *surface, TTF_Font *font)
         
         /* Update the ship */
         update_coreship(0, &ship);
+        prof_stop(PROF_INTEGRATE);
         
         /* Draw all the pbullets (including new ones) */
         for (i = 0; i < 1024; ++i) {
@@ -1292,7 +1932,11 @@ void player_test(SDL_Surface *surface, TTF_Font *font)
         if (next_shot_b_timer < 0) next_shot_b_timer = SHOT_B_TIMER;
         
         player_died = FALSE;
-        /* Update all the bullets */
+        /*
+         * Update all the bullets
+         * This moves and draws them too, but it's mostly collision checks
+         */
+        prof_start(PROF_COLLIDE);
         for (i = 0; i < 8192; ++i) {
             tmpb = &bullet_mem[i];
             if (is_alive(tmpb)) {
@@ -1361,6 +2005,7 @@ void player_test(SDL_Surface *surface, TTF_Font *font)
                 }
             }
         }
+        prof_stop(PROF_COLLIDE);
         
         /* Check if we need to make more enemies */
         if (next_enemy_timer == 0) {
@@ -1370,17 +2015,17 @@ void player_test(SDL_Surface *surface, TTF_Font *font)
         
         /* Display death counter */
         sprintf(deathstring, "Deaths: %d", deaths);
-        temp = TTF_RenderText_Solid(font, deathstring, off);
-        SDL_BlitSurface(temp, NULL, surface, NULL);
+        draw_text(hud, surface, 0, 0, deathstring);
+        prof_draw_overlay(surface, hud, 0, hud->height);
         
         /* Flip the screen */
+        prof_start(PROF_FLIP);
         SDL_Flip(surface);
+        prof_stop(PROF_FLIP);
+        prof_end_frame();
         
         /* Wait for next clock tick */
-        while (last_clock_tick == clock_60hz()) {
-            SDL_Delay(1);
-        }
-        last_clock_tick = clock_60hz();
+        last_clock_tick = wait_tick(last_clock_tick);
     }
 }
 
@@ -1393,7 +2038,8 @@ void partial_scripts_test(SDL_Surface *surface, TTF_Font *font)
     SDL_Rect rect;
     bullet_type shot;
     bullet *tmpb;
-    int i, id;
+    int i, id, oldreload, quit = FALSE, profiling = FALSE;
+    text_cache *hud;
     
 #define BULLET_DELAY 60
     int bullet_timer = 0;
@@ -1401,7 +2047,7 @@ void partial_scripts_test(SDL_Surface *surface, TTF_Font *font)
     const Uint32 bg = SDL_MapRGB(surface->format, 0, 0, 32); /* dk.blue */
     const Uint32 colorkey = SDL_MapRGBA(surface->format, 255, 0, 255, SDL_ALPHA_OPAQUE);
     
-    tempsrc = (SDL_Surface*)(get_res("res/brcore.tgz", "lgbullet.png")->data);
+    tempsrc = (SDL_Surface*)(GET_RES("res/brcore.tgz", "lgbullet.png")->data);
     fmt = tempsrc->format;
     temp = SDL_CreateRGBSurface(SDL_SWSURFACE,32,32,fmt->BitsPerPixel,
                                 fmt->Rmask,fmt->Gmask,fmt->Bmask,fmt->Amask);
@@ -1420,22 +2066,46 @@ void partial_scripts_test(SDL_Surface *surface, TTF_Font *font)
     shot.gameflags = 0;
     
     init_scripts();
-    set_runner(get_res("res/brcore.tgz", "runner.lua"));
+    set_runner(GET_RES("res/brcore.tgz", "runner.lua"));
     set_header(NULL);
-    set_main(get_res("res/brcore.tgz", "test.lua"));
+    set_main(GET_RES("res/brcore.tgz", "test.lua"));
     load_scripts();
     
+    hud = get_text_cache(font, off);
+    prof_reset();
     last_clock_tick = clock_60hz();
     
+    /* Rebuild res/brcore.tgz while this is running to see the changes */
+    oldreload = get_hot_reload();
+    set_hot_reload(TRUE);
+    
     while (TRUE) {
+        poll_reloads();
+        
         /* Check for events */
-        if (SDL_PollEvent(&event)) {
+        while (pump_poll(&event)) {
+            if (event.type != SDL_KEYDOWN) continue;
+            
             /* Check for escape */
-            if (event.type == SDL_KEYDOWN &&
-                event.key.keysym.sym == SDLK_ESCAPE) {
-                break;
+            if (event.key.keysym.sym == SDLK_ESCAPE) {
+                quit = TRUE;
+            }
+            /* D dumps the profile */
+            else if (event.key.keysym.sym == SDLK_d) {
+                prof_dump_csv("profile.csv");
+            }
+            /* P starts profiling the scripts, then writes the report */
+            else if (event.key.keysym.sym == SDLK_p) {
+                if (profiling) {
+                    stop_script_profile("scripts.prof");
+                }
+                else {
+                    start_script_profile();
+                }
+                profiling = !profiling;
             }
         }
+        if (quit) break;
         
         /* Blank out the screen */
         SDL_FillRect(surface, NULL, bg);
@@ -1467,6 +2137,7 @@ void partial_scripts_test(SDL_Surface *surface, TTF_Font *font)
         }
         
         /* Update all the bullets */
+        prof_start(PROF_INTEGRATE);
         for (i = 0; i < 8192; ++i) {
             tmpb = &bullet_mem[i];
             if (is_alive(tmpb)) {
@@ -1478,20 +2149,27 @@ void partial_scripts_test(SDL_Surface *surface, TTF_Font *font)
                 }
             }
         }
+        prof_stop(PROF_INTEGRATE);
         
         /* Run scripts */
         exec_bullet_scripts();
         
+        i = prof_draw_overlay(surface, hud, 0, 0);
+        if (profiling) {
+            draw_text(hud, surface, 0, i, "Profiling scripts");
+        }
+        
         /* Flip the screen */
+        prof_start(PROF_FLIP);
         SDL_Flip(surface);
+        prof_stop(PROF_FLIP);
+        prof_end_frame();
         
         /* Wait for next clock tick */
-        while (last_clock_tick == clock_60hz()) {
-            SDL_Delay(1);
-        }
-        last_clock_tick = clock_60hz();
+        last_clock_tick = wait_tick(last_clock_tick);
     }
     
+    set_hot_reload(oldreload);
     stop_scripts();
 }
 
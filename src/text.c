@@ -0,0 +1,194 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * text.c
+ * Contains code for drawing text from cached glyphs
+ */
+
+#include "compile.h"
+#include "debug.h"
+#include "text.h"
+#include <stdlib.h>
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#include "SDL/SDL_thread.h"
+#include "SDL/SDL_ttf.h"
+#else
+#include "SDL.h"
+#include "SDL_thread.h"
+#include "SDL_ttf.h"
+#endif
+
+/* Chain of every cache we've built */
+text_cache *text_head = NULL;
+SDL_mutex  *text_lock;
+
+/* Build the atlas for a new cache */
+text_cache *_build_text_cache(TTF_Font *font, SDL_Color color)
+{
+    text_cache *tc;
+    SDL_Surface *glyph[TEXT_NUM_CHARS];
+    SDL_Surface *screen;
+    SDL_PixelFormat *fmt;
+    SDL_Rect rect;
+    char str[2];
+    int i, width, height;
+    Uint32 key;
+    
+    screen = SDL_GetVideoSurface();
+    panic(screen != NULL, "Text cache requested before setting video mode");
+    fmt = screen->format;
+    
+    tc = malloc(sizeof(text_cache));
+    panic(tc != NULL, "Could not allocate memory for new text cache");
+    
+    tc->font  = font;
+    tc->color = color;
+    
+    /* Render every glyph on its own to find out how much room we need */
+    width  = 0;
+    height = 0;
+    str[1] = '\0';
+    for (i = 0; i < TEXT_NUM_CHARS; ++i) {
+        str[0] = (char)(TEXT_FIRST_CHAR + i);
+        glyph[i] = TTF_RenderText_Solid(font, str, color);
+        panicn(glyph[i] != NULL, "Couldn't render glyph for character",
+               TEXT_FIRST_CHAR + i);
+        width += glyph[i]->w;
+        if (glyph[i]->h > height) {
+            height = glyph[i]->h;
+        }
+    }
+    
+    /* 
+     * Make the atlas in the screen format, so drawing from it is a straight
+     * copy. The colour key is the inverse of the text colour, which can't
+     * ever be the text colour itself.
+     */
+    tc->atlas = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height,
+                                     fmt->BitsPerPixel, fmt->Rmask, fmt->Gmask,
+                                     fmt->Bmask, fmt->Amask);
+    panic(tc->atlas != NULL, "Could not create text atlas");
+    key = SDL_MapRGB(tc->atlas->format, 255 - color.r, 255 - color.g,
+                     255 - color.b);
+    SDL_FillRect(tc->atlas, NULL, key);
+    SDL_SetColorKey(tc->atlas, SDL_SRCCOLORKEY, key);
+    
+    /* Copy the glyphs in */
+    rect.x = 0;
+    rect.y = 0;
+    for (i = 0; i < TEXT_NUM_CHARS; ++i) {
+        rect.w = glyph[i]->w;
+        rect.h = glyph[i]->h;
+        tc->glyphs[i] = rect;
+        SDL_BlitSurface(glyph[i], NULL, tc->atlas, &rect);
+        rect.x += glyph[i]->w;
+        SDL_FreeSurface(glyph[i]);
+    }
+    
+    tc->height = height;
+    
+    debugn("Built text cache, atlas width", width);
+    
+    return tc;
+}
+
+/* Get the cache for a font and colour, building it if we need to */
+text_cache *get_text_cache(TTF_Font *font, SDL_Color color)
+{
+    text_cache *tc;
+    int r;
+    
+    r = SDL_mutexP(text_lock);
+    check_mutex(r);
+    
+    for (tc = text_head; tc != NULL; tc = tc->next) {
+        if (tc->font == font && tc->color.r == color.r &&
+            tc->color.g == color.g && tc->color.b == color.b) {
+            break;
+        }
+    }
+    
+    if (tc == NULL) {
+        tc = _build_text_cache(font, color);
+        tc->next = text_head;
+        text_head = tc;
+    }
+    
+    r = SDL_mutexV(text_lock);
+    check_mutex(r);
+    
+    return tc;
+}
+
+/* Draw a string, returns the width drawn in pixels */
+int draw_text(text_cache *tc, SDL_Surface *dst, int x, int y, const char *str)
+{
+    SDL_Rect dstrect;
+    int c, start = x;
+    
+    for (; *str != '\0'; ++str) {
+        c = (unsigned char)*str;
+        if (c < TEXT_FIRST_CHAR || c > TEXT_LAST_CHAR) {
+            c = '?';
+        }
+        c -= TEXT_FIRST_CHAR;
+        
+        /* SDL_BlitSurface clobbers the destination rect, so reset it */
+        dstrect.x = x;
+        dstrect.y = y;
+        SDL_BlitSurface(tc->atlas, &(tc->glyphs[c]), dst, &dstrect);
+        x += tc->glyphs[c].w;
+    }
+    
+    return x - start;
+}
+
+/* Width a string would take up if drawn, in pixels */
+int text_width(text_cache *tc, const char *str)
+{
+    int c, width = 0;
+    
+    for (; *str != '\0'; ++str) {
+        c = (unsigned char)*str;
+        if (c < TEXT_FIRST_CHAR || c > TEXT_LAST_CHAR) {
+            c = '?';
+        }
+        width += tc->glyphs[c - TEXT_FIRST_CHAR].w;
+    }
+    
+    return width;
+}
+
+/* Start/stop functions */
+int init_text(void)
+{
+    text_lock = SDL_CreateMutex();
+    text_head = NULL;
+    
+    return 0;
+}
+
+void stop_text(void)
+{
+    text_cache *tc, *next;
+    
+    /* Nobody should be drawing anything by now */
+    tc = text_head;
+    while (tc != NULL) {
+        next = tc->next;
+        SDL_FreeSurface(tc->atlas);
+        free(tc);
+        tc = next;
+    }
+    text_head = NULL;
+    
+    SDL_DestroyMutex(text_lock);
+}
@@ -0,0 +1,84 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * text.h
+ * Contains structs and function prototypes for drawing text from cached
+ * glyphs
+ */
+
+#ifndef TEXT_H
+
+#define TEXT_H
+
+#include "compile.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#include "SDL/SDL_ttf.h"
+#else
+#include "SDL.h"
+#include "SDL_ttf.h"
+#endif
+
+/*
+ * TTF_RenderText_* rasterizes every glyph from scratch and hands back a new
+ * surface each time it's called, which is far too slow (and too easy to
+ * leak) for text that gets redrawn every frame, like an FPS counter.
+ *
+ * Instead, each font/colour pair gets a text cache: every printable ASCII
+ * character is rendered once, up front, into a single atlas surface in the
+ * screen's pixel format. Drawing a string is then just one blit per
+ * character out of the atlas, and nothing is allocated per frame.
+ *
+ * Since the font handle already pins down the point size, caches are keyed
+ * on the TTF_Font pointer and the colour. Each glyph takes up as much room
+ * as TTF_RenderText_Solid gives it on its own, so kerning is ignored; this
+ * is meant for HUDs drawn in monofont.ttf, where that doesn't matter.
+ *
+ * The caches are only built after the video mode has been set, since the
+ * atlas is converted to the screen format.
+ */
+
+/* First and last characters in the atlas, anything else is drawn as '?' */
+#define TEXT_FIRST_CHAR 32
+#define TEXT_LAST_CHAR  126
+#define TEXT_NUM_CHARS  (TEXT_LAST_CHAR - TEXT_FIRST_CHAR + 1)
+
+typedef struct text_cache_ text_cache;
+struct text_cache_ {
+    /* Next cache in the chain */
+    text_cache *next;
+    
+    /* What this cache was made from */
+    TTF_Font *font;
+    SDL_Color color;
+    
+    /* Every glyph, side by side */
+    SDL_Surface *atlas;
+    SDL_Rect     glyphs[TEXT_NUM_CHARS];
+    
+    /* Height of a line of text */
+    int height;
+};
+
+/* Get the cache for a font and colour, building it if we need to */
+extern text_cache *get_text_cache(TTF_Font *font, SDL_Color color);
+
+/* Draw a string, returns the width drawn in pixels */
+extern int draw_text(text_cache *tc, SDL_Surface *dst, int x, int y,
+                     const char *str);
+
+/* Width a string would take up if drawn, in pixels */
+extern int text_width(text_cache *tc, const char *str);
+
+/* Start/stop functions, stop_text frees every cache */
+extern int  init_text(void);
+extern void stop_text(void);
+
+#endif /* !def TEXT_H */
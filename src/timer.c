@@ -14,136 +14,197 @@
 #include "compile.h"
 #include "timer.h"
 #include "debug.h"
-#include <stdlib.h> /* for abs */
+#include "metrics.h"
+#include <stdlib.h> /* for qsort */
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <time.h>
+#endif
 
 #ifdef INCLUDE_SDL_PREFIX
 #include "SDL/SDL.h"
-#include "SDL/SDL_thread.h"
 #else
 #include "SDL.h"
-#include "SDL_thread.h"
 #endif
 
-/* The value in question */
-Uint32 _clock_60hz;
-SDL_mutex *_clock_lock;
+/* High-resolution clock for profiling */
+#ifdef _WIN32
+Uint64 clock_ns(void)
+{
+    static LARGE_INTEGER freq = {{0, 0}};
+    LARGE_INTEGER now;
+    
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    
+    /* Split it up so the multiply doesn't overflow */
+    return (Uint64)(now.QuadPart / freq.QuadPart) * 1000000000 +
+           (Uint64)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+}
+#else
+Uint64 clock_ns(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (Uint64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
+
+/* When tick 0 started, by clock_ns */
+Uint64 _timer_start;
+
+/*
+ * A tick is 1/60 of a second, which isn't a whole number of nanoseconds,
+ * so tick n starts at n * NANO / HZ rather than at n times some rounded
+ * interval. That way it never drifts.
+ */
+#define NANO (1000000000)
+#define HZ   (60)
+#define TICK_START(n) ((Uint64)(n) * NANO / HZ)
+
+/*
+ * How long before a tick wait_tick stops sleeping and starts spinning.
+ * clock_nanosleep usually wakes up well within this, Sleep only to the
+ * nearest millisecond or so.
+ */
+#ifdef _WIN32
+#define SPIN_NS (2000000)
+#else
+#define SPIN_NS (500000)
+#endif
 
-SDL_Thread *_timer_thread;
-SDL_mutex *_timer_kill_lock;
-int _timer_kill = FALSE;
+/* Frame-interval errors, the last TIMER_SAMPLES of them */
+Uint64       _jitter[TIMER_SAMPLES];
+volatile int _jitter_head = 0;
 
-SDL_sem *_timer_pulse_sem;
+/* How late the last wait_tick woke up, if there's been one */
+Uint64 _last_late;
+int    _have_last = FALSE;
 
 /* This function gets the current clock value */
 Uint32 clock_60hz(void)
 {
-    int r;
-    Uint32 ret;
-    r = SDL_mutexP(_clock_lock);
-    check_mutex(r);
-    ret = _clock_60hz;
-    r = SDL_mutexV(_clock_lock);
-    check_mutex(r);
-    return ret;
+    return (Uint32)((clock_ns() - _timer_start) * HZ / NANO);
 }
 
-/* 
- * For error calculation 
- * We keep track in nanoseconds, but between the actual resolution of the clock
- * and multithreading delays, we can only guarantee a safe interval of about
- * 10 milliseconds, conservatively
- * Whenever the accumulated error is more than this resolution (absolutely),
- * we add or subtract 10 ms from the next interval length, depending on
- * what the sign of the error is
- */
-#define NANO (1000000)
-#define INTERVAL_RESOLUTION (10000000)
-/* better to be slightly under 60hz than slightly over, so round up */
-#define DESIRED_INTERVAL (16666667)
-#define NEXT_INTERVAL(error) \
-    (abs(error) < INTERVAL_RESOLUTION ?                                   \
-     (DESIRED_INTERVAL/INTERVAL_RESOLUTION) * INTERVAL_RESOLUTION :       \
-     ((error) < 0 ?                                                       \
-        (DESIRED_INTERVAL/INTERVAL_RESOLUTION+1) * INTERVAL_RESOLUTION :  \
-        (DESIRED_INTERVAL/INTERVAL_RESOLUTION-1) * INTERVAL_RESOLUTION)   \
-    )
-#define UPDATE_ERROR(interval,error) ((error) += ((interval)-DESIRED_INTERVAL))
-
-/* 
- * This function updates with the SDL timer and messes with the pulse
- * semaphore so that the timer can update
- */
-Uint32 _catch_timer_pulse(Uint32 interval, void *param)
+/* Sleep until clock_ns reaches when, or thereabouts */
+void _sleep_until(Uint64 when)
 {
+#ifdef _WIN32
+    Uint64 now = clock_ns();
     
-    int *error = (int*)param;
-    Uint32 next_int;
+    if (when > now) {
+        Sleep((DWORD)((when - now) / 1000000));
+    }
+#else
+    struct timespec until;
+    
+    /* clock_ns is CLOCK_MONOTONIC, so we can sleep until it directly */
+    until.tv_sec  = (time_t)(when / NANO);
+    until.tv_nsec = (long)(when % NANO);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL)
+           == EINTR) {
+        /* A signal woke us up early, go back to sleep */
+    }
+#endif
+}
+
+/* Wait for the tick after last to start */
+Uint32 wait_tick(Uint32 last)
+{
+    Uint64 deadline, now, late, error;
+    
+    deadline = _timer_start + TICK_START(last + 1);
+    now = clock_ns();
+    
+    /* Already started? Then there's no waiting to measure */
+    if (now >= deadline) {
+        metric_add(MET_TICKS_MISSED, 1);
+        _have_last = FALSE;
+        return clock_60hz();
+    }
     
-    /* Post the semaphore, this unblocks the timer */
-    SDL_SemPost(_timer_pulse_sem);
+    /* Sleep most of the way, then spin the rest */
+    if (deadline - now > SPIN_NS) {
+        _sleep_until(deadline - SPIN_NS);
+    }
+    while ((now = clock_ns()) < deadline) {
+        /* Nothing, the whole point is not to give the CPU away */
+    }
     
-    /* Figure out the next interval */
-    next_int = NEXT_INTERVAL(*error);
-    UPDATE_ERROR(next_int,*error);
+    /*
+     * The interval since the last wait is off by however much later this
+     * one woke up than that one did
+     */
+    late = now - deadline;
+    metric_observe(MET_TICK_LATE_NS, late);
+    if (_have_last) {
+        error = late > _last_late ? late - _last_late : _last_late - late;
+        _jitter[_jitter_head & (TIMER_SAMPLES-1)] = error;
+        __sync_synchronize();
+        ++_jitter_head;
+    }
+    _last_late = late;
+    _have_last = TRUE;
     
-    /* Tell SDL to start the next timer */
-    return (next_int / NANO);
+    return clock_60hz();
+}
+
+int _compare_jitter(const void *a, const void *b)
+{
+    Uint64 x = *(const Uint64*)a;
+    Uint64 y = *(const Uint64*)b;
     
+    return (x > y) - (x < y);
 }
 
-/* The thread function that does it all */
-int timer_thread(void *unused)
+/* Get the mean, 99th percentile and worst frame-interval error */
+int timer_jitter(Uint64 *mean, Uint64 *p99, Uint64 *max)
 {
-    int error = 0, r;
-    
-    Uint32 init_interval;
-    
-    SDL_TimerID timer;
-    
-    /* Create the pulse semaphore, this is part of how we get clock ticks */
-    _timer_pulse_sem = SDL_CreateSemaphore(0);
-    
-    /* Find the initial interval we should use */
-    init_interval = NEXT_INTERVAL(error);
-    UPDATE_ERROR(init_interval,error);
-    /* Start the timer */
-    timer = SDL_AddTimer((init_interval)/NANO, _catch_timer_pulse,
-                         (void*) &error);
-    
-    r = SDL_mutexP(_timer_kill_lock);
-    check_mutex(r);
-    
-    while (!_timer_kill) {
-        r = SDL_mutexV(_timer_kill_lock);
-        check_mutex(r);
-        /* Wait for the pulse semaphore to be updated by the timer callback */
-        SDL_SemWait(_timer_pulse_sem);
-        r = SDL_mutexP(_clock_lock);
-        check_mutex(r);
-        ++_clock_60hz;
-        r = SDL_mutexV(_clock_lock);
-        check_mutex(r);
-        r = SDL_mutexP(_timer_kill_lock);
-        check_mutex(r);
-    }
+    Uint64 samples[TIMER_SAMPLES];
+    Uint64 total = 0;
+    int head, n, i;
+    
+    head = _jitter_head;
+    __sync_synchronize();
     
-    /* Destroy the semaphore */
-    SDL_DestroySemaphore(_timer_pulse_sem);
+    n = (head < TIMER_SAMPLES) ? head : TIMER_SAMPLES;
+    if (n == 0) {
+        *mean = *p99 = *max = 0;
+        return 0;
+    }
     
-    /* Stop the timer */
-    SDL_RemoveTimer(timer);
+    for (i = 0; i < n; ++i) {
+        samples[i] = _jitter[(head - 1 - i) & (TIMER_SAMPLES-1)];
+        total += samples[i];
+    }
+    qsort(samples, n, sizeof(Uint64), _compare_jitter);
     
-    return 0;
+    *mean = total / n;
+    *p99  = samples[(n * 99) / 100];
+    *max  = samples[n - 1];
     
+    return n;
+}
+
+/* Forget the jitter samples so far */
+void timer_reset_jitter(void)
+{
+    _jitter_head = 0;
+    _have_last = FALSE;
 }
 
 /* Start the timer */
 int init_timer()
 {
-    _timer_kill_lock = SDL_CreateMutex();
-    _clock_lock = SDL_CreateMutex();
-    _clock_60hz = 0;
-    _timer_thread = SDL_CreateThread(timer_thread, NULL);
+    _timer_start = clock_ns();
+    timer_reset_jitter();
     
     return 0;
 }
@@ -151,9 +212,5 @@ int init_timer()
 /* Stop the timer */
 void stop_timer()
 {
-    SDL_mutexP(_timer_kill_lock);
-    _timer_kill = TRUE;
-    SDL_mutexV(_timer_kill_lock);
-    SDL_WaitThread(_timer_thread, NULL);
-    SDL_DestroyMutex(_timer_kill_lock);
+    /* Nothing to stop, it's just arithmetic now */
 }
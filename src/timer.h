@@ -22,20 +22,43 @@
 #define TIMER_H
 
 /*
- * This system creates a thread that increments an int at 60hz.
- * It accumulates error to get as close to 60 hz as possible.
+ * The 60hz clock counts ticks since init_timer. It's worked out from the
+ * monotonic clock every time it's read, so there's no thread to wake up,
+ * nothing to lock, and it doesn't drift: tick n starts exactly n/60 of a
+ * second after init_timer.
  * 
  * It will take well over 2 years of continuous running for the clock to
  * overflow, so I don't think it's a huge issue.
- * 
- * There's no need to synchronize access to the clock variable, as long as
- * the timer thread is the only thread that modifies it. So don't change it
- * yourself, you silly head.
  */
 
-/* These are the only externally-facing parts of the system */
 /* This function gets the current clock value */
-extern inline Uint32 clock_60hz(void);
+extern Uint32 clock_60hz(void);
+
+/*
+ * Wait for the tick after last to start, and return the current tick.
+ * Frame loops should use this instead of polling clock_60hz: it sleeps
+ * until just before the tick, then spins the rest of the way, so it's
+ * well under a millisecond late. If that tick has started already it
+ * returns straight away. Only one loop should be paced with it at once.
+ */
+extern Uint32 wait_tick(Uint32 last);
+
+/*
+ * Get the frame-interval error of the last TIMER_SAMPLES wait_ticks that
+ * had to wait, in nanoseconds: how far the time between each one and the
+ * one before was off what it should have been. Returns the number of
+ * samples, which is 0 if there aren't any yet. Must be a power of 2.
+ */
+#define TIMER_SAMPLES 256
+extern int  timer_jitter(Uint64 *mean, Uint64 *p99, Uint64 *max);
+extern void timer_reset_jitter(void);
+
+/*
+ * This one has nothing to do with the 60hz clock, it's a monotonic
+ * high-resolution clock in nanoseconds for timing things. The starting
+ * point is arbitrary, so only differences between two calls mean anything.
+ */
+extern Uint64 clock_ns(void);
 
 /* Start/stop functions */
 extern int  init_timer(void);
@@ -0,0 +1,261 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * trace.c
+ * Contains code for the event tracer
+ */
+
+#include "compile.h"
+#include "debug.h"
+#include "timer.h"
+#include "trace.h"
+#include <stdio.h>
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#include "SDL/SDL_thread.h"
+#else
+#include "SDL.h"
+#include "SDL_thread.h"
+#endif
+
+typedef struct trace_event_ trace_event;
+struct trace_event_ {
+    const char *name;
+    Uint64      ns;
+    int         phase;
+};
+
+/*
+ * One thread's ring. head is only written by the thread that owns it, and
+ * just counts up, getting masked to index the ring. Rings are handed out
+ * by trace_slots, see debug.h. A released one is kept for the dump, and
+ * only freed by the next trace_start, after a dump, or when they've all
+ * been taken; then what its thread recorded is lost, and anything from
+ * before since is left out of the dump.
+ */
+typedef struct trace_ring_ trace_ring;
+struct trace_ring_ {
+    volatile Uint32 head;
+    Uint64          since;
+    const char     *name;
+    trace_event     events[TRACE_EVENTS];
+};
+
+/*
+ * A thread that saw trace_on just before trace_dump turned it off can
+ * still be writing one event past the head it read, which in a full ring
+ * is the oldest one. So a full ring has this many of its oldest left out.
+ */
+#define TRACE_SLACK 16
+
+trace_ring  trace_rings[TRACE_THREADS];
+thread_slot trace_slots[TRACE_THREADS];
+
+volatile int trace_on = FALSE;
+volatile int trace_dumping = FALSE;
+/* Anything from before this was from an earlier trace */
+Uint64 trace_started = 0;
+Uint32 trace_dropped = 0;
+
+/* Free the rings of threads that are gone */
+void _trace_free_released(void)
+{
+    int i;
+
+    for (i = 0; i < TRACE_THREADS; ++i) {
+        if (trace_slots[i].state == THREAD_SLOT_RELEASED) {
+            trace_rings[i].name  = NULL;
+            trace_rings[i].since = clock_ns();
+            __sync_synchronize();
+            thread_slot_free(&trace_slots[i]);
+        }
+    }
+}
+
+/*
+ * Find the calling thread's ring, or give it one. Render and decode
+ * threads come and go, so if they've all been taken, a new thread gets
+ * the ring of one that's gone rather than nothing at all
+ */
+trace_ring *_trace_ring(void)
+{
+    int i = thread_slot_get(trace_slots, TRACE_THREADS);
+
+    if (i < 0 && !trace_dumping) {
+        _trace_free_released();
+        i = thread_slot_get(trace_slots, TRACE_THREADS);
+    }
+
+    return (i < 0) ? NULL : &trace_rings[i];
+}
+
+void _trace(const char *name, int phase)
+{
+    trace_ring  *ring = _trace_ring();
+    trace_event *ev;
+
+    if (ring == NULL) {
+        __sync_fetch_and_add(&trace_dropped, 1);
+        return;
+    }
+
+    ev = &ring->events[ring->head & (TRACE_EVENTS-1)];
+    ev->name  = name;
+    ev->phase = phase;
+    ev->ns    = clock_ns();
+
+    /* Make sure the event's all there before the dump can see it */
+    __sync_synchronize();
+    ++(ring->head);
+}
+
+void trace_name_thread(const char *name)
+{
+    trace_ring *ring = _trace_ring();
+
+    if (ring != NULL) ring->name = name;
+}
+
+void trace_start(void)
+{
+    _trace_free_released();
+    trace_started = clock_ns();
+    trace_dropped = 0;
+    __sync_synchronize();
+    trace_on = TRUE;
+    debug("Tracing started");
+}
+
+void trace_stop(void)
+{
+    trace_on = FALSE;
+    __sync_synchronize();
+}
+
+/* Write one event. There's always something before it, so a comma too */
+void _write_event(FILE *out, const char *name, int phase, Uint64 ns, int tid)
+{
+    fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+            "\"pid\":1,\"tid\":%d}", name, phase,
+            (ns - trace_started) / 1000.0, tid);
+}
+
+/*
+ * Write out one ring. Ends whose begins were written over are left out,
+ * and anything still going when tracing stopped is ended at the last
+ * event, so every begin in the file has an end.
+ */
+int _write_ring(FILE *out, int tid)
+{
+    trace_ring  *ring = &trace_rings[tid];
+    trace_event *ev;
+    const char  *open[TRACE_DEPTH];
+    Uint32 head, i;
+    Uint64 last = trace_started;
+    int depth = 0, skipped = 0, written = 0;
+
+    head = ring->head;
+    __sync_synchronize();
+    i = head > TRACE_EVENTS ? head - TRACE_EVENTS + TRACE_SLACK : 0;
+
+    for (; i != head; ++i) {
+        ev = &ring->events[i & (TRACE_EVENTS-1)];
+        if (ev->ns < trace_started || ev->ns < ring->since) continue;
+
+        if (ev->phase == 'B') {
+            /* Too deep to keep track of, leave it and its end out */
+            if (depth == TRACE_DEPTH) {
+                ++skipped;
+                continue;
+            }
+            open[depth++] = ev->name;
+        }
+        else if (skipped > 0) {
+            --skipped;
+            continue;
+        }
+        else if (depth == 0) {
+            continue;
+        }
+        else {
+            --depth;
+        }
+
+        _write_event(out, ev->name, ev->phase, ev->ns, tid);
+        last = ev->ns;
+        ++written;
+    }
+
+    while (depth > 0) {
+        _write_event(out, open[--depth], 'E', last, tid);
+    }
+
+    return written;
+}
+
+int trace_dump(const char *filename)
+{
+    FILE *out;
+    int written = 0, i;
+
+    trace_stop();
+    trace_dumping = TRUE;
+
+    out = fopen(filename, "w");
+    warn2(out != NULL, "Couldn't open trace file", (char*) filename);
+    if (out == NULL) {
+        trace_dumping = FALSE;
+        return FALSE;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    fprintf(out, "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"bullet rain\"}}");
+
+    for (i = 0; i < TRACE_THREADS; ++i) {
+        if (trace_slots[i].state != THREAD_SLOT_OWNED &&
+            trace_slots[i].state != THREAD_SLOT_RELEASED) {
+            continue;
+        }
+
+        if (trace_rings[i].name != NULL) {
+            fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                    "\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    i, trace_rings[i].name);
+        }
+        written += _write_ring(out, i);
+    }
+
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    _trace_free_released();
+    trace_dumping = FALSE;
+
+    debug2("Wrote trace to", (char*) filename);
+    debugn("Trace events written:", written);
+    debugn("Trace events dropped:", (int) trace_dropped);
+    return TRUE;
+}
+
+/* Start/stop functions */
+int init_trace(void)
+{
+    thread_slots_register(trace_slots, TRACE_THREADS);
+
+    /* Whoever starts the engine up is the main thread */
+    trace_name_thread("main");
+
+    return 0;
+}
+
+void stop_trace(void)
+{
+    trace_stop();
+}
@@ -0,0 +1,98 @@
+/*
+ * bullet rain
+ * A bullet hell engine by Curtis Mackie
+ *
+ * Distributed under the terms of the MIT license
+ * See LICENSE.TXT in the svn root directory for more information
+ */
+
+/*
+ * trace.h
+ * Contains definitions and prototypes for the event tracer
+ */
+
+#ifndef TRACE_H
+
+#define TRACE_H
+
+#include "compile.h"
+
+#ifdef INCLUDE_SDL_PREFIX
+#include "SDL/SDL.h"
+#else
+#include "SDL.h"
+#endif
+
+/*
+ * The profiler adds up how long each stage took; the tracer keeps every
+ * begin and end, with the thread it happened on, so you can see how the
+ * main loop, the loader, the decoders and the render threads line up
+ * frame by frame.
+ *
+ * Each thread that traces gets a ring of its own the first time it does,
+ * from the same thread slots as the log (see debug.h), so recording an
+ * event is a couple of stores and no locking. Once a ring is full the
+ * oldest events get written over. Nothing is recorded until trace_start,
+ * and while tracing is off trace_begin/trace_end cost one load and a
+ * branch. Define NO_TRACE in compile.h to compile them out.
+ *
+ * trace_dump writes what's in the rings out in Chrome's trace event JSON
+ * format, which chrome://tracing and Perfetto (ui.perfetto.dev, it works
+ * offline) can both open.
+ *
+ * Names are kept as pointers, not copied, so they have to be string
+ * literals or something else that stays put, and can't have quotes in.
+ */
+
+/* Rings for this many threads, then events from any more are dropped */
+#define TRACE_THREADS 16
+/* Events per thread, must be a power of 2 */
+#define TRACE_EVENTS  8192
+/* How deep begins can nest on one thread and still be tidied up */
+#define TRACE_DEPTH   32
+
+/*
+ * Mark the start and end of something on the calling thread. Every
+ * trace_begin needs a trace_end with the same name on the same thread.
+ */
+#ifndef NO_TRACE
+#define trace_begin(name) \
+                        if(!trace_on) {} \
+                        else { \
+                          _trace((name), 'B'); \
+                        }
+#define trace_end(name) \
+                        if(!trace_on) {} \
+                        else { \
+                          _trace((name), 'E'); \
+                        }
+#else
+#define trace_begin(name)
+#define trace_end(name)
+#endif
+
+extern volatile int trace_on;
+
+/* Record an event, phase is 'B' or 'E' */
+extern void _trace(const char *name, int phase);
+
+/* Give the calling thread a name to show up under in the trace */
+extern void trace_name_thread(const char *name);
+
+/* Throw away anything recorded so far, and start recording */
+extern void trace_start(void);
+
+/* Stop recording. What was recorded stays until the next trace_start */
+extern void trace_stop(void);
+
+/*
+ * Stop recording and write everything since trace_start to filename.
+ * Returns FALSE if it couldn't be written.
+ */
+extern int trace_dump(const char *filename);
+
+/* Start/stop functions */
+extern int  init_trace(void);
+extern void stop_trace(void);
+
+#endif /* !def TRACE_H */